@@ -0,0 +1,232 @@
+/* SFL bmp_batch v0.1
+
+This example uses sfl_bmp.h to decode a list of BMP files, either one after
+the other or with the pipelined batch decoder, and reports the time it took.
+
+MIT License
+
+Copyright (c) 2023 Michael Dodis
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+
+USAGE
+bmp_batch [options] <paths...>
+
+- paths:              Files to decode. @list reads one path per line from list
+- --serial:           Decode the files one after the other on this thread
+- --io-threads n:     Number of threads reading files (default 2)
+- --decode-threads n: Number of threads decoding, including this one (default 4)
+- --depth n:          Max number of files read but not yet decoded
+
+Example: bmp_batch --io-threads 4 @textures.txt
+
+CONTRIBUTION
+Michael Dodis (michaeldodisgr@gmail.com)
+*/
+#define SFL_BMP_BATCH 1
+#ifdef __linux__
+#define SFL_BMP_BATCH_IO_URING 1
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "sfl_bmp.h"
+
+#ifdef _WIN32
+#include <Windows.h>
+#else
+#include <time.h>
+#endif
+
+static double now_ms(void)
+{
+#ifdef _WIN32
+    LARGE_INTEGER frequency, counter;
+    QueryPerformanceFrequency(&frequency);
+    QueryPerformanceCounter(&counter);
+    return (double)counter.QuadPart * 1000.0 / (double)frequency.QuadPart;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec * 1000.0 + (double)ts.tv_nsec / 1000000.0;
+#endif
+}
+
+typedef struct {
+    char**  paths;
+    size_t  count;
+    size_t  capacity;
+    /** Decoded size of each path, or 0 if it failed */
+    size_t* sizes;
+} Batch;
+
+static void batch_add(Batch* batch, const char* path)
+{
+    size_t len = strlen(path);
+
+    if (batch->count == batch->capacity) {
+        batch->capacity = batch->capacity ? batch->capacity * 2 : 64;
+        batch->paths =
+            (char**)realloc(batch->paths, batch->capacity * sizeof(char*));
+    }
+
+    batch->paths[batch->count] = (char*)malloc(len + 1);
+    memcpy(batch->paths[batch->count], path, len + 1);
+    batch->count++;
+}
+
+static int batch_add_list(Batch* batch, const char* list_path)
+{
+    char  line[4096];
+    FILE* f = fopen(list_path, "r");
+    if (!f) {
+        return 0;
+    }
+
+    while (fgets(line, sizeof(line), f)) {
+        size_t len = strlen(line);
+        while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r')) {
+            line[--len] = 0;
+        }
+
+        if (len > 0) {
+            batch_add(batch, line);
+        }
+    }
+
+    fclose(f);
+    return 1;
+}
+
+static PROC_SFL_BMP_BATCH_DONE(on_done)
+{
+    Batch* batch = (Batch*)usr;
+    (void)path;
+
+    /* Each index is reported once, so no locking is needed here */
+    if (ok) {
+        batch->sizes[index] = desc->size;
+        free(desc->data);
+    }
+}
+
+static void decode_serial(Batch* batch)
+{
+    size_t i;
+    for (i = 0; i < batch->count; ++i) {
+        SflBmpContext ctx;
+        SflBmpDesc    desc;
+        FILE*         f = fopen(batch->paths[i], "rb");
+        if (!f) {
+            continue;
+        }
+
+        sfl_bmp_cstd_init(&ctx);
+        sfl_bmp_stdio_set_file(&ctx, f);
+
+        memset(&desc, 0, sizeof(desc));
+        desc.format = SFL_BMP_PIXEL_FORMAT_R8G8B8A8;
+        if (sfl_bmp_decode(&ctx, &desc)) {
+            batch->sizes[i] = desc.size;
+            free(desc.data);
+        }
+
+        fclose(f);
+    }
+}
+
+int main(int argc, char* argv[])
+{
+    Batch               batch;
+    SflBmpBatchSettings settings;
+    int                 serial = 0;
+    int                 i;
+    size_t              num_decoded = 0;
+    double              total_size  = 0.0;
+    double              start, elapsed;
+
+    memset(&batch, 0, sizeof(batch));
+    memset(&settings, 0, sizeof(settings));
+    settings.num_io_threads     = 2;
+    settings.num_decode_threads = 4;
+
+    for (i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "--serial") == 0) {
+            serial = 1;
+        } else if (strcmp(argv[i], "--io-threads") == 0 && i + 1 < argc) {
+            settings.num_io_threads = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--decode-threads") == 0 && i + 1 < argc) {
+            settings.num_decode_threads = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--depth") == 0 && i + 1 < argc) {
+            settings.queue_depth = atoi(argv[++i]);
+        } else if (argv[i][0] == '@') {
+            if (!batch_add_list(&batch, argv[i] + 1)) {
+                fprintf(stderr, "%s: Not a file.\n", argv[i] + 1);
+                return -1;
+            }
+        } else {
+            batch_add(&batch, argv[i]);
+        }
+    }
+
+    if (batch.count == 0) {
+        fprintf(stderr, "No files to decode\n");
+        return -1;
+    }
+
+    batch.sizes = (size_t*)calloc(batch.count, sizeof(size_t));
+
+    start = now_ms();
+    if (serial) {
+        decode_serial(&batch);
+    } else {
+        settings.format = SFL_BMP_PIXEL_FORMAT_R8G8B8A8;
+        settings.done   = on_done;
+        settings.usr    = &batch;
+        sfl_bmp_batch_decode(
+            (const char* const*)batch.paths, batch.count, &settings);
+    }
+    elapsed = now_ms() - start;
+
+    for (i = 0; i < (int)batch.count; ++i) {
+        if (batch.sizes[i]) {
+            num_decoded++;
+            total_size += (double)batch.sizes[i];
+        } else {
+            fprintf(stderr, "%s: Failed to decode.\n", batch.paths[i]);
+        }
+    }
+
+    printf(
+        "Decoded %zu/%zu files (%.2f MiB) in %.2f ms\n",
+        num_decoded,
+        batch.count,
+        total_size / (1024.0 * 1024.0),
+        elapsed);
+
+    for (i = 0; i < (int)batch.count; ++i) {
+        free(batch.paths[i]);
+    }
+    free(batch.paths);
+    free(batch.sizes);
+    return num_decoded == batch.count ? 0 : -1;
+}
+
+#define SFL_BMP_IMPLEMENTATION
+#include "sfl_bmp.h"
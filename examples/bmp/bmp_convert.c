@@ -26,8 +26,11 @@ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
 SOFTWARE.
 
 USAGE
-bmp_convert <path_to_read> <path_to_write>
+bmp_convert [--threads n] [--palette] <path_to_read> <path_to_write>
 
+- --threads n:    Decode the whole image, then encode it on n threads
+- --palette:      Write 1, 4 or 8 bpp palette indices if there are at most
+                  256 colors (ignored with --threads)
 - path_to_read:   Relative or absolute path to file or directory to read
 - path_to_write:  Relative or absolute path to file or directory to write
 
@@ -36,12 +39,32 @@ Example: bmp_convert ./input.bmp ./output.bmp
 CONTRIBUTION
 Michael Dodis (michaeldodisgr@gmail.com)
 */
+#define SFL_BMP_PARALLEL_ENCODE 1
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
 #include "sfl_bmp.h"
 
 int main(int argc, char* argv[])
 {
+    int num_threads = 0;
+    int palette     = 0;
+    while (argc > 1 && strncmp(argv[1], "--", 2) == 0) {
+        if (argc > 2 && strcmp(argv[1], "--threads") == 0) {
+            num_threads = atoi(argv[2]);
+            argv += 2;
+            argc -= 2;
+        } else if (strcmp(argv[1], "--palette") == 0) {
+            palette = 1;
+            argv += 1;
+            argc -= 1;
+        } else {
+            fprintf(stderr, "Unknown option %s\n", argv[1]);
+            return -1;
+        }
+    }
+
     if (argc != 3) {
         fprintf(stderr, "Invalid number of arguments\n");
         return -1;
@@ -69,13 +92,54 @@ int main(int argc, char* argv[])
     out_desc.compression    = SFL_BMP_COMPRESSION_NONE;
     out_desc.file_header_id = SFL_BMP_HDR_ID_BM;
     out_desc.info_header_id = SFL_BMP_NFO_ID_V5;
+    if (palette) {
+        out_desc.attributes = SFL_BMP_ATTRIBUTE_PALETTIZED;
+    }
+
+    /* The encoder doesn't read palette indices, so those are decoded first */
+    const int paletted = in_desc.attributes & SFL_BMP_ATTRIBUTE_PALETTIZED;
+    SflBmpIOImplementationMemory source;
+
+    if (num_threads > 0 || paletted) {
+        int ok;
+
+        /* Decodes to the format probe found, so only the encoder converts */
+        if (paletted) {
+            in_desc.format = SFL_BMP_PIXEL_FORMAT_B8G8R8X8;
+        }
+        if (!sfl_bmp_decode(&read_ctx, &in_desc)) {
+            return -1;
+        }
+        fclose(inf);
+        inf = 0;
+
+        if (num_threads > 0) {
+            ok = sfl_bmp_encode_parallel(
+                &write_ctx, &in_desc, argv[2], &out_desc, num_threads);
+            free(in_desc.data);
+            return ok ? 0 : -1;
+        }
+
+        sfl_bmp_memory_io_init(&read_ctx, read_ctx.mem);
+        sfl_bmp_memory_io_set_source(
+            &read_ctx, &source, in_desc.data, in_desc.size);
+    }
 
     outf = fopen(argv[2], "wb");
     sfl_bmp_stdio_set_file(&write_ctx, outf);
     sfl_bmp_encode(&write_ctx, &in_desc, &read_ctx.io, &out_desc);
+    printf(
+        "Wrote %s%s\n",
+        sfl_bmp_describe_pixel_format(out_desc.format),
+        (out_desc.attributes & SFL_BMP_ATTRIBUTE_PALETTIZED) ? " indices"
+                                                             : "");
 
     fclose(outf);
-    fclose(inf);
+    if (inf) {
+        fclose(inf);
+    } else {
+        free(in_desc.data);
+    }
     return 0;
 }
 
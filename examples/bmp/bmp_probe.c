@@ -68,7 +68,7 @@ int main(int argc, char *argv[]) {
     printf("%-20s %s\n", "Hdr", sfl_bmp_describe_hdr_id(desc.file_header_id));
     printf("%-20s %s\n", "Nfo", sfl_bmp_describe_nfo_id(desc.info_header_id));
     printf("%-20s %s\n", "Compression", sfl_bmp_describe_compression(desc.compression));
-    printf("%-20s %u\n", "Data Size", desc.size);
+    printf("%-20s %llu\n", "Data Size", (unsigned long long)desc.size);
     printf("%-20s %u\n", "Pitch", desc.pitch);
     printf("%-20s %s\n", "Flipped", (desc.attributes & SFL_BMP_ATTRIBUTE_FLIPPED) ? "Yes" : "No");
     printf("%-20s %s\n", "Palettized", (desc.attributes & SFL_BMP_ATTRIBUTE_PALETTIZED) ? "Yes" : "No");
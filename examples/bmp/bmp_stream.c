@@ -0,0 +1,112 @@
+/* SFL bmp_stream v0.1
+
+This example uses sfl_bmp.h to decode a BMP image as it arrives on stdin,
+without waiting for (or buffering) the whole file, reporting progress on the
+way.
+
+MIT License
+
+Copyright (c) 2023 Michael Dodis
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+
+USAGE
+bmp_stream [--chunk n] < <path>
+
+- chunk: Bytes read from stdin at a time (default 4096)
+
+Example: curl -s https://example.com/image.bmp | bmp_stream
+
+CONTRIBUTION
+Michael Dodis (michaeldodisgr@gmail.com)
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "sfl_bmp.h"
+
+static PROC_SFL_BMP_DECODER_ROWS(on_rows) {
+    unsigned long *num_callbacks = (unsigned long*)usr;
+    (*num_callbacks)++;
+    fprintf(stderr, "\rRows %u/%u", first + count, desc->height);
+}
+
+int main(int argc, char *argv[]) {
+    size_t chunk = 4096;
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "--chunk") == 0 && i + 1 < argc) {
+            chunk = (size_t)atol(argv[++i]);
+        } else {
+            fprintf(stderr, "Unknown argument %s\n", argv[i]);
+            return -1;
+        }
+    }
+
+    if (chunk == 0) {
+        fprintf(stderr, "Invalid chunk size\n");
+        return -1;
+    }
+
+    unsigned char *buf = (unsigned char*)malloc(chunk);
+    if (!buf) {
+        return -1;
+    }
+
+    SflBmpContext ctx;
+    sfl_bmp_cstd_init(&ctx);
+
+    unsigned long num_callbacks = 0;
+    SflBmpDesc desc = {0};
+    SflBmpDecoder *dec = sfl_bmp_decoder_begin(&ctx, &desc, on_rows, &num_callbacks);
+    if (!dec) {
+        free(buf);
+        return -1;
+    }
+
+    size_t n;
+    int ok = 1;
+    while (ok && (n = fread(buf, 1, chunk, stdin)) > 0) {
+        ok = sfl_bmp_feed(dec, buf, n);
+    }
+
+    SflBmpDecoderProgress progress;
+    sfl_bmp_decoder_progress(dec, &progress);
+    fprintf(stderr, "\n");
+
+    free(buf);
+    if (!sfl_bmp_decoder_end(dec)) {
+        fprintf(stderr, "%s after %llu bytes (%u rows)\n",
+            ok ? "Truncated" : "Invalid file format",
+            (unsigned long long)progress.bytes_fed, progress.rows_decoded);
+        return -1;
+    }
+
+    printf("%-20s %u\n", "Width",  desc.width);
+    printf("%-20s %u\n", "Height", desc.height);
+    printf("%-20s %s\n", "Pixel Format", sfl_bmp_describe_pixel_format(desc.format));
+    printf("%-20s %llu\n", "Bytes Read",
+        (unsigned long long)progress.bytes_fed);
+    printf("%-20s %lu\n", "Row Callbacks", num_callbacks);
+
+    ctx.mem->release(ctx.mem->usr, desc.data);
+    return 0;
+}
+
+#define SFL_BMP_IMPLEMENTATION
+#include "sfl_bmp.h"
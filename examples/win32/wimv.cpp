@@ -517,7 +517,8 @@ static unsigned char* load_image_sfl(
 
     sfl_bmp_winapi_io_set_file(&ctx, &file_handle);
 
-    SflBmpDesc desc;
+    SflBmpDesc desc = {0};
+    desc.format     = SFL_BMP_PIXEL_FORMAT_R8G8B8A8;
     if (!sfl_bmp_decode(&ctx, &desc)) {
         return 0;
     }
@@ -0,0 +1,766 @@
+/* SFL bmp_bench v0.1
+
+Throughput benchmark for sfl_bmp.h. Synthetic images are generated in memory
+for every combination of size, input layout and row order, and each one is
+probed, decoded (without conversion), converted (to R8G8B8A8), converted
+again by a frame decoder that keeps its buffers, converted with its mip chain
+(sRGB), split into R, G, B and A planes, resized to a normalized 224x224
+float tensor, packed (to B5G6R5, dithered) and encoded (to a V5 B8G8R8A8 file
+in memory). The images come from bmp_corpus.h, the same
+generator behind bmp_generate --check. Layouts that the decoder doesn't
+support are reported on stderr and skipped.
+
+USAGE
+bmp_bench [--max-size <n>] [--min-time <ms>] [--stats] [--peek] [--quantize]
+
+- max-size: Largest width/height to benchmark (default: 16384)
+- min-time: Minimum time spent on each measurement (default: 200)
+- stats:    Attach SflBmpStats to every operation, and report where the time
+            went (adds some overhead to each IO call)
+- peek:     Let the in-memory IO hand out pointers into its buffer, so that
+            pixel data is converted in place instead of read row by row
+- quantize: Benchmark sfl_bmp_encode_quantized instead, see below
+
+Numbers are only meaningful for optimized builds, i.e. configure with
+-DCMAKE_BUILD_TYPE=Release
+
+OUTPUT
+CSV on stdout, one line per measurement:
+op,width,height,bpp,compression,flipped,in_format,out_format,iterations,
+ns_per_op,ns_per_pixel,mb_per_s
+
+With --stats, each line also gets the following (averaged per operation):
+reads,bytes_read,allocations,io_ns,header_ns,convert_ns
+and then peak_bytes, the most memory held at once by any operation.
+
+MB/s is measured against the size of the pixel data in the source file.
+
+With --quantize, B8G8R8 gradients and noise are quantized with every dither,
+to 256 and 16 colors, on 1, 2 and 4 threads:
+op,width,height,pattern,dither,threads,colors,iterations,ns_per_op,
+ns_per_pixel,mb_per_s,psnr
+
+psnr is the peak signal to noise ratio of the decoded file against the
+original, in dB. Higher is closer, and 99 means identical.
+
+CONTRIBUTION
+Michael Dodis (michaeldodisgr@gmail.com)
+*/
+#define SFL_BMP_STATS 1
+#define SFL_BMP_QUANTIZE 1
+#define SFL_BMP_MIPMAPS 1
+#define SFL_BMP_TENSOR 1
+#define SFL_BMP_IMPLEMENTATION
+#include "sfl_bmp.h"
+#include "bmp_corpus.h"
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <Windows.h>
+#else
+#include <time.h>
+#endif
+
+#define ARRAY_COUNT(x) (sizeof(x) / sizeof(x[0]))
+
+static uint64_t now_ns(void)
+{
+#ifdef _WIN32
+    static LARGE_INTEGER frequency;
+    LARGE_INTEGER        counter;
+    if (frequency.QuadPart == 0) {
+        QueryPerformanceFrequency(&frequency);
+    }
+    QueryPerformanceCounter(&counter);
+    return (uint64_t)((double)counter.QuadPart * 1e9 /
+                      (double)frequency.QuadPart);
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+#endif
+}
+
+/** Set by --peek, otherwise the in-memory IO can't be peeked at */
+static int Use_Peek = 0;
+
+/** A context over the library's in-memory IO, which holds the buffers */
+static void bench_memory_init(SflBmpContext* ctx)
+{
+    sfl_bmp_memory_io_init(ctx, sfl_bmp_stdlib_get_implementation());
+    if (!Use_Peek) {
+        ctx->io.peek = 0;
+    }
+}
+
+/**
+ * Input layouts. The images themselves come from bmp_corpus.h, so every
+ * layout here can also be checked with bmp_generate --check
+ */
+typedef struct {
+    const char* tag;
+    int         bpp;
+    int         compression;
+    uint32_t    masks[4];
+} Layout;
+
+static const Layout The_Layouts[] = {
+    {"pal1", 1, CORPUS_COMPRESSION_RGB, {0}},
+    {"pal4", 4, CORPUS_COMPRESSION_RGB, {0}},
+    {"pal8", 8, CORPUS_COMPRESSION_RGB, {0}},
+    {"rle4", 4, CORPUS_COMPRESSION_RLE4, {0}},
+    {"rle8", 8, CORPUS_COMPRESSION_RLE8, {0}},
+    {"b5g5r5x1", 16, CORPUS_COMPRESSION_RGB, {0}},
+    {"b5g6r5",
+     16,
+     CORPUS_COMPRESSION_BITFIELDS,
+     {0xf800, 0x07e0, 0x001f, 0x0000}},
+    {"b8g8r8", 24, CORPUS_COMPRESSION_RGB, {0}},
+    {"b8g8r8x8", 32, CORPUS_COMPRESSION_RGB, {0}},
+    {"b8g8r8a8",
+     32,
+     CORPUS_COMPRESSION_BITFIELDS,
+     {0x00ff0000, 0x0000ff00, 0x000000ff, 0xff000000}},
+    {"r8g8b8a8",
+     32,
+     CORPUS_COMPRESSION_BITFIELDS,
+     {0x000000ff, 0x0000ff00, 0x00ff0000, 0xff000000}},
+    {"r10g10b10a2",
+     32,
+     CORPUS_COMPRESSION_BITFIELDS,
+     {0x3ff00000, 0x000ffc00, 0x000003ff, 0xc0000000}},
+};
+
+static const uint32_t The_Sizes[] = {64, 256, 1024, 4096, 16384};
+
+/**
+ * Builds a V5 file for the layout. RLE layouts get runs of pixels, everything
+ * else gets noise
+ */
+static uint8_t* build_image(
+    const Layout* layout,
+    uint32_t      width,
+    uint32_t      height,
+    int           flipped,
+    size_t*       out_len,
+    size_t*       out_data_size)
+{
+    CorpusSpec spec  = {0};
+    spec.header      = CORPUS_HEADER_V5;
+    spec.bpp         = layout->bpp;
+    spec.compression = layout->compression;
+    spec.width       = width;
+    spec.height      = height;
+    spec.top_down    = !flipped;
+    spec.seed        = 0x9e3779b9u;
+    spec.pattern     = CORPUS_PATTERN_NOISE;
+    if (layout->compression == CORPUS_COMPRESSION_RLE4 ||
+        layout->compression == CORPUS_COMPRESSION_RLE8)
+    {
+        spec.pattern = CORPUS_PATTERN_RUNS;
+    }
+    memcpy(spec.mask, layout->masks, sizeof(spec.mask));
+
+    uint8_t* buf = corpus_build(&spec, out_len);
+    if (buf) {
+        *out_data_size = *out_len - corpus_data_offset(&spec);
+    }
+    return buf;
+}
+
+typedef enum {
+    OP_PROBE,
+    OP_DECODE,
+    OP_CONVERT,
+    OP_FRAMES,
+    OP_MIPS,
+    OP_PLANAR,
+    OP_TENSOR,
+    OP_PACK,
+    OP_ENCODE,
+} Op;
+
+static const char* The_Op_Names[] = {
+    "probe",
+    "decode",
+    "convert",
+    "frames",
+    "mips",
+    "planar",
+    "tensor",
+    "pack",
+    "encode",
+};
+
+typedef struct {
+    /** The file, and room for the encoder's output */
+    uint8_t*            in;
+    size_t              in_len;
+    uint8_t*            out;
+    size_t              out_capacity;
+    SflBmpDesc          probe_desc;
+    int                 out_format;
+    /** Kept across the iterations of OP_FRAMES */
+    SflBmpFrameDecoder* frames;
+    /** Null, unless running with --stats */
+    SflBmpStats*        stats;
+} BenchState;
+
+static int run_op(Op op, BenchState* state)
+{
+    SflBmpContext                ctx;
+    SflBmpIOImplementationMemory in;
+    bench_memory_init(&ctx);
+    sfl_bmp_memory_io_set_source(&ctx, &in, state->in, state->in_len);
+    sfl_bmp_set_stats(&ctx, state->stats);
+
+    switch (op) {
+        case OP_PROBE: {
+            SflBmpDesc desc;
+            return sfl_bmp_probe(&ctx, &desc);
+        } break;
+
+        case OP_DECODE:
+        case OP_CONVERT:
+        case OP_MIPS:
+        case OP_PLANAR:
+        case OP_PACK: {
+            SflBmpDesc desc = {0};
+            desc.format     = state->out_format;
+            if (op == OP_MIPS) {
+                desc.attributes =
+                    SFL_BMP_ATTRIBUTE_MIPMAPPED | SFL_BMP_ATTRIBUTE_SRGB;
+            } else if (op == OP_PLANAR) {
+                desc.attributes = SFL_BMP_ATTRIBUTE_PLANAR;
+            } else if (op == OP_PACK) {
+                desc.attributes = SFL_BMP_ATTRIBUTE_DITHERED;
+            }
+            if (!sfl_bmp_decode(&ctx, &desc)) return 0;
+            free(desc.data);
+            return 1;
+        } break;
+
+        case OP_FRAMES: {
+            SflBmpDesc desc = {0};
+            desc.format     = state->out_format;
+            if (!sfl_bmp_frame_decode(state->frames, &ctx, &desc)) return 0;
+            return sfl_bmp_frame_recycle(state->frames, desc.data);
+        } break;
+
+        case OP_TENSOR: {
+            SflBmpTensorSettings settings = {0};
+            SflBmpTensor         tensor   = {0};
+            settings.width                = 224;
+            settings.height               = 224;
+            for (int c = 0; c < 3; ++c) {
+                settings.mean[c] = 0.5f;
+                settings.std[c]  = 0.25f;
+            }
+            if (!sfl_bmp_decode_tensor(&ctx, &settings, &tensor)) return 0;
+            free(tensor.data);
+            return 1;
+        } break;
+
+        case OP_ENCODE: {
+            SflBmpContext                write_ctx;
+            SflBmpIOImplementationMemory out;
+            bench_memory_init(&write_ctx);
+            sfl_bmp_memory_io_set_sink(
+                &write_ctx, &out, state->out, state->out_capacity);
+            sfl_bmp_set_stats(&write_ctx, state->stats);
+
+            SflBmpDesc out_desc     = {0};
+            out_desc.format         = SFL_BMP_PIXEL_FORMAT_B8G8R8A8;
+            out_desc.compression    = SFL_BMP_COMPRESSION_BITFIELDS;
+            out_desc.file_header_id = SFL_BMP_HDR_ID_BM;
+            out_desc.info_header_id = SFL_BMP_NFO_ID_V5;
+            return sfl_bmp_encode(
+                &write_ctx,
+                &state->probe_desc,
+                &ctx.io,
+                &out_desc);
+        } break;
+    }
+
+    return 0;
+}
+
+/**
+ * Runs the operation until min_time_ns has elapsed, and reports the result
+ */
+static int measure(
+    Op            op,
+    BenchState*   state,
+    const Layout* layout,
+    uint32_t      size,
+    int           flipped,
+    size_t        data_size,
+    uint64_t      min_time_ns)
+{
+    uint64_t iterations = 0;
+    uint64_t start      = now_ns();
+    uint64_t elapsed    = 0;
+
+    if (state->stats) {
+        memset(state->stats, 0, sizeof(*state->stats));
+    }
+
+    do {
+        if (!run_op(op, state)) {
+            fprintf(
+                stderr,
+                "%s %ux%u %s: failed\n",
+                The_Op_Names[op],
+                size,
+                size,
+                layout->tag);
+            return 0;
+        }
+        iterations++;
+        elapsed = now_ns() - start;
+    } while (elapsed < min_time_ns);
+
+    const double ns_per_op    = (double)elapsed / (double)iterations;
+    const double pixels       = (double)size * (double)size;
+    const double ns_per_pixel = ns_per_op / pixels;
+    const double mb_per_s =
+        ((double)data_size / (1024.0 * 1024.0)) / (ns_per_op / 1e9);
+
+    const char* out_format = "-";
+    if (op == OP_DECODE || op == OP_CONVERT || op == OP_FRAMES ||
+        op == OP_MIPS || op == OP_PLANAR || op == OP_PACK)
+    {
+        out_format = sfl_bmp_describe_pixel_format(state->out_format);
+    } else if (op == OP_ENCODE) {
+        out_format =
+            sfl_bmp_describe_pixel_format(SFL_BMP_PIXEL_FORMAT_B8G8R8A8);
+    }
+
+    printf(
+        "%s,%u,%u,%d,%s,%d,%s,%s,%llu,%.1f,%.4f,%.2f",
+        The_Op_Names[op],
+        size,
+        size,
+        layout->bpp,
+        corpus_compression_tag(layout->compression),
+        flipped,
+        layout->tag,
+        out_format,
+        (unsigned long long)iterations,
+        ns_per_op,
+        ns_per_pixel,
+        mb_per_s);
+
+    if (state->stats) {
+        const SflBmpStats* stats = state->stats;
+        const double       n     = (double)iterations;
+        printf(
+            ",%.1f,%.1f,%.1f,%.1f,%.1f,%.1f,%llu",
+            (double)stats->num_reads / n,
+            (double)stats->bytes_read / n,
+            (double)stats->num_allocations / n,
+            (double)stats->io_ns / n,
+            (double)stats->stage_ns[SFL_BMP_STAGE_HEADER] / n,
+            (double)stats->stage_ns[SFL_BMP_STAGE_CONVERT] / n,
+            (unsigned long long)stats->peak_bytes_in_use);
+    }
+
+    puts("");
+    fflush(stdout);
+    return 1;
+}
+
+static const char* The_Dither_Names[] = {"none", "ordered", "diffusion"};
+
+/** Peak signal to noise ratio of the color components, in dB */
+static double psnr(const uint8_t* a, const uint8_t* b, size_t num_pixels)
+{
+    double sum = 0.0;
+    for (size_t i = 0; i < num_pixels * 4; ++i) {
+        const double d = (double)a[i] - (double)b[i];
+        if ((i & 3) != 3) sum += d * d;
+    }
+
+    if (sum == 0.0) return 99.0;
+    return 10.0 * log10(255.0 * 255.0 * 3.0 * (double)num_pixels / sum);
+}
+
+/**
+ * Quantizes gradients and noise to 256 and 16 colors, with every kind of
+ * dithering and 1 to 4 threads. Each line reports the speed of the encoder
+ * next to the quality of its output
+ */
+static int bench_quantize(uint32_t max_size, uint64_t min_time_ns)
+{
+    static const int The_Patterns[] = {
+        CORPUS_PATTERN_GRADIENT,
+        CORPUS_PATTERN_NOISE,
+    };
+    static const int The_Colors[]  = {256, 16};
+    static const int The_Threads[] = {1, 2, 4};
+    int              failures      = 0;
+
+    puts(
+        "op,width,height,pattern,dither,threads,colors,iterations,ns_per_op,"
+        "ns_per_pixel,mb_per_s,psnr");
+
+    for (int s = 0; s < (int)ARRAY_COUNT(The_Sizes); ++s) {
+        const uint32_t size = The_Sizes[s];
+        if (size > max_size) break;
+
+        for (int p = 0; p < (int)ARRAY_COUNT(The_Patterns); ++p) {
+            CorpusSpec spec  = {0};
+            spec.header      = CORPUS_HEADER_V5;
+            spec.bpp         = 24;
+            spec.compression = CORPUS_COMPRESSION_RGB;
+            spec.width       = size;
+            spec.height      = size;
+            spec.top_down    = 1;
+            spec.seed        = 0x9e3779b9u;
+            spec.pattern     = The_Patterns[p];
+
+            size_t   in_len = 0;
+            uint8_t* in_buf = corpus_build(&spec, &in_len);
+            /* Headers, the largest table, and a byte per index */
+            size_t out_capacity = sizeof(SflBmpFileHeader) +
+                                  sizeof(SflBmpInfoHeader124) + 256 * 4 +
+                                  (size_t)(size + 3) / 4 * 4 * size;
+            uint8_t* out_buf = (uint8_t*)malloc(out_capacity);
+            if (!in_buf || !out_buf) {
+                fprintf(stderr, "%ux%u: out of memory\n", size, size);
+                return -1;
+            }
+
+            SflBmpContext                ctx;
+            SflBmpIOImplementationMemory in;
+            SflBmpIOImplementationMemory out;
+            bench_memory_init(&ctx);
+            sfl_bmp_memory_io_set_source(&ctx, &in, in_buf, in_len);
+
+            /* The original pixels, to compare against */
+            SflBmpDesc original = {0};
+            SflBmpDesc in_desc;
+            original.format     = SFL_BMP_PIXEL_FORMAT_R8G8B8A8;
+            if (!sfl_bmp_decode(&ctx, &original)) {
+                fprintf(stderr, "%ux%u: decode failed\n", size, size);
+                return -1;
+            }
+            in.curr = 0;
+            sfl_bmp_probe(&ctx, &in_desc);
+            out.len = 0;
+
+            /* Every combination of colors, dither and threads */
+            const int num_dithers = (int)ARRAY_COUNT(The_Dither_Names);
+            const int num_threads = (int)ARRAY_COUNT(The_Threads);
+            const int num_runs =
+                (int)ARRAY_COUNT(The_Colors) * num_dithers * num_threads;
+
+            for (int r = 0; r < num_runs; ++r) {
+                const int c = r / (num_dithers * num_threads);
+                const int d = r / num_threads % num_dithers;
+                const int t = r % num_threads;
+
+                SflBmpQuantizeSettings settings;
+                settings.num_colors  = The_Colors[c];
+                settings.dither      = (SflBmpDither)d;
+                settings.num_threads = The_Threads[t];
+
+                SflBmpDesc out_desc   = {0};
+                uint64_t   iterations = 0;
+                uint64_t   start      = now_ns();
+                uint64_t   elapsed    = 0;
+                int        ok         = 1;
+
+                do {
+                    SflBmpContext write_ctx;
+                    bench_memory_init(&write_ctx);
+                    sfl_bmp_memory_io_set_sink(
+                        &write_ctx, &out, out_buf, out_capacity);
+                    in.curr = 0;
+
+                    out_desc.file_header_id = SFL_BMP_HDR_ID_BM;
+                    out_desc.info_header_id = SFL_BMP_NFO_ID_V5;
+                    ok = sfl_bmp_encode_quantized(
+                        &write_ctx, &in_desc, &ctx.io, &out_desc, &settings);
+                    iterations++;
+                    elapsed = now_ns() - start;
+                } while (ok && elapsed < min_time_ns);
+
+                /* Quality of the last file written */
+                SflBmpContext                read_ctx;
+                SflBmpIOImplementationMemory file;
+                SflBmpDesc                   decoded = {0};
+                bench_memory_init(&read_ctx);
+                sfl_bmp_memory_io_set_source(
+                    &read_ctx, &file, out_buf, out.len);
+                decoded.format = SFL_BMP_PIXEL_FORMAT_R8G8B8A8;
+                if (!ok || !sfl_bmp_decode(&read_ctx, &decoded)) {
+                    fprintf(
+                        stderr,
+                        "quantize %ux%u %s: failed\n",
+                        size,
+                        size,
+                        corpus_pattern_tag(spec.pattern));
+                    failures++;
+                    continue;
+                }
+
+                const double ns_per_op = (double)elapsed / (double)iterations;
+                const double pixels    = (double)size * (double)size;
+                printf(
+                    "quantize,%u,%u,%s,%s,%d,%u,%llu,%.1f,%.4f,%.2f,%.2f\n",
+                    size,
+                    size,
+                    corpus_pattern_tag(spec.pattern),
+                    The_Dither_Names[d],
+                    settings.num_threads,
+                    out_desc.num_table_entries,
+                    (unsigned long long)iterations,
+                    ns_per_op,
+                    ns_per_op / pixels,
+                    ((double)(in_len - corpus_data_offset(&spec)) /
+                     (1024.0 * 1024.0)) /
+                        (ns_per_op / 1e9),
+                    psnr(
+                        (const uint8_t*)original.data,
+                        (const uint8_t*)decoded.data,
+                        (size_t)size * size));
+                fflush(stdout);
+                free(decoded.data);
+            }
+
+            free(original.data);
+            free(out_buf);
+            free(in_buf);
+        }
+    }
+
+    return failures != 0;
+}
+
+int main(int argc, char const* argv[])
+{
+    uint32_t    max_size    = 16384;
+    uint64_t    min_time_ms = 200;
+    SflBmpStats stats;
+    int         use_stats = 0;
+    int         quantize  = 0;
+
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "--max-size") == 0 && (i + 1) < argc) {
+            max_size = (uint32_t)strtoul(argv[++i], 0, 10);
+        } else if (strcmp(argv[i], "--min-time") == 0 && (i + 1) < argc) {
+            min_time_ms = strtoull(argv[++i], 0, 10);
+        } else if (strcmp(argv[i], "--stats") == 0) {
+            use_stats = 1;
+        } else if (strcmp(argv[i], "--peek") == 0) {
+            Use_Peek = 1;
+        } else if (strcmp(argv[i], "--quantize") == 0) {
+            quantize = 1;
+        } else {
+            puts(
+                "Invocation: bmp_bench [--max-size <n>] [--min-time <ms>] "
+                "[--stats] [--peek] [--quantize]");
+            return -1;
+        }
+    }
+
+    const uint64_t min_time_ns = min_time_ms * 1000000ull;
+    int            failures    = 0;
+
+#if defined(__GNUC__) && !defined(__OPTIMIZE__)
+    fputs("warning: bmp_bench was built without optimizations\n", stderr);
+#endif
+
+    if (quantize) {
+        return bench_quantize(max_size, min_time_ns);
+    }
+
+    printf(
+        "op,width,height,bpp,compression,flipped,in_format,out_format,"
+        "iterations,ns_per_op,ns_per_pixel,mb_per_s%s\n",
+        use_stats ? ",reads,bytes_read,allocations,io_ns,header_ns,convert_ns,"
+                    "peak_bytes"
+                  : "");
+
+    for (int s = 0; s < (int)ARRAY_COUNT(The_Sizes); ++s) {
+        const uint32_t size = The_Sizes[s];
+        if (size > max_size) break;
+
+        for (int l = 0; l < (int)ARRAY_COUNT(The_Layouts); ++l) {
+            const Layout* layout = &The_Layouts[l];
+
+            /* RLE bitmaps are always bottom-up */
+            int min_flipped = 0;
+            if (layout->compression == CORPUS_COMPRESSION_RLE4 ||
+                layout->compression == CORPUS_COMPRESSION_RLE8)
+            {
+                min_flipped = 1;
+            }
+
+            for (int flipped = min_flipped; flipped < 2; ++flipped) {
+                BenchState state;
+                state.stats = use_stats ? &stats : 0;
+                size_t     data_size;
+
+                state.in = build_image(
+                    layout,
+                    size,
+                    size,
+                    flipped,
+                    &state.in_len,
+                    &data_size);
+                if (!state.in) {
+                    fprintf(stderr, "%ux%u: out of memory\n", size, size);
+                    return -1;
+                }
+
+                /* B8G8R8A8 output for the encoder */
+                state.out_capacity = sizeof(SflBmpFileHeader) +
+                                     sizeof(SflBmpInfoHeader124) +
+                                     (size_t)size * size * 4;
+                state.out = (uint8_t*)malloc(state.out_capacity);
+
+                SflBmpContext                ctx;
+                SflBmpIOImplementationMemory in;
+                bench_memory_init(&ctx);
+                sfl_bmp_memory_io_set_source(&ctx, &in, state.in, state.in_len);
+                if (!state.out) {
+                    fprintf(stderr, "%ux%u: out of memory\n", size, size);
+                    return -1;
+                }
+
+                /* Layouts the decoder doesn't handle yet are skipped */
+                state.out_format = SFL_BMP_PIXEL_FORMAT_R8G8B8A8;
+                if (!sfl_bmp_probe(&ctx, &state.probe_desc) ||
+                    !run_op(OP_CONVERT, &state))
+                {
+                    fprintf(
+                        stderr,
+                        "%s: not supported, skipped\n",
+                        layout->tag);
+                    free(state.out);
+                    free(state.in);
+                    continue;
+                }
+
+                failures += !measure(
+                    OP_PROBE,
+                    &state,
+                    layout,
+                    size,
+                    flipped,
+                    data_size,
+                    min_time_ns);
+
+                const int paletted = state.probe_desc.attributes &
+                                     SFL_BMP_ATTRIBUTE_PALETTIZED;
+                if (state.probe_desc.format !=
+                    SFL_BMP_PIXEL_FORMAT_UNRECOGNIZED)
+                {
+                    /* Palette indices decode to the palette's own format */
+                    state.out_format = paletted
+                                           ? SFL_BMP_PIXEL_FORMAT_B8G8R8A8
+                                           : state.probe_desc.format;
+                    failures += !measure(
+                        OP_DECODE,
+                        &state,
+                        layout,
+                        size,
+                        flipped,
+                        data_size,
+                        min_time_ns);
+                }
+
+                state.out_format = SFL_BMP_PIXEL_FORMAT_R8G8B8A8;
+                failures += !measure(
+                    OP_CONVERT,
+                    &state,
+                    layout,
+                    size,
+                    flipped,
+                    data_size,
+                    min_time_ns);
+
+                /* Only the first iteration allocates anything */
+                SflBmpContext frames_ctx;
+                bench_memory_init(&frames_ctx);
+                sfl_bmp_set_stats(&frames_ctx, state.stats);
+                state.frames = sfl_bmp_frame_decoder_begin(&frames_ctx, 1);
+                if (!state.frames) {
+                    fprintf(stderr, "%ux%u: out of memory\n", size, size);
+                    return -1;
+                }
+
+                failures += !measure(
+                    OP_FRAMES,
+                    &state,
+                    layout,
+                    size,
+                    flipped,
+                    data_size,
+                    min_time_ns);
+                sfl_bmp_frame_decoder_end(state.frames);
+
+                failures += !measure(
+                    OP_MIPS,
+                    &state,
+                    layout,
+                    size,
+                    flipped,
+                    data_size,
+                    min_time_ns);
+
+                failures += !measure(
+                    OP_PLANAR,
+                    &state,
+                    layout,
+                    size,
+                    flipped,
+                    data_size,
+                    min_time_ns);
+
+                failures += !measure(
+                    OP_TENSOR,
+                    &state,
+                    layout,
+                    size,
+                    flipped,
+                    data_size,
+                    min_time_ns);
+
+                state.out_format = SFL_BMP_PIXEL_FORMAT_B5G6R5;
+                failures += !measure(
+                    OP_PACK,
+                    &state,
+                    layout,
+                    size,
+                    flipped,
+                    data_size,
+                    min_time_ns);
+
+                /* The encoder doesn't read palette indices */
+                if (!paletted) {
+                    failures += !measure(
+                        OP_ENCODE,
+                        &state,
+                        layout,
+                        size,
+                        flipped,
+                        data_size,
+                        min_time_ns);
+                }
+
+                free(state.out);
+                free(state.in);
+            }
+        }
+    }
+
+    return failures != 0;
+}
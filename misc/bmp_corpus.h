@@ -0,0 +1,772 @@
+/* SFL bmp_corpus v0.1
+
+Deterministic synthetic BMP files, shared by bmp_generate and bmp_bench.
+
+A CorpusSpec describes one file: info header version, bit depth, compression,
+dimensions, row order and pixel pattern. Every pixel of the file is a pure
+function of the spec and its (x, y) position, so files of any size can be
+streamed out row by row, and any decoded pixel can be checked against
+corpus_value and corpus_palette_entry without keeping the source image around.
+
+Coordinates are always top-left based (y = 0 is the top row), regardless of
+the row order used in the file.
+
+CONTRIBUTION
+Michael Dodis (michaeldodisgr@gmail.com)
+*/
+#ifndef BMP_CORPUS_H
+#define BMP_CORPUS_H
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef enum {
+    CORPUS_HEADER_CORE       = 0, /** ( 12) BITMAPCOREHEADER */
+    CORPUS_HEADER_OS22       = 1, /** ( 64) OS22XBITMAPHEADER */
+    CORPUS_HEADER_OS22_SHORT = 2, /** ( 16) OS22XBITMAPHEADER, truncated */
+    CORPUS_HEADER_V1         = 3, /** ( 40) BITMAPINFOHEADER */
+    CORPUS_HEADER_V2         = 4, /** ( 52) BITMAPV2INFOHEADER */
+    CORPUS_HEADER_V3         = 5, /** ( 56) BITMAPV3INFOHEADER */
+    CORPUS_HEADER_V4         = 6, /** (108) BITMAPV4HEADER */
+    CORPUS_HEADER_V5         = 7, /** (124) BITMAPV5HEADER */
+    CORPUS_HEADER_COUNT
+} CorpusHeader;
+
+/* Same values as the biCompression field */
+typedef enum {
+    CORPUS_COMPRESSION_RGB       = 0,
+    CORPUS_COMPRESSION_RLE8      = 1,
+    CORPUS_COMPRESSION_RLE4      = 2,
+    CORPUS_COMPRESSION_BITFIELDS = 3,
+    CORPUS_COMPRESSION_COUNT
+} CorpusCompression;
+
+typedef enum {
+    /** Every pixel is unrelated to its neighbours */
+    CORPUS_PATTERN_NOISE    = 0,
+    /** Each component ramps along x, y or both */
+    CORPUS_PATTERN_GRADIENT = 1,
+    /** Spans of equal pixels with varying lengths, friendly to RLE */
+    CORPUS_PATTERN_RUNS     = 2,
+    CORPUS_PATTERN_COUNT
+} CorpusPattern;
+
+typedef struct {
+    CorpusHeader header;
+    int          bpp;
+    int          compression;
+    uint32_t     width;
+    uint32_t     height;
+    /** Rows are stored top to bottom (negative height) */
+    int          top_down;
+    /** Color masks (r, g, b, a). Only used with BITFIELDS, all zero selects
+     * the default ones for the bit depth */
+    uint32_t     mask[4];
+    int          pattern;
+    uint32_t     seed;
+} CorpusSpec;
+
+/** Bit depths that are valid for at least one header */
+static const int Corpus_Bit_Depths[] = {1, 2, 4, 8, 16, 24, 32};
+
+#define PROC_CORPUS_WRITE(name) \
+    int name(void* usr, const void* buf, size_t size)
+typedef PROC_CORPUS_WRITE(ProcCorpusWrite);
+
+static const char* corpus_compression_tag(int compression)
+{
+    switch (compression) {
+        case CORPUS_COMPRESSION_RGB:
+            return "rgb";
+        case CORPUS_COMPRESSION_RLE8:
+            return "rle8";
+        case CORPUS_COMPRESSION_RLE4:
+            return "rle4";
+        case CORPUS_COMPRESSION_BITFIELDS:
+            return "bitfields";
+        default:
+            return 0;
+    }
+}
+
+static const char* corpus_pattern_tag(int pattern)
+{
+    switch (pattern) {
+        case CORPUS_PATTERN_NOISE:
+            return "noise";
+        case CORPUS_PATTERN_GRADIENT:
+            return "gradient";
+        case CORPUS_PATTERN_RUNS:
+            return "runs";
+        default:
+            return 0;
+    }
+}
+
+static uint32_t corpus_header_size(CorpusHeader header)
+{
+    static const uint32_t sizes[CORPUS_HEADER_COUNT] = {
+        12, 64, 16, 40, 52, 56, 108, 124};
+    return sizes[header];
+}
+
+static int corpus_is_os2(CorpusHeader header)
+{
+    return header == CORPUS_HEADER_CORE || header == CORPUS_HEADER_OS22 ||
+           header == CORPUS_HEADER_OS22_SHORT;
+}
+
+static int corpus_is_paletted(const CorpusSpec* spec) { return spec->bpp <= 8; }
+
+static uint32_t corpus_palette_count(const CorpusSpec* spec)
+{
+    return corpus_is_paletted(spec) ? (1u << spec->bpp) : 0;
+}
+
+/** Palette entries are 3 bytes in the core header, and 4 everywhere else */
+static uint32_t corpus_palette_entry_size(const CorpusSpec* spec)
+{
+    return spec->header == CORPUS_HEADER_CORE ? 3 : 4;
+}
+
+static uint64_t corpus_pitch(const CorpusSpec* spec)
+{
+    return (((uint64_t)spec->bpp * spec->width + 31) / 32) * 4;
+}
+
+/**
+ * Fills the effective color masks. BI_RGB files have implicit ones, and
+ * alpha can only be described by V3 headers and up
+ */
+static void corpus_masks(const CorpusSpec* spec, uint32_t* mask)
+{
+    memset(mask, 0, sizeof(uint32_t) * 4);
+    if (corpus_is_paletted(spec)) {
+        return;
+    }
+
+    if (spec->compression == CORPUS_COMPRESSION_BITFIELDS &&
+        (spec->mask[0] | spec->mask[1] | spec->mask[2] | spec->mask[3]))
+    {
+        memcpy(mask, spec->mask, sizeof(uint32_t) * 4);
+        return;
+    }
+
+    if (spec->bpp == 16) {
+        if (spec->compression == CORPUS_COMPRESSION_BITFIELDS) {
+            mask[0] = 0xf800;
+            mask[1] = 0x07e0;
+            mask[2] = 0x001f;
+        } else {
+            mask[0] = 0x7c00;
+            mask[1] = 0x03e0;
+            mask[2] = 0x001f;
+        }
+    } else {
+        mask[0] = 0x00ff0000;
+        mask[1] = 0x0000ff00;
+        mask[2] = 0x000000ff;
+        if (spec->compression == CORPUS_COMPRESSION_BITFIELDS &&
+            spec->header >= CORPUS_HEADER_V3)
+        {
+            mask[3] = 0xff000000;
+        }
+    }
+}
+
+static int corpus__bit_shift(uint32_t value)
+{
+    int result = 0;
+    if (value == 0) return 0;
+    while ((value & 1) == 0) {
+        value >>= 1;
+        result++;
+    }
+    return result;
+}
+
+/**
+ * Returns 0 if the spec describes a file that the format allows, otherwise a
+ * short reason
+ */
+static const char* corpus_validate(const CorpusSpec* spec)
+{
+    if (spec->header < 0 || spec->header >= CORPUS_HEADER_COUNT) {
+        return "unknown header";
+    }
+
+    if (spec->width == 0 || spec->height == 0 ||
+        spec->width > (uint32_t)INT32_MAX || spec->height > (uint32_t)INT32_MAX)
+    {
+        return "dimensions out of range";
+    }
+
+    switch (spec->bpp) {
+        case 1:
+        case 4:
+        case 8:
+        case 24:
+            break;
+        case 2:
+        case 16:
+        case 32:
+            if (corpus_is_os2(spec->header)) {
+                return "bit depth not supported by OS/2 headers";
+            }
+            break;
+        default:
+            return "invalid bit depth";
+    }
+
+    switch (spec->compression) {
+        case CORPUS_COMPRESSION_RGB:
+            break;
+        case CORPUS_COMPRESSION_RLE8:
+            if (spec->bpp != 8) return "RLE8 requires 8 bpp";
+            break;
+        case CORPUS_COMPRESSION_RLE4:
+            if (spec->bpp != 4) return "RLE4 requires 4 bpp";
+            break;
+        case CORPUS_COMPRESSION_BITFIELDS:
+            if (corpus_is_os2(spec->header)) {
+                return "BITFIELDS not supported by OS/2 headers";
+            }
+            if (spec->bpp != 16 && spec->bpp != 32) {
+                return "BITFIELDS requires 16 or 32 bpp";
+            }
+            break;
+        default:
+            return "invalid compression";
+    }
+
+    if (spec->header == CORPUS_HEADER_CORE) {
+        if (spec->compression != CORPUS_COMPRESSION_RGB) {
+            return "core header can't be compressed";
+        }
+        if (spec->width > 0xffff || spec->height > 0xffff) {
+            return "core header dimensions are 16 bit";
+        }
+    }
+
+    /* Ends before the compression field, so there's nothing to say RLE */
+    if (spec->header == CORPUS_HEADER_OS22_SHORT &&
+        spec->compression != CORPUS_COMPRESSION_RGB)
+    {
+        return "short OS/2 header can't be compressed";
+    }
+
+    if (spec->top_down) {
+        if (corpus_is_os2(spec->header)) {
+            return "OS/2 bitmaps are always bottom-up";
+        }
+        if (spec->compression == CORPUS_COMPRESSION_RLE8 ||
+            spec->compression == CORPUS_COMPRESSION_RLE4)
+        {
+            return "top-down bitmaps can't be compressed";
+        }
+    }
+
+    if (spec->compression == CORPUS_COMPRESSION_BITFIELDS) {
+        uint32_t mask[4];
+        uint32_t seen = 0;
+        corpus_masks(spec, mask);
+
+        if (mask[3] && spec->header < CORPUS_HEADER_V3) {
+            return "alpha mask requires V3 header or later";
+        }
+
+        for (int c = 0; c < 4; ++c) {
+            const uint32_t m = mask[c];
+            if (m & seen) return "overlapping masks";
+            /* Contiguous runs of bits only */
+            const uint32_t bits = m >> corpus__bit_shift(m);
+            if (bits & (bits + 1)) return "non-contiguous mask";
+            if (spec->bpp == 16 && (m >> 16)) return "mask exceeds 16 bits";
+            seen |= m;
+        }
+    } else if (spec->mask[0] | spec->mask[1] | spec->mask[2] | spec->mask[3]) {
+        return "masks require BITFIELDS";
+    }
+
+    if (spec->pattern < 0 || spec->pattern >= CORPUS_PATTERN_COUNT) {
+        return "unknown pattern";
+    }
+
+    return 0;
+}
+
+/**
+ * Patterns
+ */
+static uint32_t corpus__hash(uint32_t seed, uint32_t x, uint32_t y)
+{
+    uint32_t h = seed ^ (x * 0x9e3779b1u) ^ (y * 0x85ebca77u);
+    h ^= h >> 16;
+    h *= 0x7feb352du;
+    h ^= h >> 15;
+    h *= 0x846ca68bu;
+    h ^= h >> 16;
+    return h;
+}
+
+/** Scales t / (n - 1) into [0, max] */
+static uint32_t corpus__ramp(uint32_t t, uint32_t n, uint32_t max)
+{
+    if (n <= 1) return 0;
+    return (uint32_t)(((uint64_t)t * max) / (n - 1));
+}
+
+/**
+ * Index into the palette for paletted specs, otherwise the raw pixel value.
+ * Bits outside of the masks (or above bpp) are always zero
+ */
+static uint32_t corpus_value(const CorpusSpec* spec, uint32_t x, uint32_t y)
+{
+    uint32_t value = 0;
+
+    switch (spec->pattern) {
+        case CORPUS_PATTERN_NOISE:
+        default: {
+            value = corpus__hash(spec->seed, x, y);
+        } break;
+
+        case CORPUS_PATTERN_RUNS: {
+            /* Run length changes every row, between 1 and 32 */
+            const uint32_t row_hash = corpus__hash(spec->seed, 0xffffffffu, y);
+            const uint32_t run      = 1 + (row_hash & 31);
+            value = corpus__hash(spec->seed, (x + (row_hash >> 8)) / run, y);
+        } break;
+
+        case CORPUS_PATTERN_GRADIENT: {
+            if (corpus_is_paletted(spec)) {
+                value = corpus__ramp(
+                    x + y,
+                    spec->width + spec->height - 1,
+                    corpus_palette_count(spec) - 1);
+            } else {
+                uint32_t mask[4];
+                corpus_masks(spec, mask);
+
+                const uint32_t t[4] = {
+                    x,
+                    y,
+                    x + y,
+                    spec->width - 1 - x,
+                };
+                const uint32_t n[4] = {
+                    spec->width,
+                    spec->height,
+                    spec->width + spec->height - 1,
+                    spec->width,
+                };
+
+                for (int c = 0; c < 4; ++c) {
+                    const uint32_t shift = corpus__bit_shift(mask[c]);
+                    const uint32_t max   = mask[c] >> shift;
+                    value |= corpus__ramp(t[c], n[c], max) << shift;
+                }
+            }
+        } break;
+    }
+
+    if (corpus_is_paletted(spec)) {
+        return value & (corpus_palette_count(spec) - 1);
+    }
+
+    uint32_t mask[4];
+    corpus_masks(spec, mask);
+    return value & (mask[0] | mask[1] | mask[2] | mask[3]);
+}
+
+/** Palette entry as 0x00RRGGBB */
+static uint32_t corpus_palette_entry(const CorpusSpec* spec, uint32_t index)
+{
+    const uint32_t count = corpus_palette_count(spec);
+    if (spec->pattern == CORPUS_PATTERN_GRADIENT) {
+        /* Gray ramp */
+        const uint32_t v = corpus__ramp(index, count, 255);
+        return (v << 16) | (v << 8) | v;
+    }
+    return corpus__hash(spec->seed ^ 0x5bd1e995u, index, count) & 0x00ffffff;
+}
+
+/**
+ * File writing
+ */
+typedef struct {
+    uint8_t  data[256];
+    uint32_t size;
+} CorpusBytes;
+
+static void corpus__put(CorpusBytes* bytes, uint32_t value, uint32_t size)
+{
+    for (uint32_t i = 0; i < size; ++i) {
+        bytes->data[bytes->size++] = (uint8_t)(value >> (8 * i));
+    }
+}
+
+#define corpus__put_u8(b, x)  corpus__put(b, (uint32_t)(x), 1)
+#define corpus__put_u16(b, x) corpus__put(b, (uint32_t)(x), 2)
+#define corpus__put_u32(b, x) corpus__put(b, (uint32_t)(x), 4)
+
+/** File row i holds image row y */
+static uint32_t corpus__row_y(const CorpusSpec* spec, uint32_t i)
+{
+    return spec->top_down ? i : spec->height - 1 - i;
+}
+
+/** Packs a row of uncompressed pixel data, including the padding */
+static void corpus__pack_row(const CorpusSpec* spec, uint32_t y, uint8_t* row)
+{
+    const uint64_t pitch = corpus_pitch(spec);
+    memset(row, 0, (size_t)pitch);
+
+    switch (spec->bpp) {
+        case 1:
+        case 2:
+        case 4: {
+            const uint32_t per_byte = 8 / spec->bpp;
+            for (uint32_t x = 0; x < spec->width; ++x) {
+                const uint32_t shift = 8 - spec->bpp * (1 + (x % per_byte));
+                row[x / per_byte] |=
+                    (uint8_t)(corpus_value(spec, x, y) << shift);
+            }
+        } break;
+
+        default: {
+            const uint32_t slice = spec->bpp / 8;
+            for (uint32_t x = 0; x < spec->width; ++x) {
+                const uint32_t value = corpus_value(spec, x, y);
+                for (uint32_t i = 0; i < slice; ++i) {
+                    row[(size_t)x * slice + i] = (uint8_t)(value >> (8 * i));
+                }
+            }
+        } break;
+    }
+}
+
+/**
+ * Run length encodes one row (RLE8 or RLE4), terminated by an end of line, or
+ * an end of bitmap marker for the last row. Returns the amount of bytes
+ * written; out must hold at least corpus__rle_row_bound bytes
+ */
+static size_t corpus__rle_row(
+    const CorpusSpec* spec, uint32_t y, int last, uint8_t* out)
+{
+    const int rle4 = spec->compression == CORPUS_COMPRESSION_RLE4;
+    size_t    n    = 0;
+    uint32_t  x    = 0;
+
+    while (x < spec->width) {
+        const uint32_t value = corpus_value(spec, x, y);
+
+        uint32_t run = 1;
+        while ((x + run) < spec->width && run < 255 &&
+               corpus_value(spec, x + run, y) == value)
+        {
+            run++;
+        }
+
+        if (run >= 3) {
+            out[n++] = (uint8_t)run;
+            out[n++] = (uint8_t)(rle4 ? ((value << 4) | value) : value);
+            x += run;
+            continue;
+        }
+
+        /* Absolute mode: extend until the next run of 3 or more */
+        uint32_t count = 0;
+        while ((x + count) < spec->width && count < 255) {
+            const uint32_t v = corpus_value(spec, x + count, y);
+            if ((x + count + 2) < spec->width &&
+                corpus_value(spec, x + count + 1, y) == v &&
+                corpus_value(spec, x + count + 2, y) == v)
+            {
+                break;
+            }
+            count++;
+        }
+
+        if (count < 3) {
+            /* Absolute mode needs at least 3 pixels, emit single runs */
+            for (uint32_t i = 0; i < (count ? count : 1); ++i) {
+                const uint32_t v = corpus_value(spec, x, y);
+                out[n++]         = 1;
+                out[n++]         = (uint8_t)(rle4 ? (v << 4) : v);
+                x++;
+            }
+            continue;
+        }
+
+        out[n++] = 0;
+        out[n++] = (uint8_t)count;
+
+        const size_t start = n;
+        if (rle4) {
+            for (uint32_t i = 0; i < count; i += 2) {
+                uint8_t b = (uint8_t)(corpus_value(spec, x + i, y) << 4);
+                if ((i + 1) < count) {
+                    b |= (uint8_t)corpus_value(spec, x + i + 1, y);
+                }
+                out[n++] = b;
+            }
+        } else {
+            for (uint32_t i = 0; i < count; ++i) {
+                out[n++] = (uint8_t)corpus_value(spec, x + i, y);
+            }
+        }
+
+        /* Absolute runs are padded to 16 bits */
+        if ((n - start) & 1) {
+            out[n++] = 0;
+        }
+        x += count;
+    }
+
+    out[n++] = 0;
+    out[n++] = last ? 1 : 0;
+    return n;
+}
+
+/** Worst case for a single pixel runs: 2 bytes per pixel plus the marker */
+static size_t corpus__rle_row_bound(const CorpusSpec* spec)
+{
+    return (size_t)spec->width * 2 + 2;
+}
+
+static int corpus__is_rle(const CorpusSpec* spec)
+{
+    return spec->compression == CORPUS_COMPRESSION_RLE8 ||
+           spec->compression == CORPUS_COMPRESSION_RLE4;
+}
+
+/** Size of everything before the pixel data */
+static uint32_t corpus_data_offset(const CorpusSpec* spec)
+{
+    uint32_t offset = 14 + corpus_header_size(spec->header);
+    if (spec->header == CORPUS_HEADER_V1 &&
+        spec->compression == CORPUS_COMPRESSION_BITFIELDS)
+    {
+        offset += 12;
+    }
+    offset += corpus_palette_count(spec) * corpus_palette_entry_size(spec);
+    return offset;
+}
+
+/**
+ * Size of the pixel data. For RLE this encodes the whole image, so it's as
+ * expensive as writing it
+ */
+static uint64_t corpus_data_size(const CorpusSpec* spec)
+{
+    if (!corpus__is_rle(spec)) {
+        return corpus_pitch(spec) * spec->height;
+    }
+
+    uint8_t* row = (uint8_t*)malloc(corpus__rle_row_bound(spec));
+    if (!row) return 0;
+
+    uint64_t size = 0;
+    for (uint32_t i = 0; i < spec->height; ++i) {
+        size += corpus__rle_row(
+            spec,
+            corpus__row_y(spec, i),
+            i == (spec->height - 1),
+            row);
+    }
+
+    free(row);
+    return size;
+}
+
+/**
+ * Writes file & info headers, masks and palette. Size fields that don't fit
+ * (files over 4GB) are written as zero
+ */
+static int corpus__write_headers(
+    const CorpusSpec* spec,
+    uint64_t          data_size,
+    ProcCorpusWrite*  write,
+    void*             usr)
+{
+    CorpusBytes    b          = {{0}, 0};
+    const uint32_t offset     = corpus_data_offset(spec);
+    const uint64_t file_size  = offset + data_size;
+    const uint32_t num_colors = corpus_palette_count(spec);
+    const int32_t  height     = spec->top_down ? -(int32_t)spec->height
+                                               : (int32_t)spec->height;
+    const uint32_t raw_size =
+        data_size > 0xffffffffu ? 0 : (uint32_t)data_size;
+    uint32_t mask[4];
+
+    corpus_masks(spec, mask);
+
+    corpus__put_u8(&b, 'B');
+    corpus__put_u8(&b, 'M');
+    corpus__put_u32(&b, file_size > 0xffffffffu ? 0 : (uint32_t)file_size);
+    corpus__put_u32(&b, 0); /* reserved[2] */
+    corpus__put_u32(&b, offset);
+
+    corpus__put_u32(&b, corpus_header_size(spec->header));
+    if (spec->header == CORPUS_HEADER_CORE) {
+        corpus__put_u16(&b, spec->width);
+        corpus__put_u16(&b, spec->height);
+        corpus__put_u16(&b, 1); /* planes */
+        corpus__put_u16(&b, spec->bpp);
+    } else {
+        corpus__put_u32(&b, spec->width);
+        corpus__put_u32(&b, (uint32_t)height);
+        corpus__put_u16(&b, 1); /* planes */
+        corpus__put_u16(&b, spec->bpp);
+    }
+
+    if (spec->header != CORPUS_HEADER_CORE &&
+        spec->header != CORPUS_HEADER_OS22_SHORT)
+    {
+        corpus__put_u32(&b, spec->compression);
+        corpus__put_u32(&b, corpus__is_rle(spec) ? raw_size : 0);
+        corpus__put_u32(&b, 2835); /* hres, 72 DPI */
+        corpus__put_u32(&b, 2835); /* vres */
+        corpus__put_u32(&b, num_colors);
+        corpus__put_u32(&b, 0); /* important colors */
+    }
+
+    if (spec->header == CORPUS_HEADER_OS22) {
+        corpus__put_u16(&b, 0); /* units */
+        corpus__put_u16(&b, 0); /* reserved */
+        corpus__put_u16(&b, 0); /* recording */
+        corpus__put_u16(&b, 0); /* rendering */
+        corpus__put_u32(&b, 0); /* size1 */
+        corpus__put_u32(&b, 0); /* size2 */
+        corpus__put_u32(&b, 0); /* color encoding */
+        corpus__put_u32(&b, 0); /* identifier */
+    }
+
+    if (spec->header == CORPUS_HEADER_V1 &&
+        spec->compression == CORPUS_COMPRESSION_BITFIELDS)
+    {
+        /* Masks follow the header */
+        corpus__put_u32(&b, mask[0]);
+        corpus__put_u32(&b, mask[1]);
+        corpus__put_u32(&b, mask[2]);
+    }
+
+    if (spec->header >= CORPUS_HEADER_V2) {
+        const int bitfields = spec->compression == CORPUS_COMPRESSION_BITFIELDS;
+        corpus__put_u32(&b, bitfields ? mask[0] : 0);
+        corpus__put_u32(&b, bitfields ? mask[1] : 0);
+        corpus__put_u32(&b, bitfields ? mask[2] : 0);
+    }
+
+    if (spec->header >= CORPUS_HEADER_V3) {
+        corpus__put_u32(&b, mask[3]);
+    }
+
+    if (spec->header >= CORPUS_HEADER_V4) {
+        corpus__put_u32(&b, 'sRGB'); /* color space */
+        for (int i = 0; i < 9; ++i) {
+            corpus__put_u32(&b, 0); /* endpoints */
+        }
+        corpus__put_u32(&b, 0); /* gamma red */
+        corpus__put_u32(&b, 0); /* gamma green */
+        corpus__put_u32(&b, 0); /* gamma blue */
+    }
+
+    if (spec->header >= CORPUS_HEADER_V5) {
+        corpus__put_u32(&b, 4); /* intent, LCS_GM_IMAGES */
+        corpus__put_u32(&b, 0); /* profile data offset */
+        corpus__put_u32(&b, 0); /* profile data size */
+        corpus__put_u32(&b, 0); /* reserved */
+    }
+
+    if (!write(usr, b.data, b.size)) return 0;
+
+    for (uint32_t i = 0; i < num_colors; ++i) {
+        const uint32_t entry = corpus_palette_entry(spec, i);
+        b.size               = 0;
+        corpus__put(&b, entry, corpus_palette_entry_size(spec));
+        if (!write(usr, b.data, b.size)) return 0;
+    }
+
+    return 1;
+}
+
+/**
+ * Streams the whole file out, one row at a time
+ */
+static int corpus_write(
+    const CorpusSpec* spec, ProcCorpusWrite* write, void* usr)
+{
+    if (corpus_validate(spec)) return 0;
+
+    const int    rle   = corpus__is_rle(spec);
+    const size_t bound = rle ? corpus__rle_row_bound(spec)
+                             : (size_t)corpus_pitch(spec);
+
+    if (!corpus__write_headers(spec, corpus_data_size(spec), write, usr)) {
+        return 0;
+    }
+
+    uint8_t* row = (uint8_t*)malloc(bound);
+    if (!row) return 0;
+
+    int ok = 1;
+    for (uint32_t i = 0; ok && i < spec->height; ++i) {
+        const uint32_t y = corpus__row_y(spec, i);
+        if (rle) {
+            const size_t n =
+                corpus__rle_row(spec, y, i == (spec->height - 1), row);
+            ok = write(usr, row, n);
+        } else {
+            corpus__pack_row(spec, y, row);
+            ok = write(usr, row, bound);
+        }
+    }
+
+    free(row);
+    return ok;
+}
+
+typedef struct {
+    uint8_t* buf;
+    size_t   len;
+    size_t   curr;
+} CorpusMemory;
+
+static PROC_CORPUS_WRITE(corpus__memory_write)
+{
+    CorpusMemory* mem = (CorpusMemory*)usr;
+    if (mem->curr + size > mem->len) return 0;
+    memcpy(mem->buf + mem->curr, buf, size);
+    mem->curr += size;
+    return 1;
+}
+
+/**
+ * Builds the whole file in a malloc'd buffer
+ */
+static uint8_t* corpus_build(const CorpusSpec* spec, size_t* out_len)
+{
+    if (corpus_validate(spec)) return 0;
+
+    const uint64_t len = corpus_data_offset(spec) + corpus_data_size(spec);
+    if (len > (uint64_t)SIZE_MAX) return 0;
+
+    CorpusMemory mem;
+    mem.len  = (size_t)len;
+    mem.curr = 0;
+    mem.buf  = (uint8_t*)malloc(mem.len);
+    if (!mem.buf) return 0;
+
+    if (!corpus_write(spec, corpus__memory_write, &mem) ||
+        mem.curr != mem.len)
+    {
+        free(mem.buf);
+        return 0;
+    }
+
+    *out_len = mem.len;
+    return mem.buf;
+}
+
+#endif
@@ -1,5 +1,33 @@
+/* SFL bmp_generate v0.2
+
+Generates BMP files for testing and benchmarking sfl_bmp.h. Other than the
+hand written files selected by tag, any layout can be described through
+options, and its pixels follow a deterministic pattern (@see bmp_corpus.h).
+Rows are generated and written one at a time, so files can be as large as
+the format allows.
+
+USAGE
+bmp_generate <tag> <path>
+bmp_generate [options] <path>
+bmp_generate [options] --corpus <dir>
+bmp_generate [options] --check
+
+--corpus writes one file for every valid combination of info header, bit depth,
+compression, masks, row order and pattern into an existing directory.
+
+--check builds the same combinations in memory at several odd sizes, decodes
+them to every built-in pixel format and compares the result against the
+pattern. Layouts that the decoder rejects are reported and skipped.
+
+CONTRIBUTION
+Michael Dodis (michaeldodisgr@gmail.com)
+*/
+#define SFL_BMP_IMPLEMENTATION
+#include "sfl_bmp.h"
+#include "bmp_corpus.h"
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #define ARRAY_COUNT(x) (sizeof(x) / sizeof(x[0]))
@@ -59,6 +87,26 @@ static const Generator The_Generators[] = {
      "v1-16bpp-rgb",
      "Generates v1 bitmap with 16 bits per pixel and RGB compression"}};
 
+/**
+ * Extra BITFIELDS layouts enumerated by --corpus and --check, on top of the
+ * default masks
+ */
+static const uint32_t The_Masks_16[][4] = {
+    {0x7c00, 0x03e0, 0x001f, 0x0000},
+    {0x7c00, 0x03e0, 0x001f, 0x8000},
+    {0x0f00, 0x00f0, 0x000f, 0xf000},
+};
+
+static const uint32_t The_Masks_32[][4] = {
+    {0x00ff0000, 0x0000ff00, 0x000000ff, 0x00000000},
+    {0x000000ff, 0x0000ff00, 0x00ff0000, 0xff000000},
+    {0x3ff00000, 0x000ffc00, 0x000003ff, 0xc0000000},
+};
+
+/** Small and odd widths, so that rows end in partial bytes and padding */
+static const uint32_t The_Check_Widths[]  = {1, 2, 3, 4, 5, 6, 7, 8, 9, 61};
+static const uint32_t The_Check_Heights[] = {1, 3};
+
 static void print_help()
 {
     puts("Invocation: bmp_generate <tag> <path>");
@@ -66,6 +114,21 @@ static void print_help()
         const Generator* generator = &The_Generators[i];
         printf("%-20s %s\n", generator->tag, generator->description);
     }
+    puts("");
+    puts("Invocation: bmp_generate [options] <path>");
+    puts("Invocation: bmp_generate [options] --corpus <dir>");
+    puts("Invocation: bmp_generate [options] --check");
+    puts("--header <h>          core, os22, os22-short, v1, v2, v3, v4, v5");
+    puts("--bpp <n>             1, 2, 4, 8, 16, 24, 32");
+    puts("--compression <c>     rgb, rle8, rle4, bitfields");
+    puts("--masks <r,g,b,a>     Hex color masks (bitfields only)");
+    puts("--width <n>           Width in pixels");
+    puts("--height <n>          Height in pixels");
+    puts("--top-down            Store rows top to bottom");
+    puts("--pattern <p>         noise, gradient, runs");
+    puts("--seed <n>            Seed for the pattern");
+    puts("--corpus <dir>        Write every valid layout into <dir>");
+    puts("--check               Decode every valid layout and verify pixels");
 }
 
 static const Generator* find_generator(const char* tag)
@@ -79,31 +142,574 @@ static const Generator* find_generator(const char* tag)
     return 0;
 }
 
+/**
+ * File output
+ */
+typedef struct {
+    FILE*    f;
+    uint64_t written;
+} FileSink;
+
+static PROC_CORPUS_WRITE(file_sink_write)
+{
+    FileSink* sink = (FileSink*)usr;
+    if (fwrite(buf, 1, size, sink->f) != size) return 0;
+    sink->written += size;
+    return 1;
+}
+
+static int write_spec(const CorpusSpec* spec, const char* path)
+{
+    FILE* f = fopen(path, "wb");
+    if (!f) {
+        printf("Could not open file %s\n", path);
+        return 0;
+    }
+
+    FileSink sink = {f, 0};
+    int      ok   = corpus_write(spec, file_sink_write, &sink);
+    ok            = (fclose(f) == 0) && ok;
+
+    if (!ok) {
+        printf("Failed to write %s\n", path);
+    }
+    return ok;
+}
+
+/**
+ * Describes masks from the most significant bit down, e.g. a1r5g5b5
+ */
+static void describe_masks(const CorpusSpec* spec, char* out, size_t out_size)
+{
+    static const char components[] = "rgba";
+    uint32_t          mask[4];
+    size_t            n = 0;
+
+    corpus_masks(spec, mask);
+    out[0] = 0;
+
+    int bit = spec->bpp - 1;
+    while (bit >= 0) {
+        char c = 'x';
+        for (int i = 0; i < 4; ++i) {
+            if (mask[i] & (1u << bit)) c = components[i];
+        }
+
+        int count = 0;
+        while (bit >= 0) {
+            char next = 'x';
+            for (int i = 0; i < 4; ++i) {
+                if (mask[i] & (1u << bit)) next = components[i];
+            }
+            if (next != c) break;
+            count++;
+            bit--;
+        }
+
+        n += snprintf(out + n, out_size - n, "%c%d", c, count);
+        if (n >= out_size) break;
+    }
+}
+
+static const char* header_tag(int header)
+{
+    switch (header) {
+        case CORPUS_HEADER_CORE:
+            return "core";
+        case CORPUS_HEADER_OS22:
+            return "os22";
+        case CORPUS_HEADER_OS22_SHORT:
+            return "os22-short";
+        case CORPUS_HEADER_V1:
+            return "v1";
+        case CORPUS_HEADER_V2:
+            return "v2";
+        case CORPUS_HEADER_V3:
+            return "v3";
+        case CORPUS_HEADER_V4:
+            return "v4";
+        case CORPUS_HEADER_V5:
+            return "v5";
+        default:
+            return 0;
+    }
+}
+
+static void describe_spec(const CorpusSpec* spec, char* out, size_t out_size)
+{
+    char masks[64] = "";
+    if (spec->compression == CORPUS_COMPRESSION_BITFIELDS) {
+        masks[0] = '-';
+        describe_masks(spec, masks + 1, sizeof(masks) - 1);
+    }
+
+    snprintf(
+        out,
+        out_size,
+        "%s-%dbpp-%s%s-%s-%s-%ux%u",
+        header_tag(spec->header),
+        spec->bpp,
+        corpus_compression_tag(spec->compression),
+        masks,
+        spec->top_down ? "td" : "bu",
+        corpus_pattern_tag(spec->pattern),
+        spec->width,
+        spec->height);
+}
+
+#define PROC_VISIT(name) int name(const CorpusSpec* spec, void* usr)
+typedef PROC_VISIT(ProcVisit);
+
+/**
+ * Calls visit for every valid combination of header, bit depth, compression,
+ * masks and row order, keeping size, pattern and seed from base
+ */
+static int enumerate_layouts(
+    const CorpusSpec* base, ProcVisit* visit, void* usr)
+{
+    int ok = 1;
+
+    for (int h = 0; h < CORPUS_HEADER_COUNT; ++h) {
+        for (int b = 0; b < (int)ARRAY_COUNT(Corpus_Bit_Depths); ++b) {
+            for (int c = 0; c < CORPUS_COMPRESSION_COUNT; ++c) {
+                /* Default masks first, then the extra layouts */
+                const uint32_t(*masks)[4] = 0;
+                int num_masks             = 0;
+                if (c == CORPUS_COMPRESSION_BITFIELDS) {
+                    if (Corpus_Bit_Depths[b] == 16) {
+                        masks     = The_Masks_16;
+                        num_masks = ARRAY_COUNT(The_Masks_16);
+                    } else {
+                        masks     = The_Masks_32;
+                        num_masks = ARRAY_COUNT(The_Masks_32);
+                    }
+                }
+
+                for (int m = -1; m < num_masks; ++m) {
+                    for (int td = 0; td < 2; ++td) {
+                        CorpusSpec spec  = *base;
+                        spec.header      = (CorpusHeader)h;
+                        spec.bpp         = Corpus_Bit_Depths[b];
+                        spec.compression = c;
+                        spec.top_down    = td;
+                        memset(spec.mask, 0, sizeof(spec.mask));
+                        if (m >= 0) {
+                            uint32_t defaults[4];
+                            corpus_masks(&spec, defaults);
+                            if (memcmp(defaults, masks[m], sizeof(defaults)) ==
+                                0)
+                            {
+                                continue;
+                            }
+                            memcpy(spec.mask, masks[m], sizeof(spec.mask));
+                        }
+
+                        if (corpus_validate(&spec)) continue;
+                        ok = visit(&spec, usr) && ok;
+                    }
+                }
+            }
+        }
+    }
+
+    return ok;
+}
+
+typedef struct {
+    const char* dir;
+    int         all_patterns;
+    int         count;
+} CorpusState;
+
+static PROC_VISIT(visit_write)
+{
+    CorpusState* state   = (CorpusState*)usr;
+    CorpusSpec   variant = *spec;
+
+    for (int p = 0; p < CORPUS_PATTERN_COUNT; ++p) {
+        if (state->all_patterns) {
+            variant.pattern = p;
+        } else if (p > 0) {
+            break;
+        }
+
+        char name[128];
+        char path[1024];
+        describe_spec(&variant, name, sizeof(name));
+        snprintf(path, sizeof(path), "%s/%s.bmp", state->dir, name);
+
+        if (!write_spec(&variant, path)) return 0;
+        state->count++;
+    }
+    return 1;
+}
+
+/**
+ * Decoding checks
+ */
+static const int The_Check_Formats[] = {
+    SFL_BMP_PIXEL_FORMAT_R8G8B8A8,
+    SFL_BMP_PIXEL_FORMAT_B8G8R8A8,
+    SFL_BMP_PIXEL_FORMAT_B8G8R8,
+    SFL_BMP_PIXEL_FORMAT_B5G6R5,
+    SFL_BMP_PIXEL_FORMAT_B8G8R8X8,
+    SFL_BMP_PIXEL_FORMAT_B5G5R5X1,
+};
+
+/**
+ * Reference for the decoder's component conversion: rounds to nearest, and
+ * missing components are zero (or opaque, for alpha)
+ */
+static uint32_t scale_component(uint32_t v, int in_bits, int out_bits, int fill)
+{
+    if (out_bits == 0) return 0;
+
+    const uint64_t out_max = (1ull << out_bits) - 1;
+    if (in_bits == 0) return fill ? (uint32_t)out_max : 0;
+
+    const uint64_t in_max = (1ull << in_bits) - 1;
+    return (uint32_t)((v * out_max + in_max / 2) / in_max);
+}
+
+static int bit_count(uint32_t value)
+{
+    int result = 0;
+    for (; value; value &= value - 1) {
+        result++;
+    }
+    return result;
+}
+
+/**
+ * Returns component c (r, g, b, a) of the pixel at (x, y), as stored in the
+ * file. bits receives its width, or 0 if the file has no such component
+ */
+static uint32_t expected_component(
+    const CorpusSpec* spec, uint32_t x, uint32_t y, int c, int* bits)
+{
+    const uint32_t value = corpus_value(spec, x, y);
+
+    if (corpus_is_paletted(spec)) {
+        if (c == 3) {
+            *bits = 0;
+            return 0;
+        }
+        *bits = 8;
+        return (corpus_palette_entry(spec, value) >> (16 - 8 * c)) & 0xff;
+    }
+
+    uint32_t mask[4];
+    corpus_masks(spec, mask);
+    *bits = bit_count(mask[c]);
+    return (value & mask[c]) >> corpus__bit_shift(mask[c]);
+}
+
+/**
+ * Compares the decoded image against the spec. Returns 0 and describes the
+ * first mismatch in out if they differ
+ */
+static int verify_decoded(
+    const CorpusSpec* spec, SflBmpDesc* desc, char* out, size_t out_size)
+{
+    if (desc->width != spec->width || desc->height != spec->height) {
+        snprintf(out, out_size, "size %ux%u", desc->width, desc->height);
+        return 0;
+    }
+
+    for (uint32_t r = 0; r < desc->height; ++r) {
+        const uint32_t y = (desc->attributes & SFL_BMP_ATTRIBUTE_FLIPPED)
+                               ? desc->height - 1 - r
+                               : r;
+        const uint8_t* row =
+            (const uint8_t*)desc->data + (size_t)r * desc->pitch;
+
+        for (uint32_t x = 0; x < desc->width; ++x) {
+            uint32_t pixel = 0;
+            for (uint32_t i = 0; i < desc->slice; ++i) {
+                pixel |= (uint32_t)row[(size_t)x * desc->slice + i] << (8 * i);
+            }
+
+            for (int c = 0; c < 4; ++c) {
+                const uint32_t mask  = desc->mask[c];
+                const int      shift = corpus__bit_shift(mask);
+                int            bits;
+
+                const uint32_t value = expected_component(spec, x, y, c, &bits);
+                const uint32_t expected = scale_component(
+                    value,
+                    bits,
+                    bit_count(mask),
+                    c == 3);
+                const uint32_t actual = (pixel & mask) >> shift;
+
+                if (actual != expected) {
+                    snprintf(
+                        out,
+                        out_size,
+                        "pixel (%u, %u) component %c: expected %u, got %u",
+                        x,
+                        y,
+                        "rgba"[c],
+                        expected,
+                        actual);
+                    return 0;
+                }
+            }
+        }
+    }
+
+    return 1;
+}
+
+typedef struct {
+    int checked;
+    int failed;
+    int unsupported;
+} CheckState;
+
+/**
+ * Decodes the spec into every built-in pixel format. Returns -1 if the
+ * decoder doesn't support the file at all
+ */
+static int check_spec(const CorpusSpec* spec, CheckState* state)
+{
+    char   name[128];
+    size_t len;
+
+    describe_spec(spec, name, sizeof(name));
+
+    uint8_t* buf = corpus_build(spec, &len);
+    if (!buf) {
+        printf("FAIL %s: could not build file\n", name);
+        state->failed++;
+        return 0;
+    }
+
+    int rc = 1;
+    for (int f = 0; f < (int)ARRAY_COUNT(The_Check_Formats); ++f) {
+        SflBmpContext                ctx;
+        SflBmpIOImplementationMemory mem;
+        sfl_bmp_memory_io_init(&ctx, sfl_bmp_stdlib_get_implementation());
+        sfl_bmp_memory_io_set_source(&ctx, &mem, buf, len);
+
+        SflBmpDesc desc = {0};
+        desc.format     = The_Check_Formats[f];
+
+        if (!sfl_bmp_decode(&ctx, &desc)) {
+            if (f == 0) {
+                rc = -1;
+                break;
+            }
+            printf(
+                "FAIL %s -> %s: decode failed\n",
+                name,
+                sfl_bmp_describe_pixel_format(The_Check_Formats[f]));
+            state->failed++;
+            rc = 0;
+            continue;
+        }
+
+        char mismatch[128];
+        state->checked++;
+        if (!verify_decoded(spec, &desc, mismatch, sizeof(mismatch))) {
+            printf(
+                "FAIL %s -> %s: %s\n",
+                name,
+                sfl_bmp_describe_pixel_format(The_Check_Formats[f]),
+                mismatch);
+            state->failed++;
+            rc = 0;
+        }
+
+        free(desc.data);
+    }
+
+    free(buf);
+    return rc;
+}
+
+static PROC_VISIT(visit_check)
+{
+    CheckState* state   = (CheckState*)usr;
+    CorpusSpec  variant = *spec;
+
+    for (int p = 0; p < CORPUS_PATTERN_COUNT; ++p) {
+        for (int w = 0; w < (int)ARRAY_COUNT(The_Check_Widths); ++w) {
+            for (int h = 0; h < (int)ARRAY_COUNT(The_Check_Heights); ++h) {
+                variant.pattern = p;
+                variant.width   = The_Check_Widths[w];
+                variant.height  = The_Check_Heights[h];
+
+                if (check_spec(&variant, state) == -1) {
+                    /* Not worth trying every size of an unsupported layout */
+                    char name[128];
+                    describe_spec(&variant, name, sizeof(name));
+                    printf("SKIP %s: not supported by the decoder\n", name);
+                    state->unsupported++;
+                    return 1;
+                }
+            }
+        }
+    }
+
+    return 1;
+}
+
+static int parse_masks(const char* s, uint32_t* mask)
+{
+    char* end = 0;
+    for (int c = 0; c < 4; ++c) {
+        mask[c] = (uint32_t)strtoul(s, &end, 16);
+        if (end == s) return 0;
+        if (c < 3) {
+            if (*end != ',') return 0;
+            s = end + 1;
+        }
+    }
+    return *end == 0;
+}
+
+static int parse_enum(const char* s, const char* (*tag_proc)(int), int count)
+{
+    for (int i = 0; i < count; ++i) {
+        if (strcmp(s, tag_proc(i)) == 0) return i;
+    }
+    return -1;
+}
+
 int main(int argc, char const* argv[])
 {
-    if (argc != 3) {
+    /* bmp_generate <tag> <path> */
+    if (argc == 3 && argv[1][0] != '-') {
+        const Generator* generator = find_generator(argv[1]);
+        if (generator == 0) {
+            puts("Generator not found");
+            print_help();
+            return -1;
+        }
+
+        FILE* f = fopen(argv[2], "wb");
+        if (!f) {
+            puts("Could not open file");
+            return -1;
+        }
+
+        generator->generate_proc(f);
+        printf("Output file size: %ld\n", ftell(f));
+        fclose(f);
+
+        return 0;
+    }
+
+    CorpusSpec spec  = {0};
+    spec.header      = CORPUS_HEADER_V5;
+    spec.bpp         = 32;
+    spec.compression = CORPUS_COMPRESSION_RGB;
+    spec.width       = 61;
+    spec.height      = 17;
+    spec.pattern     = CORPUS_PATTERN_NOISE;
+    spec.seed        = 1;
+
+    int         check       = 0;
+    int         has_pattern = 0;
+    const char* corpus_dir  = 0;
+    const char* path        = 0;
+
+    for (int i = 1; i < argc; ++i) {
+        const char* arg   = argv[i];
+        const char* value = (i + 1) < argc ? argv[i + 1] : 0;
+        int         bad   = 0;
+
+        if (strcmp(arg, "--check") == 0) {
+            check = 1;
+            continue;
+        } else if (strcmp(arg, "--top-down") == 0) {
+            spec.top_down = 1;
+            continue;
+        } else if (arg[0] != '-') {
+            path = arg;
+            continue;
+        } else if (!value) {
+            bad = 1;
+        } else if (strcmp(arg, "--header") == 0) {
+            spec.header = (CorpusHeader)parse_enum(
+                value,
+                header_tag,
+                CORPUS_HEADER_COUNT);
+            bad = (int)spec.header == -1;
+        } else if (strcmp(arg, "--bpp") == 0) {
+            spec.bpp = atoi(value);
+        } else if (strcmp(arg, "--compression") == 0) {
+            spec.compression = parse_enum(
+                value,
+                corpus_compression_tag,
+                CORPUS_COMPRESSION_COUNT);
+            bad = spec.compression == -1;
+        } else if (strcmp(arg, "--masks") == 0) {
+            bad = !parse_masks(value, spec.mask);
+        } else if (strcmp(arg, "--width") == 0) {
+            spec.width = (uint32_t)strtoul(value, 0, 10);
+        } else if (strcmp(arg, "--height") == 0) {
+            spec.height = (uint32_t)strtoul(value, 0, 10);
+        } else if (strcmp(arg, "--pattern") == 0) {
+            spec.pattern = parse_enum(
+                value,
+                corpus_pattern_tag,
+                CORPUS_PATTERN_COUNT);
+            bad         = spec.pattern == -1;
+            has_pattern = 1;
+        } else if (strcmp(arg, "--seed") == 0) {
+            spec.seed = (uint32_t)strtoul(value, 0, 10);
+        } else if (strcmp(arg, "--corpus") == 0) {
+            corpus_dir = value;
+        } else {
+            bad = 1;
+        }
+
+        if (bad) {
+            printf("Invalid argument %s\n", arg);
+            print_help();
+            return -1;
+        }
+        i++;
+    }
+
+    if (check) {
+        CheckState state = {0, 0, 0};
+        enumerate_layouts(&spec, visit_check, &state);
+        printf(
+            "Checked %d decodes, %d failed, %d layouts unsupported\n",
+            state.checked,
+            state.failed,
+            state.unsupported);
+        return state.failed != 0;
+    }
+
+    if (corpus_dir) {
+        CorpusState state = {corpus_dir, !has_pattern, 0};
+        int         ok    = enumerate_layouts(&spec, visit_write, &state);
+        printf("Wrote %d files\n", state.count);
+        return ok ? 0 : -1;
+    }
+
+    if (!path) {
         puts("Invalid number of arguments");
         print_help();
         return -1;
     }
 
-    const Generator* generator = find_generator(argv[1]);
-    if (generator == 0) {
-        puts("Generator not found");
-        print_help();
+    const char* invalid = corpus_validate(&spec);
+    if (invalid) {
+        printf("Invalid layout: %s\n", invalid);
         return -1;
     }
 
-    FILE* f = fopen(argv[2], "wb");
-    if (!f) {
-        puts("Could not open file");
+    if (!write_spec(&spec, path)) {
         return -1;
     }
 
-    generator->generate_proc(f);
-    printf("Output file size: %ld\n", ftell(f));
-    fclose(f);
-
+    const uint64_t size = corpus_data_offset(&spec) + corpus_data_size(&spec);
+    printf("Output file size: %llu\n", (unsigned long long)size);
     return 0;
 }
 
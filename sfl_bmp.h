@@ -58,6 +58,8 @@ COMPILE TIME OPTIONS
 #define SFML_BMP_CUSTOM_TYPES 0
     Disables include of <stdint.h> for custom type support, instead provided
     by the user. The types are:
+    - SflBmpI64  (= int64_t by default)
+    - SflBmpU64  (= uint64_t by default)
     - SflBmpI32  (= int32_t by default)
     - SflBmpU32  (= uint32_t by default)
     - SflBmpI16  (= int16_t by default)
@@ -72,22 +74,99 @@ COMPILE TIME OPTIONS
 #define SFL_BMP_CUSTOM_PIXEL_FORMATS 0
     Enables the user to set value identifiers for the available pixel formats.
     This can be useful if you were going to translate the pixel format into your
-    own.
+    own. If they aren't set, they (and the palette index formats) are given
+    defaults. Formats beyond the built-in ones (A2R10G10B10, L8,
+    R16G16B16A16...) can also be registered at runtime, with their masks and
+    optional row kernels, which the decoders and the encoders then convert
+    to & from through R8G8B8A8. Only formats with masks can be written to a
+    file, and planar & mip outputs stay limited to the built-in formats
+    Available functions:
+      sfl_bmp_register_pixel_format
+
+#define SFL_BMP_MAX_CUSTOM_PIXEL_FORMATS 16
+    How many formats can be registered with SFL_BMP_CUSTOM_PIXEL_FORMATS
 
 #define SFL_BMP_ALWAYS_CONVERT 1
     Always converts formats even if they are generally supported by some APIs
     to R8G8B8A8
 
+#define SFL_BMP_STATS 0
+    Adds an optional SflBmpStats block to SflBmpContext, which counts IO calls,
+    bytes moved and allocations, and times each stage of probing, decoding and
+    encoding. When disabled, none of this is compiled in.
+    Available functions:
+      sfl_bmp_set_stats
+
+#define SFL_BMP_NANOSECONDS() 0
+    Defines a custom monotonic clock in nanoseconds, used by SFL_BMP_STATS
+
+#define SFL_BMP_BATCH 0
+    Includes the pipelined batch decoder, which uses threads (pthreads, or the
+    Win32 API on Windows). Files are read with pread (stdio on Windows)
+    Available functions:
+      sfl_bmp_batch_decode
+
+#define SFL_BMP_BATCH_IO_URING 0
+    Linux only. The batch decoder reads files on a single thread through
+    io_uring, with batched openat, statx, read and close requests (raw
+    syscalls, no liburing). Falls back to the pread readers if the kernel
+    doesn't support it
+
+#define SFL_BMP_PARALLEL_ENCODE 0
+    Includes an encoder that converts bands of rows on several threads and
+    writes them at their final offsets in a preallocated file (pwrite, or
+    overlapped WriteFile on Windows)
+    Available functions:
+      sfl_bmp_encode_parallel
+
+#define SFL_BMP_QUANTIZE 0
+    Includes a lossy encoder that reduces any image to a palette of at most
+    256 colors (median cut), with optional dithering, mapping bands of rows to
+    the palette on several threads
+    Available functions:
+      sfl_bmp_encode_quantized
+
+#define SFL_BMP_HASH 0
+    The decoders hash the pixel data while it's in cache, both as stored in
+    the file and as decoded, with XXH64 (seed 0). The hashes are returned in
+    SflBmpDesc::file_hash and SflBmpDesc::data_hash, for deduplication and
+    cache keys without another pass over the image
+    Available functions:
+      sfl_bmp_hash
+
+#define SFL_BMP_PIXEL_STATS 0
+    sfl_bmp_decode, the push decoder and the frame decoder gather statistics
+    of each decoded row while it's in cache: whether alpha is opaque, binary
+    or translucent, the range of each component, and histograms of them and
+    of luma. They go into an SflBmpPixelStats block set on the context, to
+    pick a texture format or drive auto exposure without another pass
+    Available functions:
+      sfl_bmp_set_pixel_stats
+
+#define SFL_BMP_TENSOR 0
+    Includes a decoder that writes float32 or float16 CHW tensors, cropped,
+    resized and normalized with a per channel mean and std on the way, for
+    inference. Bands of rows are filled on several threads
+    Available functions:
+      sfl_bmp_decode_tensor
+
+#define SFL_BMP_MIPMAPS 0
+    sfl_bmp_decode and the push decoder can build the whole mip chain of the
+    image into the same allocation, level by level as rows are decoded. Set
+    SFL_BMP_ATTRIBUTE_MIPMAPPED on the output descriptor to get it; each
+    level's offset and pitch are in SflBmpDesc::level_offset and
+    SflBmpDesc::level_pitch
+
 SUPPORT
 | Type                  | Header             | Supported |
 | --------------------- | ------------------ | --------- |
-| Windows 2.0, OS/2 1.x | BITMAPCOREHEADER   | No        |
-| OS/2 v2               | OS22XBITMAPHEADER  | No        |
-| OS/2 v2 Variant       | OS22XBITMAPHEADER  | No        |
+| Windows 2.0, OS/2 1.x | BITMAPCOREHEADER   | Yes       |
+| OS/2 v2               | OS22XBITMAPHEADER  | Partially |
+| OS/2 v2 Variant       | OS22XBITMAPHEADER  | Partially |
 | Windows NT, 3.1x      | BITMAPINFOHEADER   | Partially |
-| Undocumented          | BITMAPV2INFOHEADER | No        |
-| Adobe                 | BITMAPV3INFOHEADER | No        |
-| Windows NT 4, 95      | BITMAPV4HEADER     | No        |
+| Undocumented          | BITMAPV2INFOHEADER | Partially |
+| Adobe                 | BITMAPV3INFOHEADER | Partially |
+| Windows NT 4, 95      | BITMAPV4HEADER     | Partially |
 | Windows NT 5, 98      | BITMAPV5HEADER     | Partially |
 
 Encodings
@@ -95,6 +174,13 @@ Encodings
 | --------------------- | --------- |
 | Paletted RLE2         | No        |
 
+OS/2 containers (read only, see sfl_bmp_index and sfl_bmp_decode_image)
+| Type                  | Header | Supported |
+| --------------------- | ------ | --------- |
+| Bitmap array          | BA     | Yes       |
+| Icon, pointer         | IC, PT | Yes       |
+| Color icon, pointer   | CI, CP | Yes       |
+
 CONTRIBUTION
 Michael Dodis (michaeldodisgr@gmail.com)
 
@@ -141,14 +227,59 @@ REFERENCES
 #define SFL_BMP_CUSTOM_PIXEL_FORMATS 0
 #endif
 
+#ifndef SFL_BMP_MAX_CUSTOM_PIXEL_FORMATS
+#define SFL_BMP_MAX_CUSTOM_PIXEL_FORMATS 16
+#endif
+
 #ifndef SFL_BMP_ALWAYS_CONVERT
 #define SFL_BMP_ALWAYS_CONVERT 0
 #endif
 
+#ifndef SFL_BMP_STATS
+#define SFL_BMP_STATS 0
+#endif
+
+#ifndef SFL_BMP_BATCH
+#define SFL_BMP_BATCH 0
+#endif
+
+#ifndef SFL_BMP_BATCH_IO_URING
+#define SFL_BMP_BATCH_IO_URING 0
+#endif
+
+#ifndef SFL_BMP_PARALLEL_ENCODE
+#define SFL_BMP_PARALLEL_ENCODE 0
+#endif
+
+#ifndef SFL_BMP_QUANTIZE
+#define SFL_BMP_QUANTIZE 0
+#endif
+
+#ifndef SFL_BMP_HASH
+#define SFL_BMP_HASH 0
+#endif
+
+#ifndef SFL_BMP_PIXEL_STATS
+#define SFL_BMP_PIXEL_STATS 0
+#endif
+
+#ifndef SFL_BMP_MIPMAPS
+#define SFL_BMP_MIPMAPS 0
+#endif
+
+#ifndef SFL_BMP_TENSOR
+#define SFL_BMP_TENSOR 0
+#endif
+
+/** Enough levels for the largest width or height */
+#define SFL_BMP_MAX_LEVELS 32
+
 #if !SFL_BMP_CUSTOM_TYPES
 #include <stddef.h>
 #include <stdint.h>
 typedef size_t   SflBmpUSize;
+typedef int64_t  SflBmpI64;
+typedef uint64_t SflBmpU64;
 typedef int32_t  SflBmpI32;
 typedef uint32_t SflBmpU32;
 typedef int16_t  SflBmpI16;
@@ -158,7 +289,7 @@ typedef uint8_t  SflBmpU8;
 typedef float    SflBmpReal;
 #endif
 
-#if !SFL_BMP_CUSTOM_PIXEL_FORMATS
+#ifndef SFL_BMP_PIXEL_FORMAT_B8G8R8A8
 #define SFL_BMP_PIXEL_FORMAT_INVALID -1
 #define SFL_BMP_PIXEL_FORMAT_UNRECOGNIZED 0
 #define SFL_BMP_PIXEL_FORMAT_B8G8R8A8 1
@@ -169,6 +300,16 @@ typedef float    SflBmpReal;
 #define SFL_BMP_PIXEL_FORMAT_B5G5R5X1 6
 #endif
 
+/**
+ * Palette indices, with the leftmost pixel in the most significant bits.
+ * Paletted files probe as one of these, and are decoded through their palette
+ */
+#ifndef SFL_BMP_PIXEL_FORMAT_I1
+#define SFL_BMP_PIXEL_FORMAT_I1 7
+#define SFL_BMP_PIXEL_FORMAT_I4 8
+#define SFL_BMP_PIXEL_FORMAT_I8 9
+#endif
+
 typedef enum
 {
     SFL_BMP_IO_SET = 0,
@@ -182,6 +323,28 @@ typedef enum
     SFL_BMP_ATTRIBUTE_FLIPPED    = 1 << 0,
     /** Uses color table */
     SFL_BMP_ATTRIBUTE_PALETTIZED = 1 << 1,
+    /**
+     * Set on the output descriptor (decode or encode) to dither with a 4x4
+     * Bayer matrix when packing 8 bit components to B5G6R5 or B5G5R5X1,
+     * instead of rounding to nearest
+     */
+    SFL_BMP_ATTRIBUTE_DITHERED   = 1 << 2,
+    /**
+     * Set on the output descriptor of a decode to get the full mip chain
+     * after the image (SFL_BMP_MIPMAPS). Needs a 24 or 32 bpp output format
+     */
+    SFL_BMP_ATTRIBUTE_MIPMAPPED  = 1 << 3,
+    /**
+     * With SFL_BMP_ATTRIBUTE_MIPMAPPED, the color components are sRGB, and
+     * are averaged in linear light. Alpha is averaged as is
+     */
+    SFL_BMP_ATTRIBUTE_SRGB       = 1 << 4,
+    /**
+     * Set on the output descriptor of a decode to get one plane per
+     * component instead of interleaved pixels. Needs a 24 or 32 bpp output
+     * format, its bytes in order are the planes, @see SflBmpDesc::num_planes
+     */
+    SFL_BMP_ATTRIBUTE_PLANAR     = 1 << 5,
 } SflBmpAttributes;
 
 typedef enum
@@ -253,8 +416,8 @@ typedef struct {
     SflBmpU32   slice;
     /** @see: SflBmpAttributes */
     int         attributes;
-    /** Size (in bytes) */
-    SflBmpU32   size;
+    /** Size (in bytes), which can be over 4GiB even though pitch can't */
+    SflBmpU64   size;
     /** Pixel format of image data */
     SflBmpU32   format;
     /** File header id, @see SflBmpHdrID */
@@ -264,29 +427,68 @@ typedef struct {
     /** Compression method, @see SflBmpCompressionMethod */
     int         compression;
     /** Offset into the pixel data */
-    SflBmpU32   offset;
+    SflBmpU64   offset;
     /** Offset into table data */
-    SflBmpU32   table_offset;
+    SflBmpU64   table_offset;
     /** Number of color entries into table */
     SflBmpU32   num_table_entries;
     /** Table entry size, in bytes */
     SflBmpU32   table_entry_size;
     /** Color masks (r, g, b, a)*/
     SflBmpU32   mask[4];
+    /**
+     * Set by the decoders: 1, or with SFL_BMP_ATTRIBUTE_PLANAR one per byte
+     * of the pixel format (e.g. R, G, B and A planes for R8G8B8A8). Each
+     * plane holds a byte per pixel, pitch is the pitch of a plane and size
+     * the size of all of them
+     */
+    SflBmpU32   num_planes;
+    /** Offset of each plane into data, in bytes */
+    SflBmpU64   plane_offset[4];
+    /** The amount of bytes per row of each plane */
+    SflBmpU32   plane_pitch[4];
+#if SFL_BMP_HASH
+    /** Set by the decoders: hash of the pixel data in the file, padding
+     *  included, and of the decoded image (pitch * height bytes of data, or
+     *  all of its planes) */
+    SflBmpU64   file_hash;
+    SflBmpU64   data_hash;
+#endif
+#if SFL_BMP_MIPMAPS
+    /**
+     * Number of levels in data, 1 unless decoded with
+     * SFL_BMP_ATTRIBUTE_MIPMAPPED. Level i is max(1, width >> i) by
+     * max(1, height >> i) pixels, and level 0 is the image itself
+     */
+    SflBmpU32   num_levels;
+    /** Offset of each level into data, in bytes */
+    SflBmpU64   level_offset[SFL_BMP_MAX_LEVELS];
+    /** The amount of bytes per row of each level */
+    SflBmpU32   level_pitch[SFL_BMP_MAX_LEVELS];
+#endif
 } SflBmpDesc;
 
 #define PROC_SFL_BMP_IO_READ(name) \
     int name(void* usr, void* ptr, SflBmpUSize size)
+/** Offsets are 64 bit wide, even where long isn't */
 #define PROC_SFL_BMP_IO_SEEK(name) \
-    int name(void* usr, long offset, SflBmpIOWhence whence)
-#define PROC_SFL_BMP_IO_TELL(name) long name(void* usr)
+    int name(void* usr, SflBmpI64 offset, SflBmpIOWhence whence)
+#define PROC_SFL_BMP_IO_TELL(name) SflBmpI64 name(void* usr)
 #define PROC_SFL_BMP_IO_WRITE(name) \
     int name(void* usr, void* buf, SflBmpUSize size)
+/**
+ * Returns a pointer to size bytes at offset (from the start), that stays
+ * valid for as long as the source does, or null if they're not available.
+ * Doesn't move the cursor
+ */
+#define PROC_SFL_BMP_IO_PEEK(name) \
+    const void* name(void* usr, SflBmpUSize offset, SflBmpUSize size)
 
 typedef PROC_SFL_BMP_IO_READ(ProcSflBmpIORead);
 typedef PROC_SFL_BMP_IO_SEEK(ProcSflBmpIOSeek);
 typedef PROC_SFL_BMP_IO_TELL(ProcSflBmpIOTell);
 typedef PROC_SFL_BMP_IO_WRITE(ProcSflBmpIOWrite);
+typedef PROC_SFL_BMP_IO_PEEK(ProcSflBmpIOPeek);
 
 typedef struct {
     ProcSflBmpIORead*  read;
@@ -294,6 +496,9 @@ typedef struct {
     ProcSflBmpIOSeek*  seek;
     ProcSflBmpIOTell*  tell;
     void*              usr;
+    /** Optional. If set, pixel data is converted straight from the source
+     * instead of being read into a scan-line first */
+    ProcSflBmpIOPeek*  peek;
 } SflBmpIOImplementation;
 
 #define PROC_SFL_BMP_MEMORY_ALLOCATE(name) \
@@ -308,9 +513,122 @@ typedef struct {
     void*                     usr;
 } SflBmpMemoryImplementation;
 
+/**
+ * Limits on what a context will decode, for files that can't be trusted
+ */
+typedef struct {
+    /** Largest width & height decoded, 0 for no limit */
+    SflBmpU32   max_width;
+    SflBmpU32   max_height;
+    /** Most memory allocated through the context at once, including the
+     * decoded image, 0 for no limit */
+    SflBmpUSize max_memory;
+    /** Currently allocated, kept by the library. Decoded images stop counting
+     * once they're handed to the caller */
+    SflBmpUSize in_use;
+} SflBmpLimits;
+
+#if SFL_BMP_STATS
+typedef enum
+{
+    /** The whole of sfl_bmp_probe */
+    SFL_BMP_STAGE_PROBE   = 0,
+    /** Reading & parsing the file and info headers */
+    SFL_BMP_STAGE_HEADER  = 1,
+    /** Reading the color table, or collecting it when encoding */
+    SFL_BMP_STAGE_PALETTE = 2,
+    /** Reading (or writing) and converting the pixel data */
+    SFL_BMP_STAGE_CONVERT = 3,
+    SFL_BMP_STAGE_COUNT
+} SflBmpStage;
+
+/**
+ * Called when a stage begins (end = 0) and when it ends (end = 1), along with
+ * the time spent in it
+ */
+#define PROC_SFL_BMP_STAGE(name) \
+    void name(void* usr, SflBmpStage stage, int end, SflBmpU64 elapsed_ns)
+typedef PROC_SFL_BMP_STAGE(ProcSflBmpStage);
+
+typedef struct {
+    SflBmpU64 num_reads;
+    SflBmpU64 num_writes;
+    SflBmpU64 num_seeks;
+    /** Bytes moved by successful reads & writes */
+    SflBmpU64 bytes_read;
+    SflBmpU64 bytes_written;
+    SflBmpU64 num_allocations;
+    SflBmpU64 bytes_allocated;
+    /** Allocated and not yet released (or handed to the caller), and the most
+     * that ever was, for sizing worker pools */
+    SflBmpU64 bytes_in_use;
+    SflBmpU64 peak_bytes_in_use;
+    /** Time spent inside the IO implementation, across all stages */
+    SflBmpU64 io_ns;
+    /** Total time spent in each stage, @see SflBmpStage */
+    SflBmpU64 stage_ns[SFL_BMP_STAGE_COUNT];
+    /** Times each stage was entered */
+    SflBmpU64 stage_count[SFL_BMP_STAGE_COUNT];
+
+    /** Optional stage boundary callback */
+    ProcSflBmpStage* stage_callback;
+    void*            stage_usr;
+} SflBmpStats;
+#endif
+
+#if SFL_BMP_PIXEL_STATS
+typedef enum
+{
+    /** Alpha is max everywhere, or the image has none */
+    SFL_BMP_ALPHA_OPAQUE      = 0,
+    /** Alpha is either 0 or max, enough for alpha testing */
+    SFL_BMP_ALPHA_BINARY      = 1,
+    /** Some pixels are partly transparent */
+    SFL_BMP_ALPHA_TRANSLUCENT = 2,
+} SflBmpAlphaUsage;
+
+typedef enum
+{
+    SFL_BMP_CHANNEL_R     = 0,
+    SFL_BMP_CHANNEL_G     = 1,
+    SFL_BMP_CHANNEL_B     = 2,
+    SFL_BMP_CHANNEL_A     = 3,
+    /** Rec. 709 luma, of r, g and b */
+    SFL_BMP_CHANNEL_LUMA  = 4,
+    SFL_BMP_CHANNEL_COUNT
+} SflBmpChannel;
+
+/**
+ * Statistics of the decoded image, with each component scaled to 8 bits the
+ * way the converters would. Components that the output format lacks count
+ * as 0, and alpha as max
+ */
+typedef struct {
+    /** Pixels counted: all of them, or none if the output format has no
+     *  masks (custom formats that only have kernels) */
+    SflBmpU64        num_pixels;
+    SflBmpAlphaUsage alpha;
+    /** Smallest & largest value of each channel, @see SflBmpChannel */
+    SflBmpU8         min[SFL_BMP_CHANNEL_COUNT];
+    SflBmpU8         max[SFL_BMP_CHANNEL_COUNT];
+    /** Pixels with each value, per channel */
+    SflBmpU64        histogram[SFL_BMP_CHANNEL_COUNT][256];
+} SflBmpPixelStats;
+#endif
+
 typedef struct {
     SflBmpIOImplementation      io;
     SflBmpMemoryImplementation* mem;
+    /** Enforced when decoding, if not null */
+    SflBmpLimits*               limits;
+#if SFL_BMP_STATS
+    /** Accumulated into, if not null */
+    SflBmpStats* stats;
+#endif
+#if SFL_BMP_PIXEL_STATS
+    /** Filled in by each decode, if not null */
+    SflBmpPixelStats* pixel_stats;
+#endif
 } SflBmpContext;
 
 extern void sfl_bmp_init(
@@ -321,6 +639,37 @@ extern void sfl_bmp_init(
 extern void sfl_bmp_set_io_usr(SflBmpContext* ctx, void* usr);
 extern void sfl_bmp_set_memory_usr(SflBmpContext* ctx, void* usr);
 
+/**
+ * Sets the limits that sfl_bmp_decode and the push decoder enforce. Images
+ * over the maximum dimensions, or that would take the context over its memory
+ * budget, fail before anything is allocated for them
+ * @param ctx    The context
+ * @param limits The limits, or null to lift them. Not thread safe
+ */
+extern void sfl_bmp_set_limits(SflBmpContext* ctx, SflBmpLimits* limits);
+
+#if SFL_BMP_STATS
+/**
+ * Sets the stats block that the context accumulates into. Counters are never
+ * reset, so the same block can be shared across calls (but not threads)
+ * @param ctx   The context
+ * @param stats The stats block, or null to disable counting
+ */
+extern void sfl_bmp_set_stats(SflBmpContext* ctx, SflBmpStats* stats);
+#endif
+
+#if SFL_BMP_PIXEL_STATS
+/**
+ * Sets the block that sfl_bmp_decode, the push decoder and the frame decoder
+ * fill in with statistics of the pixels they decode. It's reset at the start
+ * of every image, and complete once the image is
+ * @param ctx   The context
+ * @param stats The statistics, or null to stop gathering them
+ */
+extern void sfl_bmp_set_pixel_stats(
+    SflBmpContext* ctx, SflBmpPixelStats* stats);
+#endif
+
 /**
  * Returns description of the file
  * @param ctx  The read context
@@ -328,14 +677,398 @@ extern void sfl_bmp_set_memory_usr(SflBmpContext* ctx, void* usr);
  */
 extern int sfl_bmp_probe(SflBmpContext* ctx, SflBmpDesc* desc);
 
+/**
+ * Decodes the image into memory allocated by the context
+ * @param ctx  The read context
+ * @param desc The descriptor to write to. desc->format selects the output
+ *             pixel format, or SFL_BMP_PIXEL_FORMAT_UNRECOGNIZED for the
+ *             default one (@see SFL_BMP_ALWAYS_CONVERT)
+ */
 extern int sfl_bmp_decode(SflBmpContext* ctx, SflBmpDesc* desc);
 
+/**
+ * An image within a file, as found by sfl_bmp_index. OS/2 bitmap arrays (BA)
+ * hold several, e.g. an icon at a few sizes and color depths
+ */
+typedef struct {
+    /** SFL_BMP_HDR_ID_BM, or an icon (IC, CI) or pointer (PT, CP) */
+    SflBmpHdrID type;
+    SflBmpU32   width;
+    /** Of the image, not of the bitmap that holds its masks (twice that) */
+    SflBmpU32   height;
+    /** Of the color bitmap, 1 for monochrome icons & pointers */
+    SflBmpU32   bpp;
+    /** Where its (first) file header is */
+    SflBmpU64   offset;
+    /** Where its pixel data (the XOR mask, or the color bitmap's) is */
+    SflBmpU64   data_offset;
+    /** The display it was made for, 0 if any (only set in bitmap arrays) */
+    SflBmpU16   display_width;
+    SflBmpU16   display_height;
+    /** Hotspot of icons & pointers, from the bottom left */
+    SflBmpI16   hotspot_x;
+    SflBmpI16   hotspot_y;
+} SflBmpImageInfo;
+
+/**
+ * Lists the images in the file from their headers alone, without reading any
+ * pixel data: every image of an OS/2 bitmap array, or the file's only one
+ * @param ctx        The read context
+ * @param images     Filled with up to max_images of them, may be null if 0
+ * @param max_images The most to fill in
+ * @return The number of images in the file (maybe more than max_images), or
+ *         0 if any of their headers can't be read
+ */
+extern SflBmpU32 sfl_bmp_index(
+    SflBmpContext* ctx, SflBmpImageInfo* images, SflBmpU32 max_images);
+
+/**
+ * Decodes a single image found by sfl_bmp_index, reading only its headers &
+ * pixel data. Icons & pointers come out with their AND mask applied: pixels
+ * it leaves to the screen (transparent or inverted) are all zero
+ * @param ctx   The read context
+ * @param image The image
+ * @param desc  The descriptor to write to, as with sfl_bmp_decode
+ */
+extern int sfl_bmp_decode_image(
+    SflBmpContext* ctx, const SflBmpImageInfo* image, SflBmpDesc* desc);
+
+#if SFL_BMP_HASH
+/**
+ * XXH64 (seed 0) of size bytes, the same hash the decoders return in
+ * SflBmpDesc::file_hash and SflBmpDesc::data_hash
+ */
+extern SflBmpU64 sfl_bmp_hash(const void* data, SflBmpUSize size);
+#endif
+
+/**
+ * Push decoder, for files that arrive a few bytes at a time (pipes, sockets)
+ */
+typedef struct SflBmpDecoder SflBmpDecoder;
+
+typedef enum
+{
+    /** Waiting for the rest of the headers */
+    SFL_BMP_DECODER_HEADERS = 0,
+    /** The output is set up, and rows are being decoded */
+    SFL_BMP_DECODER_ROWS,
+    /** Every row is decoded, further bytes are ignored */
+    SFL_BMP_DECODER_DONE,
+    SFL_BMP_DECODER_ERROR,
+} SflBmpDecoderState;
+
+typedef struct {
+    SflBmpDecoderState state;
+    SflBmpU64          bytes_fed;
+    /** Bytes up to the end of the pixel data, 0 until the headers are in */
+    SflBmpU64          bytes_expected;
+    SflBmpU32          rows_decoded;
+} SflBmpDecoderProgress;
+
+/** Called from sfl_bmp_feed, with the rows (in file order) it finished */
+#define PROC_SFL_BMP_DECODER_ROWS(name) \
+    void name(                          \
+        void*             usr,          \
+        const SflBmpDesc* desc,         \
+        SflBmpU32         first,        \
+        SflBmpU32         count)
+typedef PROC_SFL_BMP_DECODER_ROWS(ProcSflBmpDecoderRows);
+
+/**
+ * Starts a push decoder. Only what comes before the pixel data is ever
+ * buffered, plus at most one scan-line
+ * @param ctx  The context, for memory. Its IO is not used
+ * @param desc The descriptor to write to, as with sfl_bmp_decode. Filled in
+ *             once the headers are in, must outlive the decoder
+ * @param rows Called as rows are decoded, may be null
+ * @param usr  Passed to rows
+ * @return The decoder, or null on failure
+ */
+extern SflBmpDecoder* sfl_bmp_decoder_begin(
+    SflBmpContext*         ctx,
+    SflBmpDesc*            desc,
+    ProcSflBmpDecoderRows* rows,
+    void*                  usr);
+
+/**
+ * Feeds the next n bytes of the file
+ * @return 0 if the file turned out to be invalid or unsupported
+ */
+extern int sfl_bmp_feed(SflBmpDecoder* dec, const void* bytes, SflBmpUSize n);
+
+extern void sfl_bmp_decoder_progress(
+    SflBmpDecoder* dec, SflBmpDecoderProgress* progress);
+
+/**
+ * Releases the decoder. If every row was decoded, desc->data now belongs to
+ * the caller, otherwise it's released too
+ * @return 1 if every row was decoded
+ */
+extern int sfl_bmp_decoder_end(SflBmpDecoder* dec);
+
+/**
+ * Decoder for sequences of similar images (numbered frames from a capture
+ * tool, say), that keeps its scan-line and conversion plan from one frame to
+ * the next. Frames are decoded into a pool of output buffers, each one
+ * reallocated only when a frame doesn't fit in it; once the pool has grown to
+ * the largest frame, decoding allocates nothing
+ */
+typedef struct SflBmpFrameDecoder SflBmpFrameDecoder;
+
+/**
+ * Starts a frame decoder
+ * @param ctx         The context, for memory. Its IO is not used. What the
+ *                    decoder keeps between frames is allocated through it,
+ *                    but stops counting against its limits right away, like
+ *                    a decoded image; each frame is checked against them as
+ *                    sfl_bmp_decode would
+ * @param num_buffers Size of the pool: how many frames can be out at once
+ * @return The decoder, or null on failure
+ */
+extern SflBmpFrameDecoder* sfl_bmp_frame_decoder_begin(
+    SflBmpContext* ctx, SflBmpU32 num_buffers);
+
+/**
+ * Decodes the next frame into a buffer from the pool, which stays out until
+ * it's given back with sfl_bmp_frame_recycle
+ * @param dec  The decoder
+ * @param ctx  The read context of this frame. Only its IO is used
+ * @param desc The descriptor to write to, as with sfl_bmp_decode
+ * @return 0 on failure, or if every buffer of the pool is out
+ */
+extern int sfl_bmp_frame_decode(
+    SflBmpFrameDecoder* dec, SflBmpContext* ctx, SflBmpDesc* desc);
+
+/**
+ * Gives a frame's buffer (desc->data) back to the pool
+ * @return 0 if data isn't one of the pool's buffers, or isn't out
+ */
+extern int sfl_bmp_frame_recycle(SflBmpFrameDecoder* dec, void* data);
+
+/**
+ * Releases the decoder along with every buffer of the pool, including those
+ * of frames that weren't recycled
+ */
+extern void sfl_bmp_frame_decoder_end(SflBmpFrameDecoder* dec);
+
+/**
+ * Encodes the pixel data read from in_io
+ * @param ctx      The write context
+ * @param in_desc  Describes the pixel data, found at in_desc->offset
+ * @param in_io    Where to read the pixel data from
+ * @param out_desc The output format, compression and header ids. With
+ *                 SFL_BMP_ATTRIBUTE_PALETTIZED set, images of at most 256
+ *                 (opaque) colors are written as 1, 4 or 8 bpp palette
+ *                 indices instead, and out_desc->format says which
+ */
 extern int sfl_bmp_encode(
     SflBmpContext*          ctx,
     SflBmpDesc*             in_desc,
     SflBmpIOImplementation* in_io,
     SflBmpDesc*             out_desc);
 
+/**
+ * Streaming encoder, for images produced a few rows at a time
+ */
+typedef struct SflBmpEncoder SflBmpEncoder;
+
+/**
+ * Writes the headers, and returns an encoder that converts & writes rows as
+ * they're passed in. Only one output row is ever held in memory
+ * @param ctx      The write context, must outlive the encoder
+ * @param in_desc  Describes the rows to be passed in (format, width, height
+ *                 and order). A height of 0 means it's not known yet: the
+ *                 IO must be seekable, and the headers are rewritten once
+ *                 the encoder ends
+ * @param out_desc The output descriptor, @see sfl_bmp_encode. Must outlive
+ *                 the encoder
+ * @return The encoder, or null on failure
+ */
+extern SflBmpEncoder* sfl_bmp_encoder_begin(
+    SflBmpContext* ctx, SflBmpDesc* in_desc, SflBmpDesc* out_desc);
+
+/**
+ * Converts and writes rows, in the order given by in_desc's attributes
+ * @param enc   The encoder
+ * @param rows  The first row
+ * @param count Number of rows
+ * @param pitch Bytes from the start of one row to the next
+ */
+extern int sfl_bmp_encoder_write_rows(
+    SflBmpEncoder* enc, const void* rows, SflBmpU32 count, SflBmpU32 pitch);
+
+/**
+ * Finishes the file and releases the encoder
+ * @return 1 if every row was written
+ */
+extern int sfl_bmp_encoder_end(SflBmpEncoder* enc);
+
+/**
+ * Returns the exact size of the file that sfl_bmp_encode would write, without
+ * touching out_desc. If a palette is requested, this is the size without one
+ * @param in_desc  The input descriptor
+ * @param out_desc The output descriptor, @see sfl_bmp_encode
+ * @return Size in bytes, or 0 if it can't be encoded
+ */
+extern SflBmpU64 sfl_bmp_encoded_size(
+    SflBmpDesc* in_desc, SflBmpDesc* out_desc);
+
+#if SFL_BMP_PARALLEL_ENCODE
+/**
+ * Encodes an image held in memory to a file, converting bands of rows on
+ * several threads. The file is preallocated, and each band is written at its
+ * own offset as soon as it's converted
+ * @param ctx         The context, for memory. Its IO is not used
+ * @param in_desc     The input, with in_desc->data holding in_desc->height
+ *                    rows of in_desc->pitch bytes
+ * @param path        The file to create
+ * @param out_desc    The output descriptor, @see sfl_bmp_encode
+ * @param num_threads Number of threads, including the calling one (0 for 1)
+ */
+extern int sfl_bmp_encode_parallel(
+    SflBmpContext* ctx,
+    SflBmpDesc*    in_desc,
+    const char*    path,
+    SflBmpDesc*    out_desc,
+    int            num_threads);
+#endif
+
+#if SFL_BMP_QUANTIZE
+typedef enum
+{
+    SFL_BMP_DITHER_NONE = 0,
+    /** 8x8 Bayer matrix. Cheap, and the same pattern in every band */
+    SFL_BMP_DITHER_ORDERED,
+    /** Floyd-Steinberg, restarted at each band of rows */
+    SFL_BMP_DITHER_DIFFUSION,
+} SflBmpDither;
+
+typedef struct {
+    /** Most colors in the palette, 2 to 256 (0 for 256) */
+    int          num_colors;
+    SflBmpDither dither;
+    /** Threads mapping pixels, including the calling one (0 for 1) */
+    int          num_threads;
+} SflBmpQuantizeSettings;
+
+/**
+ * Encodes any image as palette indices, choosing the palette with median cut.
+ * Unlike SFL_BMP_ATTRIBUTE_PALETTIZED this is lossy: colors are approximated
+ * and alpha is dropped. Bands have a fixed number of rows, so the output
+ * doesn't depend on the number of threads
+ * @param ctx      The write context
+ * @param in_desc  The input, @see sfl_bmp_encode
+ * @param in_io    The input IO, @see sfl_bmp_encode
+ * @param out_desc File & info header ids. Receives the index format
+ * @param settings May be null, for 256 colors, no dithering and one thread
+ */
+extern int sfl_bmp_encode_quantized(
+    SflBmpContext*                ctx,
+    SflBmpDesc*                   in_desc,
+    SflBmpIOImplementation*       in_io,
+    SflBmpDesc*                   out_desc,
+    const SflBmpQuantizeSettings* settings);
+#endif
+
+#if SFL_BMP_TENSOR
+typedef enum
+{
+    SFL_BMP_TENSOR_FLOAT32 = 0,
+    /** IEEE 754 half precision, rounded to nearest even */
+    SFL_BMP_TENSOR_FLOAT16,
+} SflBmpTensorType;
+
+typedef struct {
+    SflBmpTensorType type;
+    /** Size of the tensor, resized to from the crop (0 for the crop's) */
+    SflBmpU32        width;
+    SflBmpU32        height;
+    /** Centered crop, taken first (0 for the whole width or height) */
+    SflBmpU32        crop_width;
+    SflBmpU32        crop_height;
+    /** Per channel (r, g, b): value = (component / 255 - mean) / std */
+    SflBmpReal       mean[3];
+    /** 0 is taken as 1 */
+    SflBmpReal       std[3];
+    /** Threads filling bands of rows, including the calling one (0 for 1) */
+    int              num_threads;
+} SflBmpTensorSettings;
+
+typedef struct {
+    /**
+     * 3 x height x width elements: the R, G and B planes, top row first.
+     * Set it (and size) to write to a buffer of your own, otherwise it's
+     * allocated through the context
+     */
+    void*            data;
+    /** Size of data, in bytes */
+    SflBmpUSize      size;
+    SflBmpU32        width;
+    SflBmpU32        height;
+    SflBmpTensorType type;
+} SflBmpTensor;
+
+/**
+ * Decodes straight into a normalized CHW tensor, for inference. Rows are
+ * converted, cropped, resized (bilinear, with pixel centers aligned like most
+ * frameworks do) and normalized in one pass, in bands on several threads
+ * @param ctx      The read context
+ * @param settings May be null, for float32 in [0, 1] at the image's size
+ * @param tensor   Receives the tensor
+ */
+extern int sfl_bmp_decode_tensor(
+    SflBmpContext*              ctx,
+    const SflBmpTensorSettings* settings,
+    SflBmpTensor*               tensor);
+#endif
+
+#if SFL_BMP_CUSTOM_PIXEL_FORMATS
+/**
+ * Row kernel of a custom format: converts count pixels, packed one after the
+ * other, from src to dst (R8G8B8A8 to the format, or the other way around)
+ */
+#define PROC_SFL_BMP_PIXEL_ROW(name) \
+    void name(void* usr, const void* src, void* dst, SflBmpU32 count)
+typedef PROC_SFL_BMP_PIXEL_ROW(ProcSflBmpPixelRow);
+
+/**
+ * A pixel format beyond the built-in ones. Conversions to & from it go
+ * through its kernels, or else its masks, like any other format
+ */
+typedef struct {
+    /** Identifier, positive and not used by any other format */
+    int                 format;
+    /** Returned by sfl_bmp_describe_pixel_format */
+    const char*         name;
+    /** Bits per pixel, a multiple of 8 up to 128 */
+    SflBmpU32           bpp;
+    /**
+     * Color masks (r, g, b, a) within the little endian pixel, for formats
+     * of up to 32 bpp. Files with the same bpp & masks probe as this format,
+     * and 16 & 32 bpp ones can be encoded to it. All zero for formats that
+     * masks can't describe (grayscale, over 8 bits per component), which
+     * need kernels instead
+     */
+    SflBmpU32           mask[4];
+    /** Optional, R8G8B8A8 to the format. Used over the masks if set */
+    ProcSflBmpPixelRow* from_rgba8;
+    /** Optional, the format to R8G8B8A8. Used over the masks if set */
+    ProcSflBmpPixelRow* to_rgba8;
+    /** Passed to the kernels */
+    void*               usr;
+} SflBmpPixelFormatInfo;
+
+/**
+ * Registers a custom pixel format. Not thread safe: formats should be
+ * registered before anything is decoded or encoded
+ * @param info The format, copied (the name isn't, and must outlive it)
+ * @return 0 if the identifier is taken, the format can't be converted to or
+ *         from (no masks or kernels), or SFL_BMP_MAX_CUSTOM_PIXEL_FORMATS
+ *         are registered already
+ */
+extern int sfl_bmp_register_pixel_format(const SflBmpPixelFormatInfo* info);
+#endif
+
 extern const char* sfl_bmp_describe_pixel_format(int format);
 extern const char* sfl_bmp_describe_hdr_id(SflBmpHdrID id);
 extern const char* sfl_bmp_describe_nfo_id(SflBmpNfoID id);
@@ -373,22 +1106,160 @@ extern void sfl_bmp_winapi_io_set_file(SflBmpContext* ctx, HANDLE* file);
 extern SflBmpIOImplementation* sfl_bmp_winapi_io_get_implementation(void);
 #endif
 
+/**
+ * Memory IO, reading from or writing to a buffer
+ */
+typedef struct {
+    unsigned char*              buf;
+    /** Current position */
+    SflBmpUSize                 curr;
+    /** Bytes that can be read, or the furthest byte written so far */
+    SflBmpUSize                 len;
+    /** Bytes that can be written to buf (0 for sources) */
+    SflBmpUSize                 capacity;
+    /** Grows buf on writes past its capacity through this context's memory,
+     *  stats and limits, if not null */
+    SflBmpContext*              grow;
+} SflBmpIOImplementationMemory;
+
+extern void sfl_bmp_memory_io_init(
+    SflBmpContext* ctx, SflBmpMemoryImplementation* memory);
+
+/**
+ * Reads from buf in place; it's never copied as a whole or written to
+ * @param ctx  The context
+ * @param io   The memory IO state, must outlive its use
+ * @param buf  The encoded file
+ * @param size Size of buf, in bytes
+ */
+extern void sfl_bmp_memory_io_set_source(
+    SflBmpContext*                ctx,
+    SflBmpIOImplementationMemory* io,
+    const void*                   buf,
+    SflBmpUSize                   size);
+
+/**
+ * Writes into buf, up to capacity bytes. If buf is null, writes into a buffer
+ * allocated through ctx instead, like its other allocations: capacity bytes
+ * up front (@see sfl_bmp_encoded_size), doubled whenever it runs out
+ * @param ctx      The context, which must outlive the sink
+ * @param io       The memory IO state, must outlive its use
+ * @param buf      The buffer, or null for a growable one
+ * @param capacity Size of buf, or initial size of the growable buffer
+ */
+extern void sfl_bmp_memory_io_set_sink(
+    SflBmpContext*                ctx,
+    SflBmpIOImplementationMemory* io,
+    void*                         buf,
+    SflBmpUSize                   capacity);
+
+/**
+ * Hands the written buffer over to the caller, and resets the sink. A
+ * growable buffer is released through the context's memory implementation,
+ * and stops counting towards its limits
+ * @param io   The memory IO state
+ * @param size Receives the number of bytes written
+ */
+extern void* sfl_bmp_memory_io_take(
+    SflBmpIOImplementationMemory* io, SflBmpUSize* size);
+
+extern SflBmpIOImplementation* sfl_bmp_memory_io_get_implementation(void);
+
+/**
+ * Batch decoding
+ */
+#if SFL_BMP_BATCH
+/**
+ * Called once per path, from one of the decoding threads. On success, desc
+ * holds the decoded image and desc->data must be released by the callee
+ * through the batch's memory implementation
+ */
+#define PROC_SFL_BMP_BATCH_DONE(name) \
+    void name(                         \
+        void*       usr,               \
+        SflBmpUSize index,             \
+        const char* path,              \
+        int         ok,                \
+        SflBmpDesc* desc)
+typedef PROC_SFL_BMP_BATCH_DONE(ProcSflBmpBatchDone);
+
+typedef struct {
+    /** Threads reading whole files into memory (0 for 1). With
+     * SFL_BMP_BATCH_IO_URING, only used if io_uring is unavailable */
+    int                         num_io_threads;
+    /** Threads decoding, including the calling one (0 for 1) */
+    int                         num_decode_threads;
+    /** Max files read but not yet decoded (0 for 2 per decoding thread) */
+    int                         queue_depth;
+    /** Output pixel format of every image, @see sfl_bmp_decode */
+    int                         format;
+    /** Applied to each image on its own, may be null */
+    const SflBmpLimits*         limits;
+    /** Allocates file buffers & image data, must be thread safe. Null selects
+     * stdlib, if available */
+    SflBmpMemoryImplementation* mem;
+    ProcSflBmpBatchDone*        done;
+    void*                       usr;
+} SflBmpBatchSettings;
+
+/**
+ * Decodes a list of files, overlapping reading the next files with decoding
+ * the ones already in memory. Returns once every path was reported to
+ * settings->done.
+ * @param paths    The files to decode
+ * @param count    Number of paths
+ * @param settings The batch settings
+ * @return 1 if every file was decoded
+ */
+extern int sfl_bmp_batch_decode(
+    const char* const* paths, SflBmpUSize count, SflBmpBatchSettings* settings);
+#endif
+
 #endif
 
 #ifdef SFL_BMP_IMPLEMENTATION
 #include <string.h>
 
-typedef struct {
+static void* sfl_bmp__allocate(SflBmpContext* ctx, SflBmpUSize size);
+static void sfl_bmp__disown(SflBmpContext* ctx, SflBmpUSize size);
+static void sfl_bmp__release(SflBmpContext* ctx, void* ptr, SflBmpUSize size);
+
+/** Grows a sink to hold at least needed bytes, doubling its capacity */
+static int sfl_bmp__memory_grow(
+    SflBmpIOImplementationMemory* mem, SflBmpUSize needed)
+{
+    SflBmpContext* grow     = mem->grow;
+    SflBmpUSize    capacity = mem->capacity ? mem->capacity : 64;
     unsigned char* buf;
-    SflBmpUSize    curr;
-    SflBmpUSize    len;
-} SflBmpIOImplementationMemory;
+
+    if (!grow) {
+        return 0;
+    }
+
+    while (capacity < needed) {
+        capacity *= 2;
+    }
+
+    buf = (unsigned char*)sfl_bmp__allocate(grow, capacity);
+    if (!buf) {
+        return 0;
+    }
+
+    if (mem->buf) {
+        memcpy(buf, mem->buf, mem->len);
+        sfl_bmp__release(grow, mem->buf, mem->capacity);
+    }
+
+    mem->buf      = buf;
+    mem->capacity = capacity;
+    return 1;
+}
 
 static PROC_SFL_BMP_IO_READ(sfl_bmp_memory_read)
 {
     SflBmpIOImplementationMemory* mem = (SflBmpIOImplementationMemory*)usr;
     if ((mem->curr + size) <= mem->len) {
-        memcpy(ptr, mem->buf + mem->curr, mem->len);
+        memcpy(ptr, mem->buf + mem->curr, size);
         mem->curr += size;
         return 1;
     } else {
@@ -399,12 +1270,18 @@ static PROC_SFL_BMP_IO_READ(sfl_bmp_memory_read)
 static PROC_SFL_BMP_IO_WRITE(sfl_bmp_memory_write)
 {
     SflBmpIOImplementationMemory* mem = (SflBmpIOImplementationMemory*)usr;
-    if ((mem->curr + size) <= mem->len) {
-        memcpy(mem->buf + mem->curr, buf, size);
-        return 1;
-    } else {
+    if ((mem->curr + size) > mem->capacity &&
+        !sfl_bmp__memory_grow(mem, mem->curr + size))
+    {
         return 0;
     }
+
+    memcpy(mem->buf + mem->curr, buf, size);
+    mem->curr += size;
+    if (mem->curr > mem->len) {
+        mem->len = mem->curr;
+    }
+    return 1;
 }
 
 static PROC_SFL_BMP_IO_SEEK(sfl_bmp_memory_seek)
@@ -416,7 +1293,7 @@ static PROC_SFL_BMP_IO_SEEK(sfl_bmp_memory_seek)
                 return -1;
             }
 
-            if (((SflBmpUSize)offset) < mem->len) {
+            if (((SflBmpUSize)offset) <= mem->len) {
                 mem->curr = (SflBmpUSize)offset;
                 return 0;
             } else {
@@ -472,33 +1349,101 @@ static PROC_SFL_BMP_IO_TELL(sfl_bmp_memory_tell)
     return mem->curr;
 }
 
+static PROC_SFL_BMP_IO_PEEK(sfl_bmp_memory_peek)
+{
+    SflBmpIOImplementationMemory* mem = (SflBmpIOImplementationMemory*)usr;
+    if (offset > mem->len || size > (mem->len - offset)) {
+        return 0;
+    }
+    return mem->buf + offset;
+}
+
 static SflBmpIOImplementation SflBmp_IO_Memory = {
     sfl_bmp_memory_read,
     sfl_bmp_memory_write,
     sfl_bmp_memory_seek,
     sfl_bmp_memory_tell,
+    0,
+    sfl_bmp_memory_peek,
 };
 
-static void sfl_bmp_memory_init(
-    SflBmpIOImplementationMemory* ctx, void* buf, SflBmpUSize len)
+void sfl_bmp_memory_io_init(
+    SflBmpContext* ctx, SflBmpMemoryImplementation* memory)
 {
-    ctx->buf  = (unsigned char*)buf;
-    ctx->len  = len;
-    ctx->curr = 0;
+    sfl_bmp_init(ctx, &SflBmp_IO_Memory, memory);
 }
 
-static int sfl_bmp__convert(
-    SflBmpDesc*             in,
-    SflBmpIOImplementation* in_io,
-    SflBmpDesc*             out,
-    SflBmpIOImplementation* out_io);
+void sfl_bmp_memory_io_set_source(
+    SflBmpContext*                ctx,
+    SflBmpIOImplementationMemory* io,
+    const void*                   buf,
+    SflBmpUSize                   size)
+{
+    /* Never written to: capacity stays 0, and there's nothing to grow */
+    io->buf      = (unsigned char*)buf;
+    io->curr     = 0;
+    io->len      = size;
+    io->capacity = 0;
+    io->grow     = 0;
+    ctx->io.usr  = io;
+}
 
-static int sfl_bmp__next_block(
-    SflBmpDesc*             desc,
-    SflBmpIOImplementation* io,
-    void*                   buf,
-    SflBmpUSize             buf_size,
-    SflBmpUSize             offset);
+void sfl_bmp_memory_io_set_sink(
+    SflBmpContext*                ctx,
+    SflBmpIOImplementationMemory* io,
+    void*                         buf,
+    SflBmpUSize                   capacity)
+{
+    io->buf      = (unsigned char*)buf;
+    io->curr     = 0;
+    io->len      = 0;
+    io->capacity = capacity;
+    io->grow     = 0;
+    ctx->io.usr  = io;
+
+    if (!buf) {
+        io->grow     = ctx;
+        io->capacity = 0;
+        if (capacity > 0) {
+            /* Exactly what was asked for, @see sfl_bmp_encoded_size */
+            io->buf = (unsigned char*)sfl_bmp__allocate(ctx, capacity);
+            if (io->buf) {
+                io->capacity = capacity;
+            }
+        }
+    }
+}
+
+void* sfl_bmp_memory_io_take(
+    SflBmpIOImplementationMemory* io, SflBmpUSize* size)
+{
+    void* buf = io->buf;
+    if (size) {
+        *size = io->len;
+    }
+
+    if (io->grow && buf) {
+        sfl_bmp__disown(io->grow, io->capacity);
+    }
+
+    io->buf      = 0;
+    io->curr     = 0;
+    io->len      = 0;
+    io->capacity = 0;
+    return buf;
+}
+
+SflBmpIOImplementation* sfl_bmp_memory_io_get_implementation(void)
+{
+    return &SflBmp_IO_Memory;
+}
+
+static int sfl_bmp__convert(
+    SflBmpContext*          ctx,
+    SflBmpDesc*             in,
+    SflBmpIOImplementation* in_io,
+    SflBmpDesc*             out,
+    SflBmpIOImplementation* out_io);
 
 #ifndef SFL_BMP_CEILF
 #include <math.h>
@@ -513,11 +1458,25 @@ static int sfl_bmp__next_block(
 typedef struct {
     char      hdr[2];
     SflBmpU32 file_size;
+    /** The hotspot (x, y) of OS/2 icons & pointers */
     SflBmpU16 reserved[2];
     /** Offset to the image data */
     SflBmpU32 offset;
 } SflBmpFileHeader;
 
+/**
+ * BITMAPARRAYFILEHEADER (OS/2). Each image of a bitmap array starts with
+ * one, followed by the image's own file header
+ */
+typedef struct {
+    char      hdr[2];
+    SflBmpU32 size;
+    /** Offset to the next array header, 0 for the last one */
+    SflBmpU32 next;
+    SflBmpU16 display_width;
+    SflBmpU16 display_height;
+} SflBmpArrayHeader;
+
 typedef struct {
     SflBmpU32 size;
     SflBmpU16 width;
@@ -544,24 +1503,29 @@ typedef struct {
 } SflBmpInfoHeader040;
 
 /**
- * OS22XBITMAPHEADER (OS/2 v2 Variant)
+ * OS22XBITMAPHEADER (OS/2 v2). Files may end it after any field past bpp,
+ * the rest are then 0
  */
 typedef struct {
-    SflBmpCoreHeader core;
-    SflBmpU32        compression;
-    SflBmpU32        raw_size;
-    SflBmpI32        hres;
-    SflBmpI32        vres;
-    SflBmpU32        num_colors;
-    SflBmpU32        num_important_colors;
-    SflBmpU16        units;
-    SflBmpU16        reserved;
-    SflBmpU16        recording;
-    SflBmpU16        rendering;
-    SflBmpU16        size1;
-    SflBmpU16        size2;
-    SflBmpU16        color_encoding;
-    SflBmpU16        identifier;
+    SflBmpU32 size;
+    SflBmpU32 width;
+    SflBmpU32 height;
+    SflBmpU16 planes;
+    SflBmpU16 bpp;
+    SflBmpU32 compression;
+    SflBmpU32 raw_size;
+    SflBmpI32 hres;
+    SflBmpI32 vres;
+    SflBmpU32 num_colors;
+    SflBmpU32 num_important_colors;
+    SflBmpU16 units;
+    SflBmpU16 reserved;
+    SflBmpU16 recording;
+    SflBmpU16 rendering;
+    SflBmpU32 size1;
+    SflBmpU32 size2;
+    SflBmpU32 color_encoding;
+    SflBmpU32 identifier;
 } SflBmpInfoHeader064;
 
 /**
@@ -651,47 +1615,403 @@ typedef struct {
 } SflBmpConvertSettings;
 
 #define SFL_BMP_READ_STRUCT(T, ctx, dst) \
-    (ctx->io.read(ctx->io.usr, (void*)dst, sizeof(T)) == 1)
+    (sfl_bmp__read(ctx, &(ctx)->io, (void*)dst, sizeof(T)) == 1)
 
-#define SFL_BMP_READ(ctx, dst, size) ctx->io.read(ctx->io.usr, dst, size)
+#define SFL_BMP_READ(ctx, dst, size) sfl_bmp__read(ctx, &(ctx)->io, dst, size)
 
 #define SFL_BMP_SEEK(ctx, offset, whence) \
-    ctx->io.seek(ctx->io.usr, offset, whence)
+    sfl_bmp__seek(ctx, &(ctx)->io, offset, whence)
+
+#define SFL_BMP_WRITE(ctx, buf, size) \
+    sfl_bmp__write(ctx, &(ctx)->io, buf, size)
+
+#define SFL_BMP_ALLOCATE(ctx, size) sfl_bmp__allocate(ctx, size)
+
+#define SFL_BMP_RELEASE(ctx, ptr, size) sfl_bmp__release(ctx, ptr, size)
+
+#if SFL_BMP_STATS
+#ifndef SFL_BMP_NANOSECONDS
+#if defined(_WIN32)
+#include <Windows.h>
+static SflBmpU64 sfl_bmp__nanoseconds(void)
+{
+    LARGE_INTEGER frequency, counter;
+    QueryPerformanceFrequency(&frequency);
+    QueryPerformanceCounter(&counter);
+    return (SflBmpU64)((double)counter.QuadPart * 1e9 /
+                       (double)frequency.QuadPart);
+}
+#else
+#include <time.h>
+static SflBmpU64 sfl_bmp__nanoseconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (SflBmpU64)ts.tv_sec * 1000000000ull + (SflBmpU64)ts.tv_nsec;
+}
+#endif
+#define SFL_BMP_NANOSECONDS() sfl_bmp__nanoseconds()
+#endif
+
+/** Returns the start time, or 0 if there's nothing to record */
+static SflBmpU64 sfl_bmp__stage_begin(SflBmpContext* ctx, SflBmpStage stage)
+{
+    SflBmpStats* stats = ctx->stats;
+    if (!stats) return 0;
+
+    if (stats->stage_callback) {
+        stats->stage_callback(stats->stage_usr, stage, 0, 0);
+    }
+    return SFL_BMP_NANOSECONDS();
+}
+
+/** Ends the stage, if it was started. Safe to call more than once */
+static void sfl_bmp__stage_end(
+    SflBmpContext* ctx, SflBmpStage stage, SflBmpU64* start)
+{
+    SflBmpStats* stats = ctx->stats;
+    if (!stats || *start == 0) return;
+
+    const SflBmpU64 elapsed = SFL_BMP_NANOSECONDS() - *start;
+    *start                  = 0;
 
-#define SFL_BMP_WRITE(ctx, buf, size) ctx->io.write(ctx->io.usr, buf, size)
+    stats->stage_ns[stage] += elapsed;
+    stats->stage_count[stage]++;
 
-#define SFL_BMP_ALLOCATE(ctx, size) ctx->mem->allocate(ctx->mem->usr, size)
+    if (stats->stage_callback) {
+        stats->stage_callback(stats->stage_usr, stage, 1, elapsed);
+    }
+}
 
-#define SFL_BMP_RELEASE(ctx, ptr) ctx->mem->release(ctx->mem->usr, ptr)
+#define SFL_BMP__STAGE_DECLARE(name) SflBmpU64 name = 0
+#define SFL_BMP__STAGE_BEGIN(ctx, stage, name) \
+    name = sfl_bmp__stage_begin(ctx, stage)
+#define SFL_BMP__STAGE_END(ctx, stage, name) \
+    sfl_bmp__stage_end(ctx, stage, &name)
+#else
+#define SFL_BMP__STAGE_DECLARE(name)
+#define SFL_BMP__STAGE_BEGIN(ctx, stage, name)
+#define SFL_BMP__STAGE_END(ctx, stage, name)
+#endif
 
+/*
+IO & memory go through these, so that SFL_BMP_STATS can count them. The context
+is the one doing the counting, even if the IO isn't its own (e.g. the input of
+sfl_bmp_encode)
+*/
 static int sfl_bmp__read(
-    SflBmpIOImplementation* io, void* ptr, SflBmpUSize size)
+    SflBmpContext*          ctx,
+    SflBmpIOImplementation* io,
+    void*                   ptr,
+    SflBmpUSize             size)
 {
+#if SFL_BMP_STATS
+    if (ctx->stats) {
+        const SflBmpU64 start = SFL_BMP_NANOSECONDS();
+        const int       rc    = io->read(io->usr, ptr, size);
+        ctx->stats->io_ns += SFL_BMP_NANOSECONDS() - start;
+        ctx->stats->num_reads++;
+        if (rc) ctx->stats->bytes_read += size;
+        return rc;
+    }
+#else
+    (void)ctx;
+#endif
     return io->read(io->usr, ptr, size);
 }
 
 static int sfl_bmp__write(
-    SflBmpIOImplementation* io, void* ptr, SflBmpUSize size)
+    SflBmpContext*          ctx,
+    SflBmpIOImplementation* io,
+    void*                   ptr,
+    SflBmpUSize             size)
 {
+#if SFL_BMP_STATS
+    if (ctx->stats) {
+        const SflBmpU64 start = SFL_BMP_NANOSECONDS();
+        const int       rc    = io->write(io->usr, ptr, size);
+        ctx->stats->io_ns += SFL_BMP_NANOSECONDS() - start;
+        ctx->stats->num_writes++;
+        if (rc) ctx->stats->bytes_written += size;
+        return rc;
+    }
+#else
+    (void)ctx;
+#endif
     return io->write(io->usr, ptr, size);
 }
 
 static int sfl_bmp__seek(
-    SflBmpIOImplementation* io, long offset, SflBmpIOWhence w)
+    SflBmpContext*          ctx,
+    SflBmpIOImplementation* io,
+    SflBmpI64               offset,
+    SflBmpIOWhence          w)
 {
+#if SFL_BMP_STATS
+    if (ctx->stats) {
+        const SflBmpU64 start = SFL_BMP_NANOSECONDS();
+        const int       rc    = io->seek(io->usr, offset, w);
+        ctx->stats->io_ns += SFL_BMP_NANOSECONDS() - start;
+        ctx->stats->num_seeks++;
+        return rc;
+    }
+#else
+    (void)ctx;
+#endif
     return io->seek(io->usr, offset, w);
 }
 
-static long sfl_bmp__tell(SflBmpIOImplementation* io)
+static SflBmpI64 sfl_bmp__tell(SflBmpIOImplementation* io)
 {
     return io->tell(io->usr);
 }
 
-static int sfl_bmp_decode_extract(
-    SflBmpContext* ctx, SflBmpDesc* in, SflBmpDesc* out);
+/** Whether size bytes could be in memory at once, which on 32 bit targets
+ *  isn't true of every size a file can describe */
+static int sfl_bmp__addressable(SflBmpU64 size)
+{
+    return size <= (SflBmpU64)(SflBmpUSize)-1;
+}
+
+/** Returns null if the IO can't peek, or the bytes aren't available */
+static const SflBmpU8* sfl_bmp__peek(
+    SflBmpContext*          ctx,
+    SflBmpIOImplementation* io,
+    SflBmpU64               offset,
+    SflBmpU64               size)
+{
+    const SflBmpU8* ptr;
+    if (!io->peek || !sfl_bmp__addressable(offset + size)) {
+        return 0;
+    }
+
+    ptr = (const SflBmpU8*)io->peek(
+        io->usr, (SflBmpUSize)offset, (SflBmpUSize)size);
+#if SFL_BMP_STATS
+    /* Counted as a read, without the copy */
+    if (ctx->stats && ptr) {
+        ctx->stats->num_reads++;
+        ctx->stats->bytes_read += size;
+    }
+#else
+    (void)ctx;
+#endif
+    return ptr;
+}
+
+/** Whether size more bytes fit in the context's memory budget */
+static int sfl_bmp__within_budget(SflBmpContext* ctx, SflBmpUSize size)
+{
+    SflBmpLimits* limits = ctx->limits;
+    return !limits || limits->max_memory == 0 ||
+           (limits->in_use <= limits->max_memory &&
+            size <= limits->max_memory - limits->in_use);
+}
+
+static void* sfl_bmp__allocate(SflBmpContext* ctx, SflBmpUSize size)
+{
+    void* ptr;
+    if (!sfl_bmp__within_budget(ctx, size)) {
+        return 0;
+    }
+
+    ptr = ctx->mem->allocate(ctx->mem->usr, size);
+    if (!ptr) {
+        return 0;
+    }
+
+    if (ctx->limits) {
+        ctx->limits->in_use += size;
+    }
+#if SFL_BMP_STATS
+    if (ctx->stats) {
+        SflBmpStats* stats = ctx->stats;
+        stats->num_allocations++;
+        stats->bytes_allocated += size;
+        stats->bytes_in_use += size;
+        if (stats->bytes_in_use > stats->peak_bytes_in_use) {
+            stats->peak_bytes_in_use = stats->bytes_in_use;
+        }
+    }
+#endif
+    return ptr;
+}
+
+/** Stops counting size bytes, when they're released or handed to the caller */
+static void sfl_bmp__disown(SflBmpContext* ctx, SflBmpUSize size)
+{
+    if (ctx->limits) {
+        ctx->limits->in_use -= size;
+    }
+#if SFL_BMP_STATS
+    if (ctx->stats) {
+        ctx->stats->bytes_in_use -= size;
+    }
+#endif
+}
+
+/** Releases ptr, which was allocated with size bytes */
+static void sfl_bmp__release(SflBmpContext* ctx, void* ptr, SflBmpUSize size)
+{
+    ctx->mem->release(ctx->mem->usr, ptr);
+    sfl_bmp__disown(ctx, size);
+}
+
+#if SFL_BMP_HASH
+/*
+XXH64, fed a scan-line at a time. Whole 32 byte stripes go straight through
+the four accumulators; the rest waits in buf for the next row
+*/
+#define SFL_BMP__PRIME64_1 0x9E3779B185EBCA87ull
+#define SFL_BMP__PRIME64_2 0xC2B2AE3D27D4EB4Full
+#define SFL_BMP__PRIME64_3 0x165667B19E3779F9ull
+#define SFL_BMP__PRIME64_4 0x85EBCA77C2B2AE63ull
+#define SFL_BMP__PRIME64_5 0x27D4EB2F165667C5ull
+
+typedef struct {
+    SflBmpU64 acc[4];
+    SflBmpU64 total;
+    SflBmpU8  buf[32];
+    SflBmpU32 fill;
+} SflBmpHash;
+
+static inline SflBmpU64 sfl_bmp__rotl64(SflBmpU64 x, int r)
+{
+    return (x << r) | (x >> (64 - r));
+}
+
+static inline SflBmpU64 sfl_bmp__read64(const SflBmpU8* p)
+{
+    SflBmpU64 value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+static inline SflBmpU32 sfl_bmp__read32(const SflBmpU8* p)
+{
+    SflBmpU32 value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+static inline SflBmpU64 sfl_bmp__hash_round(SflBmpU64 acc, SflBmpU64 input)
+{
+    acc += input * SFL_BMP__PRIME64_2;
+    acc = sfl_bmp__rotl64(acc, 31);
+    return acc * SFL_BMP__PRIME64_1;
+}
+
+static inline SflBmpU64 sfl_bmp__hash_merge(SflBmpU64 h, SflBmpU64 acc)
+{
+    h ^= sfl_bmp__hash_round(0, acc);
+    return h * SFL_BMP__PRIME64_1 + SFL_BMP__PRIME64_4;
+}
+
+static void sfl_bmp__hash_init(SflBmpHash* hash)
+{
+    hash->acc[0] = SFL_BMP__PRIME64_1 + SFL_BMP__PRIME64_2;
+    hash->acc[1] = SFL_BMP__PRIME64_2;
+    hash->acc[2] = 0;
+    hash->acc[3] = 0 - SFL_BMP__PRIME64_1;
+    hash->total  = 0;
+    hash->fill   = 0;
+}
+
+static void sfl_bmp__hash_stripes(
+    SflBmpHash* hash, const SflBmpU8* p, SflBmpUSize num_stripes)
+{
+    SflBmpU64 a0 = hash->acc[0], a1 = hash->acc[1];
+    SflBmpU64 a2 = hash->acc[2], a3 = hash->acc[3];
+
+    for (SflBmpUSize i = 0; i < num_stripes; ++i, p += 32) {
+        a0 = sfl_bmp__hash_round(a0, sfl_bmp__read64(p));
+        a1 = sfl_bmp__hash_round(a1, sfl_bmp__read64(p + 8));
+        a2 = sfl_bmp__hash_round(a2, sfl_bmp__read64(p + 16));
+        a3 = sfl_bmp__hash_round(a3, sfl_bmp__read64(p + 24));
+    }
+
+    hash->acc[0] = a0;
+    hash->acc[1] = a1;
+    hash->acc[2] = a2;
+    hash->acc[3] = a3;
+}
+
+static void sfl_bmp__hash_update(
+    SflBmpHash* hash, const void* data, SflBmpUSize size)
+{
+    const SflBmpU8* p = (const SflBmpU8*)data;
+
+    hash->total += size;
+    if (hash->fill + size < 32) {
+        memcpy(hash->buf + hash->fill, p, size);
+        hash->fill += (SflBmpU32)size;
+        return;
+    }
+
+    if (hash->fill) {
+        const SflBmpU32 take = 32 - hash->fill;
+        memcpy(hash->buf + hash->fill, p, take);
+        sfl_bmp__hash_stripes(hash, hash->buf, 1);
+        p += take;
+        size -= take;
+    }
+
+    sfl_bmp__hash_stripes(hash, p, size / 32);
+    hash->fill = (SflBmpU32)(size % 32);
+    memcpy(hash->buf, p + (size - hash->fill), hash->fill);
+}
+
+static SflBmpU64 sfl_bmp__hash_final(const SflBmpHash* hash)
+{
+    const SflBmpU8* p = hash->buf;
+    SflBmpU32       n = hash->fill;
+    SflBmpU64       h;
+
+    if (hash->total >= 32) {
+        h = sfl_bmp__rotl64(hash->acc[0], 1) + sfl_bmp__rotl64(hash->acc[1], 7) +
+            sfl_bmp__rotl64(hash->acc[2], 12) +
+            sfl_bmp__rotl64(hash->acc[3], 18);
+        for (int i = 0; i < 4; ++i) {
+            h = sfl_bmp__hash_merge(h, hash->acc[i]);
+        }
+    } else {
+        h = SFL_BMP__PRIME64_5;
+    }
+    h += hash->total;
+
+    for (; n >= 8; n -= 8, p += 8) {
+        h ^= sfl_bmp__hash_round(0, sfl_bmp__read64(p));
+        h = sfl_bmp__rotl64(h, 27) * SFL_BMP__PRIME64_1 + SFL_BMP__PRIME64_4;
+    }
+    if (n >= 4) {
+        h ^= (SflBmpU64)sfl_bmp__read32(p) * SFL_BMP__PRIME64_1;
+        h = sfl_bmp__rotl64(h, 23) * SFL_BMP__PRIME64_2 + SFL_BMP__PRIME64_3;
+        n -= 4;
+        p += 4;
+    }
+    for (; n > 0; --n, ++p) {
+        h ^= (SflBmpU64)*p * SFL_BMP__PRIME64_5;
+        h = sfl_bmp__rotl64(h, 11) * SFL_BMP__PRIME64_1;
+    }
+
+    h ^= h >> 33;
+    h *= SFL_BMP__PRIME64_2;
+    h ^= h >> 29;
+    h *= SFL_BMP__PRIME64_3;
+    h ^= h >> 32;
+    return h;
+}
+
+SflBmpU64 sfl_bmp_hash(const void* data, SflBmpUSize size)
+{
+    SflBmpHash hash;
+    sfl_bmp__hash_init(&hash);
+    sfl_bmp__hash_update(&hash, data, size);
+    return sfl_bmp__hash_final(&hash);
+}
 
-static int sfl_bmp_decode_extract_palettized(
-    SflBmpContext* ctx, SflBmpDesc* in, SflBmpDesc* out);
+/* SFL_BMP_HASH */
+#endif
 
 static int sfl_bmp_extract(
     SflBmpContext* ctx, SflBmpDecodeSettings* settings, SflBmpDesc* desc);
@@ -748,6 +2068,63 @@ static SflBmpI32 sfl_bmp_iabs(SflBmpI32 value)
     return value < 0 ? -value : value;
 }
 
+/** Rows are always padded to a multiple of 4 bytes */
+static SflBmpU64 sfl_bmp__pitch(SflBmpU32 bpp, SflBmpU32 width)
+{
+    return (((SflBmpU64)bpp * width + 31) / 32) * 4;
+}
+
+#if SFL_BMP_CUSTOM_PIXEL_FORMATS || SFL_BMP_PIXEL_STATS
+static int sfl_bmp__has_masks(const SflBmpU32* mask)
+{
+    return (mask[0] | mask[1] | mask[2] | mask[3]) != 0;
+}
+#endif
+
+#if SFL_BMP_CUSTOM_PIXEL_FORMATS
+static SflBmpPixelFormatInfo
+    SflBmp_Custom_Formats[SFL_BMP_MAX_CUSTOM_PIXEL_FORMATS];
+static SflBmpU32 SflBmp_Num_Custom_Formats = 0;
+
+/** The registered format, or null */
+static const SflBmpPixelFormatInfo* sfl_bmp__custom_format(int format)
+{
+    for (SflBmpU32 i = 0; i < SflBmp_Num_Custom_Formats; ++i) {
+        if (SflBmp_Custom_Formats[i].format == format) {
+            return &SflBmp_Custom_Formats[i];
+        }
+    }
+    return 0;
+}
+
+static int sfl_bmp__bpp_from_pixel_format(int format);
+
+int sfl_bmp_register_pixel_format(const SflBmpPixelFormatInfo* info)
+{
+    const int has_masks = sfl_bmp__has_masks(info->mask);
+    if (SflBmp_Num_Custom_Formats == SFL_BMP_MAX_CUSTOM_PIXEL_FORMATS ||
+        info->format <= 0 ||
+        sfl_bmp__bpp_from_pixel_format(info->format) != -1 || !info->name)
+    {
+        return 0;
+    }
+
+    if (info->bpp == 0 || info->bpp % 8 != 0 || info->bpp > 128 ||
+        (has_masks && info->bpp > 32))
+    {
+        return 0;
+    }
+
+    /* There has to be some way to convert it */
+    if (!has_masks && !info->from_rgba8 && !info->to_rgba8) {
+        return 0;
+    }
+
+    SflBmp_Custom_Formats[SflBmp_Num_Custom_Formats++] = *info;
+    return 1;
+}
+#endif
+
 const char* sfl_bmp_describe_pixel_format(int format)
 {
     const char* desc_string = "Invalid format enumeration";
@@ -769,7 +2146,7 @@ const char* sfl_bmp_describe_pixel_format(int format)
         } break;
 
         case SFL_BMP_PIXEL_FORMAT_B5G6R5: {
-            desc_string = "B5G6R6";
+            desc_string = "B5G6R5";
         } break;
 
         case SFL_BMP_PIXEL_FORMAT_R8G8B8A8: {
@@ -784,8 +2161,27 @@ const char* sfl_bmp_describe_pixel_format(int format)
             desc_string = "B5G5R5X1";
         } break;
 
-        default:
-            break;
+        case SFL_BMP_PIXEL_FORMAT_I1: {
+            desc_string = "I1";
+        } break;
+
+        case SFL_BMP_PIXEL_FORMAT_I4: {
+            desc_string = "I4";
+        } break;
+
+        case SFL_BMP_PIXEL_FORMAT_I8: {
+            desc_string = "I8";
+        } break;
+
+        default: {
+#if SFL_BMP_CUSTOM_PIXEL_FORMATS
+            const SflBmpPixelFormatInfo* custom =
+                sfl_bmp__custom_format(format);
+            if (custom) {
+                desc_string = custom->name;
+            }
+#endif
+        } break;
     }
 
     return desc_string;
@@ -925,6 +2321,13 @@ void sfl_bmp_init(
     ctx->mem      = mem;
     ctx->io.usr   = 0;
     ctx->mem->usr = 0;
+    ctx->limits   = 0;
+#if SFL_BMP_STATS
+    ctx->stats = 0;
+#endif
+#if SFL_BMP_PIXEL_STATS
+    ctx->pixel_stats = 0;
+#endif
 }
 
 void sfl_bmp_set_io_usr(SflBmpContext* ctx, void* usr) { ctx->io.usr = usr; }
@@ -934,6 +2337,25 @@ void sfl_bmp_set_memory_usr(SflBmpContext* ctx, void* usr)
     ctx->mem->usr = usr;
 }
 
+void sfl_bmp_set_limits(SflBmpContext* ctx, SflBmpLimits* limits)
+{
+    ctx->limits = limits;
+}
+
+#if SFL_BMP_STATS
+void sfl_bmp_set_stats(SflBmpContext* ctx, SflBmpStats* stats)
+{
+    ctx->stats = stats;
+}
+#endif
+
+#if SFL_BMP_PIXEL_STATS
+void sfl_bmp_set_pixel_stats(SflBmpContext* ctx, SflBmpPixelStats* stats)
+{
+    ctx->pixel_stats = stats;
+}
+#endif
+
 static SflBmpHdrID sfl_bmp_get_hdr_id(char* header)
 {
     if (header[0] == 'B' && header[1] == 'M') {
@@ -1034,9 +2456,28 @@ static int sfl_bmp__bpp_from_pixel_format(int format)
         case SFL_BMP_PIXEL_FORMAT_B5G5R5X1:
             return 16;
 
+        case SFL_BMP_PIXEL_FORMAT_I8:
+            return 8;
+
+        case SFL_BMP_PIXEL_FORMAT_I4:
+            return 4;
+
+        case SFL_BMP_PIXEL_FORMAT_I1:
+            return 1;
+
         case SFL_BMP_PIXEL_FORMAT_INVALID:
-        default:
             return -1;
+
+        default: {
+#if SFL_BMP_CUSTOM_PIXEL_FORMATS
+            const SflBmpPixelFormatInfo* custom =
+                sfl_bmp__custom_format(format);
+            if (custom) {
+                return (int)custom->bpp;
+            }
+#endif
+            return -1;
+        }
     }
 }
 
@@ -1073,10 +2514,10 @@ static int sfl_bmp__bitmasks_from_pixel_format(int format, SflBmpU32* masks)
         } break;
 
         case SFL_BMP_PIXEL_FORMAT_R8G8B8A8: {
-            masks[0] = 0xff000000;
-            masks[1] = 0x00ff0000;
-            masks[2] = 0x0000ff00;
-            masks[3] = 0x000000ff;
+            masks[0] = 0x000000ff;
+            masks[1] = 0x0000ff00;
+            masks[2] = 0x00ff0000;
+            masks[3] = 0xff000000;
         } break;
 
         case SFL_BMP_PIXEL_FORMAT_B8G8R8X8: {
@@ -1086,10 +2527,27 @@ static int sfl_bmp__bitmasks_from_pixel_format(int format, SflBmpU32* masks)
             masks[3] = 0x00000000;
         } break;
 
+        case SFL_BMP_PIXEL_FORMAT_I1:
+        case SFL_BMP_PIXEL_FORMAT_I4:
+        case SFL_BMP_PIXEL_FORMAT_I8: {
+            masks[0] = 0;
+            masks[1] = 0;
+            masks[2] = 0;
+            masks[3] = 0;
+        } break;
+
         case SFL_BMP_PIXEL_FORMAT_UNRECOGNIZED: {
         } break;
 
         default: {
+#if SFL_BMP_CUSTOM_PIXEL_FORMATS
+            const SflBmpPixelFormatInfo* custom =
+                sfl_bmp__custom_format(format);
+            if (custom) {
+                memcpy(masks, custom->mask, sizeof(custom->mask));
+                break;
+            }
+#endif
             ok = 0;
         } break;
     }
@@ -1097,18 +2555,32 @@ static int sfl_bmp__bitmasks_from_pixel_format(int format, SflBmpU32* masks)
     return ok;
 }
 
-static int sfl_bmp_decide_pixel_format_from_bitmasks(SflBmpU32* masks)
+static int sfl_bmp__is_indexed(int format)
+{
+    return format == SFL_BMP_PIXEL_FORMAT_I1 ||
+           format == SFL_BMP_PIXEL_FORMAT_I4 ||
+           format == SFL_BMP_PIXEL_FORMAT_I8;
+}
+
+/**
+ * Matches bitmasks against the known pixel formats. Formats with a different
+ * bpp are skipped, since e.g. B8G8R8 and B8G8R8X8 share the same masks
+ */
+static int sfl_bmp_decide_pixel_format_from_bitmasks(
+    SflBmpU32 bpp, SflBmpU32* masks)
 {
     SflBmpU32 test_mask[4];
 #define SFL_BMP__TEST_MASKS(m1, m2)                              \
     ((m1[0] == m2[0]) && (m1[1] == m2[1]) && (m1[2] == m2[2]) && \
      (m1[3] == m2[3]))
 
-#define SFL_BMP__TEST_FORMAT(format, test_mask, mask)                     \
-    do {                                                                  \
-        int __r = sfl_bmp__bitmasks_from_pixel_format(format, test_mask); \
-        if (!__r) return 0;                                               \
-        if (SFL_BMP__TEST_MASKS(test_mask, mask)) return 1;               \
+#define SFL_BMP__TEST_FORMAT(format, test_mask, mask)                       \
+    do {                                                                    \
+        if (sfl_bmp__bpp_from_pixel_format(format) == (int)bpp) {           \
+            int __r = sfl_bmp__bitmasks_from_pixel_format(format, test_mask); \
+            if (!__r) return SFL_BMP_PIXEL_FORMAT_UNRECOGNIZED;             \
+            if (SFL_BMP__TEST_MASKS(test_mask, mask)) return format;        \
+        }                                                                   \
     } while (0)
 
     SFL_BMP__TEST_FORMAT(SFL_BMP_PIXEL_FORMAT_B8G8R8A8, test_mask, masks);
@@ -1118,1109 +2590,6127 @@ static int sfl_bmp_decide_pixel_format_from_bitmasks(SflBmpU32* masks)
     SFL_BMP__TEST_FORMAT(SFL_BMP_PIXEL_FORMAT_B8G8R8X8, test_mask, masks);
     SFL_BMP__TEST_FORMAT(SFL_BMP_PIXEL_FORMAT_B5G5R5X1, test_mask, masks);
 
-#undef SFL_BMP__TEST
+#if SFL_BMP_CUSTOM_PIXEL_FORMATS
+    for (SflBmpU32 i = 0; i < SflBmp_Num_Custom_Formats; ++i) {
+        const SflBmpPixelFormatInfo* custom = &SflBmp_Custom_Formats[i];
+        if (custom->bpp == bpp && sfl_bmp__has_masks(custom->mask) &&
+            SFL_BMP__TEST_MASKS(custom->mask, masks))
+        {
+            return custom->format;
+        }
+    }
+#endif
+
+#undef SFL_BMP__TEST_FORMAT
 #undef SFL_BMP__TEST_MASKS
     return SFL_BMP_PIXEL_FORMAT_UNRECOGNIZED;
 }
 
-int sfl_bmp_probe(SflBmpContext* ctx, SflBmpDesc* desc)
-{
-    SflBmpHdrID hdr_id = SFL_BMP_HDR_ID_NA;
-    SflBmpNfoID nfo_id = SFL_BMP_NFO_ID_NA;
-    SflBmpU16   bpp    = 0;
-    int         rc     = 0;
+/**
+ * Row converters
+ *
+ * Every pair of built-in pixel formats gets its own row kernel, generated from
+ * the constant layouts below, so that the compiler can fold the shifts & masks
+ * and vectorize the loop. Anything else (e.g. arbitrary bitfields) goes through
+ * the generic kernel, which reads the same parameters at runtime.
+ */
+struct SflBmpConverter;
 
-    /* Read in file header and determine file type */
-    SflBmpFileHeader file_header;
-    if (!SFL_BMP_READ_STRUCT(SflBmpFileHeader, ctx, &file_header)) {
-        goto EXIT_PROC;
-    }
+#if defined(_MSC_VER) || defined(__GNUC__) || defined(__clang__)
+#define SFL_BMP__RESTRICT __restrict
+#else
+#define SFL_BMP__RESTRICT
+#endif
 
-    hdr_id = sfl_bmp_get_hdr_id(file_header.hdr);
-    if (hdr_id == SFL_BMP_HDR_ID_NA) {
-        goto EXIT_PROC;
-    }
+#define PROC_SFL_BMP_CONVERT_ROW(name)              \
+    void name(                                      \
+        const struct SflBmpConverter*     conv,     \
+        const SflBmpU8* SFL_BMP__RESTRICT src,      \
+        SflBmpU8* SFL_BMP__RESTRICT       dst,      \
+        SflBmpU32                         count,    \
+        SflBmpU32                         y)
+typedef PROC_SFL_BMP_CONVERT_ROW(ProcSflBmpConvertRow);
+
+typedef struct SflBmpConverter {
+    ProcSflBmpConvertRow* convert_row;
+    /** Bytes per pixel of the input and the output */
+    SflBmpU32 i_slice;
+    SflBmpU32 o_slice;
+    /** Component (r, g, b, a) offsets and widths, in bits */
+    SflBmpU32 i_shift[4];
+    SflBmpU32 i_bits[4];
+    SflBmpU32 o_shift[4];
+    SflBmpU32 o_bits[4];
+    /** Bits per input pixel (per index if paletted), and the palette in the
+     *  output format */
+    SflBmpU32 i_bpp;
+    SflBmpU32 palette[256];
+    /** Packing to 16 bpp dithers, @see SFL_BMP_ATTRIBUTE_DITHERED */
+    int       dither;
+    /**
+     * Planar output, one plane per output byte (0 when interleaved). With
+     * split_direct, plane p is byte plane_source[p] of each input pixel, or
+     * plane_fill[p] where that is -1. Otherwise pixels are converted first
+     */
+    SflBmpU32 num_planes;
+    int       split_direct;
+    SflBmpI32 plane_source[4];
+    SflBmpU8  plane_fill[4];
+    /** AND mask of an OS/2 icon or pointer (1 bpp, in file row order), or
+     *  null. Pixels with their bit set come out transparent */
+    const SflBmpU8* mask;
+    SflBmpU32       mask_pitch;
+#if SFL_BMP_CUSTOM_PIXEL_FORMATS
+    /**
+     * Kernels of the custom input & output formats, if they're used. The
+     * rest of the converter is then set up for inner_row, which converts
+     * from or to R8G8B8A8 in between, or is null if there's nothing to do
+     */
+    const SflBmpPixelFormatInfo* custom_in;
+    const SflBmpPixelFormatInfo* custom_out;
+    ProcSflBmpConvertRow*        inner_row;
+#endif
+#if SFL_BMP_PIXEL_STATS
+    /**
+     * Where statistics of the decoded rows go, if anywhere. Components of
+     * the output are at p_shift, p_bits wide, and up to 8 bits they're
+     * scaled through p_scale
+     */
+    SflBmpPixelStats* pixel_stats;
+    SflBmpU32         p_shift[4];
+    SflBmpU32         p_bits[4];
+    SflBmpU8          p_scale[4][256];
+#endif
+} SflBmpConverter;
+
+/* Layouts: bytes per pixel, followed by (shift, bits) for each component */
+#define SFL_BMP__B8G8R8A8_SLICE 4
+#define SFL_BMP__B8G8R8A8_R     16, 8
+#define SFL_BMP__B8G8R8A8_G     8, 8
+#define SFL_BMP__B8G8R8A8_B     0, 8
+#define SFL_BMP__B8G8R8A8_A     24, 8
+
+#define SFL_BMP__B8G8R8_SLICE 3
+#define SFL_BMP__B8G8R8_R     16, 8
+#define SFL_BMP__B8G8R8_G     8, 8
+#define SFL_BMP__B8G8R8_B     0, 8
+#define SFL_BMP__B8G8R8_A     0, 0
+
+#define SFL_BMP__B5G6R5_SLICE 2
+#define SFL_BMP__B5G6R5_R     11, 5
+#define SFL_BMP__B5G6R5_G     5, 6
+#define SFL_BMP__B5G6R5_B     0, 5
+#define SFL_BMP__B5G6R5_A     0, 0
+
+#define SFL_BMP__R8G8B8A8_SLICE 4
+#define SFL_BMP__R8G8B8A8_R     0, 8
+#define SFL_BMP__R8G8B8A8_G     8, 8
+#define SFL_BMP__R8G8B8A8_B     16, 8
+#define SFL_BMP__R8G8B8A8_A     24, 8
+
+#define SFL_BMP__B8G8R8X8_SLICE 4
+#define SFL_BMP__B8G8R8X8_R     16, 8
+#define SFL_BMP__B8G8R8X8_G     8, 8
+#define SFL_BMP__B8G8R8X8_B     0, 8
+#define SFL_BMP__B8G8R8X8_A     0, 0
+
+#define SFL_BMP__B5G5R5X1_SLICE 2
+#define SFL_BMP__B5G5R5X1_R     10, 5
+#define SFL_BMP__B5G5R5X1_G     5, 5
+#define SFL_BMP__B5G5R5X1_B     0, 5
+#define SFL_BMP__B5G5R5X1_A     0, 0
+
+enum {
+    SFL_BMP__FORMAT_INDEX_B8G8R8A8 = 0,
+    SFL_BMP__FORMAT_INDEX_B8G8R8   = 1,
+    SFL_BMP__FORMAT_INDEX_B5G6R5   = 2,
+    SFL_BMP__FORMAT_INDEX_R8G8B8A8 = 3,
+    SFL_BMP__FORMAT_INDEX_B8G8R8X8 = 4,
+    SFL_BMP__FORMAT_INDEX_B5G5R5X1 = 5,
+    SFL_BMP__FORMAT_INDEX_COUNT
+};
 
-    /* Read in  header size and get info header kind */
-    SflBmpU32 info_header_size;
-    if (!SFL_BMP_READ(ctx, &info_header_size, sizeof(info_header_size))) {
-        goto EXIT_PROC;
+static int sfl_bmp__format_index(int format)
+{
+    switch (format) {
+        case SFL_BMP_PIXEL_FORMAT_B8G8R8A8:
+            return SFL_BMP__FORMAT_INDEX_B8G8R8A8;
+        case SFL_BMP_PIXEL_FORMAT_B8G8R8:
+            return SFL_BMP__FORMAT_INDEX_B8G8R8;
+        case SFL_BMP_PIXEL_FORMAT_B5G6R5:
+            return SFL_BMP__FORMAT_INDEX_B5G6R5;
+        case SFL_BMP_PIXEL_FORMAT_R8G8B8A8:
+            return SFL_BMP__FORMAT_INDEX_R8G8B8A8;
+        case SFL_BMP_PIXEL_FORMAT_B8G8R8X8:
+            return SFL_BMP__FORMAT_INDEX_B8G8R8X8;
+        case SFL_BMP_PIXEL_FORMAT_B5G5R5X1:
+            return SFL_BMP__FORMAT_INDEX_B5G5R5X1;
+        default:
+            return -1;
     }
+}
 
-    if (SFL_BMP_SEEK(ctx, -((long)sizeof(info_header_size)), SFL_BMP_IO_CUR)) {
-        goto EXIT_PROC;
+/**
+ * Loads/stores the i-th pixel of a row. 16 and 32 bit pixels go through
+ * memcpy, since peeked rows are only as aligned as the pixel data offset in
+ * the file. Compilers turn it into plain (unaligned) loads and stores, which
+ * still lets them vectorize the fixed kernels.
+ */
+static inline SflBmpU32 sfl_bmp__load_pixel(
+    const SflBmpU8* row, SflBmpU32 i, SflBmpU32 slice)
+{
+    switch (slice) {
+        case 1:
+            return (SflBmpU32)row[i];
+        case 2: {
+            SflBmpU16 pixel;
+            memcpy(&pixel, row + (SflBmpUSize)i * 2, sizeof(pixel));
+            return (SflBmpU32)pixel;
+        }
+        case 3: {
+            const SflBmpU8* p = row + (SflBmpUSize)i * 3;
+            return (SflBmpU32)p[0] | ((SflBmpU32)p[1] << 8) |
+                   ((SflBmpU32)p[2] << 16);
+        }
+        default: {
+            SflBmpU32 pixel;
+            memcpy(&pixel, row + (SflBmpUSize)i * 4, sizeof(pixel));
+            return pixel;
+        }
     }
+}
 
-    nfo_id = sfl_bmp_get_nfo_id(info_header_size);
-
-    /* Set initial values for descriptor */
-    desc->data              = 0;
-    desc->attributes        = 0;
-    desc->offset            = file_header.offset;
-    desc->file_header_id    = hdr_id;
-    desc->info_header_id    = nfo_id;
-    desc->num_table_entries = 0;
-    desc->table_offset      = 0;
-    desc->physical_width    = 0;
-    desc->physical_height   = 0;
-
-    switch (nfo_id) {
-        case SFL_BMP_NFO_ID_CORE: {
-            /*
-            @note: Core headers for Windows 2.0 and OS/2 1.x differ in dimension
-            signage
-            */
-
+static inline void sfl_bmp__store_pixel(
+    SflBmpU8* row, SflBmpU32 i, SflBmpU32 slice, SflBmpU32 pixel)
+{
+    switch (slice) {
+        case 1: {
+            row[i] = (SflBmpU8)pixel;
         } break;
-
-        case SFL_BMP_NFO_ID_OS22_V1: {
+        case 2: {
+            const SflBmpU16 value = (SflBmpU16)pixel;
+            memcpy(row + (SflBmpUSize)i * 2, &value, sizeof(value));
         } break;
-
-        case SFL_BMP_NFO_ID_OS22_V2: {
+        case 3: {
+            SflBmpU8* p = row + (SflBmpUSize)i * 3;
+            p[0]        = (SflBmpU8)(pixel);
+            p[1]        = (SflBmpU8)(pixel >> 8);
+            p[2]        = (SflBmpU8)(pixel >> 16);
         } break;
+        default: {
+            memcpy(row + (SflBmpUSize)i * 4, &pixel, sizeof(pixel));
+        } break;
+    }
+}
 
-        case SFL_BMP_NFO_ID_V1: {
-            SflBmpInfoHeader040 info_header;
-            if (!SFL_BMP_READ_STRUCT(SflBmpInfoHeader040, ctx, &info_header)) {
-                goto EXIT_PROC;
-            }
-            desc->width           = info_header.width;
-            desc->height          = info_header.height;
-            desc->physical_width  = info_header.hres;
-            desc->physical_height = info_header.vres;
-
-            if (info_header.height > 0) {
-                desc->attributes |= SFL_BMP_ATTRIBUTE_FLIPPED;
-            }
+/**
+ * Rescales a component from in_bits to out_bits, rounding to nearest.
+ * Missing input components are either zero, or max if fill is set (alpha).
+ */
+static inline SflBmpU32 sfl_bmp__scale_component(
+    SflBmpU32 value, SflBmpU32 in_bits, SflBmpU32 out_bits, int fill)
+{
+    if (out_bits == 0) return 0;
 
-            /* v1 doesn't support alpha */
-            desc->mask[3] = 0;
+    const SflBmpU64 out_max = (((SflBmpU64)1) << out_bits) - 1;
+    if (in_bits == 0) return fill ? (SflBmpU32)out_max : 0;
+    if (in_bits == out_bits) return value;
 
-            /*
-            msdocs on BITMAPINFOHEADER say that these are the only
-            possible values
-            */
-            if (info_header.compression == SFL_BMP_COMPRESSION_BITFIELDS) {
-                /*
-                > Palette field contains three 4 byte color masks that specify
-                > the red, green, and blue components
-                From msdocs on BITMAPINFOHEADER
-                */
+    const SflBmpU64 in_max = (((SflBmpU64)1) << in_bits) - 1;
+    return (SflBmpU32)((value * out_max + in_max / 2) / in_max);
+}
 
-                SflBmpU32 masks[3];
-                if (!SFL_BMP_READ(ctx, masks, sizeof(SflBmpU32) * 3)) {
-                    goto EXIT_PROC;
-                }
+/** Same as above, for components no wider than 8 bits (fixed kernels) */
+static inline SflBmpU32 sfl_bmp__scale_component8(
+    SflBmpU32 value, SflBmpU32 in_bits, SflBmpU32 out_bits, int fill)
+{
+    if (out_bits == 0) return 0;
 
-                desc->mask[0] = masks[0];
-                desc->mask[1] = masks[1];
-                desc->mask[2] = masks[2];
-            } else if (info_header.compression != SFL_BMP_COMPRESSION_NONE) {
-                goto EXIT_PROC;
-            }
-            desc->num_table_entries = info_header.num_colors;
-            desc->compression       = info_header.compression;
-            bpp                     = info_header.bpp;
-        } break;
+    const SflBmpU32 out_max = (1u << out_bits) - 1;
+    if (in_bits == 0) return fill ? out_max : 0;
+    if (in_bits == out_bits) return value;
 
-        case SFL_BMP_NFO_ID_V2: {
-        } break;
+    const SflBmpU32 in_max = (1u << in_bits) - 1;
+    return (value * out_max + in_max / 2) / in_max;
+}
 
-        case SFL_BMP_NFO_ID_V3: {
-        } break;
+static inline SflBmpU32 sfl_bmp__convert_component8(
+    SflBmpU32 pixel,
+    SflBmpU32 in_shift,
+    SflBmpU32 in_bits,
+    SflBmpU32 out_shift,
+    SflBmpU32 out_bits,
+    int       fill)
+{
+    const SflBmpU32 value = (pixel >> in_shift) & ((1u << in_bits) - 1);
+    return sfl_bmp__scale_component8(value, in_bits, out_bits, fill)
+           << out_shift;
+}
 
-        case SFL_BMP_NFO_ID_V4: {
-        } break;
+#define SFL_BMP__DEFINE_CONVERT_ROW(I, O)                                    \
+    static PROC_SFL_BMP_CONVERT_ROW(sfl_bmp__convert_row_##I##_to_##O)       \
+    {                                                                        \
+        (void)conv;                                                          \
+        (void)y;                                                             \
+        for (SflBmpU32 i = 0; i < count; ++i) {                              \
+            const SflBmpU32 p =                                              \
+                sfl_bmp__load_pixel(src, i, SFL_BMP__##I##_SLICE);           \
+            const SflBmpU32 r = sfl_bmp__convert_component8(                 \
+                p,                                                           \
+                SFL_BMP__##I##_R,                                            \
+                SFL_BMP__##O##_R,                                            \
+                0);                                                          \
+            const SflBmpU32 g = sfl_bmp__convert_component8(                 \
+                p,                                                           \
+                SFL_BMP__##I##_G,                                            \
+                SFL_BMP__##O##_G,                                            \
+                0);                                                          \
+            const SflBmpU32 b = sfl_bmp__convert_component8(                 \
+                p,                                                           \
+                SFL_BMP__##I##_B,                                            \
+                SFL_BMP__##O##_B,                                            \
+                0);                                                          \
+            const SflBmpU32 a = sfl_bmp__convert_component8(                 \
+                p,                                                           \
+                SFL_BMP__##I##_A,                                            \
+                SFL_BMP__##O##_A,                                            \
+                1);                                                          \
+            sfl_bmp__store_pixel(                                            \
+                dst,                                                         \
+                i,                                                           \
+                SFL_BMP__##O##_SLICE,                                        \
+                r | g | b | a);                                              \
+        }                                                                    \
+    }
 
-        case SFL_BMP_NFO_ID_V5: {
-            SflBmpInfoHeader124 info_header;
-            if (!SFL_BMP_READ_STRUCT(SflBmpInfoHeader124, ctx, &info_header)) {
-                goto EXIT_PROC;
-            }
-            desc->width           = info_header.width;
-            desc->height          = sfl_bmp_iabs(info_header.height);
-            desc->physical_width  = info_header.hres;
-            desc->physical_height = info_header.vres;
+/**
+ * Bias added before dividing by 255 when packing 8 bit components, by column.
+ * The first row rounds to nearest, the other four are the rows of a 4x4 Bayer
+ * matrix spread over 0-255 (mean 128)
+ */
+static const SflBmpU32 sfl_bmp__pack_bias[5][4] = {
+    {127, 127, 127, 127},
+    {8, 136, 40, 168},
+    {200, 72, 232, 104},
+    {56, 184, 24, 152},
+    {248, 120, 216, 88},
+};
 
-            if (info_header.height > 0) {
-                desc->attributes |= SFL_BMP_ATTRIBUTE_FLIPPED;
-            }
+/** (value * out_max + bias) / 255, with shifts: exact below 65535 */
+static inline SflBmpU32 sfl_bmp__pack_component(
+    SflBmpU32 pixel,
+    SflBmpU32 in_shift,
+    SflBmpU32 in_bits,
+    SflBmpU32 out_shift,
+    SflBmpU32 out_bits,
+    SflBmpU32 bias)
+{
+    const SflBmpU32 x = ((pixel >> in_shift) & 0xFF) * ((1u << out_bits) - 1) +
+                        bias;
+    (void)in_bits;
+    return ((x + 1 + (x >> 8)) >> 8) << out_shift;
+}
 
-            desc->mask[0]           = info_header.red_mask;
-            desc->mask[1]           = info_header.green_mask;
-            desc->mask[2]           = info_header.blue_mask;
-            desc->mask[3]           = info_header.alpha_mask;
-            /*
-            @todo: technically, this is incorrect. Due to overlap with other
-            headers, # of palette entries are usually 4 with this header, which
-            includes the masks inside the struct decl. So, handle this, and
-            report the correct amount of entries in the palette
-            */
-            desc->num_table_entries = info_header.num_colors;
-            desc->compression = (SflBmpCompression)info_header.compression;
-            bpp               = info_header.bpp;
-        } break;
+/*
+ * 8 bit components packed to 16 bpp. There's no division and no branch per
+ * pixel; the biases for four columns stay in registers, so each group of four
+ * pixels vectorizes. Dithering only changes which row of biases is used. The
+ * outputs have no alpha.
+ */
+#define SFL_BMP__PACK_PIXEL(I, O, i, k)                                     \
+    do {                                                                    \
+        const SflBmpU32 p =                                                 \
+            sfl_bmp__load_pixel(src, i, SFL_BMP__##I##_SLICE);              \
+        const SflBmpU32 r = sfl_bmp__pack_component(                        \
+            p, SFL_BMP__##I##_R, SFL_BMP__##O##_R, k);                      \
+        const SflBmpU32 g = sfl_bmp__pack_component(                        \
+            p, SFL_BMP__##I##_G, SFL_BMP__##O##_G, k);                      \
+        const SflBmpU32 b = sfl_bmp__pack_component(                        \
+            p, SFL_BMP__##I##_B, SFL_BMP__##O##_B, k);                      \
+        sfl_bmp__store_pixel(dst, i, SFL_BMP__##O##_SLICE, r | g | b);      \
+    } while (0)
 
-        case SFL_BMP_NFO_ID_NA:
-        default:
-            break;
+#define SFL_BMP__DEFINE_PACK_ROW(I, O)                                      \
+    static PROC_SFL_BMP_CONVERT_ROW(sfl_bmp__convert_row_##I##_to_##O)      \
+    {                                                                       \
+        const SflBmpU32* bias =                                             \
+            sfl_bmp__pack_bias[conv->dither ? 1 + (y & 3) : 0];             \
+        const SflBmpU32 k0 = bias[0], k1 = bias[1];                         \
+        const SflBmpU32 k2 = bias[2], k3 = bias[3];                         \
+        SflBmpU32       i  = 0;                                             \
+        for (; i + 4 <= count; i += 4) {                                    \
+            SFL_BMP__PACK_PIXEL(I, O, i, k0);                               \
+            SFL_BMP__PACK_PIXEL(I, O, i + 1, k1);                           \
+            SFL_BMP__PACK_PIXEL(I, O, i + 2, k2);                           \
+            SFL_BMP__PACK_PIXEL(I, O, i + 3, k3);                           \
+        }                                                                   \
+        for (; i < count; ++i) {                                            \
+            SFL_BMP__PACK_PIXEL(I, O, i, bias[i & 3]);                      \
+        }                                                                   \
     }
 
-    /* @todo: or ALPHA_BITFIELDS */
-    if (desc->compression == SFL_BMP_COMPRESSION_BITFIELDS) {
-        desc->table_offset =
-            sizeof(SflBmpFileHeader) + info_header_size + sizeof(SflBmpU32) * 3;
-    } else {
-        desc->table_offset = sizeof(SflBmpFileHeader) + info_header_size;
+/* Same format on both ends; nothing to convert */
+#define SFL_BMP__DEFINE_COPY_ROW(I)                                     \
+    static PROC_SFL_BMP_CONVERT_ROW(sfl_bmp__convert_row_##I##_to_##I)  \
+    {                                                                   \
+        (void)conv;                                                     \
+        (void)y;                                                        \
+        memcpy(dst, src, (SflBmpUSize)count * SFL_BMP__##I##_SLICE);    \
     }
 
-    if (desc->info_header_id == SFL_BMP_NFO_ID_OS22_V1) {
-        desc->table_entry_size = 3;
-    } else {
-        desc->table_entry_size = 4;
+SFL_BMP__DEFINE_COPY_ROW(B8G8R8A8)
+SFL_BMP__DEFINE_CONVERT_ROW(B8G8R8A8, B8G8R8)
+SFL_BMP__DEFINE_PACK_ROW(B8G8R8A8, B5G6R5)
+SFL_BMP__DEFINE_CONVERT_ROW(B8G8R8A8, R8G8B8A8)
+SFL_BMP__DEFINE_CONVERT_ROW(B8G8R8A8, B8G8R8X8)
+SFL_BMP__DEFINE_PACK_ROW(B8G8R8A8, B5G5R5X1)
+
+SFL_BMP__DEFINE_CONVERT_ROW(B8G8R8, B8G8R8A8)
+SFL_BMP__DEFINE_COPY_ROW(B8G8R8)
+SFL_BMP__DEFINE_PACK_ROW(B8G8R8, B5G6R5)
+SFL_BMP__DEFINE_CONVERT_ROW(B8G8R8, R8G8B8A8)
+SFL_BMP__DEFINE_CONVERT_ROW(B8G8R8, B8G8R8X8)
+SFL_BMP__DEFINE_PACK_ROW(B8G8R8, B5G5R5X1)
+
+SFL_BMP__DEFINE_CONVERT_ROW(B5G6R5, B8G8R8A8)
+SFL_BMP__DEFINE_CONVERT_ROW(B5G6R5, B8G8R8)
+SFL_BMP__DEFINE_COPY_ROW(B5G6R5)
+SFL_BMP__DEFINE_CONVERT_ROW(B5G6R5, R8G8B8A8)
+SFL_BMP__DEFINE_CONVERT_ROW(B5G6R5, B8G8R8X8)
+SFL_BMP__DEFINE_CONVERT_ROW(B5G6R5, B5G5R5X1)
+
+SFL_BMP__DEFINE_CONVERT_ROW(R8G8B8A8, B8G8R8A8)
+SFL_BMP__DEFINE_CONVERT_ROW(R8G8B8A8, B8G8R8)
+SFL_BMP__DEFINE_PACK_ROW(R8G8B8A8, B5G6R5)
+SFL_BMP__DEFINE_COPY_ROW(R8G8B8A8)
+SFL_BMP__DEFINE_CONVERT_ROW(R8G8B8A8, B8G8R8X8)
+SFL_BMP__DEFINE_PACK_ROW(R8G8B8A8, B5G5R5X1)
+
+SFL_BMP__DEFINE_CONVERT_ROW(B8G8R8X8, B8G8R8A8)
+SFL_BMP__DEFINE_CONVERT_ROW(B8G8R8X8, B8G8R8)
+SFL_BMP__DEFINE_PACK_ROW(B8G8R8X8, B5G6R5)
+SFL_BMP__DEFINE_CONVERT_ROW(B8G8R8X8, R8G8B8A8)
+SFL_BMP__DEFINE_COPY_ROW(B8G8R8X8)
+SFL_BMP__DEFINE_PACK_ROW(B8G8R8X8, B5G5R5X1)
+
+SFL_BMP__DEFINE_CONVERT_ROW(B5G5R5X1, B8G8R8A8)
+SFL_BMP__DEFINE_CONVERT_ROW(B5G5R5X1, B8G8R8)
+SFL_BMP__DEFINE_CONVERT_ROW(B5G5R5X1, B5G6R5)
+SFL_BMP__DEFINE_CONVERT_ROW(B5G5R5X1, R8G8B8A8)
+SFL_BMP__DEFINE_CONVERT_ROW(B5G5R5X1, B8G8R8X8)
+SFL_BMP__DEFINE_COPY_ROW(B5G5R5X1)
+
+#define SFL_BMP__CONVERT_ROWS_FROM(I)           \
+    {                                           \
+        sfl_bmp__convert_row_##I##_to_B8G8R8A8, \
+        sfl_bmp__convert_row_##I##_to_B8G8R8,   \
+        sfl_bmp__convert_row_##I##_to_B5G6R5,   \
+        sfl_bmp__convert_row_##I##_to_R8G8B8A8, \
+        sfl_bmp__convert_row_##I##_to_B8G8R8X8, \
+        sfl_bmp__convert_row_##I##_to_B5G5R5X1, \
     }
 
-    desc->pitch = (SflBmpU32)SFL_BMP_CEILF((bpp * desc->width) / 32.f) * 4;
+/** [input format index][output format index] */
+static ProcSflBmpConvertRow* const SflBmp_Convert_Row_Table
+    [SFL_BMP__FORMAT_INDEX_COUNT][SFL_BMP__FORMAT_INDEX_COUNT] = {
+        SFL_BMP__CONVERT_ROWS_FROM(B8G8R8A8),
+        SFL_BMP__CONVERT_ROWS_FROM(B8G8R8),
+        SFL_BMP__CONVERT_ROWS_FROM(B5G6R5),
+        SFL_BMP__CONVERT_ROWS_FROM(R8G8B8A8),
+        SFL_BMP__CONVERT_ROWS_FROM(B8G8R8X8),
+        SFL_BMP__CONVERT_ROWS_FROM(B5G5R5X1),
+};
 
-    desc->size = desc->pitch * desc->height;
+#undef SFL_BMP__CONVERT_ROWS_FROM
+#undef SFL_BMP__DEFINE_COPY_ROW
+#undef SFL_BMP__DEFINE_PACK_ROW
+#undef SFL_BMP__PACK_PIXEL
+#undef SFL_BMP__DEFINE_CONVERT_ROW
 
-    /* If bits per pixel is <= 8, then the bitmap is always palettized */
-    switch (bpp) {
-        case 1:
-        case 4:
-        case 8: {
-            desc->attributes |= SFL_BMP_ATTRIBUTE_PALETTIZED;
+static PROC_SFL_BMP_CONVERT_ROW(sfl_bmp__convert_row_generic)
+{
+    (void)y;
+    for (SflBmpU32 i = 0; i < count; ++i) {
+        const SflBmpU32 p = sfl_bmp__load_pixel(src, i, conv->i_slice);
+
+        SflBmpU32 pixel = 0;
+        for (int c = 0; c < 4; ++c) {
+            const SflBmpU32 mask =
+                (SflBmpU32)((((SflBmpU64)1) << conv->i_bits[c]) - 1);
+            const SflBmpU32 value = (p >> conv->i_shift[c]) & mask;
+
+            pixel |= sfl_bmp__scale_component(
+                         value,
+                         conv->i_bits[c],
+                         conv->o_bits[c],
+                         c == 3)
+                     << conv->o_shift[c];
+        }
 
-            if (desc->compression == SFL_BMP_COMPRESSION_RLE4) {
-                if (bpp != 4) {
-                    goto EXIT_PROC;
-                }
-            } else if (desc->compression == SFL_BMP_COMPRESSION_RLE8) {
-                if (bpp != 8) {
-                    goto EXIT_PROC;
-                }
-            }
+        sfl_bmp__store_pixel(dst, i, conv->o_slice, pixel);
+    }
+}
 
-            desc->format =
-                sfl_bmp_decide_pixel_format_from_bitmasks(desc->mask);
-        } break;
+static PROC_SFL_BMP_CONVERT_ROW(sfl_bmp__convert_row_indexed)
+{
+    const SflBmpU32 bpp  = conv->i_bpp;
+    const SflBmpU32 mask = (1u << bpp) - 1;
+
+    (void)y;
+    for (SflBmpU32 i = 0; i < count; ++i) {
+        const SflBmpU32 bit   = i * bpp;
+        const SflBmpU32 index = (src[bit / 8] >> (8 - bpp - bit % 8)) & mask;
+        sfl_bmp__store_pixel(dst, i, conv->o_slice, conv->palette[index]);
+    }
+}
 
-        case 16: {
-            desc->slice = 2;
-            if (desc->compression == SFL_BMP_COMPRESSION_NONE) {
-                /*
-                @note: Documentation mentions that the most significant bit
-                isn't used in 16 bpp
-                */
-                desc->format = SFL_BMP_PIXEL_FORMAT_B5G5R5X1;
-                sfl_bmp__bitmasks_from_pixel_format(desc->format, desc->mask);
-            } else if (desc->compression == SFL_BMP_COMPRESSION_BITFIELDS) {
-                desc->format =
-                    sfl_bmp_decide_pixel_format_from_bitmasks(desc->mask);
-            } else {
-                goto EXIT_PROC;
-            }
-        } break;
+/**
+ * Sets up planar output (SFL_BMP_ATTRIBUTE_PLANAR). When every component is
+ * a whole byte of the input pixel, or missing from it, planes are split
+ * straight from the input
+ */
+static void sfl_bmp__planar_init(
+    SflBmpConverter* conv, SflBmpDesc* in, SflBmpDesc* out)
+{
+    conv->num_planes   = 0;
+    conv->split_direct = 0;
+    if (!(out->attributes & SFL_BMP_ATTRIBUTE_PLANAR)) {
+        return;
+    }
 
-        case 24: {
-            desc->slice  = 3;
-            desc->format = SFL_BMP_PIXEL_FORMAT_B8G8R8;
-            if (desc->compression != SFL_BMP_COMPRESSION_NONE) {
-                goto EXIT_PROC;
+    conv->num_planes   = out->slice;
+    conv->split_direct = !(in->attributes & SFL_BMP_ATTRIBUTE_PALETTIZED) &&
+                         (in->slice == 3 || in->slice == 4);
+
+    for (SflBmpU32 p = 0; p < conv->num_planes; ++p) {
+        conv->plane_source[p] = -1;
+        conv->plane_fill[p]   = 0;
+
+        for (int c = 0; c < 4; ++c) {
+            if (conv->o_bits[c] != 8 || conv->o_shift[c] != p * 8) {
+                continue;
             }
-        } break;
 
-        case 32: {
-            desc->slice = 4;
-            if (desc->compression == SFL_BMP_COMPRESSION_BITFIELDS) {
-                desc->format =
-                    sfl_bmp_decide_pixel_format_from_bitmasks(desc->mask);
-            } else if (desc->compression == SFL_BMP_COMPRESSION_NONE) {
-                desc->format = SFL_BMP_PIXEL_FORMAT_B8G8R8X8;
+            if (conv->i_bits[c] == 8 && (conv->i_shift[c] % 8) == 0) {
+                conv->plane_source[p] = (SflBmpI32)(conv->i_shift[c] / 8);
+            } else if (conv->i_bits[c] == 0) {
+                conv->plane_fill[p] = (c == 3) ? 0xFF : 0;
             } else {
-                goto EXIT_PROC;
+                conv->split_direct = 0;
             }
-        } break;
-
-        default: {
-            goto EXIT_PROC;
-        } break;
+        }
     }
-
-    rc = 1;
-EXIT_PROC:
-    SFL_BMP_SEEK(ctx, 0, SFL_BMP_IO_SET);
-    return rc;
 }
 
-int sfl_bmp_decode(SflBmpContext* ctx, SflBmpDesc* desc)
+static void sfl_bmp__converter_init_builtin(
+    SflBmpConverter* conv, SflBmpDesc* in, SflBmpDesc* out)
 {
-    SflBmpDesc intermediate_desc;
-    if (!sfl_bmp_probe(ctx, &intermediate_desc)) {
-        return 0;
-    }
-
-    desc->width          = intermediate_desc.width;
-    desc->height         = intermediate_desc.height;
-    desc->file_header_id = intermediate_desc.file_header_id;
-    desc->info_header_id = intermediate_desc.info_header_id;
-
-    if (!sfl_bmp__fill_desc(desc)) {
-        return 0;
+    for (int c = 0; c < 4; ++c) {
+        conv->i_shift[c] =
+            in->mask[c] ? sfl_bmp_bit_scan_forward(in->mask[c]) : 0;
+        conv->i_bits[c] = sfl_bmp_bit_count(in->mask[c]);
+        conv->o_shift[c] =
+            out->mask[c] ? sfl_bmp_bit_scan_forward(out->mask[c]) : 0;
+        conv->o_bits[c] = sfl_bmp_bit_count(out->mask[c]);
     }
 
-    if (desc->attributes & SFL_BMP_ATTRIBUTE_PALETTIZED) {
-        SFL_BMP_UNIMPLEMENTED();
-    } else {
-        desc->data = SFL_BMP_ALLOCATE(ctx, desc->size);
+    conv->i_slice     = in->slice;
+    conv->o_slice     = out->slice;
+    conv->i_bpp       = in->slice * 8;
+    conv->convert_row = sfl_bmp__convert_row_generic;
+    conv->dither      = (out->attributes & SFL_BMP_ATTRIBUTE_DITHERED) != 0;
+
+    const int ii = sfl_bmp__format_index(in->format);
+    const int oi = sfl_bmp__format_index(out->format);
+
+    /* Only trust the format if the layout agrees with it */
+    if ((ii != -1) && (oi != -1) &&
+        (sfl_bmp__bpp_from_pixel_format(in->format) == (int)in->slice * 8) &&
+        (sfl_bmp__bpp_from_pixel_format(out->format) == (int)out->slice * 8))
+    {
+        conv->convert_row = SflBmp_Convert_Row_Table[ii][oi];
     }
 
-    SflBmpIOImplementationMemory desc_io_memory;
-    sfl_bmp_memory_init(&desc_io_memory, desc->data, desc->size);
-
-    sfl_bmp__convert(&intermediate_desc, &ctx->io, desc, &SflBmp_IO_Memory);
-
-    return 1;
+    sfl_bmp__planar_init(conv, in, out);
 }
 
-static int sfl_bmp__next_block(
-    SflBmpDesc*             desc,
-    SflBmpIOImplementation* io,
-    void*                   buf,
-    SflBmpUSize             buf_size,
-    SflBmpUSize             offset)
+#if SFL_BMP_CUSTOM_PIXEL_FORMATS
+/** A tightly packed R8G8B8A8 layout */
+static void sfl_bmp__rgba8_desc(SflBmpDesc* desc)
 {
-    if (desc->slice > buf_size) {
-        return -1;
-    }
+    memset(desc, 0, sizeof(*desc));
+    desc->format = SFL_BMP_PIXEL_FORMAT_R8G8B8A8;
+    desc->slice  = 4;
+    sfl_bmp__bitmasks_from_pixel_format(desc->format, desc->mask);
+}
 
-    int col = (int)(offset % desc->pitch);
+/** Pixels converted at a time through R8G8B8A8, for custom formats */
+#define SFL_BMP__CUSTOM_CHUNK 256
 
-    int skip_bytes = 0;
-    if ((col + desc->slice) > desc->pitch) {
-        skip_bytes = desc->pitch - col;
-    }
+/**
+ * Custom input kernel, then inner_row, then custom output kernel, a chunk
+ * at a time, with R8G8B8A8 in between
+ */
+static PROC_SFL_BMP_CONVERT_ROW(sfl_bmp__convert_row_custom)
+{
+    const SflBmpPixelFormatInfo* ci = conv->custom_in;
+    const SflBmpPixelFormatInfo* co = conv->custom_out;
+    const SflBmpU32 o_slice = co ? co->bpp / 8 : conv->o_slice;
+    SflBmpU8        rgba[SFL_BMP__CUSTOM_CHUNK * 4];
+
+    for (SflBmpU32 i = 0; i < count; i += SFL_BMP__CUSTOM_CHUNK) {
+        const SflBmpU32 n = (count - i < SFL_BMP__CUSTOM_CHUNK)
+                                ? count - i
+                                : SFL_BMP__CUSTOM_CHUNK;
+
+        /* Chunks start on a whole byte, even for 1 bpp indices */
+        const SflBmpU8* pixels = src + (SflBmpUSize)i * conv->i_bpp / 8;
+        SflBmpU8*       to     = dst + (SflBmpUSize)i * o_slice;
+
+        if (ci) {
+            SflBmpU8* out = (conv->inner_row || co) ? rgba : to;
+            ci->to_rgba8(ci->usr, pixels, out, n);
+            pixels = out;
+        }
 
-    if (skip_bytes != 0) {
-        if (sfl_bmp__seek(io, skip_bytes, SFL_BMP_IO_CUR)) {
-            return -1;
+        if (conv->inner_row) {
+            SflBmpU8* out = co ? rgba : to;
+            conv->inner_row(conv, pixels, out, n, y);
+            pixels = out;
         }
-    }
 
-    if (!sfl_bmp__read(io, buf, desc->slice)) {
-        return -1;
+        if (co) {
+            co->from_rgba8(co->usr, pixels, to, n);
+        }
     }
-
-    return desc->slice + skip_bytes;
 }
 
-static int sfl_bmp__write_block(
-    SflBmpDesc* desc, SflBmpIOImplementation* io, void* buf, SflBmpUSize size)
+/**
+ * Sets up conversion from or to a custom format, through its kernels or its
+ * masks. Returns 0 if neither side is one
+ */
+static int sfl_bmp__custom_converter_init(
+    SflBmpConverter* conv, SflBmpDesc* in, SflBmpDesc* out)
 {
-    if (size < desc->slice) {
+    const SflBmpPixelFormatInfo* ci = sfl_bmp__custom_format(in->format);
+    const SflBmpPixelFormatInfo* co = sfl_bmp__custom_format(out->format);
+
+    conv->custom_in  = (ci && ci->to_rgba8) ? ci : 0;
+    conv->custom_out = (co && co->from_rgba8) ? co : 0;
+    conv->inner_row  = 0;
+    if (!ci && !co) {
         return 0;
     }
 
-    return io->write(io->usr, buf, desc->slice);
-    return 1;
-}
+    /*
+     * The generic row goes by masks, which the caller may have left out
+     * for built-in formats, since their rows never needed them
+     */
+    SflBmpDesc inner_in  = *in;
+    SflBmpDesc inner_out = *out;
+    if (conv->custom_in) {
+        sfl_bmp__rgba8_desc(&inner_in);
+    } else if (!sfl_bmp__has_masks(inner_in.mask)) {
+        sfl_bmp__bitmasks_from_pixel_format(in->format, inner_in.mask);
+    }
 
-static int sfl_bmp__convert(
-    SflBmpDesc*             in,
-    SflBmpIOImplementation* in_io,
-    SflBmpDesc*             out,
-    SflBmpIOImplementation* out_io)
-{
-    SflBmpU32 in_buf          = 0;
-    int       x               = 0;
-    int       y               = 0;
-    int       bytes_processed = 0;
-    if (sfl_bmp__seek(in_io, in->offset, SFL_BMP_IO_SET)) {
-        return 0;
+    if (conv->custom_out) {
+        sfl_bmp__rgba8_desc(&inner_out);
+    } else if (!sfl_bmp__has_masks(inner_out.mask)) {
+        sfl_bmp__bitmasks_from_pixel_format(out->format, inner_out.mask);
     }
 
-    /* Amounts to shift each pixel value */
-    const SflBmpI32 irs = sfl_bmp_bit_scan_forward(in->mask[0]);
-    const SflBmpI32 igs = sfl_bmp_bit_scan_forward(in->mask[1]);
-    const SflBmpI32 ibs = sfl_bmp_bit_scan_forward(in->mask[2]);
-    const SflBmpI32 ias = sfl_bmp_bit_scan_forward(in->mask[3]);
+    sfl_bmp__converter_init_builtin(conv, &inner_in, &inner_out);
+    if (!conv->custom_in && !conv->custom_out) {
+        return 1;
+    }
 
-    const SflBmpI32 ors = sfl_bmp_bit_scan_forward(out->mask[0]);
-    const SflBmpI32 ogs = sfl_bmp_bit_scan_forward(out->mask[1]);
-    const SflBmpI32 obs = sfl_bmp_bit_scan_forward(out->mask[2]);
-    const SflBmpI32 oas = sfl_bmp_bit_scan_forward(out->mask[3]);
+    /* R8G8B8A8 to R8G8B8A8 needs no inner step */
+    if (inner_in.format != SFL_BMP_PIXEL_FORMAT_R8G8B8A8 ||
+        inner_in.slice != 4 ||
+        inner_out.format != SFL_BMP_PIXEL_FORMAT_R8G8B8A8)
+    {
+        conv->inner_row = conv->convert_row;
+    }
 
-    /* Amount of bits representing component */
-    const SflBmpI32 irc = sfl_bmp_bit_count(in->mask[0]);
-    const SflBmpI32 igc = sfl_bmp_bit_count(in->mask[1]);
-    const SflBmpI32 ibc = sfl_bmp_bit_count(in->mask[2]);
-    const SflBmpI32 iac = sfl_bmp_bit_count(in->mask[3]);
+    /* The input is read through the kernel, never split directly */
+    if (conv->custom_in) {
+        conv->i_bpp        = conv->custom_in->bpp;
+        conv->split_direct = 0;
+    }
 
-    const SflBmpI32 orc = sfl_bmp_bit_count(in->mask[0]);
-    const SflBmpI32 ogc = sfl_bmp_bit_count(in->mask[1]);
-    const SflBmpI32 obc = sfl_bmp_bit_count(in->mask[2]);
-    const SflBmpI32 oac = sfl_bmp_bit_count(in->mask[3]);
+    conv->convert_row = sfl_bmp__convert_row_custom;
+    return 1;
+}
+#endif
 
-    /* Max value of each component */
-    const SflBmpReal imr = (SflBmpReal)(sfl_bmp_ipow(2, irc) - 1);
-    const SflBmpReal img = (SflBmpReal)(sfl_bmp_ipow(2, igc) - 1);
-    const SflBmpReal imb = (SflBmpReal)(sfl_bmp_ipow(2, ibc) - 1);
-    const SflBmpReal ima = (SflBmpReal)(sfl_bmp_ipow(2, iac) - 1);
+static void sfl_bmp__converter_init(
+    SflBmpConverter* conv, SflBmpDesc* in, SflBmpDesc* out)
+{
+    conv->mask = 0;
+#if SFL_BMP_PIXEL_STATS
+    conv->pixel_stats = 0;
+#endif
+#if SFL_BMP_CUSTOM_PIXEL_FORMATS
+    if (sfl_bmp__custom_converter_init(conv, in, out)) {
+        return;
+    }
+#endif
+    sfl_bmp__converter_init_builtin(conv, in, out);
+}
 
-    const SflBmpReal omr = (SflBmpReal)(sfl_bmp_ipow(2, orc) - 1);
-    const SflBmpReal omg = (SflBmpReal)(sfl_bmp_ipow(2, ogc) - 1);
-    const SflBmpReal omb = (SflBmpReal)(sfl_bmp_ipow(2, obc) - 1);
-    const SflBmpReal oma = (SflBmpReal)(sfl_bmp_ipow(2, oac) - 1);
+/** Pixels converted at a time, before planar output is split from them */
+#define SFL_BMP__SPLIT_CHUNK 256
 
-    for (;;) {
-        int num_bytes = sfl_bmp__next_block(
-            in,
-            in_io,
-            &in_buf,
-            sizeof(in_buf),
-            bytes_processed);
-
-        if (num_bytes <= 0) {
-            return 0;
+/** Copies every slice-th byte of src into plane */
+static void sfl_bmp__split_plane(
+    const SflBmpU8* SFL_BMP__RESTRICT src,
+    SflBmpU8* SFL_BMP__RESTRICT       plane,
+    SflBmpU32                         count,
+    SflBmpU32                         slice)
+{
+    /* Constant strides, so that each loop vectorizes to shuffles */
+    if (slice == 4) {
+        for (SflBmpUSize x = 0; x < count; ++x) {
+            plane[x] = src[x * 4];
         }
+    } else {
+        for (SflBmpUSize x = 0; x < count; ++x) {
+            plane[x] = src[x * 3];
+        }
+    }
+}
 
-        /* Let's pretend there's no compression for now */
+/** Converts count pixels of src into one row of each plane */
+static void sfl_bmp__split_row(
+    const SflBmpConverter* conv,
+    const SflBmpU8*        src,
+    SflBmpU8* const*       planes,
+    SflBmpU32              count,
+    SflBmpU32              y)
+{
+    if (conv->split_direct) {
+        for (SflBmpU32 p = 0; p < conv->num_planes; ++p) {
+            if (conv->plane_source[p] < 0) {
+                memset(planes[p], conv->plane_fill[p], count);
+            } else {
+                sfl_bmp__split_plane(
+                    src + conv->plane_source[p],
+                    planes[p],
+                    count,
+                    conv->i_slice);
+            }
+        }
+        return;
+    }
 
-        /* Convert to normalized colors */
-        SflBmpReal ir = (SflBmpReal)((in_buf & in->mask[0]) >> irs);
-        SflBmpReal ig = (SflBmpReal)((in_buf & in->mask[1]) >> igs);
-        SflBmpReal ib = (SflBmpReal)((in_buf & in->mask[2]) >> ibs);
-        SflBmpReal ia = (SflBmpReal)((in_buf & in->mask[3]) >> ias);
+    SflBmpU8 chunk[SFL_BMP__SPLIT_CHUNK * 4];
+    for (SflBmpU32 i = 0; i < count; i += SFL_BMP__SPLIT_CHUNK) {
+        const SflBmpU32 n = (count - i < SFL_BMP__SPLIT_CHUNK)
+                                ? count - i
+                                : SFL_BMP__SPLIT_CHUNK;
+
+        /* Chunks start on a whole byte, even for 1 bpp indices */
+        conv->convert_row(
+            conv, src + (SflBmpUSize)i * conv->i_bpp / 8, chunk, n, y);
+        for (SflBmpU32 p = 0; p < conv->num_planes; ++p) {
+            sfl_bmp__split_plane(chunk + p, planes[p] + i, n, conv->o_slice);
+        }
+    }
+}
 
-        ir = imr != 0.0f ? ir / imr : 0.0f;
-        ig = img != 0.0f ? ig / img : 0.0f;
-        ib = imb != 0.0f ? ib / imb : 0.0f;
-        ia = ima != 0.0f ? ia / ima : 0.0f;
+#if SFL_BMP_PIXEL_STATS
+/**
+ * Resets stats, and sets conv up to gather them from rows of desc (or not,
+ * if stats is null or the output format has no masks to read them by)
+ */
+static void sfl_bmp__pixel_stats_begin(
+    SflBmpConverter* conv, SflBmpPixelStats* stats, const SflBmpDesc* desc)
+{
+    conv->pixel_stats = 0;
+    if (!stats) {
+        return;
+    }
 
-        /* Convert to target pixel */
-        SflBmpI32 tr = (((SflBmpU32)SFL_BMP_CEILF(ir * omr)) << ors);
-        SflBmpI32 tg = (((SflBmpU32)SFL_BMP_CEILF(ig * omg)) << ogs);
-        SflBmpI32 tb = (((SflBmpU32)SFL_BMP_CEILF(ib * omb)) << obs);
-        SflBmpI32 ta = (((SflBmpU32)SFL_BMP_CEILF(ia * oma)) << oas);
+    memset(stats, 0, sizeof(*stats));
+    if (!sfl_bmp__has_masks(desc->mask)) {
+        return;
+    }
 
-        SflBmpU32 pixel = tr | tg | tb | ta;
+    for (int c = 0; c < 4; ++c) {
+        const SflBmpU32 bits = sfl_bmp_bit_count(desc->mask[c]);
 
-        sfl_bmp__write_block(out, out_io, &pixel, sizeof(pixel));
-        bytes_processed += num_bytes;
+        conv->p_shift[c] = bits ? sfl_bmp_bit_scan_forward(desc->mask[c]) : 0;
+        conv->p_bits[c]  = bits;
+        if (bits > 8) {
+            continue;
+        }
 
-        if (bytes_processed == in->size) {
-            break;
+        for (SflBmpU32 v = 0; v < (1u << bits); ++v) {
+            conv->p_scale[c][v] =
+                (SflBmpU8)sfl_bmp__scale_component8(v, bits, 8, c == 3);
         }
     }
-    return 1;
+    conv->pixel_stats = stats;
 }
 
-static int sfl_bmp__fill_desc(SflBmpDesc* desc)
+/** Adds row y of desc, just decoded, to the statistics */
+static void sfl_bmp__pixel_stats_row(
+    const SflBmpConverter* conv, const SflBmpDesc* desc, SflBmpU32 y)
 {
-    sfl_bmp__bitmasks_from_pixel_format(desc->format, desc->mask);
+    SflBmpPixelStats* stats = conv->pixel_stats;
+    const SflBmpU8*   data  = (const SflBmpU8*)desc->data;
+    const SflBmpU8*   row   = data + (SflBmpUSize)y * desc->pitch;
+    const SflBmpU8*   planes[4];
+    SflBmpU32         value[4];
+
+    for (SflBmpU32 p = 0; p < conv->num_planes; ++p) {
+        planes[p] = data + desc->plane_offset[p] +
+                    (SflBmpUSize)y * desc->plane_pitch[p];
+    }
 
-    if (desc->attributes & SFL_BMP_ATTRIBUTE_PALETTIZED) {
-        SFL_BMP_UNIMPLEMENTED();
-        return 0;
-    } else {
-        int bpp = sfl_bmp__bpp_from_pixel_format(desc->format);
+    for (SflBmpU32 x = 0; x < desc->width; ++x) {
+        SflBmpU32 pixel = 0;
+        if (conv->num_planes) {
+            /* Plane p is byte p of the interleaved pixel */
+            for (SflBmpU32 p = 0; p < conv->num_planes; ++p) {
+                pixel |= (SflBmpU32)planes[p][x] << (p * 8);
+            }
+        } else {
+            pixel = sfl_bmp__load_pixel(row, x, desc->slice);
+        }
+
+        for (int c = 0; c < 4; ++c) {
+            const SflBmpU32 bits = conv->p_bits[c];
+            const SflBmpU32 v    = (SflBmpU32)(
+                (pixel >> conv->p_shift[c]) & ((((SflBmpU64)1) << bits) - 1));
+
+            value[c] = (bits <= 8)
+                           ? conv->p_scale[c][v]
+                           : sfl_bmp__scale_component(v, bits, 8, c == 3);
+            stats->histogram[c][value[c]]++;
+        }
 
-        desc->slice = bpp / 8;
-        desc->pitch = (SflBmpU32)SFL_BMP_CEILF((bpp * desc->width) / 32.f) * 4;
-        desc->size  = desc->pitch * desc->height;
+        const SflBmpU32 luma =
+            (54 * value[0] + 183 * value[1] + 19 * value[2] + 128) >> 8;
+        stats->histogram[SFL_BMP_CHANNEL_LUMA][luma]++;
     }
-    return 1;
+
+    stats->num_pixels += desc->width;
 }
 
-static int sfl_bmp_decode_extract(
-    SflBmpContext* ctx, SflBmpDesc* in, SflBmpDesc* out)
+/** Once every row is in, the ranges & alpha usage follow from histograms */
+static void sfl_bmp__pixel_stats_end(SflBmpPixelStats* stats)
 {
-    out->width             = in->width;
-    out->height            = in->height;
-    out->attributes        = 0;
-    out->table_offset      = 0;
-    out->table_entry_size  = 0;
-    out->num_table_entries = 0;
-    out->palette_data      = 0;
-    out->compression       = SFL_BMP_COMPRESSION_NONE;
-    out->pitch             = out->width * sizeof(SflBmpU32);
-    out->size              = out->pitch * out->height;
-    out->format            = SFL_BMP_PIXEL_FORMAT_R8G8B8A8;
-    out->data              = SFL_BMP_ALLOCATE(ctx, out->size);
-    sfl_bmp__bitmasks_from_pixel_format(out->format, out->mask);
-    SflBmpU32* data = (SflBmpU32*)out->data;
-
-    /* Amounts to shift each pixel value */
-    const SflBmpI32 rs = sfl_bmp_bit_scan_forward(in->mask[0]);
-    const SflBmpI32 gs = sfl_bmp_bit_scan_forward(in->mask[1]);
-    const SflBmpI32 bs = sfl_bmp_bit_scan_forward(in->mask[2]);
-    const SflBmpI32 as = sfl_bmp_bit_scan_forward(in->mask[3]);
+    if (!stats || stats->num_pixels == 0) {
+        return;
+    }
 
-    /* Amount of bits representing component */
-    const SflBmpI32 rc = sfl_bmp_bit_count(in->mask[0]);
-    const SflBmpI32 gc = sfl_bmp_bit_count(in->mask[1]);
-    const SflBmpI32 bc = sfl_bmp_bit_count(in->mask[2]);
-    const SflBmpI32 ac = sfl_bmp_bit_count(in->mask[3]);
+    for (int c = 0; c < SFL_BMP_CHANNEL_COUNT; ++c) {
+        const SflBmpU64* histogram = stats->histogram[c];
+        int              lo = 0, hi = 255;
 
-    /* Max value of each component */
-    const SflBmpReal mr = (SflBmpReal)(sfl_bmp_ipow(2, rc) - 1);
-    const SflBmpReal mg = (SflBmpReal)(sfl_bmp_ipow(2, gc) - 1);
-    const SflBmpReal mb = (SflBmpReal)(sfl_bmp_ipow(2, bc) - 1);
-    const SflBmpReal ma = (SflBmpReal)(sfl_bmp_ipow(2, ac) - 1);
+        while (histogram[lo] == 0) ++lo;
+        while (histogram[hi] == 0) --hi;
+        stats->min[c] = (SflBmpU8)lo;
+        stats->max[c] = (SflBmpU8)hi;
+    }
 
-    const SflBmpU32 skip = in->pitch - (in->width - in->slice);
+    const SflBmpU64* alpha = stats->histogram[SFL_BMP_CHANNEL_A];
+    if (alpha[255] == stats->num_pixels) {
+        stats->alpha = SFL_BMP_ALPHA_OPAQUE;
+    } else if (alpha[0] + alpha[255] == stats->num_pixels) {
+        stats->alpha = SFL_BMP_ALPHA_BINARY;
+    } else {
+        stats->alpha = SFL_BMP_ALPHA_TRANSLUCENT;
+    }
+}
+#endif
 
-    const int is_flipped = in->attributes & SFL_BMP_ATTRIBUTE_FLIPPED;
-    SFL_BMP_SEEK(ctx, in->offset, SFL_BMP_IO_SET);
+/**
+ * Clears the pixels of row y that the AND mask of an OS/2 icon or pointer
+ * leaves to the screen, which makes them transparent
+ */
+static void sfl_bmp__mask_row(
+    const SflBmpConverter* conv, SflBmpDesc* desc, SflBmpU32 y)
+{
+    const SflBmpU8* mask = conv->mask + (SflBmpUSize)y * conv->mask_pitch;
+    SflBmpU8*       data = (SflBmpU8*)desc->data;
 
-    for (int y = 0; y < in->height; ++y) {
-        for (int x = 0; x < in->height; ++x) {
-            SflBmpU32 pixel;
-            if (!SFL_BMP_READ(ctx, &pixel, in->slice)) {
-                goto EXIT_ERROR;
-            }
+    for (SflBmpU32 x = 0; x < desc->width; ++x) {
+        if (!(mask[x / 8] & (0x80 >> (x % 8)))) {
+            continue;
+        }
 
-            SflBmpReal r = (SflBmpReal)((pixel & in->mask[0]) >> rs);
-            SflBmpReal g = (SflBmpReal)((pixel & in->mask[1]) >> gs);
-            SflBmpReal b = (SflBmpReal)((pixel & in->mask[2]) >> bs);
-            SflBmpReal a = (SflBmpReal)((pixel & in->mask[3]) >> as);
+        if (conv->num_planes == 0) {
+            memset(data + (SflBmpUSize)y * desc->pitch +
+                       (SflBmpUSize)x * desc->slice,
+                   0,
+                   desc->slice);
+            continue;
+        }
 
-            /* Ternary op handles case where any of these components is zero */
-            SflBmpU32 cr =
-                (rc != 0) ? (SflBmpU32)SFL_BMP_CEILF((r / mr) * 255) : 0;
-            SflBmpU32 cg =
-                (gc != 0) ? (SflBmpU32)SFL_BMP_CEILF((g / mg) * 255) : 0;
-            SflBmpU32 cb =
-                (bc != 0) ? (SflBmpU32)SFL_BMP_CEILF((b / mb) * 255) : 0;
-            SflBmpU32 ca =
-                (ac != 0) ? (SflBmpU32)SFL_BMP_CEILF((a / ma) * 255) : 0;
+        for (SflBmpU32 p = 0; p < conv->num_planes; ++p) {
+            data[desc->plane_offset[p] +
+                 (SflBmpUSize)y * desc->plane_pitch[p] + x] = 0;
+        }
+    }
+}
 
-            if (in->mask[3] == 0) {
-                ca = 0xff;
-            }
+/**
+ * Converts row y of the output from in_row, interleaved or planar, zeroing
+ * the padding after it
+ */
+static void sfl_bmp__decode_row(
+    const SflBmpConverter* conv,
+    SflBmpDesc*            desc,
+    const SflBmpU8*        in_row,
+    SflBmpU32              y)
+{
+    SflBmpU8* data = (SflBmpU8*)desc->data;
 
-            SflBmpU32 pixel32 = (cr << 0) | (cg << 8) | (cb << 16) | (ca << 24);
+    if (conv->num_planes == 0) {
+        const SflBmpU32 row_size = desc->width * desc->slice;
+        SflBmpU8*       out_row  = data + (SflBmpUSize)y * desc->pitch;
 
-            if (is_flipped) {
-                data[(in->height - y - 1) * in->width + x] = pixel32;
-            } else {
-                data[y * in->width + x] = pixel32;
-            }
+        conv->convert_row(conv, in_row, out_row, desc->width, y);
+        memset(out_row + row_size, 0, desc->pitch - row_size);
+    } else {
+        SflBmpU8* planes[4];
+        for (SflBmpU32 p = 0; p < desc->num_planes; ++p) {
+            planes[p] = data + desc->plane_offset[p] +
+                        (SflBmpUSize)y * desc->plane_pitch[p];
         }
-        if (SFL_BMP_SEEK(ctx, (long)skip, SFL_BMP_IO_CUR)) {
-            goto EXIT_ERROR;
+
+        sfl_bmp__split_row(conv, in_row, planes, desc->width, y);
+        for (SflBmpU32 p = 0; p < desc->num_planes; ++p) {
+            memset(
+                planes[p] + desc->width, 0, desc->plane_pitch[p] - desc->width);
         }
     }
 
-    return 1;
-
-EXIT_ERROR:
-    return 0;
+    if (conv->mask) {
+        sfl_bmp__mask_row(conv, desc, y);
+    }
+#if SFL_BMP_PIXEL_STATS
+    if (conv->pixel_stats) {
+        sfl_bmp__pixel_stats_row(conv, desc, y);
+    }
+#endif
 }
 
-static int sfl_bmp_decode_extract_palettized(
-    SflBmpContext* ctx, SflBmpDesc* in, SflBmpDesc* out)
+/**
+ * sfl_bmp_probe, for an image whose file header is at base (within an OS/2
+ * bitmap array or icon). Offsets in desc are from the start of the file
+ */
+static int sfl_bmp__probe_at(
+    SflBmpContext* ctx, SflBmpU64 base, SflBmpDesc* desc)
 {
-    return 0;
-}
-
-static int sfl_bmp__check_nfo_compat(SflBmpDesc* desc);
+    SflBmpHdrID hdr_id = SFL_BMP_HDR_ID_NA;
+    SflBmpNfoID nfo_id = SFL_BMP_NFO_ID_NA;
+    SflBmpU16   bpp    = 0;
+    int         rc     = 0;
+    SFL_BMP__STAGE_DECLARE(probe_time);
+    SFL_BMP__STAGE_DECLARE(header_time);
 
-int sfl_bmp_encode(
-    SflBmpContext*          ctx,
-    SflBmpDesc*             in_desc,
-    SflBmpIOImplementation* in_io,
-    SflBmpDesc*             out_desc)
-{
-    out_desc->width           = in_desc->width;
-    out_desc->height          = in_desc->height;
-    out_desc->physical_width  = in_desc->physical_width;
-    out_desc->physical_height = in_desc->physical_height;
+    SFL_BMP__STAGE_BEGIN(ctx, SFL_BMP_STAGE_PROBE, probe_time);
+    SFL_BMP__STAGE_BEGIN(ctx, SFL_BMP_STAGE_HEADER, header_time);
 
-    /* @todo: Add actual checks for file header, for now it's only 'BM' */
-    if (!sfl_bmp__fill_desc(out_desc)) {
-        return 0;
+    /* Read in file header and determine file type */
+    SflBmpFileHeader file_header;
+    if ((base != 0 && SFL_BMP_SEEK(ctx, (SflBmpI64)base, SFL_BMP_IO_SET)) ||
+        !SFL_BMP_READ_STRUCT(SflBmpFileHeader, ctx, &file_header))
+    {
+        goto EXIT_PROC;
     }
 
-    /* Info Header compatibility */
-    sfl_bmp__check_nfo_compat(out_desc);
-
-    /* Write file header */
-    SflBmpFileHeader hdr;
-    int              nfo_size = sfl_bmp__nfo_size(out_desc->info_header_id);
-    if (nfo_size == -1) {
-        return 0;
+    hdr_id = sfl_bmp_get_hdr_id(file_header.hdr);
+    if (hdr_id == SFL_BMP_HDR_ID_NA) {
+        goto EXIT_PROC;
     }
-    const char* hdr_str = sfl_bmp__hdr_id_to_str(out_desc->file_header_id);
-    hdr.hdr[0]          = hdr_str[0];
-    hdr.hdr[1]          = hdr_str[1];
-    hdr.reserved[0]     = 0;
-    hdr.reserved[1]     = 0;
-    hdr.file_size       = sizeof(SflBmpFileHeader) + nfo_size + out_desc->size;
-    hdr.offset          = sizeof(SflBmpFileHeader) + nfo_size;
 
-    if (!SFL_BMP_WRITE(ctx, &hdr, sizeof(hdr))) {
-        return 0;
+    /* Read in  header size and get info header kind */
+    SflBmpU32 info_header_size;
+    if (!SFL_BMP_READ(ctx, &info_header_size, sizeof(info_header_size))) {
+        goto EXIT_PROC;
     }
 
-    /* Write info header */
-    int pfbpp = sfl_bmp__bpp_from_pixel_format(out_desc->format);
+    if (SFL_BMP_SEEK(
+            ctx, -(SflBmpI64)sizeof(info_header_size), SFL_BMP_IO_CUR))
+    {
+        goto EXIT_PROC;
+    }
 
-    switch (out_desc->info_header_id) {
-        default:
-        case SFL_BMP_NFO_ID_NA:
-        case SFL_BMP_NFO_ID_CORE:
-        case SFL_BMP_NFO_ID_OS22_V1:
-        case SFL_BMP_NFO_ID_OS22_V2:
-        case SFL_BMP_NFO_ID_V1:
-        case SFL_BMP_NFO_ID_V2:
-        case SFL_BMP_NFO_ID_V3:
-        case SFL_BMP_NFO_ID_V4:
-            return 0;
-        case SFL_BMP_NFO_ID_V5: {
-            SflBmpInfoHeader124 info;
-            info.size                 = sizeof(info);
-            info.width                = out_desc->width;
-            info.height               = out_desc->height;
-            info.planes               = 1;
-            info.bpp                  = pfbpp;
-            info.compression          = out_desc->compression;
-            info.raw_size             = out_desc->size;
-            info.hres                 = out_desc->physical_width;
-            info.vres                 = out_desc->physical_height;
-            info.num_colors           = 0;
-            info.num_important_colors = 0;
-            info.red_mask             = out_desc->mask[0];
-            info.green_mask           = out_desc->mask[1];
-            info.blue_mask            = out_desc->mask[2];
-            info.alpha_mask           = out_desc->mask[3];
-            /* @todo */
-            info.color_space          = SFL_BMP_COLORSPACE_SRGB;
-            info.endpoint_red[0]      = 0;
-            info.endpoint_red[1]      = 0;
-            info.endpoint_red[2]      = 0;
-            info.endpoint_green[0]    = 0;
-            info.endpoint_green[1]    = 0;
-            info.endpoint_green[2]    = 0;
-            info.endpoint_blue[0]     = 0;
-            info.endpoint_blue[1]     = 0;
-            info.endpoint_blue[2]     = 0;
-            info.gamma_red            = 0;
-            info.gamma_green          = 0;
-            info.gamma_blue           = 0;
-            info.intent               = SFL_BMP_INTENT_LCS_GM_IMAGES;
-            info.profile_data_offset  = 0;
-            info.profile_data_size    = 0;
+    nfo_id = sfl_bmp_get_nfo_id(info_header_size);
 
-            info.reserved = 0;
+    /* Set initial values for descriptor */
+    desc->data              = 0;
+    desc->attributes        = 0;
+    desc->offset            = file_header.offset;
+    desc->file_header_id    = hdr_id;
+    desc->info_header_id    = nfo_id;
+    desc->num_table_entries = 0;
+    desc->table_offset      = 0;
+    desc->physical_width    = 0;
+    desc->physical_height   = 0;
 
-            if (!SFL_BMP_WRITE(ctx, &info, sizeof(info))) {
-                return 0;
+    switch (nfo_id) {
+        case SFL_BMP_NFO_ID_CORE: {
+            SflBmpCoreHeader info_header;
+            if (!SFL_BMP_READ_STRUCT(SflBmpCoreHeader, ctx, &info_header)) {
+                goto EXIT_PROC;
             }
+
+            /* Dimensions are unsigned, so rows always go bottom to top */
+            desc->width       = info_header.width;
+            desc->height      = info_header.height;
+            desc->attributes |= SFL_BMP_ATTRIBUTE_FLIPPED;
+            desc->mask[3]     = 0;
+            desc->compression = SFL_BMP_COMPRESSION_NONE;
+            bpp               = info_header.bpp;
         } break;
-    }
 
-    /* @todo: palette table */
-    return sfl_bmp__convert(in_desc, in_io, out_desc, &ctx->io);
-}
+        case SFL_BMP_NFO_ID_OS22_V1:
+        case SFL_BMP_NFO_ID_OS22_V2: {
+            SflBmpInfoHeader064 info_header;
+            memset(&info_header, 0, sizeof(info_header));
+            if (!SFL_BMP_READ(ctx, &info_header, info_header_size)) {
+                goto EXIT_PROC;
+            }
 
-static int sfl_bmp__check_nfo_compat(SflBmpDesc* desc)
-{
-#define SFL_BMP_MUST(x)     \
-    do {                    \
-        if (!(x)) return 0; \
-    } while (0)
+            /* Same here, and compression 3 & 4 are OS/2's Huffman & RLE24 */
+            if (info_header.compression != SFL_BMP_COMPRESSION_NONE) {
+                goto EXIT_PROC;
+            }
+            desc->width             = info_header.width;
+            desc->height            = info_header.height;
+            desc->physical_width    = info_header.hres;
+            desc->physical_height   = info_header.vres;
+            desc->attributes       |= SFL_BMP_ATTRIBUTE_FLIPPED;
+            desc->mask[3]           = 0;
+            desc->num_table_entries = info_header.num_colors;
+            desc->compression       = SFL_BMP_COMPRESSION_NONE;
+            bpp                     = info_header.bpp;
+        } break;
 
-    switch (desc->info_header_id) {
-        case SFL_BMP_NFO_ID_NA:
-        case SFL_BMP_NFO_ID_CORE:
-        case SFL_BMP_NFO_ID_OS22_V1:
-        case SFL_BMP_NFO_ID_OS22_V2:
-        case SFL_BMP_NFO_ID_V1:
-        case SFL_BMP_NFO_ID_V2:
-        case SFL_BMP_NFO_ID_V3:
-        case SFL_BMP_NFO_ID_V4:
-        case SFL_BMP_NFO_ID_V5:
-            if (!sfl_bmp__is_compressed(desc)) {
-                if ((desc->format == SFL_BMP_PIXEL_FORMAT_B8G8R8X8) ||
-                    (desc->format == SFL_BMP_PIXEL_FORMAT_B5G5R5X1))
-                {
-                    SFL_BMP_MUST(desc->compression == SFL_BMP_COMPRESSION_NONE);
-                } else {
-                    SFL_BMP_MUST(
-                        desc->compression == SFL_BMP_COMPRESSION_BITFIELDS);
+        case SFL_BMP_NFO_ID_V1: {
+            SflBmpInfoHeader040 info_header;
+            if (!SFL_BMP_READ_STRUCT(SflBmpInfoHeader040, ctx, &info_header)) {
+                goto EXIT_PROC;
+            }
+
+            /* Its magnitude doesn't fit in 32 bits */
+            if (info_header.height == -0x7FFFFFFF - 1) {
+                goto EXIT_PROC;
+            }
+            desc->width           = info_header.width;
+            desc->height          = sfl_bmp_iabs(info_header.height);
+            desc->physical_width  = info_header.hres;
+            desc->physical_height = info_header.vres;
+
+            if (info_header.height > 0) {
+                desc->attributes |= SFL_BMP_ATTRIBUTE_FLIPPED;
+            }
+
+            /* v1 doesn't support alpha */
+            desc->mask[3] = 0;
+
+            /*
+            msdocs on BITMAPINFOHEADER say that these are the only
+            possible values
+            */
+            if (info_header.compression == SFL_BMP_COMPRESSION_BITFIELDS) {
+                /*
+                > Palette field contains three 4 byte color masks that specify
+                > the red, green, and blue components
+                From msdocs on BITMAPINFOHEADER
+                */
+
+                SflBmpU32 masks[3];
+                if (!SFL_BMP_READ(ctx, masks, sizeof(SflBmpU32) * 3)) {
+                    goto EXIT_PROC;
+                }
+
+                desc->mask[0] = masks[0];
+                desc->mask[1] = masks[1];
+                desc->mask[2] = masks[2];
+            } else if (info_header.compression != SFL_BMP_COMPRESSION_NONE) {
+                goto EXIT_PROC;
+            }
+            desc->num_table_entries = info_header.num_colors;
+            desc->compression       = info_header.compression;
+            bpp                     = info_header.bpp;
+        } break;
+
+        /*
+        Each of these is the one before it with more fields: V2 adds the RGB
+        masks, V3 the alpha mask, V4 the color space and V5 the profile. So
+        read as much as there is, and leave the rest 0
+        */
+        case SFL_BMP_NFO_ID_V2:
+        case SFL_BMP_NFO_ID_V3:
+        case SFL_BMP_NFO_ID_V4:
+        case SFL_BMP_NFO_ID_V5: {
+            SflBmpInfoHeader124 info_header;
+            memset(&info_header, 0, sizeof(info_header));
+            if (!SFL_BMP_READ(ctx, &info_header, info_header_size)) {
+                goto EXIT_PROC;
+            }
+
+            if (info_header.height == -0x7FFFFFFF - 1) {
+                goto EXIT_PROC;
+            }
+            desc->width           = info_header.width;
+            desc->height          = sfl_bmp_iabs(info_header.height);
+            desc->physical_width  = info_header.hres;
+            desc->physical_height = info_header.vres;
+
+            if (info_header.height > 0) {
+                desc->attributes |= SFL_BMP_ATTRIBUTE_FLIPPED;
+            }
+
+            desc->mask[0]           = info_header.red_mask;
+            desc->mask[1]           = info_header.green_mask;
+            desc->mask[2]           = info_header.blue_mask;
+            desc->mask[3]           = info_header.alpha_mask;
+            /*
+            @todo: technically, this is incorrect. Due to overlap with other
+            headers, # of palette entries are usually 4 with this header, which
+            includes the masks inside the struct decl. So, handle this, and
+            report the correct amount of entries in the palette
+            */
+            desc->num_table_entries = info_header.num_colors;
+            desc->compression = (SflBmpCompression)info_header.compression;
+            bpp               = info_header.bpp;
+        } break;
+
+        case SFL_BMP_NFO_ID_NA:
+        default:
+            break;
+    }
+
+    SFL_BMP__STAGE_END(ctx, SFL_BMP_STAGE_HEADER, header_time);
+
+    /* @todo: or ALPHA_BITFIELDS. Only V1 keeps its masks past the header */
+    desc->table_offset = base + sizeof(SflBmpFileHeader) + info_header_size;
+    if (desc->info_header_id == SFL_BMP_NFO_ID_V1 &&
+        desc->compression == SFL_BMP_COMPRESSION_BITFIELDS)
+    {
+        desc->table_offset += sizeof(SflBmpU32) * 3;
+    }
+
+    /* Core headers have RGBTRIPLE entries, the rest RGBQUAD ones */
+    if (desc->info_header_id == SFL_BMP_NFO_ID_CORE) {
+        desc->table_entry_size = 3;
+    } else {
+        desc->table_entry_size = 4;
+    }
+
+    /* Only whole images may be over 4GiB, scan-lines can't */
+    SflBmpU64 pitch;
+    pitch = sfl_bmp__pitch(bpp, desc->width);
+    if (pitch > 0xFFFFFFFFu) {
+        goto EXIT_PROC;
+    }
+
+    desc->pitch = (SflBmpU32)pitch;
+    desc->size  = pitch * desc->height;
+
+    /* If bits per pixel is <= 8, then the bitmap is always palettized */
+    switch (bpp) {
+        case 1:
+        case 4:
+        case 8: {
+            desc->attributes |= SFL_BMP_ATTRIBUTE_PALETTIZED;
+
+            if (desc->compression == SFL_BMP_COMPRESSION_RLE4) {
+                if (bpp != 4) {
+                    goto EXIT_PROC;
+                }
+            } else if (desc->compression == SFL_BMP_COMPRESSION_RLE8) {
+                if (bpp != 8) {
+                    goto EXIT_PROC;
                 }
+            }
+
+            desc->format = (bpp == 1)   ? SFL_BMP_PIXEL_FORMAT_I1
+                           : (bpp == 4) ? SFL_BMP_PIXEL_FORMAT_I4
+                                        : SFL_BMP_PIXEL_FORMAT_I8;
+        } break;
+
+        case 16: {
+            desc->slice = 2;
+            if (desc->compression == SFL_BMP_COMPRESSION_NONE) {
+                /*
+                @note: Documentation mentions that the most significant bit
+                isn't used in 16 bpp
+                */
+                desc->format = SFL_BMP_PIXEL_FORMAT_B5G5R5X1;
+                sfl_bmp__bitmasks_from_pixel_format(desc->format, desc->mask);
+            } else if (desc->compression == SFL_BMP_COMPRESSION_BITFIELDS) {
+                desc->format =
+                    sfl_bmp_decide_pixel_format_from_bitmasks(bpp, desc->mask);
+            } else {
+                goto EXIT_PROC;
+            }
+        } break;
+
+        case 24: {
+            desc->slice  = 3;
+            desc->format = SFL_BMP_PIXEL_FORMAT_B8G8R8;
+            if (desc->compression != SFL_BMP_COMPRESSION_NONE) {
+                goto EXIT_PROC;
+            }
+            sfl_bmp__bitmasks_from_pixel_format(desc->format, desc->mask);
+        } break;
+
+        case 32: {
+            desc->slice = 4;
+            if (desc->compression == SFL_BMP_COMPRESSION_BITFIELDS) {
+                desc->format =
+                    sfl_bmp_decide_pixel_format_from_bitmasks(bpp, desc->mask);
+            } else if (desc->compression == SFL_BMP_COMPRESSION_NONE) {
+                desc->format = SFL_BMP_PIXEL_FORMAT_B8G8R8X8;
+                sfl_bmp__bitmasks_from_pixel_format(desc->format, desc->mask);
             } else {
+                goto EXIT_PROC;
             }
+        } break;
+
+        default: {
+            goto EXIT_PROC;
+        } break;
+    }
+
+    rc = 1;
+EXIT_PROC:
+    SFL_BMP_SEEK(ctx, 0, SFL_BMP_IO_SET);
+    SFL_BMP__STAGE_END(ctx, SFL_BMP_STAGE_HEADER, header_time);
+    SFL_BMP__STAGE_END(ctx, SFL_BMP_STAGE_PROBE, probe_time);
+    return rc;
+}
+
+int sfl_bmp_probe(SflBmpContext* ctx, SflBmpDesc* desc)
+{
+    return sfl_bmp__probe_at(ctx, 0, desc);
+}
+
+/**
+ * Output format for sfl_bmp_decode when the caller didn't request one
+ */
+static int sfl_bmp__default_decode_format(SflBmpDesc* in)
+{
+#if SFL_BMP_ALWAYS_CONVERT
+    (void)in;
+    return SFL_BMP_PIXEL_FORMAT_R8G8B8A8;
+#else
+    if (sfl_bmp__format_index(in->format) != -1) {
+        return in->format;
+    }
+    return SFL_BMP_PIXEL_FORMAT_R8G8B8A8;
+#endif
+}
+
+/**
+ * sfl_bmp__converter_init, and for paletted input, reads the color table
+ * (through ctx's IO) and converts it to the output format
+ */
+static int sfl_bmp__decode_converter_init(
+    SflBmpContext* ctx, SflBmpConverter* conv, SflBmpDesc* in, SflBmpDesc* out)
+{
+    SflBmpU8        entries[256 * 4];
+    SflBmpU8        converted[256 * 4];
+    SflBmpDesc      entry_desc;
+    SflBmpConverter entry_conv;
+    SflBmpDesc*     palette_desc = out;
+    SflBmpU32       count;
+#if SFL_BMP_CUSTOM_PIXEL_FORMATS
+    SflBmpDesc rgba8;
+#endif
+    int             rc = 0;
+    SFL_BMP__STAGE_DECLARE(palette_time);
+
+    sfl_bmp__converter_init(conv, in, out);
+    if (!(in->attributes & SFL_BMP_ATTRIBUTE_PALETTIZED)) {
+        return 1;
+    }
+
+    conv->i_bpp = (SflBmpU32)sfl_bmp__bpp_from_pixel_format(in->format);
+#if SFL_BMP_CUSTOM_PIXEL_FORMATS
+    /* Indices go to R8G8B8A8 first, and the output kernel takes it after */
+    if (conv->custom_out) {
+        sfl_bmp__rgba8_desc(&rgba8);
+        palette_desc    = &rgba8;
+        conv->inner_row = sfl_bmp__convert_row_indexed;
+    } else
+#endif
+    {
+        conv->convert_row = sfl_bmp__convert_row_indexed;
+    }
+    memset(conv->palette, 0, sizeof(conv->palette));
+
+    /* No count means all of them, and indices can't reach past 2^bpp */
+    count = in->num_table_entries;
+    if (count == 0 || count > (1u << conv->i_bpp)) {
+        count = 1u << conv->i_bpp;
+    }
+
+    SFL_BMP__STAGE_BEGIN(ctx, SFL_BMP_STAGE_PALETTE, palette_time);
+
+    if (SFL_BMP_SEEK(ctx, in->table_offset, SFL_BMP_IO_SET) ||
+        !SFL_BMP_READ(ctx, entries, count * in->table_entry_size))
+    {
+        goto EXIT_PROC;
+    }
+
+    /* Entries are B8G8R8 with core headers, B8G8R8X8 otherwise */
+    memset(&entry_desc, 0, sizeof(entry_desc));
+    entry_desc.format = (in->table_entry_size == 3)
+                            ? SFL_BMP_PIXEL_FORMAT_B8G8R8
+                            : SFL_BMP_PIXEL_FORMAT_B8G8R8X8;
+    entry_desc.slice  = in->table_entry_size;
+    sfl_bmp__bitmasks_from_pixel_format(entry_desc.format, entry_desc.mask);
+
+    sfl_bmp__converter_init(&entry_conv, &entry_desc, palette_desc);
+    /* Each entry is a color of its own, so it's rounded, never dithered */
+    entry_conv.dither = 0;
+    entry_conv.convert_row(&entry_conv, entries, converted, count, 0);
+    for (SflBmpU32 i = 0; i < count; ++i) {
+        conv->palette[i] =
+            sfl_bmp__load_pixel(converted, i, palette_desc->slice);
+    }
+
+    rc = 1;
+EXIT_PROC:
+    SFL_BMP__STAGE_END(ctx, SFL_BMP_STAGE_PALETTE, palette_time);
+    return rc;
+}
+
+#if SFL_BMP_MIPMAPS
+/*
+Mip chain, built while decoding: as soon as both source rows of a row in the
+next level exist, that row is filtered, and so on down the chain, so every
+level is made from rows that were written a moment ago. Levels are halved
+(rounding down, never below 1), and filtered with a 2x2 box; an odd last
+column or row of a level is dropped, the way most GPUs do it
+*/
+
+/** sRGB to linear light, in 1/65535 */
+static const SflBmpU16 sfl_bmp__srgb_to_linear[256] = {
+    0, 20, 40, 60, 80, 99, 119, 139, 159, 179, 199, 219, 241, 264, 288, 313,
+    340, 367, 396, 427, 458, 491, 526, 562, 599, 637, 677, 718, 761, 805, 851,
+    898, 947, 997, 1048, 1101, 1156, 1212, 1270, 1330, 1391, 1453, 1517, 1583,
+    1651, 1720, 1790, 1863, 1937, 2013, 2090, 2170, 2250, 2333, 2418, 2504,
+    2592, 2681, 2773, 2866, 2961, 3058, 3157, 3258, 3360, 3464, 3570, 3678,
+    3788, 3900, 4014, 4129, 4247, 4366, 4488, 4611, 4736, 4864, 4993, 5124,
+    5257, 5392, 5530, 5669, 5810, 5953, 6099, 6246, 6395, 6547, 6700, 6856,
+    7014, 7174, 7335, 7500, 7666, 7834, 8004, 8177, 8352, 8528, 8708, 8889,
+    9072, 9258, 9445, 9635, 9828, 10022, 10219, 10417, 10619, 10822, 11028,
+    11235, 11446, 11658, 11873, 12090, 12309, 12530, 12754, 12980, 13209,
+    13440, 13673, 13909, 14146, 14387, 14629, 14874, 15122, 15371, 15623,
+    15878, 16135, 16394, 16656, 16920, 17187, 17456, 17727, 18001, 18277,
+    18556, 18837, 19121, 19407, 19696, 19987, 20281, 20577, 20876, 21177,
+    21481, 21787, 22096, 22407, 22721, 23038, 23357, 23678, 24002, 24329,
+    24658, 24990, 25325, 25662, 26001, 26344, 26688, 27036, 27386, 27739,
+    28094, 28452, 28813, 29176, 29542, 29911, 30282, 30656, 31033, 31412,
+    31794, 32179, 32567, 32957, 33350, 33745, 34143, 34544, 34948, 35355,
+    35764, 36176, 36591, 37008, 37429, 37852, 38278, 38706, 39138, 39572,
+    40009, 40449, 40891, 41337, 41785, 42236, 42690, 43147, 43606, 44069,
+    44534, 45002, 45473, 45947, 46423, 46903, 47385, 47871, 48359, 48850,
+    49344, 49841, 50341, 50844, 51349, 51858, 52369, 52884, 53401, 53921,
+    54445, 54971, 55500, 56032, 56567, 57105, 57646, 58190, 58737, 59287,
+    59840, 60396, 60955, 61517, 62082, 62650, 63221, 63795, 64372, 64952,
+    65535,
+};
+
+/**
+ * Linear light halfway between each sRGB value and the next, the sRGB value
+ * of a linear one is the number of these below it. The last is a sentinel
+ */
+static const SflBmpU16 sfl_bmp__linear_to_srgb_threshold[256] = {
+    10, 30, 50, 70, 90, 109, 129, 149, 169, 189, 209, 230, 252, 276, 300, 326,
+    353, 382, 411, 442, 475, 508, 543, 580, 618, 657, 697, 739, 783, 828, 874,
+    922, 971, 1022, 1075, 1129, 1184, 1241, 1300, 1360, 1422, 1485, 1550,
+    1617, 1685, 1755, 1826, 1900, 1975, 2051, 2130, 2210, 2292, 2375, 2460,
+    2547, 2636, 2727, 2819, 2914, 3010, 3107, 3207, 3309, 3412, 3517, 3624,
+    3733, 3844, 3957, 4071, 4188, 4306, 4427, 4549, 4673, 4800, 4928, 5058,
+    5190, 5325, 5461, 5599, 5739, 5881, 6026, 6172, 6320, 6471, 6623, 6778,
+    6935, 7093, 7254, 7417, 7582, 7750, 7919, 8090, 8264, 8440, 8618, 8798,
+    8980, 9165, 9351, 9540, 9731, 9925, 10120, 10318, 10518, 10720, 10924,
+    11131, 11340, 11551, 11765, 11981, 12199, 12419, 12642, 12867, 13094,
+    13324, 13556, 13790, 14027, 14266, 14508, 14751, 14998, 15246, 15497,
+    15750, 16006, 16264, 16525, 16788, 17053, 17321, 17591, 17864, 18139,
+    18416, 18696, 18979, 19264, 19551, 19841, 20134, 20429, 20726, 21026,
+    21329, 21634, 21941, 22251, 22564, 22879, 23197, 23517, 23840, 24165,
+    24493, 24824, 25157, 25493, 25831, 26172, 26516, 26862, 27211, 27562,
+    27916, 28273, 28632, 28994, 29359, 29726, 30096, 30469, 30844, 31222,
+    31603, 31986, 32372, 32761, 33153, 33547, 33944, 34344, 34746, 35151,
+    35559, 35970, 36383, 36799, 37218, 37640, 38064, 38492, 38922, 39354,
+    39790, 40228, 40670, 41114, 41560, 42010, 42463, 42918, 43376, 43837,
+    44301, 44768, 45237, 45709, 46185, 46663, 47144, 47628, 48114, 48604,
+    49097, 49592, 50091, 50592, 51096, 51603, 52113, 52626, 53142, 53661,
+    54183, 54707, 55235, 55766, 56299, 56836, 57375, 57918, 58463, 59012,
+    59563, 60118, 60675, 61235, 61799, 62365, 62935, 63507, 64083, 64661,
+    65243, 65535,
+};
+
+/** Entries of the linear to sRGB table, one per 16 linear values */
+#define SFL_BMP__MIP_SRGB_ENTRIES 4096
+
+/** Width or height of a level */
+static inline SflBmpU32 sfl_bmp__level_extent(SflBmpU32 extent, SflBmpU32 level)
+{
+    /* 64 bits, so that level 32 shifts everything out */
+    const SflBmpU32 result = (SflBmpU32)((SflBmpU64)extent >> level);
+    return result ? result : 1;
+}
+
+/**
+ * Lays out the mip chain of desc after level 0, which fill_desc already
+ * did. Only formats with 8 bit components can be filtered
+ */
+static int sfl_bmp__mip_layout(SflBmpDesc* desc)
+{
+    desc->num_levels      = 1;
+    desc->level_offset[0] = 0;
+    desc->level_pitch[0]  = desc->pitch;
+
+    if (!(desc->attributes & SFL_BMP_ATTRIBUTE_MIPMAPPED)) {
+        return 1;
+    }
+
+    /* Levels are filtered as interleaved pixels */
+    if (desc->attributes & SFL_BMP_ATTRIBUTE_PLANAR) {
+        return 0;
+    }
+
+    switch (desc->format) {
+        case SFL_BMP_PIXEL_FORMAT_B8G8R8A8:
+        case SFL_BMP_PIXEL_FORMAT_R8G8B8A8:
+        case SFL_BMP_PIXEL_FORMAT_B8G8R8X8:
+        case SFL_BMP_PIXEL_FORMAT_B8G8R8:
             break;
+        default:
+            return 0;
+    }
+
+    const SflBmpU32 bpp = desc->slice * 8;
+    SflBmpU64       size = desc->size;
+    SflBmpU32       level = 1;
+
+    /*
+    Levels are narrower than level 0, so their pitches fit too. A 32 bit
+    extent takes at most SFL_BMP_MAX_LEVELS levels to get down to 1
+    */
+    while (level < SFL_BMP_MAX_LEVELS &&
+           (((SflBmpU64)desc->width >> level) ||
+            ((SflBmpU64)desc->height >> level)))
+    {
+        const SflBmpU64 pitch =
+            sfl_bmp__pitch(bpp, sfl_bmp__level_extent(desc->width, level));
+
+        desc->level_offset[level] = size;
+        desc->level_pitch[level]  = (SflBmpU32)pitch;
+        size += pitch * sfl_bmp__level_extent(desc->height, level);
+        level++;
     }
 
+    desc->num_levels = level;
+    desc->size       = size;
     return 1;
-#undef SFL_BMP_MUST
 }
 
-static int sfl_bmp_extract(
-    SflBmpContext* ctx, SflBmpDecodeSettings* settings, SflBmpDesc* desc)
+/** Rounded average of the four pixels, two 8 bit components per lane */
+static inline SflBmpU32 sfl_bmp__average4(
+    SflBmpU32 a, SflBmpU32 b, SflBmpU32 c, SflBmpU32 d)
+{
+    const SflBmpU32 m  = 0x00FF00FF;
+    const SflBmpU32 lo = (a & m) + (b & m) + (c & m) + (d & m) + 0x00020002;
+    const SflBmpU32 hi = ((a >> 8) & m) + ((b >> 8) & m) + ((c >> 8) & m) +
+                         ((d >> 8) & m) + 0x00020002;
+    return ((lo >> 2) & m) | (((hi >> 2) & m) << 8);
+}
+
+/** Averages 2x2 blocks of src0 and src1 into width pixels of dst */
+static void sfl_bmp__mip_row_box4(
+    const SflBmpU8* SFL_BMP__RESTRICT src0,
+    const SflBmpU8* SFL_BMP__RESTRICT src1,
+    SflBmpU8* SFL_BMP__RESTRICT       dst,
+    SflBmpU32                         width)
+{
+    for (SflBmpUSize x = 0; x < width; ++x) {
+        SflBmpU32 a, b, c, d;
+        memcpy(&a, src0 + x * 8, 4);
+        memcpy(&b, src0 + x * 8 + 4, 4);
+        memcpy(&c, src1 + x * 8, 4);
+        memcpy(&d, src1 + x * 8 + 4, 4);
+
+        const SflBmpU32 average = sfl_bmp__average4(a, b, c, d);
+        memcpy(dst + x * 4, &average, 4);
+    }
+}
+
+/** Same, for 3 byte pixels */
+static void sfl_bmp__mip_row_box3(
+    const SflBmpU8* SFL_BMP__RESTRICT src0,
+    const SflBmpU8* SFL_BMP__RESTRICT src1,
+    SflBmpU8* SFL_BMP__RESTRICT       dst,
+    SflBmpU32                         width)
+{
+    for (SflBmpUSize x = 0; x < width * 3; x += 3) {
+        const SflBmpUSize i = x * 2;
+        for (SflBmpUSize c = 0; c < 3; ++c) {
+            dst[x + c] = (SflBmpU8)((src0[i + c] + src0[i + 3 + c] +
+                                     src1[i + c] + src1[i + 3 + c] + 2) >>
+                                    2);
+        }
+    }
+}
+
+/**
+ * sRGB value of every 16th linear value. Midpoints are at least 20 apart,
+ * so the sRGB value of any linear one is at most one more than the entry
+ * for its group of 16
+ */
+static void sfl_bmp__mip_srgb_init(SflBmpU8* to_srgb)
+{
+    SflBmpU32 value = 0;
+    for (SflBmpU32 i = 0; i < SFL_BMP__MIP_SRGB_ENTRIES; ++i) {
+        while (sfl_bmp__linear_to_srgb_threshold[value] < i * 16) {
+            value++;
+        }
+        to_srgb[i] = (SflBmpU8)value;
+    }
+}
+
+/** Averages 2x2 blocks in linear light, a fourth component is alpha */
+static inline void sfl_bmp__mip_row_srgb(
+    const SflBmpU8* SFL_BMP__RESTRICT src0,
+    const SflBmpU8* SFL_BMP__RESTRICT src1,
+    SflBmpU8* SFL_BMP__RESTRICT       dst,
+    SflBmpU32                         width,
+    SflBmpUSize                       slice,
+    const SflBmpU8*                   to_srgb)
+{
+    const SflBmpU16* to_linear = sfl_bmp__srgb_to_linear;
+    const SflBmpU16* threshold = sfl_bmp__linear_to_srgb_threshold;
+
+    for (SflBmpUSize x = 0; x < width; ++x) {
+        const SflBmpUSize i = x * 2 * slice;
+        for (SflBmpUSize c = 0; c < 3; ++c) {
+            const SflBmpU32 linear =
+                (to_linear[src0[i + c]] + to_linear[src0[i + slice + c]] +
+                 to_linear[src1[i + c]] + to_linear[src1[i + slice + c]] + 2) >>
+                2;
+
+            const SflBmpU32 value = to_srgb[linear >> 4];
+            dst[x * slice + c] =
+                (SflBmpU8)(value + (threshold[value] < linear));
+        }
+
+        if (slice == 4) {
+            dst[x * 4 + 3] = (SflBmpU8)((src0[i + 3] + src0[i + 7] +
+                                         src1[i + 3] + src1[i + 7] + 2) >>
+                                        2);
+        }
+    }
+}
+
+/**
+ * Called once row y of level 0 is written, fills every row further down the
+ * chain that it completes. to_srgb is only needed for SFL_BMP_ATTRIBUTE_SRGB
+ */
+static void sfl_bmp__mip_cascade(
+    SflBmpDesc* desc, const SflBmpU8* to_srgb, SflBmpU32 y)
+{
+    const SflBmpUSize slice = desc->slice;
+    const int         srgb  = desc->attributes & SFL_BMP_ATTRIBUTE_SRGB;
+
+    for (SflBmpU32 level = 1; level < desc->num_levels; ++level) {
+        const SflBmpU32 src_width =
+            sfl_bmp__level_extent(desc->width, level - 1);
+        const SflBmpU32 src_height =
+            sfl_bmp__level_extent(desc->height, level - 1);
+        const SflBmpU32 width  = sfl_bmp__level_extent(desc->width, level);
+        const SflBmpU32 height = sfl_bmp__level_extent(desc->height, level);
+        const SflBmpU32 dst_y  = y >> 1;
+        const SflBmpU32 last_y =
+            (dst_y * 2 + 1 < src_height) ? dst_y * 2 + 1 : src_height - 1;
+
+        /* Waiting on the second row, or past what this level keeps */
+        if (dst_y >= height || y != last_y) {
+            return;
+        }
+
+        const SflBmpU32 src_pitch = desc->level_pitch[level - 1];
+        const SflBmpU32 pitch     = desc->level_pitch[level];
+        const SflBmpU8* src       = (const SflBmpU8*)desc->data +
+                              desc->level_offset[level - 1];
+        SflBmpU8* dst = (SflBmpU8*)desc->data + desc->level_offset[level] +
+                        (SflBmpUSize)dst_y * pitch;
+
+        const SflBmpU8* src0 = src + (SflBmpUSize)(dst_y * 2) * src_pitch;
+        const SflBmpU8* src1 = src + (SflBmpUSize)y * src_pitch;
+
+        /* A level one pixel wide averages each pixel with itself */
+        SflBmpU8 column[2][8];
+        if (src_width == 1) {
+            memcpy(column[0], src0, slice);
+            memcpy(column[0] + slice, src0, slice);
+            memcpy(column[1], src1, slice);
+            memcpy(column[1] + slice, src1, slice);
+            src0 = column[0];
+            src1 = column[1];
+        }
+
+        if (srgb && slice == 4) {
+            sfl_bmp__mip_row_srgb(src0, src1, dst, width, 4, to_srgb);
+        } else if (srgb) {
+            sfl_bmp__mip_row_srgb(src0, src1, dst, width, 3, to_srgb);
+        } else if (slice == 4) {
+            sfl_bmp__mip_row_box4(src0, src1, dst, width);
+        } else {
+            sfl_bmp__mip_row_box3(src0, src1, dst, width);
+        }
+        memset(dst + width * slice, 0, pitch - width * slice);
+
+        y = dst_y;
+    }
+}
+
+/* SFL_BMP_MIPMAPS */
+#endif
+
+/**
+ * Lays out planar output (SFL_BMP_ATTRIBUTE_PLANAR): one plane of bytes for
+ * each byte of an output pixel, one after the other
+ */
+static int sfl_bmp__planar_layout(SflBmpDesc* desc)
+{
+    desc->num_planes      = 1;
+    desc->plane_offset[0] = 0;
+    desc->plane_pitch[0]  = desc->pitch;
+
+    if (!(desc->attributes & SFL_BMP_ATTRIBUTE_PLANAR)) {
+        return 1;
+    }
+
+    switch (desc->format) {
+        case SFL_BMP_PIXEL_FORMAT_B8G8R8A8:
+        case SFL_BMP_PIXEL_FORMAT_R8G8B8A8:
+        case SFL_BMP_PIXEL_FORMAT_B8G8R8X8:
+        case SFL_BMP_PIXEL_FORMAT_B8G8R8:
+            break;
+        default:
+            return 0;
+    }
+
+    /* A plane's pitch is at most the interleaved one */
+    const SflBmpU32 pitch = (SflBmpU32)sfl_bmp__pitch(8, desc->width);
+    const SflBmpU64 plane = (SflBmpU64)pitch * desc->height;
+
+    desc->num_planes = desc->slice;
+    for (SflBmpU32 p = 0; p < desc->num_planes; ++p) {
+        desc->plane_offset[p] = p * plane;
+        desc->plane_pitch[p]  = pitch;
+    }
+    desc->pitch = pitch;
+    desc->size  = plane * desc->slice;
+    return 1;
+}
+
+/** What the caller may ask for on the output descriptor of a decode */
+#if SFL_BMP_MIPMAPS
+#define SFL_BMP__DECODE_ATTRIBUTES                                            \
+    (SFL_BMP_ATTRIBUTE_DITHERED | SFL_BMP_ATTRIBUTE_PLANAR |                  \
+     SFL_BMP_ATTRIBUTE_MIPMAPPED | SFL_BMP_ATTRIBUTE_SRGB)
+#else
+#define SFL_BMP__DECODE_ATTRIBUTES                                            \
+    (SFL_BMP_ATTRIBUTE_DITHERED | SFL_BMP_ATTRIBUTE_PLANAR)
+#endif
+
+/** Whether what probe found (in) is within the context's limits, and can be
+ *  decoded at all */
+static int sfl_bmp__decodable(SflBmpContext* ctx, SflBmpDesc* in)
+{
+    SflBmpLimits* limits = ctx->limits;
+    if (limits && ((limits->max_width && in->width > limits->max_width) ||
+                   (limits->max_height && in->height > limits->max_height)))
+    {
+        return 0;
+    }
+
+    if ((in->attributes & SFL_BMP_ATTRIBUTE_PALETTIZED) &&
+        in->compression != SFL_BMP_COMPRESSION_NONE)
+    {
+        SFL_BMP_UNIMPLEMENTED();
+        return 0;
+    }
+
+    return 1;
+}
+
+/**
+ * Fills desc (the output) from what probe found (in). Fails if the image is
+ * over the context's limits, or if the output and a scan-line of input
+ * wouldn't fit in its memory budget
+ */
+static int sfl_bmp__decode_layout(
+    SflBmpContext* ctx, SflBmpDesc* in, SflBmpDesc* desc)
+{
+    if (!sfl_bmp__decodable(ctx, in)) {
+        return 0;
+    }
+
+    if (desc->format == SFL_BMP_PIXEL_FORMAT_UNRECOGNIZED) {
+        desc->format = sfl_bmp__default_decode_format(in);
+    }
+
+    if (sfl_bmp__bpp_from_pixel_format(desc->format) <= 0) {
+        return 0;
+    }
+
+    desc->width             = in->width;
+    desc->height            = in->height;
+    desc->physical_width    = in->physical_width;
+    desc->physical_height   = in->physical_height;
+    desc->file_header_id    = in->file_header_id;
+    desc->info_header_id    = in->info_header_id;
+    desc->attributes        = (in->attributes & SFL_BMP_ATTRIBUTE_FLIPPED) |
+                              (desc->attributes & SFL_BMP__DECODE_ATTRIBUTES);
+    desc->compression       = SFL_BMP_COMPRESSION_NONE;
+    desc->palette_data      = 0;
+    desc->offset            = 0;
+    desc->table_offset      = 0;
+    desc->num_table_entries = 0;
+    desc->table_entry_size  = 0;
+#if SFL_BMP_HASH
+    desc->file_hash         = 0;
+    desc->data_hash         = 0;
+#endif
+
+    if (!sfl_bmp__fill_desc(desc) || !sfl_bmp__planar_layout(desc)) {
+        return 0;
+    }
+
+#if SFL_BMP_MIPMAPS
+    if (!sfl_bmp__mip_layout(desc)) {
+        return 0;
+    }
+#endif
+
+    /* Unlike the file, the output has to fit in memory */
+    return sfl_bmp__addressable(desc->size + in->pitch) &&
+           sfl_bmp__within_budget(
+               ctx, (SflBmpUSize)desc->size + in->pitch);
+}
+
+/**
+ * Reads the pixel data that probe found (in) and converts it into desc->data,
+ * which is already allocated. Pixels come from source if the data could be
+ * peeked at, and are read through row (in->pitch bytes) otherwise
+ */
+static int sfl_bmp__decode_pixels(
+    SflBmpContext*   ctx,
+    SflBmpDesc*      in,
+    SflBmpDesc*      desc,
+    SflBmpConverter* conv,
+    const SflBmpU8*  source,
+    SflBmpU8*        row)
+{
+#if SFL_BMP_HASH
+    SflBmpHash file_hash, data_hash;
+#endif
+#if SFL_BMP_MIPMAPS
+    SflBmpU8 to_srgb[SFL_BMP__MIP_SRGB_ENTRIES];
+#endif
+    int rc = 0;
+    SFL_BMP__STAGE_DECLARE(convert_time);
+    if (!source && SFL_BMP_SEEK(ctx, in->offset, SFL_BMP_IO_SET)) {
+        return 0;
+    }
+
+    SFL_BMP__STAGE_BEGIN(ctx, SFL_BMP_STAGE_CONVERT, convert_time);
+#if SFL_BMP_HASH
+    sfl_bmp__hash_init(&file_hash);
+    sfl_bmp__hash_init(&data_hash);
+#endif
+#if SFL_BMP_MIPMAPS
+    if (desc->attributes & SFL_BMP_ATTRIBUTE_SRGB) {
+        sfl_bmp__mip_srgb_init(to_srgb);
+    }
+#endif
+#if SFL_BMP_PIXEL_STATS
+    sfl_bmp__pixel_stats_begin(conv, ctx->pixel_stats, desc);
+#endif
+
+    for (SflBmpU32 y = 0; y < desc->height; ++y) {
+        const SflBmpU8* in_row;
+
+        if (source) {
+            in_row = source + (SflBmpUSize)y * in->pitch;
+        } else if (SFL_BMP_READ(ctx, row, in->pitch)) {
+            in_row = row;
+        } else {
+            goto EXIT_PROC;
+        }
+
+        sfl_bmp__decode_row(conv, desc, in_row, y);
+#if SFL_BMP_HASH
+        /* Both rows are still in cache, hashing them here is nearly free */
+        sfl_bmp__hash_update(&file_hash, in_row, in->pitch);
+        if (!conv->num_planes) {
+            sfl_bmp__hash_update(
+                &data_hash,
+                (SflBmpU8*)desc->data + (SflBmpUSize)y * desc->pitch,
+                desc->pitch);
+        }
+#endif
+#if SFL_BMP_MIPMAPS
+        sfl_bmp__mip_cascade(desc, to_srgb, y);
+#endif
+    }
+
+#if SFL_BMP_HASH
+    /* Planes aren't done until the last row, so they're hashed after it */
+    if (conv->num_planes) {
+        sfl_bmp__hash_update(
+            &data_hash, desc->data, (SflBmpUSize)desc->size);
+    }
+    desc->file_hash = sfl_bmp__hash_final(&file_hash);
+    desc->data_hash = sfl_bmp__hash_final(&data_hash);
+#endif
+#if SFL_BMP_PIXEL_STATS
+    sfl_bmp__pixel_stats_end(conv->pixel_stats);
+#endif
+    rc = 1;
+EXIT_PROC:
+    SFL_BMP__STAGE_END(ctx, SFL_BMP_STAGE_CONVERT, convert_time);
+    return rc;
+}
+
+/**
+ * sfl_bmp_decode, of what probe found (intermediate_desc), with the AND mask
+ * of an icon or pointer applied if there is one
+ */
+static int sfl_bmp__decode_probed(
+    SflBmpContext*    ctx,
+    const SflBmpDesc* probed,
+    SflBmpDesc*       desc,
+    const SflBmpU8*   mask,
+    SflBmpU32         mask_pitch)
+{
+    SflBmpDesc intermediate_desc = *probed;
+    if (!sfl_bmp__decode_layout(ctx, &intermediate_desc, desc)) {
+        return 0;
+    }
+
+    SflBmpConverter conv;
+    if (!sfl_bmp__decode_converter_init(ctx, &conv, &intermediate_desc, desc)) {
+        return 0;
+    }
+    conv.mask       = mask;
+    conv.mask_pitch = mask_pitch;
+
+    desc->data = SFL_BMP_ALLOCATE(ctx, (SflBmpUSize)desc->size);
+    if (!desc->data) {
+        return 0;
+    }
+
+    /* Pixel data that can be peeked at needs no scan-line of its own */
+    SflBmpU8*       row    = 0;
+    const SflBmpU8* source = sfl_bmp__peek(
+        ctx,
+        &ctx->io,
+        intermediate_desc.offset,
+        (SflBmpU64)intermediate_desc.pitch * intermediate_desc.height);
+    if (!source) {
+        row = (SflBmpU8*)SFL_BMP_ALLOCATE(ctx, intermediate_desc.pitch);
+        if (!row) {
+            goto EXIT_ERROR;
+        }
+    }
+
+    if (!sfl_bmp__decode_pixels(
+            ctx, &intermediate_desc, desc, &conv, source, row))
+    {
+        goto EXIT_ERROR;
+    }
+
+    if (row) {
+        SFL_BMP_RELEASE(ctx, row, intermediate_desc.pitch);
+    }
+    sfl_bmp__disown(ctx, (SflBmpUSize)desc->size);
+    return 1;
+
+EXIT_ERROR:
+    if (row) {
+        SFL_BMP_RELEASE(ctx, row, intermediate_desc.pitch);
+    }
+    SFL_BMP_RELEASE(ctx, desc->data, (SflBmpUSize)desc->size);
+    desc->data = 0;
+    return 0;
+}
+
+int sfl_bmp_decode(SflBmpContext* ctx, SflBmpDesc* desc)
+{
+    SflBmpDesc intermediate_desc;
+    if (!sfl_bmp_probe(ctx, &intermediate_desc)) {
+        return 0;
+    }
+
+    return sfl_bmp__decode_probed(ctx, &intermediate_desc, desc, 0, 0);
+}
+
+/*
+OS/2 containers: a bitmap array (BA) is a list of array headers, each followed
+by an image, which is either a plain bitmap (BM) or an icon or pointer. Those
+hold a 1 bpp bitmap twice the image's height, with the AND mask in its first
+rows and the XOR mask after; color ones (CI, CP) follow it with a second file
+header, for the color bitmap that takes the XOR mask's place. Every offset is
+from the start of the file
+*/
+
+/**
+ * Probes the image whose file header is at offset, and for icons & pointers
+ * the bitmap that holds its AND mask (into mask). Returns 0 if it's none of
+ * those
+ */
+static int sfl_bmp__probe_image(
+    SflBmpContext* ctx, SflBmpU64 offset, SflBmpDesc* desc, SflBmpDesc* mask)
+{
+    /* Images may be decoded in any order, so the stream could be anywhere */
+    if (SFL_BMP_SEEK(ctx, (SflBmpI64)offset, SFL_BMP_IO_SET) ||
+        !sfl_bmp__probe_at(ctx, offset, desc))
+    {
+        return 0;
+    }
+
+    switch (desc->file_header_id) {
+        case SFL_BMP_HDR_ID_BM: {
+            *mask = *desc;
+            return 1;
+        }
+
+        case SFL_BMP_HDR_ID_IC:
+        case SFL_BMP_HDR_ID_PT: {
+            /* The XOR mask is the image, 1 bpp with its own palette */
+            *mask = *desc;
+            desc->height /= 2;
+            desc->offset += (SflBmpU64)desc->pitch * desc->height;
+            desc->size = (SflBmpU64)desc->pitch * desc->height;
+        } break;
+
+        case SFL_BMP_HDR_ID_CI:
+        case SFL_BMP_HDR_ID_CP: {
+            *mask = *desc;
+            const SflBmpU64 color = mask->table_offset +
+                                    (SflBmpU64)2 * mask->table_entry_size;
+            if (!sfl_bmp__probe_at(ctx, color, desc) ||
+                desc->file_header_id != mask->file_header_id)
+            {
+                return 0;
+            }
+        } break;
+
+        default:
+            return 0;
+    }
+
+    return mask->format == SFL_BMP_PIXEL_FORMAT_I1 &&
+           mask->width == desc->width && mask->height == desc->height * 2;
+}
+
+/** Fills image from the image whose file header is at offset */
+static int sfl_bmp__index_image(
+    SflBmpContext* ctx, SflBmpU64 offset, SflBmpImageInfo* image)
+{
+    SflBmpFileHeader file_header;
+    SflBmpDesc       desc, mask;
+
+    /* Probing leaves the stream at the start, so it goes first */
+    if (!sfl_bmp__probe_image(ctx, offset, &desc, &mask) ||
+        SFL_BMP_SEEK(ctx, (SflBmpI64)offset, SFL_BMP_IO_SET) ||
+        !SFL_BMP_READ_STRUCT(SflBmpFileHeader, ctx, &file_header))
+    {
+        return 0;
+    }
+
+    image->type        = desc.file_header_id;
+    image->width       = desc.width;
+    image->height      = desc.height;
+    image->bpp         = (SflBmpU32)sfl_bmp__bpp_from_pixel_format(desc.format);
+    image->offset      = offset;
+    image->data_offset = desc.offset;
+    image->hotspot_x   = (SflBmpI16)file_header.reserved[0];
+    image->hotspot_y   = (SflBmpI16)file_header.reserved[1];
+    return 1;
+}
+
+SflBmpU32 sfl_bmp_index(
+    SflBmpContext* ctx, SflBmpImageInfo* images, SflBmpU32 max_images)
+{
+    SflBmpArrayHeader array;
+    SflBmpImageInfo   image;
+    SflBmpU64         offset = 0;
+    SflBmpU32         count  = 0;
+
+    if (!SFL_BMP_READ_STRUCT(SflBmpArrayHeader, ctx, &array)) {
+        goto EXIT_PROC;
+    }
+
+    if (sfl_bmp_get_hdr_id(array.hdr) != SFL_BMP_HDR_ID_BA) {
+        memset(&image, 0, sizeof(image));
+        if (sfl_bmp__index_image(ctx, 0, &image)) {
+            if (max_images > 0) {
+                images[0] = image;
+            }
+            count = 1;
+        }
+        goto EXIT_PROC;
+    }
+
+    for (;;) {
+        memset(&image, 0, sizeof(image));
+        if (!sfl_bmp__index_image(ctx, offset + sizeof(array), &image)) {
+            count = 0;
+            goto EXIT_PROC;
+        }
+
+        image.display_width  = array.display_width;
+        image.display_height = array.display_height;
+        if (count < max_images) {
+            images[count] = image;
+        }
+        count++;
+
+        /* Only forward, so that a bad chain can't loop */
+        if (array.next == 0) {
+            break;
+        }
+
+        if (array.next <= offset) {
+            count = 0;
+            goto EXIT_PROC;
+        }
+
+        offset = array.next;
+        if (SFL_BMP_SEEK(ctx, (SflBmpI64)offset, SFL_BMP_IO_SET) ||
+            !SFL_BMP_READ_STRUCT(SflBmpArrayHeader, ctx, &array) ||
+            sfl_bmp_get_hdr_id(array.hdr) != SFL_BMP_HDR_ID_BA)
+        {
+            count = 0;
+            goto EXIT_PROC;
+        }
+    }
+
+EXIT_PROC:
+    SFL_BMP_SEEK(ctx, 0, SFL_BMP_IO_SET);
+    return count;
+}
+
+int sfl_bmp_decode_image(
+    SflBmpContext* ctx, const SflBmpImageInfo* image, SflBmpDesc* desc)
+{
+    SflBmpDesc in, mask_desc;
+    SflBmpU8*  mask      = 0;
+    SflBmpU64  mask_size = 0;
+    int        rc        = 0;
+
+    if (!sfl_bmp__probe_image(ctx, image->offset, &in, &mask_desc)) {
+        return 0;
+    }
+
+    if (in.file_header_id == SFL_BMP_HDR_ID_BM) {
+        return sfl_bmp__decode_probed(ctx, &in, desc, 0, 0);
+    }
+
+    /* The AND mask is the first half of its bitmap */
+    mask_size = (SflBmpU64)mask_desc.pitch * in.height;
+    if (!sfl_bmp__addressable(mask_size) ||
+        !sfl_bmp__within_budget(ctx, (SflBmpUSize)mask_size))
+    {
+        return 0;
+    }
+
+    mask = (SflBmpU8*)SFL_BMP_ALLOCATE(ctx, (SflBmpUSize)mask_size);
+    if (!mask) {
+        return 0;
+    }
+
+    if (!SFL_BMP_SEEK(ctx, (SflBmpI64)mask_desc.offset, SFL_BMP_IO_SET) &&
+        SFL_BMP_READ(ctx, mask, (SflBmpUSize)mask_size))
+    {
+        rc = sfl_bmp__decode_probed(ctx, &in, desc, mask, mask_desc.pitch);
+    }
+
+    SFL_BMP_RELEASE(ctx, mask, (SflBmpUSize)mask_size);
+    return rc;
+}
+
+/** The bytes buffered so far, noting when probe wanted more than that */
+typedef struct {
+    SflBmpIOImplementationMemory mem;
+    int                          starved;
+} SflBmpDecoderSource;
+
+static PROC_SFL_BMP_IO_READ(sfl_bmp__decoder_read)
+{
+    SflBmpDecoderSource* source = (SflBmpDecoderSource*)usr;
+    if (!sfl_bmp_memory_read(&source->mem, ptr, size)) {
+        source->starved = 1;
+        return 0;
+    }
+    return 1;
+}
+
+static PROC_SFL_BMP_IO_SEEK(sfl_bmp__decoder_seek)
+{
+    SflBmpDecoderSource* source = (SflBmpDecoderSource*)usr;
+    return sfl_bmp_memory_seek(&source->mem, offset, whence);
+}
+
+static PROC_SFL_BMP_IO_TELL(sfl_bmp__decoder_tell)
+{
+    SflBmpDecoderSource* source = (SflBmpDecoderSource*)usr;
+    return sfl_bmp_memory_tell(&source->mem);
+}
+
+static SflBmpIOImplementation SflBmp_IO_Decoder = {
+    sfl_bmp__decoder_read,
+    0,
+    sfl_bmp__decoder_seek,
+    sfl_bmp__decoder_tell,
+    0,
+    0,
+};
+
+struct SflBmpDecoder {
+    /** The caller's context, reading from source */
+    SflBmpContext          ctx;
+    SflBmpDecoderSource    source;
+    SflBmpDesc*            desc;
+    ProcSflBmpDecoderRows* rows;
+    void*                  usr;
+    SflBmpDecoderState     state;
+    /** What probe found, once probed is set */
+    SflBmpDesc             in;
+    int                    probed;
+    SflBmpConverter        conv;
+    /** What comes before the pixel data, never grown past in.offset once
+     *  probed */
+    SflBmpU8*              header;
+    SflBmpUSize            header_capacity;
+    /** A scan-line split across feeds */
+    SflBmpU8*              row;
+    SflBmpU32              row_fill;
+    SflBmpU32              num_rows;
+    SflBmpU64              bytes_fed;
+#if SFL_BMP_HASH
+    SflBmpHash             file_hash;
+    SflBmpHash             data_hash;
+#endif
+#if SFL_BMP_MIPMAPS
+    SflBmpU8               to_srgb[SFL_BMP__MIP_SRGB_ENTRIES];
+#endif
+};
+
+SflBmpDecoder* sfl_bmp_decoder_begin(
+    SflBmpContext*         ctx,
+    SflBmpDesc*            desc,
+    ProcSflBmpDecoderRows* rows,
+    void*                  usr)
+{
+    SflBmpDecoder* dec =
+        (SflBmpDecoder*)SFL_BMP_ALLOCATE(ctx, sizeof(SflBmpDecoder));
+    if (!dec) {
+        return 0;
+    }
+
+    memset(dec, 0, sizeof(*dec));
+    dec->ctx        = *ctx;
+    dec->ctx.io     = SflBmp_IO_Decoder;
+    dec->ctx.io.usr = &dec->source;
+    dec->desc       = desc;
+    dec->rows       = rows;
+    dec->usr        = usr;
+    dec->state      = SFL_BMP_DECODER_HEADERS;
+    desc->data      = 0;
+    return dec;
+}
+
+/** Converts whole rows out of bytes, keeping what's left of a partial one */
+static SflBmpUSize sfl_bmp__decoder_rows(
+    SflBmpDecoder* dec, const SflBmpU8* bytes, SflBmpUSize n)
+{
+    SflBmpDesc*     desc     = dec->desc;
+    const SflBmpU32 pitch    = dec->in.pitch;
+    const SflBmpU32 first    = dec->num_rows;
+    SflBmpUSize     consumed = 0;
+    SFL_BMP__STAGE_DECLARE(convert_time);
+
+    SFL_BMP__STAGE_BEGIN(&dec->ctx, SFL_BMP_STAGE_CONVERT, convert_time);
+
+    while (consumed < n && dec->num_rows < desc->height) {
+        const SflBmpU8* in_row;
+
+        if (dec->row_fill == 0 && (n - consumed) >= pitch) {
+            /* Whole row in this chunk, convert it in place */
+            in_row = bytes + consumed;
+            consumed += pitch;
+        } else {
+            SflBmpUSize take = pitch - dec->row_fill;
+            if (take > n - consumed) {
+                take = n - consumed;
+            }
+
+            memcpy(dec->row + dec->row_fill, bytes + consumed, take);
+            dec->row_fill += (SflBmpU32)take;
+            consumed += take;
+            if (dec->row_fill < pitch) {
+                break;
+            }
+
+            in_row        = dec->row;
+            dec->row_fill = 0;
+        }
+
+        sfl_bmp__decode_row(&dec->conv, desc, in_row, dec->num_rows);
+#if SFL_BMP_HASH
+        sfl_bmp__hash_update(&dec->file_hash, in_row, pitch);
+        if (!dec->conv.num_planes) {
+            const SflBmpUSize offset = (SflBmpUSize)dec->num_rows * desc->pitch;
+            sfl_bmp__hash_update(
+                &dec->data_hash, (SflBmpU8*)desc->data + offset, desc->pitch);
+        }
+#endif
+#if SFL_BMP_MIPMAPS
+        sfl_bmp__mip_cascade(desc, dec->to_srgb, dec->num_rows);
+#endif
+        dec->num_rows++;
+    }
+
+#if SFL_BMP_HASH
+    /* Before the callback, so its last call sees the hashes */
+    if (dec->num_rows == desc->height && dec->num_rows > first) {
+        if (dec->conv.num_planes) {
+            sfl_bmp__hash_update(
+                &dec->data_hash, desc->data, (SflBmpUSize)desc->size);
+        }
+        desc->file_hash = sfl_bmp__hash_final(&dec->file_hash);
+        desc->data_hash = sfl_bmp__hash_final(&dec->data_hash);
+    }
+#endif
+#if SFL_BMP_PIXEL_STATS
+    /* Also before the callback */
+    if (dec->num_rows == desc->height && dec->num_rows > first) {
+        sfl_bmp__pixel_stats_end(dec->conv.pixel_stats);
+    }
+#endif
+    SFL_BMP__STAGE_END(&dec->ctx, SFL_BMP_STAGE_CONVERT, convert_time);
+
+    if (dec->num_rows > first && dec->rows) {
+        dec->rows(dec->usr, desc, first, dec->num_rows - first);
+    }
+
+    if (dec->num_rows == desc->height) {
+        dec->state = SFL_BMP_DECODER_DONE;
+    }
+
+    return consumed;
+}
+
+/**
+ * Appends n bytes to the buffered headers. Once probed, the buffer never
+ * grows past the start of the pixel data
+ */
+static int sfl_bmp__decoder_buffer(
+    SflBmpDecoder* dec, const SflBmpU8* bytes, SflBmpUSize n)
+{
+    SflBmpIOImplementationMemory* mem  = &dec->source.mem;
+    SflBmpUSize                   size = dec->header ? mem->len + n : n;
+    SflBmpU8*                     header;
+
+    if (size > dec->header_capacity) {
+        SflBmpUSize capacity =
+            dec->header_capacity ? dec->header_capacity * 2 : 256;
+        while (capacity < size) {
+            capacity *= 2;
+        }
+        if (dec->probed && capacity > dec->in.offset) {
+            capacity = (SflBmpUSize)dec->in.offset;
+        }
+
+        header = (SflBmpU8*)SFL_BMP_ALLOCATE(&dec->ctx, capacity);
+        if (!header) {
+            return 0;
+        }
+
+        if (dec->header) {
+            memcpy(header, dec->header, mem->len);
+            SFL_BMP_RELEASE((&dec->ctx), dec->header, dec->header_capacity);
+        }
+        dec->header          = header;
+        dec->header_capacity = capacity;
+    }
+
+    memcpy(dec->header + size - n, bytes, n);
+    mem->buf  = dec->header;
+    mem->len  = size;
+    mem->curr = 0;
+    return 1;
+}
+
+/**
+ * Probes once enough of the headers are in, keeps what comes before the
+ * pixel data and then sets up the output. Pixel data goes straight from
+ * bytes to the rows. Returns 0 on error
+ */
+static int sfl_bmp__decoder_headers(
+    SflBmpDecoder* dec, const SflBmpU8* bytes, SflBmpUSize n)
+{
+    SflBmpIOImplementationMemory* mem = &dec->source.mem;
+    /* Bytes of this chunk that are in dec->header */
+    SflBmpUSize                   used = 0;
+
+    if (!dec->probed) {
+        if (!dec->header) {
+            /* Probe the caller's bytes, they're only copied if it's short */
+            mem->buf  = (unsigned char*)bytes;
+            mem->len  = n;
+            mem->curr = 0;
+        } else {
+            if (!sfl_bmp__decoder_buffer(dec, bytes, n)) {
+                return 0;
+            }
+            used = n;
+        }
+
+        dec->source.starved = 0;
+        if (!sfl_bmp_probe(&dec->ctx, &dec->in)) {
+            /* Either not a BMP, or not enough of it yet */
+            if (!dec->source.starved) {
+                return 0;
+            }
+            return used || sfl_bmp__decoder_buffer(dec, bytes, n);
+        }
+
+        if (!sfl_bmp__decode_layout(&dec->ctx, &dec->in, dec->desc)) {
+            return 0;
+        }
+        dec->probed = 1;
+
+        if (!used) {
+            mem->buf = 0;
+            mem->len = 0;
+        }
+    }
+
+    /* Only what comes before the pixel data is kept */
+    if (mem->len < dec->in.offset) {
+        SflBmpUSize take = (SflBmpUSize)dec->in.offset - mem->len;
+        if (take > n - used) {
+            take = n - used;
+        }
+        if (take && !sfl_bmp__decoder_buffer(dec, bytes + used, take)) {
+            return 0;
+        }
+        used += take;
+    }
+
+    if (mem->len < dec->in.offset) {
+        return 1;
+    }
+
+    dec->desc->data =
+        SFL_BMP_ALLOCATE(&dec->ctx, (SflBmpUSize)dec->desc->size);
+    dec->row        = (SflBmpU8*)SFL_BMP_ALLOCATE(&dec->ctx, dec->in.pitch);
+    if (!dec->desc->data || !dec->row) {
+        return 0;
+    }
+
+    if (!sfl_bmp__decode_converter_init(
+            &dec->ctx, &dec->conv, &dec->in, dec->desc))
+    {
+        return 0;
+    }
+    dec->state = SFL_BMP_DECODER_ROWS;
+#if SFL_BMP_HASH
+    sfl_bmp__hash_init(&dec->file_hash);
+    sfl_bmp__hash_init(&dec->data_hash);
+#endif
+#if SFL_BMP_MIPMAPS
+    if (dec->desc->attributes & SFL_BMP_ATTRIBUTE_SRGB) {
+        sfl_bmp__mip_srgb_init(dec->to_srgb);
+    }
+#endif
+#if SFL_BMP_PIXEL_STATS
+    sfl_bmp__pixel_stats_begin(&dec->conv, dec->ctx.pixel_stats, dec->desc);
+#endif
+
+    /*
+    Whatever came after the headers is pixel data: buffered while probe was
+    still short of bytes, and then the rest of this chunk
+    */
+    if (mem->len > dec->in.offset) {
+        sfl_bmp__decoder_rows(
+            dec,
+            dec->header + dec->in.offset,
+            mem->len - (SflBmpUSize)dec->in.offset);
+    }
+    sfl_bmp__decoder_rows(dec, bytes + used, n - used);
+    return 1;
+}
+
+int sfl_bmp_feed(SflBmpDecoder* dec, const void* bytes, SflBmpUSize n)
+{
+    dec->bytes_fed += n;
+
+    switch (dec->state) {
+        case SFL_BMP_DECODER_HEADERS: {
+            if (!sfl_bmp__decoder_headers(dec, (const SflBmpU8*)bytes, n)) {
+                dec->state = SFL_BMP_DECODER_ERROR;
+            }
+        } break;
+
+        case SFL_BMP_DECODER_ROWS: {
+            sfl_bmp__decoder_rows(dec, (const SflBmpU8*)bytes, n);
+        } break;
+
+        /* Anything past the pixel data is ignored */
+        case SFL_BMP_DECODER_DONE:
+        case SFL_BMP_DECODER_ERROR:
+            break;
+    }
+
+    return dec->state != SFL_BMP_DECODER_ERROR;
+}
+
+void sfl_bmp_decoder_progress(
+    SflBmpDecoder* dec, SflBmpDecoderProgress* progress)
+{
+    progress->state          = dec->state;
+    progress->bytes_fed      = dec->bytes_fed;
+    progress->bytes_expected = 0;
+    progress->rows_decoded   = dec->num_rows;
+    if (dec->state == SFL_BMP_DECODER_ROWS ||
+        dec->state == SFL_BMP_DECODER_DONE)
+    {
+        progress->bytes_expected =
+            dec->in.offset + (SflBmpU64)dec->in.pitch * dec->in.height;
+    }
+}
+
+int sfl_bmp_decoder_end(SflBmpDecoder* dec)
+{
+    SflBmpContext ctx = dec->ctx;
+    const int     ok  = dec->state == SFL_BMP_DECODER_DONE;
+
+    if (ok) {
+        sfl_bmp__disown(&ctx, (SflBmpUSize)dec->desc->size);
+    } else if (dec->desc->data) {
+        SFL_BMP_RELEASE(
+            (&ctx), dec->desc->data, (SflBmpUSize)dec->desc->size);
+        dec->desc->data = 0;
+    }
+
+    if (dec->row) {
+        SFL_BMP_RELEASE((&ctx), dec->row, dec->in.pitch);
+    }
+
+    if (dec->header) {
+        SFL_BMP_RELEASE((&ctx), dec->header, dec->header_capacity);
+    }
+
+    SFL_BMP_RELEASE((&ctx), dec, sizeof(SflBmpDecoder));
+    return ok;
+}
+
+/** An output buffer of the frame decoder's pool */
+typedef struct {
+    void*       data;
+    SflBmpUSize capacity;
+    /** Handed out with a frame, and not recycled yet */
+    int         out;
+} SflBmpFrameBuffer;
+
+struct SflBmpFrameDecoder {
+    /** The caller's context, for memory */
+    SflBmpContext      ctx;
+    /** Conversion plan of the last frame, and the layouts it was made for */
+    SflBmpConverter    conv;
+    SflBmpDesc         plan_in;
+    SflBmpDesc         plan_out;
+    int                has_plan;
+    /** Scan-line, for sources that can't be peeked at */
+    void*              row;
+    SflBmpUSize        row_capacity;
+    SflBmpFrameBuffer* buffers;
+    SflBmpU32          num_buffers;
+};
+
+/** Input & output attributes that change the conversion plan */
+#define SFL_BMP__PLAN_IN_ATTRIBUTES SFL_BMP_ATTRIBUTE_PALETTIZED
+#define SFL_BMP__PLAN_OUT_ATTRIBUTES \
+    (SFL_BMP_ATTRIBUTE_DITHERED | SFL_BMP_ATTRIBUTE_PLANAR)
+
+/**
+ * Whether the last frame's plan converts in to out as well. Paletted frames
+ * don't reuse it, since each has its own color table
+ */
+static int sfl_bmp__frame_plan_fits(
+    SflBmpFrameDecoder* dec, SflBmpDesc* in, SflBmpDesc* out)
+{
+    SflBmpDesc* pi = &dec->plan_in;
+    SflBmpDesc* po = &dec->plan_out;
+    return dec->has_plan && !(in->attributes & SFL_BMP_ATTRIBUTE_PALETTIZED) &&
+           in->format == pi->format && in->slice == pi->slice &&
+           memcmp(in->mask, pi->mask, sizeof(in->mask)) == 0 &&
+           (in->attributes & SFL_BMP__PLAN_IN_ATTRIBUTES) ==
+               (pi->attributes & SFL_BMP__PLAN_IN_ATTRIBUTES) &&
+           out->format == po->format &&
+           (out->attributes & SFL_BMP__PLAN_OUT_ATTRIBUTES) ==
+               (po->attributes & SFL_BMP__PLAN_OUT_ATTRIBUTES);
+}
+
+/**
+ * Makes sure that *ptr holds at least size bytes, reallocating it (without
+ * keeping its contents) if it doesn't. Kept buffers don't count against the
+ * context's limits, @see sfl_bmp_frame_decoder_begin
+ */
+static int sfl_bmp__frame_reserve(
+    SflBmpFrameDecoder* dec,
+    void**              ptr,
+    SflBmpUSize*        capacity,
+    SflBmpUSize         size)
+{
+    if (*ptr && *capacity >= size) {
+        return 1;
+    }
+
+    if (*ptr) {
+        dec->ctx.mem->release(dec->ctx.mem->usr, *ptr);
+        *ptr      = 0;
+        *capacity = 0;
+    }
+
+    *ptr = SFL_BMP_ALLOCATE(&dec->ctx, size);
+    if (!*ptr) {
+        return 0;
+    }
+
+    sfl_bmp__disown(&dec->ctx, size);
+    *capacity = size;
+    return 1;
+}
+
+/**
+ * A buffer that isn't out, preferring one that's big enough already, then
+ * the biggest one (the least to grow)
+ */
+static SflBmpFrameBuffer* sfl_bmp__frame_buffer(
+    SflBmpFrameDecoder* dec, SflBmpUSize size)
+{
+    SflBmpFrameBuffer* best = 0;
+    for (SflBmpU32 i = 0; i < dec->num_buffers; ++i) {
+        SflBmpFrameBuffer* buffer = &dec->buffers[i];
+        if (buffer->out) {
+            continue;
+        }
+
+        if (buffer->data && buffer->capacity >= size) {
+            return buffer;
+        }
+
+        if (!best || buffer->capacity > best->capacity) {
+            best = buffer;
+        }
+    }
+    return best;
+}
+
+SflBmpFrameDecoder* sfl_bmp_frame_decoder_begin(
+    SflBmpContext* ctx, SflBmpU32 num_buffers)
+{
+    const SflBmpUSize size = sizeof(SflBmpFrameDecoder) +
+                             sizeof(SflBmpFrameBuffer) * num_buffers;
+    if (num_buffers == 0) {
+        return 0;
+    }
+
+    SflBmpFrameDecoder* dec = (SflBmpFrameDecoder*)SFL_BMP_ALLOCATE(ctx, size);
+    if (!dec) {
+        return 0;
+    }
+
+    memset(dec, 0, size);
+    dec->ctx         = *ctx;
+    dec->buffers     = (SflBmpFrameBuffer*)(dec + 1);
+    dec->num_buffers = num_buffers;
+    return dec;
+}
+
+int sfl_bmp_frame_decode(
+    SflBmpFrameDecoder* dec, SflBmpContext* ctx, SflBmpDesc* desc)
+{
+    SflBmpDesc         in;
+    SflBmpFrameBuffer* buffer;
+    const SflBmpU8*    source;
+
+    /* The frame's IO, with everything else from the decoder's context */
+    SflBmpContext frame = dec->ctx;
+    frame.io            = ctx->io;
+
+    if (!sfl_bmp_probe(&frame, &in)) {
+        return 0;
+    }
+
+    if (!sfl_bmp__decode_layout(&frame, &in, desc)) {
+        return 0;
+    }
+
+    if (!sfl_bmp__frame_plan_fits(dec, &in, desc)) {
+        dec->has_plan = 0;
+        if (!sfl_bmp__decode_converter_init(&frame, &dec->conv, &in, desc)) {
+            return 0;
+        }
+
+        dec->plan_in  = in;
+        dec->plan_out = *desc;
+        dec->has_plan = 1;
+    }
+
+    buffer = sfl_bmp__frame_buffer(dec, (SflBmpUSize)desc->size);
+    if (!buffer || !sfl_bmp__frame_reserve(
+                       dec,
+                       &buffer->data,
+                       &buffer->capacity,
+                       (SflBmpUSize)desc->size))
+    {
+        return 0;
+    }
+
+    /* Pixel data that can be peeked at needs no scan-line */
+    source = sfl_bmp__peek(
+        &frame, &frame.io, in.offset, (SflBmpU64)in.pitch * in.height);
+    if (!source && !sfl_bmp__frame_reserve(
+                       dec, &dec->row, &dec->row_capacity, in.pitch))
+    {
+        return 0;
+    }
+
+    desc->data = buffer->data;
+    if (!sfl_bmp__decode_pixels(
+            &frame, &in, desc, &dec->conv, source, (SflBmpU8*)dec->row))
+    {
+        desc->data = 0;
+        return 0;
+    }
+
+    buffer->out = 1;
+    return 1;
+}
+
+int sfl_bmp_frame_recycle(SflBmpFrameDecoder* dec, void* data)
+{
+    for (SflBmpU32 i = 0; i < dec->num_buffers; ++i) {
+        SflBmpFrameBuffer* buffer = &dec->buffers[i];
+        if (buffer->out && buffer->data == data) {
+            buffer->out = 0;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+void sfl_bmp_frame_decoder_end(SflBmpFrameDecoder* dec)
+{
+    SflBmpContext     ctx  = dec->ctx;
+    const SflBmpUSize size = sizeof(SflBmpFrameDecoder) +
+                             sizeof(SflBmpFrameBuffer) * dec->num_buffers;
+
+    /* Kept buffers stopped counting when they were allocated */
+    for (SflBmpU32 i = 0; i < dec->num_buffers; ++i) {
+        if (dec->buffers[i].data) {
+            ctx.mem->release(ctx.mem->usr, dec->buffers[i].data);
+        }
+    }
+
+    if (dec->row) {
+        ctx.mem->release(ctx.mem->usr, dec->row);
+    }
+
+    SFL_BMP_RELEASE((&ctx), dec, size);
+}
+
+static int sfl_bmp__convert(
+    SflBmpContext*          ctx,
+    SflBmpDesc*             in,
+    SflBmpIOImplementation* in_io,
+    SflBmpDesc*             out,
+    SflBmpIOImplementation* out_io)
+{
+    int rc = 0;
+    SFL_BMP__STAGE_DECLARE(convert_time);
+
+    /* Input that can be peeked at is converted in place */
+    const SflBmpU8* source = sfl_bmp__peek(
+        ctx, in_io, in->offset, (SflBmpU64)in->pitch * in->height);
+    const SflBmpUSize in_size = source ? 0 : in->pitch;
+
+    if (!source && sfl_bmp__seek(ctx, in_io, in->offset, SFL_BMP_IO_SET)) {
+        return 0;
+    }
+
+    SflBmpConverter conv;
+    sfl_bmp__converter_init(&conv, in, out);
+
+    /* One scan-line of each, back to back */
+    SflBmpU8* in_row = (SflBmpU8*)SFL_BMP_ALLOCATE(ctx, in_size + out->pitch);
+    if (!in_row) {
+        return 0;
+    }
+    SflBmpU8* out_row = in_row + in_size;
+
+    /* Padding is never touched by the converter */
+    memset(out_row, 0, out->pitch);
+
+    SFL_BMP__STAGE_BEGIN(ctx, SFL_BMP_STAGE_CONVERT, convert_time);
+
+    for (SflBmpU32 y = 0; y < in->height; ++y) {
+        if (source) {
+            conv.convert_row(
+                &conv,
+                source + (SflBmpUSize)y * in->pitch,
+                out_row,
+                in->width,
+                y);
+        } else if (sfl_bmp__read(ctx, in_io, in_row, in->pitch)) {
+            conv.convert_row(&conv, in_row, out_row, in->width, y);
+        } else {
+            goto EXIT_PROC;
+        }
+
+        if (!sfl_bmp__write(ctx, out_io, out_row, out->pitch)) {
+            goto EXIT_PROC;
+        }
+    }
+
+    rc = 1;
+EXIT_PROC:
+    SFL_BMP__STAGE_END(ctx, SFL_BMP_STAGE_CONVERT, convert_time);
+    SFL_BMP_RELEASE(ctx, in_row, in_size + out->pitch);
+    return rc;
+}
+static int sfl_bmp__fill_desc(SflBmpDesc* desc)
+{
+    int bpp = sfl_bmp__bpp_from_pixel_format(desc->format);
+    sfl_bmp__bitmasks_from_pixel_format(desc->format, desc->mask);
+
+    /* A palette goes with palette indices, and only with them */
+    if (!(desc->attributes & SFL_BMP_ATTRIBUTE_PALETTIZED) !=
+        !sfl_bmp__is_indexed(desc->format))
+    {
+        return 0;
+    }
+
+    const SflBmpU64 pitch = sfl_bmp__pitch(bpp, desc->width);
+    if (pitch > 0xFFFFFFFFu) {
+        return 0;
+    }
+
+    desc->slice = bpp / 8;
+    desc->pitch = (SflBmpU32)pitch;
+    desc->size  = pitch * desc->height;
+    return 1;
+}
+
+static int sfl_bmp__check_nfo_compat(SflBmpDesc* desc);
+
+/** Negative height in the info header means that rows go top to bottom */
+static SflBmpI32 sfl_bmp__signed_height(SflBmpDesc* desc)
+{
+    if (desc->attributes & SFL_BMP_ATTRIBUTE_FLIPPED) {
+        return (SflBmpI32)desc->height;
+    } else {
+        return -(SflBmpI32)desc->height;
+    }
+}
+
+/** Fills out_desc from in_desc. Returns the info header size, or -1 */
+static int sfl_bmp__encode_layout(SflBmpDesc* in_desc, SflBmpDesc* out_desc)
+{
+    /* Palette indices only come out of sfl_bmp__encode_palettized */
+    if (sfl_bmp__is_indexed(in_desc->format) ||
+        (sfl_bmp__is_indexed(out_desc->format) &&
+         (!out_desc->palette_data || out_desc->num_table_entries == 0 ||
+          out_desc->num_table_entries >
+              (1u << sfl_bmp__bpp_from_pixel_format(out_desc->format)))))
+    {
+        return -1;
+    }
+
+#if SFL_BMP_CUSTOM_PIXEL_FORMATS
+    /* Custom formats are stored as bitfields, so they need masks to match */
+    const SflBmpPixelFormatInfo* custom =
+        sfl_bmp__custom_format(out_desc->format);
+    if (custom && (!sfl_bmp__has_masks(custom->mask) ||
+                   (custom->bpp != 16 && custom->bpp != 32)))
+    {
+        return -1;
+    }
+#endif
+
+    out_desc->width           = in_desc->width;
+    out_desc->height          = in_desc->height;
+    out_desc->physical_width  = in_desc->physical_width;
+    out_desc->physical_height = in_desc->physical_height;
+    /* Rows are written in the same order they're read */
+    out_desc->attributes = (in_desc->attributes & SFL_BMP_ATTRIBUTE_FLIPPED) |
+                           (out_desc->attributes & SFL_BMP_ATTRIBUTE_DITHERED);
+    if (sfl_bmp__is_indexed(out_desc->format)) {
+        out_desc->attributes |= SFL_BMP_ATTRIBUTE_PALETTIZED;
+        out_desc->table_entry_size = 4;
+    }
+
+    /* @todo: Add actual checks for file header, for now it's only 'BM' */
+    if (!sfl_bmp__fill_desc(out_desc)) {
+        return -1;
+    }
+
+    /* Info Header compatibility */
+    sfl_bmp__check_nfo_compat(out_desc);
+
+    return sfl_bmp__nfo_size(out_desc->info_header_id);
+}
+
+/** Size of the color table that follows the info header when encoding */
+static SflBmpU32 sfl_bmp__table_size(SflBmpDesc* desc)
+{
+    if (desc->attributes & SFL_BMP_ATTRIBUTE_PALETTIZED) {
+        return desc->num_table_entries * desc->table_entry_size;
+    }
+    return 0;
+}
+
+SflBmpU64 sfl_bmp_encoded_size(SflBmpDesc* in_desc, SflBmpDesc* out_desc)
+{
+    SflBmpDesc layout   = *out_desc;
+    int        nfo_size = sfl_bmp__encode_layout(in_desc, &layout);
+
+    /* Only V5 info headers are written for now */
+    if (nfo_size == -1 || layout.info_header_id != SFL_BMP_NFO_ID_V5) {
+        return 0;
+    }
+
+    return sizeof(SflBmpFileHeader) + nfo_size + sfl_bmp__table_size(&layout) +
+           layout.size;
+}
+
+/** Fills out_desc from in_desc, and writes the file & info headers */
+static int sfl_bmp__encode_header(
+    SflBmpContext* ctx, SflBmpDesc* in_desc, SflBmpDesc* out_desc)
+{
+    /* Write file header */
+    SflBmpFileHeader hdr;
+    int              nfo_size = sfl_bmp__encode_layout(in_desc, out_desc);
+    if (nfo_size == -1) {
+        return 0;
+    }
+    const SflBmpU32 table_size = sfl_bmp__table_size(out_desc);
+
+    const char* hdr_str = sfl_bmp__hdr_id_to_str(out_desc->file_header_id);
+    hdr.hdr[0]          = hdr_str[0];
+    hdr.hdr[1]          = hdr_str[1];
+    hdr.reserved[0]     = 0;
+    hdr.reserved[1]     = 0;
+    hdr.offset          = sizeof(SflBmpFileHeader) + nfo_size + table_size;
+
+    /* Sizes over 4GiB are written as 0 (unknown): readers find the pixel
+     * data from the offset and the dimensions */
+    const SflBmpU64 file_size = hdr.offset + out_desc->size;
+    hdr.file_size = (file_size > 0xFFFFFFFFu) ? 0 : (SflBmpU32)file_size;
+
+    if (!SFL_BMP_WRITE(ctx, &hdr, sizeof(hdr))) {
+        return 0;
+    }
+
+    /* Write info header */
+    int pfbpp = sfl_bmp__bpp_from_pixel_format(out_desc->format);
+
+    switch (out_desc->info_header_id) {
+        default:
+        case SFL_BMP_NFO_ID_NA:
+        case SFL_BMP_NFO_ID_CORE:
+        case SFL_BMP_NFO_ID_OS22_V1:
+        case SFL_BMP_NFO_ID_OS22_V2:
+        case SFL_BMP_NFO_ID_V1:
+        case SFL_BMP_NFO_ID_V2:
+        case SFL_BMP_NFO_ID_V3:
+        case SFL_BMP_NFO_ID_V4:
+            return 0;
+        case SFL_BMP_NFO_ID_V5: {
+            SflBmpInfoHeader124 info;
+            info.size                 = sizeof(info);
+            info.width                = out_desc->width;
+            info.height               = sfl_bmp__signed_height(out_desc);
+            info.planes               = 1;
+            info.bpp                  = pfbpp;
+            info.compression          = out_desc->compression;
+            info.raw_size             = (out_desc->size > 0xFFFFFFFFu)
+                                            ? 0
+                                            : (SflBmpU32)out_desc->size;
+            info.hres                 = out_desc->physical_width;
+            info.vres                 = out_desc->physical_height;
+            info.num_colors           = table_size / 4;
+            info.num_important_colors = 0;
+            info.red_mask             = out_desc->mask[0];
+            info.green_mask           = out_desc->mask[1];
+            info.blue_mask            = out_desc->mask[2];
+            info.alpha_mask           = out_desc->mask[3];
+            /* @todo */
+            info.color_space          = SFL_BMP_COLORSPACE_SRGB;
+            info.endpoint_red[0]      = 0;
+            info.endpoint_red[1]      = 0;
+            info.endpoint_red[2]      = 0;
+            info.endpoint_green[0]    = 0;
+            info.endpoint_green[1]    = 0;
+            info.endpoint_green[2]    = 0;
+            info.endpoint_blue[0]     = 0;
+            info.endpoint_blue[1]     = 0;
+            info.endpoint_blue[2]     = 0;
+            info.gamma_red            = 0;
+            info.gamma_green          = 0;
+            info.gamma_blue           = 0;
+            info.intent               = SFL_BMP_INTENT_LCS_GM_IMAGES;
+            info.profile_data_offset  = 0;
+            info.profile_data_size    = 0;
+
+            info.reserved = 0;
+
+            if (!SFL_BMP_WRITE(ctx, &info, sizeof(info))) {
+                return 0;
+            }
+        } break;
+    }
+
+    if (table_size && !SFL_BMP_WRITE(ctx, out_desc->palette_data, table_size)) {
+        return 0;
+    }
+
+    return 1;
+}
+
+/** Slots in the color table's hash, kept at most a quarter full */
+#define SFL_BMP__PALETTE_SLOTS 1024
+
+/**
+ * Up to 256 colors, as B8G8R8X8 table entries, and an open-addressing hash
+ * from B8G8R8A8 pixels to their index. Keys live in a flat array, so that a
+ * probe is a short linear scan
+ */
+typedef struct {
+    SflBmpU32 colors[256];
+    SflBmpU32 num_colors;
+    SflBmpU32 keys[SFL_BMP__PALETTE_SLOTS];
+    /** Index + 1 of each key, 0 for empty slots */
+    SflBmpU16 values[SFL_BMP__PALETTE_SLOTS];
+} SflBmpPalette;
+
+/** Returns the index of pixel, adding it if it's new, or -1 once full */
+static int sfl_bmp__palette_index(SflBmpPalette* palette, SflBmpU32 pixel)
+{
+    SflBmpU32 slot = (pixel * 0x9E3779B1u) >> 22;
+
+    while (palette->values[slot]) {
+        if (palette->keys[slot] == pixel) {
+            return palette->values[slot] - 1;
+        }
+        slot = (slot + 1) & (SFL_BMP__PALETTE_SLOTS - 1);
+    }
+
+    if (palette->num_colors == 256) {
+        return -1;
+    }
+
+    palette->colors[palette->num_colors] = pixel & 0x00FFFFFF;
+    palette->keys[slot]                  = pixel;
+    palette->values[slot] = (SflBmpU16)(++palette->num_colors);
+    return palette->num_colors - 1;
+}
+
+/**
+ * Encodes the image as palette indices, if it has at most 256 colors and is
+ * opaque. The pixels are read twice: once to collect the colors, and once to
+ * write their indices
+ * @return 1 on success, 0 on failure, -1 if the image doesn't fit a palette
+ */
+static int sfl_bmp__encode_palettized(
+    SflBmpContext*          ctx,
+    SflBmpDesc*             in,
+    SflBmpIOImplementation* in_io,
+    SflBmpDesc*             out)
+{
+    SflBmpPalette*  palette;
+    SflBmpDesc      pixel_desc;
+    SflBmpConverter conv;
+    SflBmpU8*       in_row;
+    SflBmpU32*      pixels;
+    SflBmpU8*       out_row;
+    SflBmpU32       bpp;
+    SflBmpU32       last  = 0;
+    int             index = -1;
+    int             rc    = 0;
+    SFL_BMP__STAGE_DECLARE(palette_time);
+    SFL_BMP__STAGE_DECLARE(convert_time);
+
+    /* Input that can be peeked at is converted in place */
+    const SflBmpU8* source = sfl_bmp__peek(
+        ctx, in_io, in->offset, (SflBmpU64)in->pitch * in->height);
+    const SflBmpUSize in_size = source ? 0 : in->pitch;
+    /* Indices take at most a byte per pixel, plus padding */
+    const SflBmpUSize size = sizeof(SflBmpPalette) + in_size +
+                             (SflBmpUSize)in->width * 4 +
+                             (SflBmpUSize)sfl_bmp__pitch(8, in->width);
+
+    /* Rows are converted to B8G8R8A8 first, and hashed as such */
+    memset(&pixel_desc, 0, sizeof(pixel_desc));
+    pixel_desc.format = SFL_BMP_PIXEL_FORMAT_B8G8R8A8;
+    pixel_desc.slice  = 4;
+    sfl_bmp__bitmasks_from_pixel_format(pixel_desc.format, pixel_desc.mask);
+    sfl_bmp__converter_init(&conv, in, &pixel_desc);
+
+    palette = (SflBmpPalette*)SFL_BMP_ALLOCATE(ctx, size);
+    if (!palette) {
+        return 0;
+    }
+    memset(palette, 0, sizeof(*palette));
+    in_row  = (SflBmpU8*)(palette + 1);
+    pixels  = (SflBmpU32*)(in_row + in_size);
+    out_row = (SflBmpU8*)(pixels + in->width);
+
+    SFL_BMP__STAGE_BEGIN(ctx, SFL_BMP_STAGE_PALETTE, palette_time);
+
+    if (!source && sfl_bmp__seek(ctx, in_io, in->offset, SFL_BMP_IO_SET)) {
+        goto EXIT_PROC;
+    }
+
+    for (SflBmpU32 y = 0; y < in->height; ++y) {
+        const SflBmpU8* row = in_row;
+        if (source) {
+            row = source + (SflBmpUSize)y * in->pitch;
+        } else if (!sfl_bmp__read(ctx, in_io, in_row, in->pitch)) {
+            goto EXIT_PROC;
+        }
+
+        conv.convert_row(&conv, row, (SflBmpU8*)pixels, in->width, y);
+        for (SflBmpU32 x = 0; x < in->width; ++x) {
+            /* Runs of the same color skip the hash */
+            if (pixels[x] == last && index != -1) {
+                continue;
+            }
+
+            last  = pixels[x];
+            index = (last >> 24) == 0xFF ? sfl_bmp__palette_index(palette, last)
+                                         : -1;
+            if (index == -1) {
+                rc = -1;
+                goto EXIT_PROC;
+            }
+        }
+    }
+
+    SFL_BMP__STAGE_END(ctx, SFL_BMP_STAGE_PALETTE, palette_time);
+
+    /* The fewest bits per index that fit */
+    if (palette->num_colors <= 2) {
+        out->format = SFL_BMP_PIXEL_FORMAT_I1;
+    } else if (palette->num_colors <= 16) {
+        out->format = SFL_BMP_PIXEL_FORMAT_I4;
+    } else {
+        out->format = SFL_BMP_PIXEL_FORMAT_I8;
+    }
+    out->compression       = SFL_BMP_COMPRESSION_NONE;
+    out->num_table_entries = palette->num_colors;
+    out->palette_data      = palette->colors;
+    bpp = (SflBmpU32)sfl_bmp__bpp_from_pixel_format(out->format);
+
+    if (!sfl_bmp__encode_header(ctx, in, out)) {
+        goto EXIT_PROC;
+    }
+
+    SFL_BMP__STAGE_BEGIN(ctx, SFL_BMP_STAGE_CONVERT, convert_time);
+
+    if (!source && sfl_bmp__seek(ctx, in_io, in->offset, SFL_BMP_IO_SET)) {
+        goto EXIT_PROC;
+    }
+
+    for (SflBmpU32 y = 0; y < in->height; ++y) {
+        const SflBmpU8* row = in_row;
+        if (source) {
+            row = source + (SflBmpUSize)y * in->pitch;
+        } else if (!sfl_bmp__read(ctx, in_io, in_row, in->pitch)) {
+            goto EXIT_PROC;
+        }
+
+        conv.convert_row(&conv, row, (SflBmpU8*)pixels, in->width, y);
+        memset(out_row, 0, out->pitch);
+        for (SflBmpU32 x = 0; x < in->width; ++x) {
+            const SflBmpU32 bit = x * bpp;
+            if (pixels[x] != last) {
+                last  = pixels[x];
+                index = sfl_bmp__palette_index(palette, last);
+            }
+            out_row[bit / 8] |= (SflBmpU8)(index << (8 - bpp - bit % 8));
+        }
+
+        if (!sfl_bmp__write(ctx, &ctx->io, out_row, out->pitch)) {
+            goto EXIT_PROC;
+        }
+    }
+
+    rc = 1;
+EXIT_PROC:
+    SFL_BMP__STAGE_END(ctx, SFL_BMP_STAGE_PALETTE, palette_time);
+    SFL_BMP__STAGE_END(ctx, SFL_BMP_STAGE_CONVERT, convert_time);
+    /* The table isn't kept past the call */
+    out->palette_data = 0;
+    SFL_BMP_RELEASE(ctx, palette, size);
+    return rc;
+}
+
+int sfl_bmp_encode(
+    SflBmpContext*          ctx,
+    SflBmpDesc*             in_desc,
+    SflBmpIOImplementation* in_io,
+    SflBmpDesc*             out_desc)
+{
+    if ((out_desc->attributes & SFL_BMP_ATTRIBUTE_PALETTIZED) &&
+        !sfl_bmp__is_indexed(in_desc->format))
+    {
+        const int rc =
+            sfl_bmp__encode_palettized(ctx, in_desc, in_io, out_desc);
+        if (rc != -1) {
+            return rc;
+        }
+
+        /* Too many colors (or not opaque), so out_desc->format it is */
+        out_desc->attributes &= ~SFL_BMP_ATTRIBUTE_PALETTIZED;
+    }
+
+    if (!sfl_bmp__encode_header(ctx, in_desc, out_desc)) {
+        return 0;
+    }
+
+    return sfl_bmp__convert(ctx, in_desc, in_io, out_desc, &ctx->io);
+}
+
+struct SflBmpEncoder {
+    SflBmpContext*  ctx;
+    SflBmpDesc      in;
+    SflBmpDesc*     out;
+    SflBmpConverter conv;
+    /** Where the file header starts, to rewrite it if the height is unknown */
+    SflBmpI64       header_offset;
+    SflBmpU32       num_rows;
+    /** One output scan-line, follows the encoder in the same allocation */
+    SflBmpU8*       row;
+};
+
+SflBmpEncoder* sfl_bmp_encoder_begin(
+    SflBmpContext* ctx, SflBmpDesc* in_desc, SflBmpDesc* out_desc)
+{
+    SflBmpEncoder* enc;
+    SflBmpI64      header_offset = 0;
+
+    if (in_desc->height == 0) {
+        if (!ctx->io.seek || !ctx->io.tell) {
+            return 0;
+        }
+
+        header_offset = sfl_bmp__tell(&ctx->io);
+        if (header_offset < 0) {
+            return 0;
+        }
+    }
+
+    if (!sfl_bmp__encode_header(ctx, in_desc, out_desc)) {
+        return 0;
+    }
+
+    enc = (SflBmpEncoder*)SFL_BMP_ALLOCATE(
+        ctx, sizeof(SflBmpEncoder) + out_desc->pitch);
+    if (!enc) {
+        return 0;
+    }
+
+    enc->ctx           = ctx;
+    enc->in            = *in_desc;
+    enc->out           = out_desc;
+    enc->header_offset = header_offset;
+    enc->num_rows      = 0;
+    enc->row           = (SflBmpU8*)(enc + 1);
+    sfl_bmp__converter_init(&enc->conv, &enc->in, out_desc);
+
+    /* Padding is never touched by the converter */
+    memset(enc->row, 0, out_desc->pitch);
+    return enc;
+}
+
+int sfl_bmp_encoder_write_rows(
+    SflBmpEncoder* enc, const void* rows, SflBmpU32 count, SflBmpU32 pitch)
+{
+    SflBmpContext*  ctx = enc->ctx;
+    const SflBmpU8* row = (const SflBmpU8*)rows;
+    int             rc  = 0;
+    SflBmpU32       y;
+    SFL_BMP__STAGE_DECLARE(convert_time);
+
+    if (enc->in.height && (count > enc->in.height - enc->num_rows)) {
+        return 0;
+    }
+
+    SFL_BMP__STAGE_BEGIN(ctx, SFL_BMP_STAGE_CONVERT, convert_time);
+
+    for (y = 0; y < count; ++y) {
+        enc->conv.convert_row(
+            &enc->conv, row, enc->row, enc->in.width, enc->num_rows);
+
+        if (!SFL_BMP_WRITE(ctx, enc->row, enc->out->pitch)) {
+            goto EXIT_PROC;
+        }
+
+        row += pitch;
+        enc->num_rows++;
+    }
+
+    rc = 1;
+EXIT_PROC:
+    SFL_BMP__STAGE_END(ctx, SFL_BMP_STAGE_CONVERT, convert_time);
+    return rc;
+}
+
+int sfl_bmp_encoder_end(SflBmpEncoder* enc)
+{
+    SflBmpContext* ctx = enc->ctx;
+    int            rc  = 0;
+
+    if (enc->in.height) {
+        rc = enc->num_rows == enc->in.height;
+    } else if (enc->num_rows > 0) {
+        /* Back-fill the headers, now that the height is known */
+        SflBmpI64 end = sfl_bmp__tell(&ctx->io);
+
+        enc->in.height = enc->num_rows;
+        rc = (end >= 0) &&
+             !SFL_BMP_SEEK(ctx, enc->header_offset, SFL_BMP_IO_SET) &&
+             sfl_bmp__encode_header(ctx, &enc->in, enc->out) &&
+             !SFL_BMP_SEEK(ctx, end, SFL_BMP_IO_SET);
+    }
+
+    SFL_BMP_RELEASE(ctx, enc, sizeof(SflBmpEncoder) + enc->out->pitch);
+    return rc;
+}
+
+static int sfl_bmp__check_nfo_compat(SflBmpDesc* desc)
+{
+#define SFL_BMP_MUST(x)     \
+    do {                    \
+        if (!(x)) return 0; \
+    } while (0)
+
+    switch (desc->info_header_id) {
+        case SFL_BMP_NFO_ID_NA:
+        case SFL_BMP_NFO_ID_CORE:
+        case SFL_BMP_NFO_ID_OS22_V1:
+        case SFL_BMP_NFO_ID_OS22_V2:
+        case SFL_BMP_NFO_ID_V1:
+        case SFL_BMP_NFO_ID_V2:
+        case SFL_BMP_NFO_ID_V3:
+        case SFL_BMP_NFO_ID_V4:
+        case SFL_BMP_NFO_ID_V5:
+            if (!sfl_bmp__is_compressed(desc)) {
+                if ((desc->format == SFL_BMP_PIXEL_FORMAT_B8G8R8X8) ||
+                    (desc->format == SFL_BMP_PIXEL_FORMAT_B5G5R5X1) ||
+                    sfl_bmp__is_indexed(desc->format))
+                {
+                    SFL_BMP_MUST(desc->compression == SFL_BMP_COMPRESSION_NONE);
+                } else {
+                    SFL_BMP_MUST(
+                        desc->compression == SFL_BMP_COMPRESSION_BITFIELDS);
+                }
+            } else {
+            }
+            break;
+    }
+
+    return 1;
+#undef SFL_BMP_MUST
+}
+
+static int sfl_bmp_extract(
+    SflBmpContext* ctx, SflBmpDecodeSettings* settings, SflBmpDesc* desc)
+{
+    desc->width      = settings->width;
+    desc->height     = settings->height;
+    desc->attributes = 0;
+
+    SflBmpU32 pitch =
+        (SflBmpU32)SFL_BMP_CEILF((settings->bpp * settings->width) / 32.f) * 4;
+
+    SflBmpU32 size = pitch * desc->height;
+    desc->size     = size;
+    desc->pitch    = pitch;
+
+    /** In BMP files, positive height means the image is flipped. */
+    if (settings->height > 0) {
+        desc->attributes |= SFL_BMP_ATTRIBUTE_FLIPPED;
+    } else {
+        desc->height = -desc->height;
+    }
+
+    switch (settings->bpp) {
+        case 32: {
+            if (settings->a_mask == 0) {
+                desc->format = SFL_BMP_PIXEL_FORMAT_B8G8R8X8;
+            } else {
+                desc->format = SFL_BMP_PIXEL_FORMAT_B8G8R8A8;
+            }
+            return sfl_bmp_extract_raw(ctx, settings, desc);
+        } break;
+
+        case 24: {
+            desc->format = SFL_BMP_PIXEL_FORMAT_B8G8R8;
+            SflBmpConvertSettings convert_settings;
+            convert_settings.i_rbits = settings->r_mask;
+            convert_settings.i_gbits = settings->g_mask;
+            convert_settings.i_bbits = settings->b_mask;
+            convert_settings.i_abits = settings->a_mask;
+            convert_settings.i_pitch = desc->pitch;
+            convert_settings.i_slice = 3;
+            return sfl_bmp_extract_raw_convert(
+                ctx,
+                settings,
+                &convert_settings,
+                desc);
+        } break;
+
+        case 16: {
+            desc->format = SFL_BMP_PIXEL_FORMAT_B5G6R5;
+#if SFL_BMP_ALWAYS_CONVERT
+            SflBmpConvertSettings convert_settings;
+            convert_settings.i_rbits = settings->r_mask;
+            convert_settings.i_gbits = settings->g_mask;
+            convert_settings.i_bbits = settings->b_mask;
+            convert_settings.i_abits = settings->a_mask;
+            convert_settings.i_pitch = desc->pitch;
+            convert_settings.i_slice = 2;
+            return sfl_bmp_extract_raw_convert(
+                ctx,
+                settings,
+                &convert_settings,
+                desc);
+#else
+            return sfl_bmp_extract_raw(ctx, settings, desc);
+#endif
+        } break;
+
+        case 4: {
+            return sfl_bmp_extract_paletted(ctx, settings, desc);
+        } break;
+
+        default: {
+            return 0;
+        } break;
+    }
+}
+
+static int sfl_bmp_extract_raw(
+    SflBmpContext* ctx, SflBmpDecodeSettings* settings, SflBmpDesc* desc)
+{
+    SFL_BMP_SEEK(ctx, settings->offset, SFL_BMP_IO_SET);
+    desc->data = SFL_BMP_ALLOCATE(ctx, (SflBmpUSize)desc->size);
+    if (!SFL_BMP_READ(ctx, desc->data, (SflBmpUSize)desc->size)) {
+        return 0;
+    }
+    return 1;
+}
+
+static int sfl_bmp_extract_raw_convert(
+    SflBmpContext*         ctx,
+    SflBmpDecodeSettings*  settings,
+    SflBmpConvertSettings* convert_settings,
+    SflBmpDesc*            desc)
+{
+    desc->format    = SFL_BMP_PIXEL_FORMAT_R8G8B8A8;
+    desc->pitch     = desc->width * sizeof(SflBmpU32);
+    desc->size      = desc->pitch * desc->height;
+    desc->data      = SFL_BMP_ALLOCATE(ctx, (SflBmpUSize)desc->size);
+    SflBmpU32* data = (SflBmpU32*)desc->data;
+
+    /* Amounts to shift each pixel value */
+    const SflBmpI32 rs = sfl_bmp_bit_scan_forward(convert_settings->i_rbits);
+    const SflBmpI32 gs = sfl_bmp_bit_scan_forward(convert_settings->i_gbits);
+    const SflBmpI32 bs = sfl_bmp_bit_scan_forward(convert_settings->i_bbits);
+    const SflBmpI32 as = sfl_bmp_bit_scan_forward(convert_settings->i_abits);
+
+    /* Amount of bits representing component */
+    const SflBmpI32 rc = sfl_bmp_bit_count(convert_settings->i_rbits);
+    const SflBmpI32 gc = sfl_bmp_bit_count(convert_settings->i_gbits);
+    const SflBmpI32 bc = sfl_bmp_bit_count(convert_settings->i_bbits);
+    const SflBmpI32 ac = sfl_bmp_bit_count(convert_settings->i_abits);
+
+    /* Max value of each component */
+    const SflBmpReal mr = (SflBmpReal)(sfl_bmp_ipow(2, rc) - 1);
+    const SflBmpReal mg = (SflBmpReal)(sfl_bmp_ipow(2, gc) - 1);
+    const SflBmpReal mb = (SflBmpReal)(sfl_bmp_ipow(2, bc) - 1);
+    const SflBmpReal ma = (SflBmpReal)(sfl_bmp_ipow(2, ac) - 1);
+
+    const SflBmpU32 skip =
+        convert_settings->i_pitch - (desc->width * convert_settings->i_slice);
+
+    const int is_flipped = settings->height > 0 ? 1 : 0;
+    desc->attributes &= ~SFL_BMP_ATTRIBUTE_FLIPPED;
+    SFL_BMP_SEEK(ctx, settings->offset, SFL_BMP_IO_SET);
+
+    for (int y = 0; y < desc->height; ++y) {
+        for (int x = 0; x < desc->width; ++x) {
+            SflBmpU32 pixel;
+            if (!SFL_BMP_READ(ctx, &pixel, convert_settings->i_slice)) {
+                goto EXIT_ERROR;
+            }
+
+            SflBmpReal r =
+                (SflBmpReal)((pixel & convert_settings->i_rbits) >> rs);
+            SflBmpReal g =
+                (SflBmpReal)((pixel & convert_settings->i_gbits) >> gs);
+            SflBmpReal b =
+                (SflBmpReal)((pixel & convert_settings->i_bbits) >> bs);
+            SflBmpReal a =
+                (SflBmpReal)((pixel & convert_settings->i_abits) >> as);
+
+            /* Ternary op handles case where any of these components is zero */
+            SflBmpU32 cr =
+                (rc != 0) ? (SflBmpU32)SFL_BMP_CEILF((r / mr) * 255) : 0;
+            SflBmpU32 cg =
+                (gc != 0) ? (SflBmpU32)SFL_BMP_CEILF((g / mg) * 255) : 0;
+            SflBmpU32 cb =
+                (bc != 0) ? (SflBmpU32)SFL_BMP_CEILF((b / mb) * 255) : 0;
+            SflBmpU32 ca =
+                (ac != 0) ? (SflBmpU32)SFL_BMP_CEILF((a / ma) * 255) : 0;
+
+            if (convert_settings->i_abits == 0) {
+                ca = 0xFF;
+            }
+
+            SflBmpU32 pixel32 = (cr << 0) | (cg << 8) | (cb << 16) | (ca << 24);
+
+            if (is_flipped) {
+                data[(desc->height - y - 1) * desc->width + x] = pixel32;
+            } else {
+                data[y * desc->width + x] = pixel32;
+            }
+        }
+
+        if (SFL_BMP_SEEK(ctx, (long)skip, SFL_BMP_IO_CUR)) {
+            goto EXIT_ERROR;
+        }
+    }
+
+    return 1;
+EXIT_ERROR:
+    return 0;
+}
+
+static int sfl_bmp_extract_paletted(
+    SflBmpContext* ctx, SflBmpDecodeSettings* settings, SflBmpDesc* desc)
+{
+    SflBmpU32 color_table_count;
+    if (settings->num_colors == 0) {
+        color_table_count = sfl_bmp_ipow(2, settings->bpp);
+    } else {
+        color_table_count = settings->num_colors;
+    }
+    const SflBmpU32 color_table_size = color_table_count * sizeof(SflBmpU32);
+
+    const SflBmpU32 converted_size =
+        desc->height * desc->width * sizeof(SflBmpU32);
+
+    settings->pitch = desc->pitch;
+
+    desc->format     = SFL_BMP_PIXEL_FORMAT_B8G8R8A8;
+    desc->pitch      = desc->width * sizeof(SflBmpU32);
+    desc->attributes = 0;
+
+    SflBmpU32* color_table =
+        (SflBmpU32*)SFL_BMP_ALLOCATE(ctx, color_table_size);
+    if (!color_table) {
+        return 0;
+    }
+
+    desc->data = SFL_BMP_ALLOCATE(ctx, converted_size);
+    if (!desc->data) {
+        return 0;
+    }
+
+    SFL_BMP_SEEK(ctx, settings->table_offset, SFL_BMP_IO_SET);
+
+    if (!SFL_BMP_READ(ctx, color_table, color_table_size)) {
+        return 0;
+    }
+    settings->color_table       = color_table;
+    settings->color_table_count = color_table_count;
+    settings->color_table_size  = color_table_size;
+
+    switch (settings->compression) {
+        case SFL_BMP_COMPRESSION_NONE: {
+            return sfl_bmp_extract_paletted_none(ctx, settings, desc);
+        } break;
+
+        default: {
+            return 0;
+        } break;
+    }
+}
+
+static int sfl_bmp_extract_paletted_none(
+    SflBmpContext* ctx, SflBmpDecodeSettings* settings, SflBmpDesc* desc)
+{
+    const int is_flipped  = settings->height > 0 ? 1 : 0;
+    SflBmpU32 curr_offset = settings->offset;
+
+    SFL_BMP_SEEK(ctx, settings->offset, SFL_BMP_IO_SET);
+
+    SflBmpU32* out_pixels = (SflBmpU32*)desc->data;
+
+    for (SflBmpI32 c = 0; c < desc->height; ++c) {
+        SflBmpI32 y        = is_flipped ? desc->height - 1 - c : c;
+        SflBmpU32 curr_row = curr_offset;
+        SflBmpU32 row_end  = curr_offset + settings->pitch;
+        SflBmpI32 x        = 0;
+
+        while (1) {
+            if (x == desc->width) {
+                curr_row = row_end;
+                break;
+            }
+
+            SflBmpU8 code;
+            if (!SFL_BMP_READ(ctx, &code, 1)) {
+                return 0;
+            }
+
+            const SflBmpU8 left_pixel  = code >> 4;
+            const SflBmpU8 right_pixel = code & 0x0f;
+
+            SflBmpU32  image_offset = desc->width * y + x;
+            SflBmpU32* data         = out_pixels + image_offset;
+            data[0]                 = settings->color_table[left_pixel];
+
+            if (x < desc->width) {
+                data[1] = settings->color_table[right_pixel];
+                x++;
+            }
+        }
+    }
+
+    return 1;
+}
+
+#if SFL_BMP_IO_IMPLEMENTATION_STDIO
+#include <stdio.h>
+
+static PROC_SFL_BMP_IO_READ(sfl_bmp_stdlib_read)
+{
+    FILE* f   = (FILE*)usr;
+    int   ret = fread(ptr, size, 1, f);
+    return ret == 1;
+}
+
+static PROC_SFL_BMP_IO_SEEK(sfl_bmp_stdlib_seek)
+{
+    int whence_stdio = -1;
+
+    switch (whence) {
+        case SFL_BMP_IO_SET:
+            whence_stdio = SEEK_SET;
+            break;
+        case SFL_BMP_IO_CUR:
+            whence_stdio = SEEK_CUR;
+            break;
+        case SFL_BMP_IO_END:
+            whence_stdio = SEEK_END;
+            break;
+        default:
+            break;
+    }
+
+    FILE* f = (FILE*)usr;
+#if defined(_WIN32)
+    /* long is 32 bits on Windows, even on 64 bit targets */
+    return _fseeki64(f, offset, whence_stdio);
+#else
+    /* Fails, rather than seeking somewhere else, where long is 32 bits */
+    if ((SflBmpI64)(long)offset != offset) {
+        return -1;
+    }
+    return fseek(f, (long)offset, whence_stdio);
+#endif
+}
+
+static PROC_SFL_BMP_IO_TELL(sfl_bmp_stdlib_tell)
+{
+    FILE* f = (FILE*)usr;
+#if defined(_WIN32)
+    return _ftelli64(f);
+#else
+    return ftell(f);
+#endif
+}
+
+static PROC_SFL_BMP_IO_WRITE(sfl_bmp_stdlib_write)
+{
+    FILE* f = (FILE*)usr;
+    return fwrite(buf, size, 1, f) == 1;
+}
+
+static SflBmpIOImplementation SflBmp_IO_STDLIB = {
+    sfl_bmp_stdlib_read,
+    sfl_bmp_stdlib_write,
+    sfl_bmp_stdlib_seek,
+    sfl_bmp_stdlib_tell,
+    0,
+    0,
+};
+
+void sfl_bmp_stdio_init(SflBmpContext* ctx, SflBmpMemoryImplementation* memory)
+{
+    sfl_bmp_init(ctx, &SflBmp_IO_STDLIB, memory);
+}
+
+void sfl_bmp_stdio_set_file(SflBmpContext* ctx, FILE* file)
+{
+    sfl_bmp_set_io_usr(ctx, (void*)file);
+}
+
+SflBmpIOImplementation* sfl_bmp_stdio_get_implementation(void)
+{
+    return &SflBmp_IO_STDLIB;
+}
+
+#endif
+
+#if SFL_BMP_MEMORY_IMPLEMENTATION_STDLIB
+#include <stdlib.h>
+
+static PROC_SFL_BMP_MEMORY_ALLOCATE(sfl_bmp_stdlib_allocate)
+{
+    return malloc(size);
+}
+
+static PROC_SFL_BMP_MEMORY_RELEASE(sfl_bmp_stdlib_release) { free(ptr); }
+
+static SflBmpMemoryImplementation SflBmp_Memory_STDLIB = {
+    sfl_bmp_stdlib_allocate,
+    sfl_bmp_stdlib_release,
+    0,
+};
+
+void sfl_bmp_stdlib_init(SflBmpContext* ctx, SflBmpIOImplementation* io)
+{
+    sfl_bmp_init(ctx, io, &SflBmp_Memory_STDLIB);
+}
+
+SflBmpMemoryImplementation* sfl_bmp_stdlib_get_implementation(void)
+{
+    return &SflBmp_Memory_STDLIB;
+}
+
+/* SFL_BMP_MEMORY_IMPLEMENTATION_STDLIB */
+#endif
+
+#if SFL_BMP_IO_IMPLEMENTATION_STDIO && SFL_BMP_MEMORY_IMPLEMENTATION_STDLIB
+void sfl_bmp_cstd_init(SflBmpContext* ctx)
+{
+    sfl_bmp_init(ctx, &SflBmp_IO_STDLIB, &SflBmp_Memory_STDLIB);
+}
+
+#endif
+
+#if SFL_BMP_IO_IMPLEMENTATION_WINAPI
+
+static PROC_SFL_BMP_IO_READ(sfl_bmp_winapi_read)
+{
+    HANDLE* f = (HANDLE*)usr;
+    DWORD   bytes_read;
+    BOOL    success = ReadFile(*f, ptr, size, &bytes_read, NULL);
+    return success && (bytes_read == size);
+}
+
+static PROC_SFL_BMP_IO_SEEK(sfl_bmp_winapi_seek)
+{
+    DWORD move_method = 3;
+
+    switch (whence) {
+        case SFL_BMP_IO_SET:
+            move_method = FILE_BEGIN;
+            break;
+        case SFL_BMP_IO_CUR:
+            move_method = FILE_CURRENT;
+            break;
+        case SFL_BMP_IO_END:
+            move_method = FILE_END;
+            break;
+        default: {
+            return -1;
+        } break;
+    }
+
+    HANDLE*       f = (HANDLE*)usr;
+    LARGE_INTEGER distance;
+    distance.QuadPart = (LONGLONG)offset;
+    return SetFilePointerEx(*f, distance, 0, move_method) ? 0 : -1;
+}
+
+static PROC_SFL_BMP_IO_TELL(sfl_bmp_winapi_tell)
+{
+    HANDLE*       f = (HANDLE*)usr;
+    LARGE_INTEGER distance;
+    LARGE_INTEGER position;
+    distance.QuadPart = 0;
+    if (!SetFilePointerEx(*f, distance, &position, FILE_CURRENT)) {
+        return -1;
+    }
+    return (SflBmpI64)position.QuadPart;
+}
+
+static SflBmpIOImplementation SflBmp_IO_WINAPI = {
+    sfl_bmp_winapi_read,
+    0,
+    sfl_bmp_winapi_seek,
+    sfl_bmp_winapi_tell,
+    0,
+    0,
+};
+
+void sfl_bmp_winapi_io_init(
+    SflBmpContext* ctx, SflBmpMemoryImplementation* memory)
+{
+    sfl_bmp_init(ctx, &SflBmp_IO_WINAPI, memory);
+}
+
+void sfl_bmp_winapi_io_set_file(SflBmpContext* ctx, HANDLE* file)
+{
+    ctx->io.usr = (void*)file;
+}
+
+SflBmpIOImplementation* sfl_bmp_winapi_io_get_implementation(void)
+{
+    return &SflBmp_IO_WINAPI;
+}
+
+/* SFL_BMP_IO_IMPLEMENTATION_WINAPI */
+#endif
+
+#if SFL_BMP_BATCH || SFL_BMP_PARALLEL_ENCODE || SFL_BMP_QUANTIZE ||           \
+    SFL_BMP_TENSOR
+#if defined(_WIN32)
+#include <Windows.h>
+typedef HANDLE             SflBmpThread;
+typedef CRITICAL_SECTION   SflBmpMutex;
+typedef CONDITION_VARIABLE SflBmpCondition;
+
+#define SFL_BMP__THREAD_PROC(name) DWORD WINAPI name(LPVOID param)
+#define SFL_BMP__THREAD_RETURN     0
+#else
+#include <pthread.h>
+typedef pthread_t       SflBmpThread;
+typedef pthread_mutex_t SflBmpMutex;
+typedef pthread_cond_t  SflBmpCondition;
+
+#define SFL_BMP__THREAD_PROC(name) void* name(void* param)
+#define SFL_BMP__THREAD_RETURN     0
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#ifndef O_CLOEXEC
+#define O_CLOEXEC 0
+#endif
+#endif
+#include <stdio.h>
+
+#if SFL_BMP_BATCH_IO_URING
+#include <linux/io_uring.h>
+#include <linux/stat.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+
+typedef SFL_BMP__THREAD_PROC(ProcSflBmpThread);
+
+static int sfl_bmp__thread_start(
+    SflBmpThread* thread, ProcSflBmpThread* proc, void* param)
+{
+#if defined(_WIN32)
+    *thread = CreateThread(0, 0, proc, param, 0, 0);
+    return *thread != 0;
+#else
+    return pthread_create(thread, 0, proc, param) == 0;
+#endif
+}
+
+static void sfl_bmp__thread_join(SflBmpThread thread)
+{
+#if defined(_WIN32)
+    WaitForSingleObject(thread, INFINITE);
+    CloseHandle(thread);
+#else
+    pthread_join(thread, 0);
+#endif
+}
+
+static void sfl_bmp__mutex_init(SflBmpMutex* mutex)
+{
+#if defined(_WIN32)
+    InitializeCriticalSection(mutex);
+#else
+    pthread_mutex_init(mutex, 0);
+#endif
+}
+
+static void sfl_bmp__mutex_destroy(SflBmpMutex* mutex)
+{
+#if defined(_WIN32)
+    DeleteCriticalSection(mutex);
+#else
+    pthread_mutex_destroy(mutex);
+#endif
+}
+
+static void sfl_bmp__mutex_lock(SflBmpMutex* mutex)
+{
+#if defined(_WIN32)
+    EnterCriticalSection(mutex);
+#else
+    pthread_mutex_lock(mutex);
+#endif
+}
+
+static void sfl_bmp__mutex_unlock(SflBmpMutex* mutex)
+{
+#if defined(_WIN32)
+    LeaveCriticalSection(mutex);
+#else
+    pthread_mutex_unlock(mutex);
+#endif
+}
+
+/* Only the batch decoder's queue waits on conditions */
+#if SFL_BMP_BATCH
+static void sfl_bmp__condition_init(SflBmpCondition* cond)
+{
+#if defined(_WIN32)
+    InitializeConditionVariable(cond);
+#else
+    pthread_cond_init(cond, 0);
+#endif
+}
+
+static void sfl_bmp__condition_destroy(SflBmpCondition* cond)
+{
+#if defined(_WIN32)
+    (void)cond;
+#else
+    pthread_cond_destroy(cond);
+#endif
+}
+
+static void sfl_bmp__condition_wait(SflBmpCondition* cond, SflBmpMutex* mutex)
+{
+#if defined(_WIN32)
+    SleepConditionVariableCS(cond, mutex, INFINITE);
+#else
+    pthread_cond_wait(cond, mutex);
+#endif
+}
+
+static void sfl_bmp__condition_signal(SflBmpCondition* cond)
+{
+#if defined(_WIN32)
+    WakeConditionVariable(cond);
+#else
+    pthread_cond_signal(cond);
+#endif
+}
+
+static void sfl_bmp__condition_broadcast(SflBmpCondition* cond)
+{
+#if defined(_WIN32)
+    WakeAllConditionVariable(cond);
+#else
+    pthread_cond_broadcast(cond);
+#endif
+}
+/* SFL_BMP_BATCH */
+#endif
+
+/* SFL_BMP_BATCH || SFL_BMP_PARALLEL_ENCODE || SFL_BMP_QUANTIZE ||
+   SFL_BMP_TENSOR */
+#endif
+
+#if SFL_BMP_BATCH
+/** A file read into memory, waiting to be decoded */
+typedef struct {
+    SflBmpUSize index;
+    void*       data;
+    SflBmpUSize size;
+} SflBmpBatchEntry;
+
+typedef struct {
+    const char* const*  paths;
+    SflBmpUSize         count;
+    SflBmpBatchSettings settings;
+
+    SflBmpMutex     mutex;
+    /** Signaled when a file buffer is released */
+    SflBmpCondition not_full;
+    /** Signaled when a file is queued, or the last reader is done */
+    SflBmpCondition not_empty;
+
+    /** Ring of files waiting to be decoded, queue_depth entries */
+    SflBmpBatchEntry* queue;
+    int               head;
+    int               num_queued;
+    /** Files being read or waiting to be decoded */
+    int               num_in_flight;
+    /** Readers still running */
+    int               num_readers;
+    /** Next path to read */
+    SflBmpUSize       next;
+    SflBmpUSize       num_failed;
+} SflBmpBatch;
+
+/** Reads a whole file into a buffer allocated from mem */
+static void* sfl_bmp__batch_load(
+    SflBmpMemoryImplementation* mem, const char* path, SflBmpUSize* size)
+{
+#if defined(_WIN32)
+    void*     result = 0;
+    SflBmpI64 length;
+    FILE*     f = fopen(path, "rb");
+    if (!f) {
+        return 0;
+    }
+
+    if (_fseeki64(f, 0, SEEK_END) != 0) goto EXIT_PROC;
+    length = _ftelli64(f);
+    if (length <= 0 || !sfl_bmp__addressable((SflBmpU64)length)) {
+        goto EXIT_PROC;
+    }
+    if (_fseeki64(f, 0, SEEK_SET) != 0) goto EXIT_PROC;
+
+    result = mem->allocate(mem->usr, (SflBmpUSize)length);
+    if (!result) goto EXIT_PROC;
+
+    if (fread(result, (size_t)length, 1, f) != 1) {
+        mem->release(mem->usr, result);
+        result = 0;
+        goto EXIT_PROC;
+    }
+
+    *size = (SflBmpUSize)length;
+
+EXIT_PROC:
+    fclose(f);
+    return result;
+#else
+    /* open, lseek, pread(s) & close instead of stdio's buffered calls */
+    SflBmpU8*   result = 0;
+    off_t       length;
+    SflBmpUSize done = 0;
+    int         fd   = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return 0;
+    }
+
+    length = lseek(fd, 0, SEEK_END);
+    if (length <= 0 || !sfl_bmp__addressable((SflBmpU64)length)) {
+        goto EXIT_PROC;
+    }
+
+    result = (SflBmpU8*)mem->allocate(mem->usr, (SflBmpUSize)length);
+    if (!result) goto EXIT_PROC;
+
+    while (done < (SflBmpUSize)length) {
+        ssize_t n = pread(
+            fd, result + done, (size_t)length - done, (off_t)done);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            mem->release(mem->usr, result);
+            result = 0;
+            goto EXIT_PROC;
+        }
+        done += (SflBmpUSize)n;
+    }
+
+    *size = (SflBmpUSize)length;
+
+EXIT_PROC:
+    close(fd);
+    return result;
+#endif
+}
+
+static SFL_BMP__THREAD_PROC(sfl_bmp__batch_reader)
+{
+    SflBmpBatch* batch = (SflBmpBatch*)param;
+
+    sfl_bmp__mutex_lock(&batch->mutex);
+    for (;;) {
+        SflBmpBatchEntry entry;
+        int              tail;
+
+        while (batch->next < batch->count &&
+               batch->num_in_flight >= batch->settings.queue_depth)
+        {
+            sfl_bmp__condition_wait(&batch->not_full, &batch->mutex);
+        }
+
+        if (batch->next >= batch->count) {
+            break;
+        }
+
+        entry.index = batch->next++;
+        entry.size  = 0;
+        batch->num_in_flight++;
+        sfl_bmp__mutex_unlock(&batch->mutex);
+
+        /* A failed read is still queued, to be reported by a decoder */
+        entry.data = sfl_bmp__batch_load(
+            batch->settings.mem, batch->paths[entry.index], &entry.size);
+
+        sfl_bmp__mutex_lock(&batch->mutex);
+        tail = (batch->head + batch->num_queued) % batch->settings.queue_depth;
+        batch->queue[tail] = entry;
+        batch->num_queued++;
+        sfl_bmp__condition_signal(&batch->not_empty);
+    }
+
+    /* Wake the readers still waiting for a slot, there's nothing left */
+    batch->num_readers--;
+    sfl_bmp__condition_broadcast(&batch->not_full);
+    if (batch->num_readers == 0) {
+        sfl_bmp__condition_broadcast(&batch->not_empty);
+    }
+    sfl_bmp__mutex_unlock(&batch->mutex);
+
+    return SFL_BMP__THREAD_RETURN;
+}
+
+#if SFL_BMP_BATCH_IO_URING
+/**
+ * A minimal io_uring, driven with raw syscalls. Each file in flight owns a
+ * slot, and walks through openat & statx (submitted together), then as many
+ * reads as it takes, then close. Completions carry the slot and the request
+ * in user_data.
+ */
+typedef enum
+{
+    SFL_BMP__URING_OPENAT = 0,
+    SFL_BMP__URING_STATX  = 1,
+    SFL_BMP__URING_READ   = 2,
+    SFL_BMP__URING_CLOSE  = 3,
+} SflBmpUringRequest;
+
+typedef struct {
+    int                  fd;
+    unsigned*            sq_head;
+    unsigned*            sq_tail;
+    unsigned*            sq_mask;
+    unsigned*            sq_array;
+    unsigned*            cq_head;
+    unsigned*            cq_tail;
+    unsigned*            cq_mask;
+    struct io_uring_sqe* sqes;
+    struct io_uring_cqe* cqes;
+    void*                sq_ring;
+    SflBmpUSize          sq_ring_size;
+    void*                cq_ring;
+    SflBmpUSize          cq_ring_size;
+    SflBmpUSize          sqes_size;
+    /** Requests queued but not yet submitted */
+    unsigned             num_pending;
+    /** Requests submitted whose completion wasn't reaped yet */
+    unsigned             num_in_kernel;
+} SflBmpUring;
+
+typedef struct {
+    SflBmpBatchEntry entry;
+    int              active;
+    int              fd;
+    /** Requests of the current step still waiting for completion */
+    int              num_pending;
+    int              failed;
+    SflBmpUSize      done;
+    struct statx     stx;
+} SflBmpUringSlot;
+
+static void sfl_bmp__uring_close(SflBmpUring* ring)
+{
+    if (ring->fd < 0) return;
+    if (ring->sqes) munmap(ring->sqes, ring->sqes_size);
+    if (ring->cq_ring && ring->cq_ring != ring->sq_ring) {
+        munmap(ring->cq_ring, ring->cq_ring_size);
+    }
+    if (ring->sq_ring) munmap(ring->sq_ring, ring->sq_ring_size);
+    close(ring->fd);
+}
+
+/** Returns 0 if io_uring, or one of the requests needed, is unavailable */
+static int sfl_bmp__uring_open(SflBmpUring* ring, unsigned entries)
+{
+    static const int       required[] = {
+        IORING_OP_OPENAT,
+        IORING_OP_STATX,
+        IORING_OP_READ,
+        IORING_OP_CLOSE,
+    };
+    struct io_uring_params params;
+    struct io_uring_probe* probe;
+    SflBmpU64              probe_storage
+        [(sizeof(struct io_uring_probe) +
+          sizeof(struct io_uring_probe_op) * 64) / sizeof(SflBmpU64)];
+    unsigned i;
+
+    memset(ring, 0, sizeof(*ring));
+    memset(&params, 0, sizeof(params));
+    ring->fd = (int)syscall(__NR_io_uring_setup, entries, &params);
+    if (ring->fd < 0) {
+        return 0;
+    }
+
+    probe = (struct io_uring_probe*)probe_storage;
+    memset(probe_storage, 0, sizeof(probe_storage));
+    if (syscall(
+            __NR_io_uring_register,
+            ring->fd,
+            IORING_REGISTER_PROBE,
+            probe,
+            64) < 0)
+    {
+        close(ring->fd);
+        return 0;
+    }
+
+    for (i = 0; i < sizeof(required) / sizeof(required[0]); ++i) {
+        if (required[i] > probe->last_op ||
+            !(probe->ops[required[i]].flags & IO_URING_OP_SUPPORTED))
+        {
+            close(ring->fd);
+            return 0;
+        }
+    }
+
+    ring->sq_ring_size =
+        params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_ring_size =
+        params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cq_ring_size > ring->sq_ring_size) {
+            ring->sq_ring_size = ring->cq_ring_size;
+        }
+        ring->cq_ring_size = ring->sq_ring_size;
+    }
+
+    ring->sq_ring = mmap(
+        0,
+        ring->sq_ring_size,
+        PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE,
+        ring->fd,
+        IORING_OFF_SQ_RING);
+    if (ring->sq_ring == MAP_FAILED) {
+        ring->sq_ring = 0;
+        goto EXIT_ERROR;
+    }
+
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->cq_ring = ring->sq_ring;
+    } else {
+        ring->cq_ring = mmap(
+            0,
+            ring->cq_ring_size,
+            PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE,
+            ring->fd,
+            IORING_OFF_CQ_RING);
+        if (ring->cq_ring == MAP_FAILED) {
+            ring->cq_ring = 0;
+            goto EXIT_ERROR;
+        }
+    }
+
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes      = (struct io_uring_sqe*)mmap(
+        0,
+        ring->sqes_size,
+        PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE,
+        ring->fd,
+        IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        ring->sqes = 0;
+        goto EXIT_ERROR;
+    }
+
+    ring->sq_head  = (unsigned*)((char*)ring->sq_ring + params.sq_off.head);
+    ring->sq_tail  = (unsigned*)((char*)ring->sq_ring + params.sq_off.tail);
+    ring->sq_mask  = (unsigned*)((char*)ring->sq_ring + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned*)((char*)ring->sq_ring + params.sq_off.array);
+    ring->cq_head  = (unsigned*)((char*)ring->cq_ring + params.cq_off.head);
+    ring->cq_tail  = (unsigned*)((char*)ring->cq_ring + params.cq_off.tail);
+    ring->cq_mask  = (unsigned*)((char*)ring->cq_ring + params.cq_off.ring_mask);
+    ring->cqes =
+        (struct io_uring_cqe*)((char*)ring->cq_ring + params.cq_off.cqes);
+    return 1;
+
+EXIT_ERROR:
+    sfl_bmp__uring_close(ring);
+    return 0;
+}
+
+/** Queues a zeroed request, submitted by the next sfl_bmp__uring_submit */
+static struct io_uring_sqe* sfl_bmp__uring_push(
+    SflBmpUring* ring, int op, SflBmpUSize slot, SflBmpUringRequest request)
+{
+    unsigned             tail  = *ring->sq_tail;
+    unsigned             index = tail & *ring->sq_mask;
+    struct io_uring_sqe* sqe   = &ring->sqes[index];
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode          = (SflBmpU8)op;
+    sqe->user_data       = (SflBmpU64)slot * 4 + request;
+    ring->sq_array[index] = index;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ring->num_pending++;
+    return sqe;
+}
+
+/** Submits the queued requests, and waits for at least one completion */
+static int sfl_bmp__uring_submit(SflBmpUring* ring)
+{
+    for (;;) {
+        long ret = syscall(
+            __NR_io_uring_enter,
+            ring->fd,
+            ring->num_pending,
+            1,
+            IORING_ENTER_GETEVENTS,
+            0,
+            0);
+        if (ret >= 0) {
+            ring->num_pending -= (unsigned)ret;
+            ring->num_in_kernel += (unsigned)ret;
+            return 1;
+        }
+
+        if (errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+            return 0;
+        }
+    }
+}
+
+static void sfl_bmp__uring_read(
+    SflBmpUring* ring, SflBmpUringSlot* slot, SflBmpUSize index)
+{
+    struct io_uring_sqe* sqe = sfl_bmp__uring_push(
+        ring, IORING_OP_READ, index, SFL_BMP__URING_READ);
+    sqe->fd   = slot->fd;
+    sqe->addr = (SflBmpU64)(SflBmpUSize)((SflBmpU8*)slot->entry.data +
+                                         slot->done);
+    /* Linux reads at most 0x7FFFF000 bytes at once, the rest comes next */
+    sqe->len  = (slot->entry.size - slot->done > 0x7FFFF000)
+                    ? 0x7FFFF000
+                    : (SflBmpU32)(slot->entry.size - slot->done);
+    sqe->off  = slot->done;
+    slot->num_pending = 1;
+}
+
+/** Closes the file, or finishes the slot if it was never opened */
+static int sfl_bmp__uring_finish(
+    SflBmpUring* ring, SflBmpUringSlot* slot, SflBmpUSize index)
+{
+    if (slot->fd >= 0) {
+        struct io_uring_sqe* sqe = sfl_bmp__uring_push(
+            ring, IORING_OP_CLOSE, index, SFL_BMP__URING_CLOSE);
+        sqe->fd           = slot->fd;
+        slot->fd          = -1;
+        slot->num_pending = 1;
+        return 0;
+    }
+
+    return 1;
+}
+
+/**
+ * Advances a slot after one of its requests completed. Returns 1 once the
+ * file is read (or failed) and closed
+ */
+static int sfl_bmp__uring_complete(
+    SflBmpUring*                ring,
+    SflBmpMemoryImplementation* mem,
+    SflBmpUringSlot*            slot,
+    SflBmpUSize                 index,
+    SflBmpUringRequest          request,
+    int                         res)
+{
+    slot->num_pending--;
+
+    switch (request) {
+        case SFL_BMP__URING_OPENAT: {
+            if (res < 0) {
+                slot->failed = 1;
+            } else {
+                slot->fd = res;
+            }
+        } break;
+
+        case SFL_BMP__URING_STATX: {
+            if (res < 0 || slot->stx.stx_size == 0 ||
+                !sfl_bmp__addressable(slot->stx.stx_size))
+            {
+                slot->failed = 1;
+            }
+        } break;
+
+        case SFL_BMP__URING_READ: {
+            if (res <= 0) {
+                slot->failed = 1;
+            } else {
+                slot->done += (SflBmpUSize)res;
+            }
+        } break;
+
+        case SFL_BMP__URING_CLOSE: {
+            return 1;
+        } break;
+    }
+
+    if (slot->num_pending > 0) {
+        return 0;
+    }
+
+    if (slot->failed) {
+        if (slot->entry.data) {
+            mem->release(mem->usr, slot->entry.data);
+            slot->entry.data = 0;
+        }
+        return sfl_bmp__uring_finish(ring, slot, index);
+    }
+
+    if (request != SFL_BMP__URING_READ) {
+        slot->entry.size = (SflBmpUSize)slot->stx.stx_size;
+        slot->entry.data = mem->allocate(mem->usr, slot->entry.size);
+        if (!slot->entry.data) {
+            return sfl_bmp__uring_finish(ring, slot, index);
+        }
+    }
+
+    if (slot->done < slot->entry.size) {
+        sfl_bmp__uring_read(ring, slot, index);
+        return 0;
+    }
+
+    return sfl_bmp__uring_finish(ring, slot, index);
+}
+
+/**
+ * Waits for every submitted request, so that none of them can land in a slot
+ * or a buffer once it's released. Files that were opened are left in their
+ * slot's fd. Returns 0 if the ring stopped working before that
+ */
+static int sfl_bmp__uring_drain(SflBmpUring* ring, SflBmpUringSlot* slots)
+{
+    while (ring->num_in_kernel > 0) {
+        unsigned head = *ring->cq_head;
+        unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+
+        if (head == tail) {
+            long ret = syscall(
+                __NR_io_uring_enter,
+                ring->fd,
+                0,
+                1,
+                IORING_ENTER_GETEVENTS,
+                0,
+                0);
+            if (ret < 0 && errno != EINTR && errno != EAGAIN &&
+                errno != EBUSY)
+            {
+                return 0;
+            }
+            continue;
+        }
+
+        while (head != tail) {
+            struct io_uring_cqe* cqe   = &ring->cqes[head & *ring->cq_mask];
+            SflBmpUringSlot*     slot  = &slots[cqe->user_data / 4];
+
+            if (cqe->user_data % 4 == SFL_BMP__URING_OPENAT && cqe->res >= 0) {
+                slot->fd = cqe->res;
+            }
+            ring->num_in_kernel--;
+            head++;
+        }
+        __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+    }
+
+    return 1;
+}
+
+typedef struct {
+    SflBmpBatch*     batch;
+    SflBmpUring      ring;
+    SflBmpUringSlot* slots;
+    /** Set if requests might still be in flight after the ring was closed,
+     *  in which case the slots & their buffers are never released */
+    int              undrained;
+} SflBmpUringReader;
+
+/**
+ * Reads up to queue_depth files at once with a single thread, queueing each
+ * one for decoding as soon as it's closed
+ */
+static SFL_BMP__THREAD_PROC(sfl_bmp__batch_uring_reader)
+{
+    SflBmpUringReader*          reader = (SflBmpUringReader*)param;
+    SflBmpBatch*                batch  = reader->batch;
+    SflBmpUring*                ring   = &reader->ring;
+    SflBmpMemoryImplementation* mem    = batch->settings.mem;
+    const int                   depth  = batch->settings.queue_depth;
+    int                         num_active = 0;
+    int                         broken     = 0;
+    int                         i;
+
+    sfl_bmp__mutex_lock(&batch->mutex);
+    for (;;) {
+        unsigned head, tail;
+
+        /* Queue the finished files, then start new ones in their slots */
+        for (i = 0; i < depth; ++i) {
+            SflBmpUringSlot* slot = &reader->slots[i];
+            int              next_tail;
+
+            if (slot->active != 2) continue;
+
+            next_tail =
+                (batch->head + batch->num_queued) % batch->settings.queue_depth;
+            batch->queue[next_tail] = slot->entry;
+            batch->num_queued++;
+            slot->active = 0;
+            num_active--;
+            sfl_bmp__condition_signal(&batch->not_empty);
+        }
+
+        for (i = 0; i < depth && !broken; ++i) {
+            SflBmpUringSlot*     slot = &reader->slots[i];
+            struct io_uring_sqe* sqe;
+            const char*          path;
+
+            if (slot->active) continue;
+            if (batch->next >= batch->count ||
+                batch->num_in_flight >= batch->settings.queue_depth)
+            {
+                break;
+            }
+
+            memset(slot, 0, sizeof(*slot));
+            slot->active      = 1;
+            slot->fd          = -1;
+            slot->num_pending = 2;
+            slot->entry.index = batch->next++;
+            batch->num_in_flight++;
+            num_active++;
+
+            path = batch->paths[slot->entry.index];
+
+            sqe = sfl_bmp__uring_push(
+                ring, IORING_OP_OPENAT, i, SFL_BMP__URING_OPENAT);
+            sqe->fd          = AT_FDCWD;
+            sqe->addr        = (SflBmpU64)(SflBmpUSize)path;
+            sqe->open_flags  = O_RDONLY | O_CLOEXEC;
+
+            sqe = sfl_bmp__uring_push(
+                ring, IORING_OP_STATX, i, SFL_BMP__URING_STATX);
+            sqe->fd          = AT_FDCWD;
+            sqe->addr        = (SflBmpU64)(SflBmpUSize)path;
+            sqe->len         = STATX_SIZE;
+            sqe->off         = (SflBmpU64)(SflBmpUSize)&slot->stx;
+            sqe->statx_flags = 0;
+        }
+
+        if (num_active == 0) {
+            if (batch->next >= batch->count || broken) {
+                break;
+            }
+
+            sfl_bmp__condition_wait(&batch->not_full, &batch->mutex);
+            continue;
+        }
+        sfl_bmp__mutex_unlock(&batch->mutex);
+
+        if (!sfl_bmp__uring_submit(ring)) {
+            /* Wait for what the kernel already took before tearing the ring
+             * down, then read what was in flight the plain way. Buffers that
+             * might still be written to are leaked, rather than released */
+            reader->undrained = !sfl_bmp__uring_drain(ring, reader->slots);
+            sfl_bmp__uring_close(ring);
+            ring->fd = -1;
+            for (i = 0; i < depth; ++i) {
+                SflBmpUringSlot* slot = &reader->slots[i];
+                if (slot->active != 1) continue;
+                if (slot->entry.data && !reader->undrained) {
+                    mem->release(mem->usr, slot->entry.data);
+                }
+                if (slot->fd >= 0) close(slot->fd);
+                slot->fd         = -1;
+                slot->entry.data = sfl_bmp__batch_load(
+                    mem, batch->paths[slot->entry.index], &slot->entry.size);
+                slot->active = 2;
+            }
+
+            sfl_bmp__mutex_lock(&batch->mutex);
+            broken = 1;
+            continue;
+        }
+
+        head = *ring->cq_head;
+        tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+        while (head != tail) {
+            struct io_uring_cqe* cqe = &ring->cqes[head & *ring->cq_mask];
+            SflBmpUSize          index = (SflBmpUSize)(cqe->user_data / 4);
+            SflBmpUringRequest   request =
+                (SflBmpUringRequest)(cqe->user_data % 4);
+
+            if (sfl_bmp__uring_complete(
+                    ring, mem, &reader->slots[index], index, request, cqe->res))
+            {
+                reader->slots[index].active = 2;
+            }
+            ring->num_in_kernel--;
+            head++;
+        }
+        __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+
+        sfl_bmp__mutex_lock(&batch->mutex);
+    }
+
+    sfl_bmp__mutex_unlock(&batch->mutex);
+
+    /* Whatever is left is read with pread, on this thread */
+    return sfl_bmp__batch_reader(batch);
+}
+
+/* SFL_BMP_BATCH_IO_URING */
+#endif
+
+static SFL_BMP__THREAD_PROC(sfl_bmp__batch_decoder)
+{
+    SflBmpBatch*                 batch = (SflBmpBatch*)param;
+    SflBmpMemoryImplementation*  mem   = batch->settings.mem;
+    SflBmpContext                ctx;
+    SflBmpIOImplementationMemory source;
+    SflBmpLimits                 limits;
+
+    /* sfl_bmp_init would reset the (shared) memory implementation's usr.
+     * Everything else (stats, pixel stats...) stays off */
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.io  = SflBmp_IO_Memory;
+    ctx.mem = mem;
+    if (batch->settings.limits) {
+        limits        = *batch->settings.limits;
+        limits.in_use = 0;
+        ctx.limits    = &limits;
+    }
+
+    sfl_bmp__mutex_lock(&batch->mutex);
+    for (;;) {
+        SflBmpBatchEntry entry;
+        SflBmpDesc       desc;
+        int              ok = 0;
+
+        while (batch->num_queued == 0 && batch->num_readers > 0) {
+            sfl_bmp__condition_wait(&batch->not_empty, &batch->mutex);
+        }
+
+        if (batch->num_queued == 0) {
+            break;
+        }
+
+        entry       = batch->queue[batch->head];
+        batch->head = (batch->head + 1) % batch->settings.queue_depth;
+        batch->num_queued--;
+        sfl_bmp__mutex_unlock(&batch->mutex);
+
+        memset(&desc, 0, sizeof(desc));
+        desc.format = batch->settings.format;
+        if (entry.data) {
+            sfl_bmp_memory_io_set_source(&ctx, &source, entry.data, entry.size);
+            ok = sfl_bmp_decode(&ctx, &desc);
+            mem->release(mem->usr, entry.data);
+        }
+
+        /* Let the readers refill the queue while the callback runs */
+        sfl_bmp__mutex_lock(&batch->mutex);
+        batch->num_in_flight--;
+        if (!ok) batch->num_failed++;
+        sfl_bmp__condition_signal(&batch->not_full);
+        sfl_bmp__mutex_unlock(&batch->mutex);
+
+        if (!ok) desc.data = 0;
+        batch->settings.done(
+            batch->settings.usr,
+            entry.index,
+            batch->paths[entry.index],
+            ok,
+            &desc);
+
+        sfl_bmp__mutex_lock(&batch->mutex);
+    }
+    sfl_bmp__mutex_unlock(&batch->mutex);
+
+    return SFL_BMP__THREAD_RETURN;
+}
+
+int sfl_bmp_batch_decode(
+    const char* const* paths, SflBmpUSize count, SflBmpBatchSettings* settings)
+{
+    SflBmpBatch       batch;
+    SflBmpThread*     threads;
+    ProcSflBmpThread* reader_proc;
+    void*             reader;
+    int               num_readers;
+    int               num_threads = 0;
+    int               num_workers;
+#if SFL_BMP_BATCH_IO_URING
+    SflBmpUringReader uring;
+#endif
+    int               result = 0;
+    int               i;
+
+    memset(&batch, 0, sizeof(batch));
+    batch.paths    = paths;
+    batch.count    = count;
+    batch.settings = *settings;
+
+    if (batch.settings.num_io_threads <= 0) {
+        batch.settings.num_io_threads = 1;
+    }
+
+    if (batch.settings.num_decode_threads <= 0) {
+        batch.settings.num_decode_threads = 1;
+    }
+
+    if (batch.settings.queue_depth <= 0) {
+        batch.settings.queue_depth = batch.settings.num_decode_threads * 2;
+    }
+
+    if (!batch.settings.mem) {
+#if SFL_BMP_MEMORY_IMPLEMENTATION_STDLIB
+        batch.settings.mem = &SflBmp_Memory_STDLIB;
+#else
+        return 0;
+#endif
+    }
+
+    if (!batch.settings.done) {
+        return 0;
+    }
+
+    num_workers = batch.settings.num_io_threads +
+                  batch.settings.num_decode_threads - 1;
+    num_readers = batch.settings.num_io_threads;
+    reader_proc = sfl_bmp__batch_reader;
+    reader      = &batch;
+
+    batch.queue = (SflBmpBatchEntry*)batch.settings.mem->allocate(
+        batch.settings.mem->usr,
+        sizeof(SflBmpBatchEntry) * batch.settings.queue_depth +
+            sizeof(SflBmpThread) * num_workers);
+    if (!batch.queue) {
+        return 0;
+    }
+    threads = (SflBmpThread*)(batch.queue + batch.settings.queue_depth);
+
+#if SFL_BMP_BATCH_IO_URING
+    /* A single thread keeps the whole queue depth in flight. Without
+     * io_uring, num_io_threads pread readers are used instead */
+    uring.batch     = &batch;
+    uring.slots     = 0;
+    uring.undrained = 0;
+    if (sfl_bmp__uring_open(
+            &uring.ring, (unsigned)batch.settings.queue_depth * 2))
+    {
+        uring.slots = (SflBmpUringSlot*)batch.settings.mem->allocate(
+            batch.settings.mem->usr,
+            sizeof(SflBmpUringSlot) * batch.settings.queue_depth);
+        if (uring.slots) {
+            memset(
+                uring.slots,
+                0,
+                sizeof(SflBmpUringSlot) * batch.settings.queue_depth);
+            num_readers = 1;
+            reader_proc = sfl_bmp__batch_uring_reader;
+            reader      = &uring;
+        } else {
+            sfl_bmp__uring_close(&uring.ring);
+        }
+    }
+#endif
+
+    sfl_bmp__mutex_init(&batch.mutex);
+    sfl_bmp__condition_init(&batch.not_full);
+    sfl_bmp__condition_init(&batch.not_empty);
+
+    batch.num_readers = num_readers;
+    for (i = 0; i < num_readers; ++i) {
+        if (!sfl_bmp__thread_start(&threads[num_threads], reader_proc, reader))
+        {
+            break;
+        }
+        num_threads++;
+    }
+
+    if (num_threads < num_readers) {
+        /* Stop reading; files already claimed still get decoded */
+        sfl_bmp__mutex_lock(&batch.mutex);
+        batch.num_readers -= num_readers - num_threads;
+        batch.next = batch.count;
+        sfl_bmp__condition_broadcast(&batch.not_full);
+        sfl_bmp__condition_broadcast(&batch.not_empty);
+        sfl_bmp__mutex_unlock(&batch.mutex);
+    } else {
+        for (i = 1; i < batch.settings.num_decode_threads; ++i) {
+            if (!sfl_bmp__thread_start(
+                    &threads[num_threads], sfl_bmp__batch_decoder, &batch))
+            {
+                break;
+            }
+            num_threads++;
+        }
+
+        result = 1;
+    }
+
+    /* The calling thread is always a decoder */
+    sfl_bmp__batch_decoder(&batch);
+
+    for (i = 0; i < num_threads; ++i) {
+        sfl_bmp__thread_join(threads[i]);
+    }
+
+    sfl_bmp__condition_destroy(&batch.not_empty);
+    sfl_bmp__condition_destroy(&batch.not_full);
+    sfl_bmp__mutex_destroy(&batch.mutex);
+#if SFL_BMP_BATCH_IO_URING
+    if (uring.slots) {
+        sfl_bmp__uring_close(&uring.ring);
+        if (!uring.undrained) {
+            batch.settings.mem->release(batch.settings.mem->usr, uring.slots);
+        }
+    }
+#endif
+    batch.settings.mem->release(batch.settings.mem->usr, batch.queue);
+
+    return result && (batch.num_failed == 0) && (batch.next == batch.count);
+}
+
+/* SFL_BMP_BATCH */
+#endif
+
+#if SFL_BMP_PARALLEL_ENCODE
+#if defined(_WIN32)
+typedef HANDLE SflBmpFileHandle;
+#else
+typedef int SflBmpFileHandle;
+#endif
+
+/** Writes size bytes at offset, without touching the file pointer */
+static int sfl_bmp__pwrite(
+    SflBmpFileHandle file, const void* buf, SflBmpUSize size, SflBmpU64 offset)
+{
+#if defined(_WIN32)
+    OVERLAPPED overlapped;
+    DWORD      written;
+
+    memset(&overlapped, 0, sizeof(overlapped));
+    overlapped.Offset     = (DWORD)(offset & 0xFFFFFFFF);
+    overlapped.OffsetHigh = (DWORD)(offset >> 32);
+    return WriteFile(file, buf, (DWORD)size, &written, &overlapped) &&
+           (written == size);
+#else
+    const SflBmpU8* ptr = (const SflBmpU8*)buf;
+    while (size > 0) {
+        ssize_t n = pwrite(file, ptr, size, (off_t)offset);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return 0;
+        ptr    += n;
+        size   -= (SflBmpUSize)n;
+        offset += (SflBmpU64)n;
+    }
+    return 1;
+#endif
+}
+
+/** Write-only IO over a file handle, used for the headers */
+typedef struct {
+    SflBmpFileHandle file;
+    SflBmpU64        offset;
+} SflBmpPositionalFile;
+
+static PROC_SFL_BMP_IO_WRITE(sfl_bmp__positional_write)
+{
+    SflBmpPositionalFile* f = (SflBmpPositionalFile*)usr;
+    if (!sfl_bmp__pwrite(f->file, buf, size, f->offset)) {
+        return 0;
+    }
+    f->offset += size;
+    return 1;
+}
+
+typedef struct {
+    SflBmpDesc*      in;
+    SflBmpDesc*      out;
+    SflBmpConverter  conv;
+    SflBmpFileHandle file;
+    /** File offset of the first row */
+    SflBmpU64        offset;
+    SflBmpU32        band_rows;
+    SflBmpU32        num_bands;
+
+    SflBmpMutex mutex;
+    SflBmpU32   next_band;
+    int         failed;
+} SflBmpParallelEncode;
+
+typedef struct {
+    SflBmpParallelEncode* encode;
+    /** band_rows rows of output */
+    SflBmpU8*             band;
+} SflBmpParallelEncodeWorker;
+
+static SFL_BMP__THREAD_PROC(sfl_bmp__parallel_encode_worker)
+{
+    SflBmpParallelEncodeWorker* worker = (SflBmpParallelEncodeWorker*)param;
+    SflBmpParallelEncode*       encode = worker->encode;
+    SflBmpDesc*                 in     = encode->in;
+    SflBmpDesc*                 out    = encode->out;
+
+    for (;;) {
+        SflBmpU32 band, first, count, y;
+        int       failed;
+
+        sfl_bmp__mutex_lock(&encode->mutex);
+        band   = encode->next_band++;
+        failed = encode->failed;
+        sfl_bmp__mutex_unlock(&encode->mutex);
+
+        if (band >= encode->num_bands || failed) {
+            break;
+        }
+
+        first = band * encode->band_rows;
+        count = in->height - first;
+        if (count > encode->band_rows) {
+            count = encode->band_rows;
+        }
+
+        for (y = 0; y < count; ++y) {
+            const SflBmpU8* in_row =
+                (const SflBmpU8*)in->data + (SflBmpUSize)(first + y) * in->pitch;
+            encode->conv.convert_row(
+                &encode->conv,
+                in_row,
+                worker->band + (SflBmpUSize)y * out->pitch,
+                in->width,
+                first + y);
+        }
+
+        if (!sfl_bmp__pwrite(
+                encode->file,
+                worker->band,
+                (SflBmpUSize)count * out->pitch,
+                encode->offset + (SflBmpU64)first * out->pitch))
+        {
+            sfl_bmp__mutex_lock(&encode->mutex);
+            encode->failed = 1;
+            sfl_bmp__mutex_unlock(&encode->mutex);
+            break;
+        }
+    }
+
+    return SFL_BMP__THREAD_RETURN;
+}
+
+int sfl_bmp_encode_parallel(
+    SflBmpContext* ctx,
+    SflBmpDesc*    in_desc,
+    const char*    path,
+    SflBmpDesc*    out_desc,
+    int            num_threads)
+{
+    SflBmpParallelEncode        encode;
+    SflBmpParallelEncodeWorker* workers = 0;
+    SflBmpThread*               threads;
+    SflBmpPositionalFile        file;
+    SflBmpContext               header_ctx;
+    SflBmpU64                   file_size;
+    SflBmpUSize                 band_size;
+    int                         num_started = 0;
+    int                         result      = 0;
+    int                         i;
+    SFL_BMP__STAGE_DECLARE(convert_time);
+
+    /* Empty images have no rows to split into bands */
+    if (!in_desc->data || in_desc->width == 0 || in_desc->height == 0) {
+        return 0;
+    }
+
+    if (num_threads <= 0) {
+        num_threads = 1;
+    }
+
+#if defined(_WIN32)
+    file.file = CreateFileA(
+        path,
+        GENERIC_WRITE,
+        0,
+        0,
+        CREATE_ALWAYS,
+        FILE_ATTRIBUTE_NORMAL,
+        0);
+    if (file.file == INVALID_HANDLE_VALUE) {
+        return 0;
+    }
+#else
+    file.file = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (file.file < 0) {
+        return 0;
+    }
+#endif
+    file.offset = 0;
+
+    /* The headers go through the usual path, on an IO that pwrites them */
+    header_ctx          = *ctx;
+    header_ctx.io.read  = 0;
+    header_ctx.io.seek  = 0;
+    header_ctx.io.tell  = 0;
+    header_ctx.io.write = sfl_bmp__positional_write;
+    header_ctx.io.usr   = &file;
+    if (!sfl_bmp__encode_header(&header_ctx, in_desc, out_desc)) {
+        goto EXIT_PROC;
+    }
+
+    /* Reserve the whole file up front, so bands can land in any order */
+    file_size = file.offset + out_desc->size;
+#if defined(_WIN32)
+    {
+        LARGE_INTEGER size;
+        size.QuadPart = (LONGLONG)file_size;
+        if (!SetFilePointerEx(file.file, size, 0, FILE_BEGIN) ||
+            !SetEndOfFile(file.file))
+        {
+            goto EXIT_PROC;
+        }
+    }
+#else
+    if (posix_fallocate(file.file, 0, (off_t)file_size) != 0 &&
+        ftruncate(file.file, (off_t)file_size) != 0)
+    {
+        goto EXIT_PROC;
+    }
+#endif
+
+    memset(&encode, 0, sizeof(encode));
+    encode.in     = in_desc;
+    encode.out    = out_desc;
+    encode.file   = file.file;
+    encode.offset = file.offset;
+    sfl_bmp__converter_init(&encode.conv, in_desc, out_desc);
+
+    /* Bands of about 1MiB, but at least one per thread */
+    encode.band_rows = (1u << 20) / out_desc->pitch;
+    if (encode.band_rows * (SflBmpU32)num_threads > in_desc->height) {
+        encode.band_rows = (in_desc->height + num_threads - 1) / num_threads;
+    }
+    if (encode.band_rows == 0) {
+        encode.band_rows = 1;
+    }
+    encode.num_bands =
+        (in_desc->height + encode.band_rows - 1) / encode.band_rows;
+    band_size = (SflBmpUSize)encode.band_rows * out_desc->pitch;
+
+    /* Everything is allocated here, so ctx->mem needn't be thread safe */
+    workers = (SflBmpParallelEncodeWorker*)SFL_BMP_ALLOCATE(
+        ctx,
+        (sizeof(SflBmpParallelEncodeWorker) + sizeof(SflBmpThread) +
+         band_size) *
+            num_threads);
+    if (!workers) {
+        goto EXIT_PROC;
+    }
+    threads = (SflBmpThread*)(workers + num_threads);
+
+    for (i = 0; i < num_threads; ++i) {
+        workers[i].encode = &encode;
+        workers[i].band   = (SflBmpU8*)(threads + num_threads) + band_size * i;
+        /* Padding is never touched by the converter */
+        memset(workers[i].band, 0, band_size);
+    }
+
+    sfl_bmp__mutex_init(&encode.mutex);
+    SFL_BMP__STAGE_BEGIN(ctx, SFL_BMP_STAGE_CONVERT, convert_time);
+
+    for (i = 1; i < num_threads; ++i) {
+        if (!sfl_bmp__thread_start(
+                &threads[num_started],
+                sfl_bmp__parallel_encode_worker,
+                &workers[i]))
+        {
+            break;
+        }
+        num_started++;
+    }
+
+    /* The calling thread takes bands too, and all of them if no thread
+     * could be started */
+    sfl_bmp__parallel_encode_worker(&workers[0]);
+
+    for (i = 0; i < num_started; ++i) {
+        sfl_bmp__thread_join(threads[i]);
+    }
+
+    SFL_BMP__STAGE_END(ctx, SFL_BMP_STAGE_CONVERT, convert_time);
+    sfl_bmp__mutex_destroy(&encode.mutex);
+
+#if SFL_BMP_STATS
+    if (ctx->stats) {
+        ctx->stats->num_writes += encode.num_bands;
+        ctx->stats->bytes_written += out_desc->size;
+    }
+#endif
+
+    result = !encode.failed;
+
+EXIT_PROC:
+    if (workers) {
+        SFL_BMP_RELEASE(
+            ctx,
+            workers,
+            (sizeof(SflBmpParallelEncodeWorker) + sizeof(SflBmpThread) +
+             band_size) *
+                num_threads);
+    }
+#if defined(_WIN32)
+    CloseHandle(file.file);
+#else
+    if (close(file.file) != 0) {
+        result = 0;
+    }
+#endif
+    return result;
+}
+
+/* SFL_BMP_PARALLEL_ENCODE */
+#endif
+
+#if SFL_BMP_QUANTIZE
+/** Histogram bins are colors with 5 bits per component */
+#define SFL_BMP__QUANTIZE_BINS (1 << 15)
+/** The nearest color cache has cells of 6 bits per component */
+#define SFL_BMP__QUANTIZE_CELLS (1 << 18)
+/** Rows per band. Fixed, so that the output doesn't depend on the threads */
+#define SFL_BMP__QUANTIZE_BAND_ROWS 32
+
+typedef struct {
+    SflBmpU32 count;
+    /** Sum of each component (R, G, B) of the pixels in the bin */
+    SflBmpU64 sum[3];
+} SflBmpQuantizeBin;
+
+/** A range of bin ids, and the bounds of their components */
+typedef struct {
+    SflBmpU32 begin, end;
+    SflBmpU64 count;
+    SflBmpU32 lo[3], hi[3];
+} SflBmpQuantizeBox;
+
+typedef struct {
+    SflBmpDesc*      in;
+    SflBmpDesc*      out;
+    /** in->height rows of in->pitch bytes */
+    const SflBmpU8*  source;
+    /** out->height rows of out->pitch bytes, the pixel data of the file */
+    SflBmpU8*        rows;
+    SflBmpConverter  conv;
+    SflBmpDither     dither;
+    /** Amplitude of the ordered dither */
+    SflBmpI32        spread;
+    SflBmpU32        bpp;
+    SflBmpU32        num_colors;
+    /** The palette, one array per component (R, G, B), sorted by green */
+    SflBmpI32        palette[3][256];
+    /** Index of the first color with at least as much green as each value */
+    SflBmpU16        first_green[256];
+    SflBmpU32        num_bands;
+
+    SflBmpMutex mutex;
+    SflBmpU32   next_band;
+} SflBmpQuantize;
+
+typedef struct {
+    SflBmpQuantize* quantize;
+    /** One row of B8G8R8A8 */
+    SflBmpU32*      pixels;
+    /** Diffused error x16, two rows of (width + 2) RGB triplets */
+    SflBmpI32*      errors;
+    /** Index + 1 of the nearest color to each cell, 0 if not known yet */
+    SflBmpU16*      cache;
+} SflBmpQuantizeWorker;
+
+static const SflBmpU8 sfl_bmp__bayer[8][8] = {
+    {0, 32, 8, 40, 2, 34, 10, 42},
+    {48, 16, 56, 24, 50, 18, 58, 26},
+    {12, 44, 4, 36, 14, 46, 6, 38},
+    {60, 28, 52, 20, 62, 30, 54, 22},
+    {3, 35, 11, 43, 1, 33, 9, 41},
+    {51, 19, 59, 27, 49, 17, 57, 25},
+    {15, 47, 7, 39, 13, 45, 5, 37},
+    {63, 31, 55, 23, 61, 29, 53, 21},
+};
+
+static SflBmpU32 sfl_bmp__quantize_component(SflBmpU32 bin, int component)
+{
+    return (bin >> (10 - component * 5)) & 31;
+}
+
+static void sfl_bmp__quantize_shrink(
+    const SflBmpQuantizeBin* bins, const SflBmpU32* ids, SflBmpQuantizeBox* box)
 {
-    desc->width      = settings->width;
-    desc->height     = settings->height;
-    desc->attributes = 0;
+    box->count = 0;
+    for (int c = 0; c < 3; ++c) {
+        box->lo[c] = 31;
+        box->hi[c] = 0;
+    }
 
-    SflBmpU32 pitch =
-        (SflBmpU32)SFL_BMP_CEILF((settings->bpp * settings->width) / 32.f) * 4;
+    for (SflBmpU32 i = box->begin; i < box->end; ++i) {
+        box->count += bins[ids[i]].count;
+        for (int c = 0; c < 3; ++c) {
+            const SflBmpU32 value = sfl_bmp__quantize_component(ids[i], c);
+            if (value < box->lo[c]) box->lo[c] = value;
+            if (value > box->hi[c]) box->hi[c] = value;
+        }
+    }
+}
 
-    SflBmpU32 size = pitch * desc->height;
-    desc->size     = size;
-    desc->pitch    = pitch;
+/**
+ * Median cut over the non-empty bins: the box with the widest, most populated
+ * range is split at the median of its widest component, until there are
+ * max_colors boxes or no box can be split. Each color is the mean of a box
+ * @param ids     The num_ids non-empty bins, reordered
+ * @param scratch Room for num_ids ids
+ * @return The number of colors
+ */
+static SflBmpU32 sfl_bmp__quantize_palette(
+    const SflBmpQuantizeBin* bins,
+    SflBmpU32*               ids,
+    SflBmpU32*               scratch,
+    SflBmpU32                num_ids,
+    SflBmpU32                max_colors,
+    SflBmpI32                palette[3][256])
+{
+    SflBmpQuantizeBox boxes[256];
+    SflBmpU32         num_boxes = 0;
 
-    /** In BMP files, positive height means the image is flipped. */
-    if (settings->height > 0) {
-        desc->attributes |= SFL_BMP_ATTRIBUTE_FLIPPED;
-    } else {
-        desc->height = -desc->height;
+    if (num_ids == 0) {
+        return 0;
     }
 
-    switch (settings->bpp) {
-        case 32: {
-            if (settings->a_mask == 0) {
-                desc->format = SFL_BMP_PIXEL_FORMAT_B8G8R8X8;
-            } else {
-                desc->format = SFL_BMP_PIXEL_FORMAT_B8G8R8A8;
+    boxes[0].begin = 0;
+    boxes[0].end   = num_ids;
+    sfl_bmp__quantize_shrink(bins, ids, &boxes[0]);
+    num_boxes = 1;
+
+    while (num_boxes < max_colors) {
+        SflBmpQuantizeBox* box        = 0;
+        SflBmpU64          best_score = 0;
+        int                component  = 0;
+
+        for (SflBmpU32 i = 0; i < num_boxes; ++i) {
+            for (int c = 0; c < 3; ++c) {
+                const SflBmpU64 range = boxes[i].hi[c] - boxes[i].lo[c];
+                const SflBmpU64 score = range * range * boxes[i].count;
+                if (boxes[i].end - boxes[i].begin > 1 && score > best_score) {
+                    box        = &boxes[i];
+                    best_score = score;
+                    component  = c;
+                }
             }
-            return sfl_bmp_extract_raw(ctx, settings, desc);
-        } break;
+        }
 
-        case 24: {
-            desc->format = SFL_BMP_PIXEL_FORMAT_B8G8R8;
-            SflBmpConvertSettings convert_settings;
-            convert_settings.i_rbits = settings->r_mask;
-            convert_settings.i_gbits = settings->g_mask;
-            convert_settings.i_bbits = settings->b_mask;
-            convert_settings.i_abits = settings->a_mask;
-            convert_settings.i_pitch = desc->pitch;
-            convert_settings.i_slice = 3;
-            return sfl_bmp_extract_raw_convert(
-                ctx,
-                settings,
-                &convert_settings,
-                desc);
-        } break;
+        if (!box) {
+            break;
+        }
 
-        case 16: {
-            desc->format = SFL_BMP_PIXEL_FORMAT_B5G6R5;
-#if SFL_BMP_ALWAYS_CONVERT
-            SflBmpConvertSettings convert_settings;
-            convert_settings.i_rbits = settings->r_mask;
-            convert_settings.i_gbits = settings->g_mask;
-            convert_settings.i_bbits = settings->b_mask;
-            convert_settings.i_abits = settings->a_mask;
-            convert_settings.i_pitch = desc->pitch;
-            convert_settings.i_slice = 2;
-            return sfl_bmp_extract_raw_convert(
-                ctx,
-                settings,
-                &convert_settings,
-                desc);
-#else
-            return sfl_bmp_extract_raw(ctx, settings, desc);
-#endif
-        } break;
+        /* Counting sort on the component, which only has 32 values */
+        SflBmpU32 offsets[33];
+        memset(offsets, 0, sizeof(offsets));
+        for (SflBmpU32 i = box->begin; i < box->end; ++i) {
+            offsets[sfl_bmp__quantize_component(ids[i], component) + 1]++;
+        }
+        for (int v = 0; v < 32; ++v) {
+            offsets[v + 1] += offsets[v];
+        }
+        for (SflBmpU32 i = box->begin; i < box->end; ++i) {
+            scratch[offsets[sfl_bmp__quantize_component(ids[i], component)]++] =
+                ids[i];
+        }
+        memcpy(
+            ids + box->begin,
+            scratch,
+            (box->end - box->begin) * sizeof(SflBmpU32));
+
+        /* Split where half of the pixels are on each side */
+        SflBmpU64 below = 0;
+        SflBmpU32 split = box->begin + 1;
+        for (SflBmpU32 i = box->begin; i < box->end - 1; ++i) {
+            below += bins[ids[i]].count;
+            split = i + 1;
+            if (below * 2 >= box->count) {
+                break;
+            }
+        }
 
-        case 4: {
-            return sfl_bmp_extract_paletted(ctx, settings, desc);
-        } break;
+        boxes[num_boxes].begin = split;
+        boxes[num_boxes].end   = box->end;
+        box->end               = split;
+        sfl_bmp__quantize_shrink(bins, ids, box);
+        sfl_bmp__quantize_shrink(bins, ids, &boxes[num_boxes]);
+        num_boxes++;
+    }
 
-        default: {
-            return 0;
-        } break;
+    for (SflBmpU32 i = 0; i < num_boxes; ++i) {
+        SflBmpU64 sum[3] = {0, 0, 0};
+        for (SflBmpU32 j = boxes[i].begin; j < boxes[i].end; ++j) {
+            for (int c = 0; c < 3; ++c) {
+                sum[c] += bins[ids[j]].sum[c];
+            }
+        }
+        for (int c = 0; c < 3; ++c) {
+            palette[c][i] =
+                (SflBmpI32)((sum[c] + boxes[i].count / 2) / boxes[i].count);
+        }
     }
+
+    return num_boxes;
 }
 
-static int sfl_bmp_extract_raw(
-    SflBmpContext* ctx, SflBmpDecodeSettings* settings, SflBmpDesc* desc)
+/** Sorts the palette by green, and fills in q->first_green */
+static void sfl_bmp__quantize_sort(SflBmpQuantize* q)
 {
-    SFL_BMP_SEEK(ctx, settings->offset, SFL_BMP_IO_SET);
-    desc->data = SFL_BMP_ALLOCATE(ctx, desc->size);
-    if (!SFL_BMP_READ(ctx, desc->data, desc->size)) {
-        return 0;
+    for (SflBmpU32 i = 1; i < q->num_colors; ++i) {
+        SflBmpI32 color[3];
+        SflBmpU32 j = i;
+
+        for (int c = 0; c < 3; ++c) {
+            color[c] = q->palette[c][i];
+        }
+        for (; j > 0 && q->palette[1][j - 1] > color[1]; --j) {
+            for (int c = 0; c < 3; ++c) {
+                q->palette[c][j] = q->palette[c][j - 1];
+            }
+        }
+        for (int c = 0; c < 3; ++c) {
+            q->palette[c][j] = color[c];
+        }
+    }
+
+    for (SflBmpU32 g = 0, i = 0; g < 256; ++g) {
+        while (i < q->num_colors && q->palette[1][i] < (SflBmpI32)g) {
+            i++;
+        }
+        q->first_green[g] = (SflBmpU16)i;
     }
-    return 1;
 }
 
-static int sfl_bmp_extract_raw_convert(
-    SflBmpContext*         ctx,
-    SflBmpDecodeSettings*  settings,
-    SflBmpConvertSettings* convert_settings,
-    SflBmpDesc*            desc)
+/**
+ * Returns the index of the color closest to (r, g, b). The search starts at
+ * the colors with the same green, and walks away from them until green alone
+ * is further than the best match so far
+ */
+static SflBmpU32 sfl_bmp__quantize_nearest(
+    const SflBmpQuantize* q, SflBmpI32 r, SflBmpI32 g, SflBmpI32 b)
 {
-    desc->format    = SFL_BMP_PIXEL_FORMAT_R8G8B8A8;
-    desc->pitch     = desc->width * sizeof(SflBmpU32);
-    desc->size      = desc->pitch * desc->height;
-    desc->data      = SFL_BMP_ALLOCATE(ctx, desc->size);
-    SflBmpU32* data = (SflBmpU32*)desc->data;
+    const SflBmpU32 first  = q->first_green[g];
+    SflBmpU32       best   = 0;
+    SflBmpI32       best_d = 3 * 256 * 256;
+
+    for (SflBmpU32 i = first; i < q->num_colors; ++i) {
+        const SflBmpI32 dg = q->palette[1][i] - g;
+        if (dg * dg >= best_d) break;
+
+        const SflBmpI32 dr = q->palette[0][i] - r;
+        const SflBmpI32 db = q->palette[2][i] - b;
+        const SflBmpI32 d  = dr * dr + dg * dg + db * db;
+        if (d < best_d) {
+            best   = i;
+            best_d = d;
+        }
+    }
 
-    /* Amounts to shift each pixel value */
-    const SflBmpI32 rs = sfl_bmp_bit_scan_forward(convert_settings->i_rbits);
-    const SflBmpI32 gs = sfl_bmp_bit_scan_forward(convert_settings->i_gbits);
-    const SflBmpI32 bs = sfl_bmp_bit_scan_forward(convert_settings->i_bbits);
-    const SflBmpI32 as = sfl_bmp_bit_scan_forward(convert_settings->i_abits);
+    for (SflBmpU32 i = first; i-- > 0;) {
+        const SflBmpI32 dg = q->palette[1][i] - g;
+        if (dg * dg >= best_d) break;
 
-    /* Amount of bits representing component */
-    const SflBmpI32 rc = sfl_bmp_bit_count(convert_settings->i_rbits);
-    const SflBmpI32 gc = sfl_bmp_bit_count(convert_settings->i_gbits);
-    const SflBmpI32 bc = sfl_bmp_bit_count(convert_settings->i_bbits);
-    const SflBmpI32 ac = sfl_bmp_bit_count(convert_settings->i_abits);
+        const SflBmpI32 dr = q->palette[0][i] - r;
+        const SflBmpI32 db = q->palette[2][i] - b;
+        const SflBmpI32 d  = dr * dr + dg * dg + db * db;
+        if (d < best_d) {
+            best   = i;
+            best_d = d;
+        }
+    }
 
-    /* Max value of each component */
-    const SflBmpReal mr = (SflBmpReal)(sfl_bmp_ipow(2, rc) - 1);
-    const SflBmpReal mg = (SflBmpReal)(sfl_bmp_ipow(2, gc) - 1);
-    const SflBmpReal mb = (SflBmpReal)(sfl_bmp_ipow(2, bc) - 1);
-    const SflBmpReal ma = (SflBmpReal)(sfl_bmp_ipow(2, ac) - 1);
+    return best;
+}
 
-    const SflBmpU32 skip =
-        convert_settings->i_pitch - (desc->width * convert_settings->i_slice);
+static SflBmpI32 sfl_bmp__quantize_clamp(SflBmpI32 value)
+{
+    return value < 0 ? 0 : (value > 255 ? 255 : value);
+}
 
-    const int is_flipped = settings->height > 0 ? 1 : 0;
-    desc->attributes &= ~SFL_BMP_ATTRIBUTE_FLIPPED;
-    SFL_BMP_SEEK(ctx, settings->offset, SFL_BMP_IO_SET);
+/** Maps row y to palette indices, packed into the output row */
+static void sfl_bmp__quantize_row(SflBmpQuantizeWorker* worker, SflBmpU32 y)
+{
+    SflBmpQuantize* q      = worker->quantize;
+    const SflBmpU32 width  = q->in->width;
+    const SflBmpU32 stride = (width + 2) * 3;
+    SflBmpI32*      error  = worker->errors + (y & 1) * stride;
+    SflBmpI32*      next   = worker->errors + (~y & 1) * stride;
+    SflBmpU8*       out    = q->rows + (SflBmpUSize)y * q->out->pitch;
+
+    q->conv.convert_row(
+        &q->conv,
+        q->source + (SflBmpUSize)y * q->in->pitch,
+        (SflBmpU8*)worker->pixels,
+        width,
+        y);
+
+    for (SflBmpU32 x = 0; x < width; ++x) {
+        const SflBmpU32 pixel = worker->pixels[x];
+        SflBmpI32       color[3];
+        SflBmpU32       cell, index;
+
+        color[0] = (SflBmpI32)((pixel >> 16) & 0xFF);
+        color[1] = (SflBmpI32)((pixel >> 8) & 0xFF);
+        color[2] = (SflBmpI32)(pixel & 0xFF);
+
+        if (q->dither == SFL_BMP_DITHER_ORDERED) {
+            const SflBmpI32 offset =
+                ((SflBmpI32)sfl_bmp__bayer[y & 7][x & 7] - 32) * q->spread / 64;
+            for (int c = 0; c < 3; ++c) {
+                color[c] = sfl_bmp__quantize_clamp(color[c] + offset);
+            }
+        } else if (q->dither == SFL_BMP_DITHER_DIFFUSION) {
+            for (int c = 0; c < 3; ++c) {
+                color[c] = sfl_bmp__quantize_clamp(
+                    color[c] + error[(x + 1) * 3 + c] / 16);
+            }
+        }
 
-    for (int y = 0; y < desc->height; ++y) {
-        for (int x = 0; x < desc->width; ++x) {
-            SflBmpU32 pixel;
-            if (!SFL_BMP_READ(ctx, &pixel, convert_settings->i_slice)) {
-                goto EXIT_ERROR;
+        /* Cells are searched from their centers, so that a cell maps to the
+         * same color whichever pixel filled it */
+        cell = ((SflBmpU32)color[0] >> 2) << 12 |
+               ((SflBmpU32)color[1] >> 2) << 6 | ((SflBmpU32)color[2] >> 2);
+        if (!worker->cache[cell]) {
+            worker->cache[cell] = (SflBmpU16)(sfl_bmp__quantize_nearest(
+                                                  q,
+                                                  (color[0] & ~3) + 2,
+                                                  (color[1] & ~3) + 2,
+                                                  (color[2] & ~3) + 2) +
+                                              1);
+        }
+        index = worker->cache[cell] - 1u;
+
+        if (q->dither == SFL_BMP_DITHER_DIFFUSION) {
+            for (int c = 0; c < 3; ++c) {
+                const SflBmpI32 e = color[c] - q->palette[c][index];
+                error[(x + 2) * 3 + c] += e * 7;
+                next[x * 3 + c] += e * 3;
+                next[(x + 1) * 3 + c] += e * 5;
+                next[(x + 2) * 3 + c] += e;
             }
+        }
 
-            SflBmpReal r =
-                (SflBmpReal)((pixel & convert_settings->i_rbits) >> rs);
-            SflBmpReal g =
-                (SflBmpReal)((pixel & convert_settings->i_gbits) >> gs);
-            SflBmpReal b =
-                (SflBmpReal)((pixel & convert_settings->i_bbits) >> bs);
-            SflBmpReal a =
-                (SflBmpReal)((pixel & convert_settings->i_abits) >> as);
+        const SflBmpU32 bit = x * q->bpp;
+        out[bit / 8] |= (SflBmpU8)(index << (8 - q->bpp - bit % 8));
+    }
 
-            /* Ternary op handles case where any of these components is zero */
-            SflBmpU32 cr =
-                (rc != 0) ? (SflBmpU32)SFL_BMP_CEILF((r / mr) * 255) : 0;
-            SflBmpU32 cg =
-                (gc != 0) ? (SflBmpU32)SFL_BMP_CEILF((g / mg) * 255) : 0;
-            SflBmpU32 cb =
-                (bc != 0) ? (SflBmpU32)SFL_BMP_CEILF((b / mb) * 255) : 0;
-            SflBmpU32 ca =
-                (ac != 0) ? (SflBmpU32)SFL_BMP_CEILF((a / ma) * 255) : 0;
+    /* This row's error is spent, and it's the next row's next */
+    if (q->dither == SFL_BMP_DITHER_DIFFUSION) {
+        memset(error, 0, stride * sizeof(SflBmpI32));
+    }
+}
 
-            if (convert_settings->i_abits == 0) {
-                ca = 0xFF;
-            }
+static SFL_BMP__THREAD_PROC(sfl_bmp__quantize_worker)
+{
+    SflBmpQuantizeWorker* worker = (SflBmpQuantizeWorker*)param;
+    SflBmpQuantize*       q      = worker->quantize;
 
-            SflBmpU32 pixel32 = (cr << 0) | (cg << 8) | (cb << 16) | (ca << 24);
+    for (;;) {
+        SflBmpU32 band, first, count;
 
-            if (is_flipped) {
-                data[(desc->height - y - 1) * desc->width + x] = pixel32;
-            } else {
-                data[y * desc->width + x] = pixel32;
-            }
+        sfl_bmp__mutex_lock(&q->mutex);
+        band = q->next_band++;
+        sfl_bmp__mutex_unlock(&q->mutex);
+
+        if (band >= q->num_bands) {
+            break;
         }
 
-        if (SFL_BMP_SEEK(ctx, (long)skip, SFL_BMP_IO_CUR)) {
-            goto EXIT_ERROR;
+        first = band * SFL_BMP__QUANTIZE_BAND_ROWS;
+        count = q->in->height - first;
+        if (count > SFL_BMP__QUANTIZE_BAND_ROWS) {
+            count = SFL_BMP__QUANTIZE_BAND_ROWS;
+        }
+
+        /* Error doesn't cross bands, which are mapped independently */
+        memset(
+            worker->errors,
+            0,
+            (SflBmpUSize)(q->in->width + 2) * 6 * sizeof(SflBmpI32));
+
+        for (SflBmpU32 y = first; y < first + count; ++y) {
+            sfl_bmp__quantize_row(worker, y);
         }
     }
 
-    return 1;
-EXIT_ERROR:
-    return 0;
+    return SFL_BMP__THREAD_RETURN;
 }
 
-static int sfl_bmp_extract_paletted(
-    SflBmpContext* ctx, SflBmpDecodeSettings* settings, SflBmpDesc* desc)
+int sfl_bmp_encode_quantized(
+    SflBmpContext*                ctx,
+    SflBmpDesc*                   in_desc,
+    SflBmpIOImplementation*       in_io,
+    SflBmpDesc*                   out_desc,
+    const SflBmpQuantizeSettings* settings)
 {
-    SflBmpU32 color_table_count;
-    if (settings->num_colors == 0) {
-        color_table_count = sfl_bmp_ipow(2, settings->bpp);
-    } else {
-        color_table_count = settings->num_colors;
+    SflBmpQuantize        q;
+    SflBmpQuantizeWorker* workers = 0;
+    SflBmpThread*         threads;
+    SflBmpQuantizeBin*    bins    = 0;
+    SflBmpU32*            ids;
+    SflBmpU8*             copy    = 0;
+    SflBmpDesc            pixel_desc;
+    SflBmpU32             colors[256];
+    SflBmpU32             max_colors  = 256;
+    SflBmpU32             num_ids     = 0;
+    SflBmpUSize           out_size    = 0;
+    int                   num_threads = 1;
+    int                   num_started = 0;
+    int                   result      = 0;
+    int                   i;
+    SFL_BMP__STAGE_DECLARE(palette_time);
+    SFL_BMP__STAGE_DECLARE(convert_time);
+
+    const SflBmpUSize in_size    = (SflBmpUSize)in_desc->pitch * in_desc->height;
+    const SflBmpUSize bins_size  = sizeof(SflBmpQuantizeBin) *
+                                      SFL_BMP__QUANTIZE_BINS +
+                                  sizeof(SflBmpU32) * SFL_BMP__QUANTIZE_BINS * 2;
+    const SflBmpUSize error_size =
+        (SflBmpUSize)(in_desc->width + 2) * 6 * sizeof(SflBmpI32);
+    const SflBmpUSize worker_size =
+        sizeof(SflBmpQuantizeWorker) + sizeof(SflBmpThread) +
+        (SflBmpUSize)in_desc->width * 4 + error_size +
+        SFL_BMP__QUANTIZE_CELLS * sizeof(SflBmpU16);
+
+    /* The whole image is held in memory, input and output */
+    if (in_desc->width == 0 || in_desc->height == 0 ||
+        sfl_bmp__is_indexed(in_desc->format) ||
+        !sfl_bmp__addressable((SflBmpU64)in_desc->pitch * in_desc->height))
+    {
+        return 0;
     }
-    const SflBmpU32 color_table_size = color_table_count * sizeof(SflBmpU32);
 
-    const SflBmpU32 converted_size =
-        desc->height * desc->width * sizeof(SflBmpU32);
+    if (settings) {
+        if (settings->num_colors >= 2 && settings->num_colors < 256) {
+            max_colors = (SflBmpU32)settings->num_colors;
+        }
+        if (settings->num_threads > 1) {
+            num_threads = settings->num_threads;
+        }
+    }
 
-    settings->pitch = desc->pitch;
+    memset(&q, 0, sizeof(q));
+    q.in     = in_desc;
+    q.out    = out_desc;
+    q.dither = settings ? settings->dither : SFL_BMP_DITHER_NONE;
+
+    /* Bands are mapped in any order, so the input has to be all there */
+    q.source = sfl_bmp__peek(ctx, in_io, in_desc->offset, in_size);
+    if (!q.source) {
+        copy = (SflBmpU8*)SFL_BMP_ALLOCATE(ctx, in_size);
+        if (!copy ||
+            sfl_bmp__seek(ctx, in_io, in_desc->offset, SFL_BMP_IO_SET) ||
+            !sfl_bmp__read(ctx, in_io, copy, in_size))
+        {
+            goto EXIT_PROC;
+        }
+        q.source = copy;
+    }
 
-    desc->format     = SFL_BMP_PIXEL_FORMAT_B8G8R8A8;
-    desc->pitch      = desc->width * sizeof(SflBmpU32);
-    desc->attributes = 0;
+    /* Everything is allocated here, so ctx->mem needn't be thread safe */
+    workers = (SflBmpQuantizeWorker*)SFL_BMP_ALLOCATE(
+        ctx, worker_size * num_threads);
+    if (!workers) {
+        goto EXIT_PROC;
+    }
+    threads = (SflBmpThread*)(workers + num_threads);
+
+    for (i = 0; i < num_threads; ++i) {
+        SflBmpU8* memory =
+            (SflBmpU8*)(threads + num_threads) +
+            (worker_size - sizeof(SflBmpQuantizeWorker) -
+             sizeof(SflBmpThread)) *
+                i;
+        workers[i].quantize = &q;
+        workers[i].cache    = (SflBmpU16*)memory;
+        workers[i].errors =
+            (SflBmpI32*)(memory + SFL_BMP__QUANTIZE_CELLS * sizeof(SflBmpU16));
+        workers[i].pixels =
+            (SflBmpU32*)((SflBmpU8*)workers[i].errors + error_size);
+        memset(workers[i].cache, 0, SFL_BMP__QUANTIZE_CELLS * sizeof(SflBmpU16));
+    }
 
-    SflBmpU32* color_table =
-        (SflBmpU32*)SFL_BMP_ALLOCATE(ctx, color_table_size);
-    if (!color_table) {
-        return 0;
+    /* Rows are converted to B8G8R8A8 first, and quantized as such */
+    memset(&pixel_desc, 0, sizeof(pixel_desc));
+    pixel_desc.format = SFL_BMP_PIXEL_FORMAT_B8G8R8A8;
+    pixel_desc.slice  = 4;
+    sfl_bmp__bitmasks_from_pixel_format(pixel_desc.format, pixel_desc.mask);
+    sfl_bmp__converter_init(&q.conv, in_desc, &pixel_desc);
+
+    SFL_BMP__STAGE_BEGIN(ctx, SFL_BMP_STAGE_PALETTE, palette_time);
+
+    bins = (SflBmpQuantizeBin*)SFL_BMP_ALLOCATE(ctx, bins_size);
+    if (!bins) {
+        goto EXIT_PROC;
+    }
+    memset(bins, 0, sizeof(SflBmpQuantizeBin) * SFL_BMP__QUANTIZE_BINS);
+    ids = (SflBmpU32*)(bins + SFL_BMP__QUANTIZE_BINS);
+
+    for (SflBmpU32 y = 0; y < in_desc->height; ++y) {
+        q.conv.convert_row(
+            &q.conv,
+            q.source + (SflBmpUSize)y * in_desc->pitch,
+            (SflBmpU8*)workers[0].pixels,
+            in_desc->width,
+            y);
+
+        for (SflBmpU32 x = 0; x < in_desc->width; ++x) {
+            const SflBmpU32    pixel = workers[0].pixels[x];
+            SflBmpQuantizeBin* bin   = &bins
+                [(pixel >> 9 & 0x7C00) | (pixel >> 6 & 0x3E0) |
+                 (pixel >> 3 & 0x1F)];
+            bin->count++;
+            bin->sum[0] += (pixel >> 16) & 0xFF;
+            bin->sum[1] += (pixel >> 8) & 0xFF;
+            bin->sum[2] += pixel & 0xFF;
+        }
     }
 
-    desc->data = SFL_BMP_ALLOCATE(ctx, converted_size);
-    if (!desc->data) {
-        return 0;
+    for (SflBmpU32 bin = 0; bin < SFL_BMP__QUANTIZE_BINS; ++bin) {
+        if (bins[bin].count) {
+            ids[num_ids++] = bin;
+        }
     }
 
-    SFL_BMP_SEEK(ctx, settings->table_offset, SFL_BMP_IO_SET);
+    q.num_colors = sfl_bmp__quantize_palette(
+        bins,
+        ids,
+        ids + SFL_BMP__QUANTIZE_BINS,
+        num_ids,
+        max_colors,
+        q.palette);
+    SFL_BMP_RELEASE(ctx, bins, bins_size);
+    bins = 0;
 
-    if (!SFL_BMP_READ(ctx, color_table, color_table_size)) {
-        return 0;
+    sfl_bmp__quantize_sort(&q);
+
+    SFL_BMP__STAGE_END(ctx, SFL_BMP_STAGE_PALETTE, palette_time);
+
+    for (SflBmpU32 c = 0; c < q.num_colors; ++c) {
+        colors[c] = (SflBmpU32)q.palette[0][c] << 16 |
+                    (SflBmpU32)q.palette[1][c] << 8 | (SflBmpU32)q.palette[2][c];
     }
-    settings->color_table       = color_table;
-    settings->color_table_count = color_table_count;
-    settings->color_table_size  = color_table_size;
 
-    switch (settings->compression) {
-        case SFL_BMP_COMPRESSION_NONE: {
-            return sfl_bmp_extract_paletted_none(ctx, settings, desc);
-        } break;
+    /* Half the distance between neighbouring colors, were they a grid. The
+     * palette is usually denser where the pixels are, so a full step is too
+     * much */
+    q.spread = 1;
+    while ((SflBmpU32)(q.spread * q.spread * q.spread) < q.num_colors) {
+        q.spread++;
+    }
+    q.spread = 128 / q.spread;
+
+    /* The fewest bits per index that fit */
+    if (q.num_colors <= 2) {
+        out_desc->format = SFL_BMP_PIXEL_FORMAT_I1;
+    } else if (q.num_colors <= 16) {
+        out_desc->format = SFL_BMP_PIXEL_FORMAT_I4;
+    } else {
+        out_desc->format = SFL_BMP_PIXEL_FORMAT_I8;
+    }
+    out_desc->compression       = SFL_BMP_COMPRESSION_NONE;
+    out_desc->num_table_entries = q.num_colors;
+    out_desc->palette_data      = colors;
+    q.bpp = (SflBmpU32)sfl_bmp__bpp_from_pixel_format(out_desc->format);
+
+    if (!sfl_bmp__encode_header(ctx, in_desc, out_desc)) {
+        goto EXIT_PROC;
+    }
+
+    /* Padding and the bits not yet or'ed in are zero. Indices are smaller
+     * than the pixels they replace, so they're addressable too */
+    out_size = (SflBmpUSize)out_desc->size;
+    q.rows   = (SflBmpU8*)SFL_BMP_ALLOCATE(ctx, out_size);
+    if (!q.rows) {
+        goto EXIT_PROC;
+    }
+    memset(q.rows, 0, out_size);
+
+    q.num_bands = (in_desc->height + SFL_BMP__QUANTIZE_BAND_ROWS - 1) /
+                  SFL_BMP__QUANTIZE_BAND_ROWS;
+
+    sfl_bmp__mutex_init(&q.mutex);
+    SFL_BMP__STAGE_BEGIN(ctx, SFL_BMP_STAGE_CONVERT, convert_time);
+
+    for (i = 1; i < num_threads; ++i) {
+        if (!sfl_bmp__thread_start(
+                &threads[num_started], sfl_bmp__quantize_worker, &workers[i]))
+        {
+            break;
+        }
+        num_started++;
+    }
+
+    /* The calling thread takes bands too, and all of them if no thread
+     * could be started */
+    sfl_bmp__quantize_worker(&workers[0]);
 
-        default: {
-            return 0;
-        } break;
+    for (i = 0; i < num_started; ++i) {
+        sfl_bmp__thread_join(threads[i]);
     }
-}
 
-static int sfl_bmp_extract_paletted_none(
-    SflBmpContext* ctx, SflBmpDecodeSettings* settings, SflBmpDesc* desc)
-{
-    const int is_flipped  = settings->height > 0 ? 1 : 0;
-    SflBmpU32 curr_offset = settings->offset;
+    SFL_BMP__STAGE_END(ctx, SFL_BMP_STAGE_CONVERT, convert_time);
+    sfl_bmp__mutex_destroy(&q.mutex);
 
-    SFL_BMP_SEEK(ctx, settings->offset, SFL_BMP_IO_SET);
+    result = sfl_bmp__write(ctx, &ctx->io, q.rows, out_size);
 
-    SflBmpU32* out_pixels = (SflBmpU32*)desc->data;
+EXIT_PROC:
+    SFL_BMP__STAGE_END(ctx, SFL_BMP_STAGE_PALETTE, palette_time);
+    /* The table isn't kept past the call */
+    out_desc->palette_data = 0;
+    if (q.rows) {
+        SFL_BMP_RELEASE(ctx, q.rows, out_size);
+    }
+    if (bins) {
+        SFL_BMP_RELEASE(ctx, bins, bins_size);
+    }
+    if (workers) {
+        SFL_BMP_RELEASE(ctx, workers, worker_size * num_threads);
+    }
+    if (copy) {
+        SFL_BMP_RELEASE(ctx, copy, in_size);
+    }
+    return result;
+}
 
-    for (SflBmpI32 c = 0; c < desc->height; ++c) {
-        SflBmpI32 y        = is_flipped ? desc->height - 1 - c : c;
-        SflBmpU32 curr_row = curr_offset;
-        SflBmpU32 row_end  = curr_offset + settings->pitch;
-        SflBmpI32 x        = 0;
+/* SFL_BMP_QUANTIZE */
+#endif
 
-        while (1) {
-            if (x == desc->width) {
-                curr_row = row_end;
-                break;
-            }
+#if SFL_BMP_TENSOR
+/** Rows of the tensor handed to a thread at a time */
+#define SFL_BMP__TENSOR_BAND_ROWS 16
 
-            SflBmpU8 code;
-            if (!SFL_BMP_READ(ctx, &code, 1)) {
-                return 0;
-            }
+/** Where a row or column of the tensor samples the image */
+typedef struct {
+    SflBmpU32  i0;
+    SflBmpU32  i1;
+    SflBmpReal t;
+} SflBmpTensorTap;
 
-            const SflBmpU8 left_pixel  = code >> 4;
-            const SflBmpU8 right_pixel = code & 0x0f;
+typedef struct {
+    SflBmpDesc*      in;
+    /** Image row y in the pixel data (top row first), where it's sampled */
+    const SflBmpU8** rows;
+    SflBmpConverter  conv;
+    SflBmpTensor*    tensor;
+    SflBmpTensorTap* x_taps;
+    SflBmpTensorTap* y_taps;
+    /** Per channel, so that value = sample * scale + bias */
+    SflBmpReal       scale[3];
+    SflBmpReal       bias[3];
+    SflBmpMutex      mutex;
+    SflBmpU32        num_bands;
+    SflBmpU32        next_band;
+} SflBmpTensorJob;
 
-            SflBmpU32  image_offset = desc->width * y + x;
-            SflBmpU32* data         = out_pixels + image_offset;
-            data[0]                 = settings->color_table[left_pixel];
+typedef struct {
+    SflBmpTensorJob* job;
+    /** A converted image row (R8G8B8A8) */
+    SflBmpU8*        pixels;
+    /** Two image rows resampled to the tensor's width, 3 planes each */
+    SflBmpReal*      rows[2];
+    SflBmpU32        row_ids[2];
+    /** A row of one plane, before it's stored as halves */
+    SflBmpReal*      values;
+} SflBmpTensorWorker;
+
+/** Bilinear taps from count output samples to extent input ones, at first */
+static void sfl_bmp__tensor_taps(
+    SflBmpTensorTap* taps, SflBmpU32 count, SflBmpU32 first, SflBmpU32 extent)
+{
+    /* In double: in float, taps tens of thousands of rows in are off by a
+     * few thousandths of a row */
+    const double ratio = (double)extent / (double)count;
+
+    for (SflBmpU32 i = 0; i < count; ++i) {
+        /* Centers of output samples, in input samples */
+        double position = ((double)i + 0.5) * ratio - 0.5;
+        if (position < 0) {
+            position = 0;
+        }
 
-            if (x < desc->width) {
-                data[1] = settings->color_table[right_pixel];
-                x++;
-            }
+        SflBmpU32 i0 = (SflBmpU32)position;
+        if (i0 > extent - 1) {
+            i0 = extent - 1;
         }
-    }
 
-    return 1;
+        const double t = position - (double)i0;
+        taps[i].i0     = first + i0;
+        taps[i].i1     = first + ((i0 + 1 < extent) ? i0 + 1 : i0);
+        taps[i].t      = (SflBmpReal)((t > 1) ? 1 : t);
+    }
 }
 
-#if SFL_BMP_IO_IMPLEMENTATION_STDIO
-#include <stdio.h>
-
-static PROC_SFL_BMP_IO_READ(sfl_bmp_stdlib_read)
+/** Rounds to the nearest half, ties to even; large values become infinity */
+static SflBmpU16 sfl_bmp__half_from_float(SflBmpReal value)
 {
-    FILE* f   = (FILE*)usr;
-    int   ret = fread(ptr, size, 1, f);
-    return ret == 1;
-}
+    SflBmpU32 bits;
+    memcpy(&bits, &value, sizeof(bits));
 
-static PROC_SFL_BMP_IO_SEEK(sfl_bmp_stdlib_seek)
-{
-    int whence_stdio = -1;
+    const SflBmpU32 sign     = (bits >> 16) & 0x8000;
+    const SflBmpU32 exponent = (bits >> 23) & 0xFF;
+    SflBmpU32       mantissa = bits & 0x7FFFFF;
 
-    switch (whence) {
-        case SFL_BMP_IO_SET:
-            whence_stdio = SEEK_SET;
-            break;
-        case SFL_BMP_IO_CUR:
-            whence_stdio = SEEK_CUR;
-            break;
-        case SFL_BMP_IO_END:
-            whence_stdio = SEEK_END;
-            break;
-        default:
-            break;
+    if (exponent == 0xFF) {
+        /* Infinity, or NaN (kept quiet) */
+        return (SflBmpU16)(sign | 0x7C00 | (mantissa ? 0x200 : 0));
     }
 
-    FILE* f = (FILE*)usr;
-    return fseek(f, offset, whence_stdio);
+    const SflBmpI32 half_exponent = (SflBmpI32)exponent - 127 + 15;
+    if (half_exponent >= 31) {
+        return (SflBmpU16)(sign | 0x7C00);
+    }
+
+    if (half_exponent <= 0) {
+        /* Subnormal, or too small for anything but zero */
+        if (half_exponent < -10) {
+            return (SflBmpU16)sign;
+        }
+        mantissa |= 0x800000;
+        const SflBmpU32 shift = (SflBmpU32)(14 - half_exponent);
+        const SflBmpU32 half  = 1u << (shift - 1);
+        const SflBmpU32 odd   = (mantissa >> shift) & 1;
+        return (SflBmpU16)(sign | ((mantissa + half - 1 + odd) >> shift));
+    }
+
+    /* A carry out of the mantissa rounds up into the exponent, as it should */
+    const SflBmpU32 odd = (mantissa >> 13) & 1;
+    return (SflBmpU16)(sign | (((SflBmpU32)half_exponent << 10) +
+                               ((mantissa + 0xFFF + odd) >> 13)));
 }
 
-static PROC_SFL_BMP_IO_TELL(sfl_bmp_stdlib_tell)
+/** Makes rows[slot] image row y, resampled horizontally */
+static void sfl_bmp__tensor_load_row(
+    SflBmpTensorWorker* worker, int slot, SflBmpU32 y)
 {
-    FILE* f = (FILE*)usr;
-    return ftell(f);
+    SflBmpTensorJob*       job    = worker->job;
+    const SflBmpU32        width  = job->tensor->width;
+    const SflBmpTensorTap* taps   = job->x_taps;
+    const SflBmpU8*        pixels = worker->pixels;
+    SflBmpReal*            row    = worker->rows[slot];
+
+    /* Bottom-up files store the last row first */
+    const SflBmpU32 file_y = (job->in->attributes & SFL_BMP_ATTRIBUTE_FLIPPED)
+                                 ? job->in->height - 1 - y
+                                 : y;
+    job->conv.convert_row(
+        &job->conv, job->rows[y], worker->pixels, job->in->width, file_y);
+
+    for (SflBmpU32 c = 0; c < 3; ++c) {
+        SflBmpReal* plane = row + (SflBmpUSize)c * width;
+        for (SflBmpU32 x = 0; x < width; ++x) {
+            const SflBmpReal a = pixels[(SflBmpUSize)taps[x].i0 * 4 + c];
+            const SflBmpReal b = pixels[(SflBmpUSize)taps[x].i1 * 4 + c];
+            plane[x]           = a + (b - a) * taps[x].t;
+        }
+    }
+
+    worker->row_ids[slot] = y;
 }
 
-static PROC_SFL_BMP_IO_WRITE(sfl_bmp_stdlib_write)
+/** Fills row y of each plane of the tensor */
+static void sfl_bmp__tensor_row(SflBmpTensorWorker* worker, SflBmpU32 y)
 {
-    FILE* f = (FILE*)usr;
-    return fwrite(buf, size, 1, f) == 1;
-}
+    SflBmpTensorJob*      job    = worker->job;
+    SflBmpTensor*         tensor = job->tensor;
+    const SflBmpTensorTap tap    = job->y_taps[y];
+    const SflBmpU32       width  = tensor->width;
+
+    /* Going down, the second row of one is usually the first of the next */
+    if (worker->row_ids[0] != tap.i0) {
+        if (worker->row_ids[1] == tap.i0) {
+            SflBmpReal* row    = worker->rows[0];
+            worker->rows[0]    = worker->rows[1];
+            worker->rows[1]    = row;
+            worker->row_ids[0] = tap.i0;
+            worker->row_ids[1] = (SflBmpU32)-1;
+        } else {
+            sfl_bmp__tensor_load_row(worker, 0, tap.i0);
+        }
+    }
+    if (worker->row_ids[1] != tap.i1) {
+        sfl_bmp__tensor_load_row(worker, 1, tap.i1);
+    }
 
-static SflBmpIOImplementation SflBmp_IO_STDLIB = {
-    sfl_bmp_stdlib_read,
-    sfl_bmp_stdlib_write,
-    sfl_bmp_stdlib_seek,
-    sfl_bmp_stdlib_tell,
-};
+    for (SflBmpU32 c = 0; c < 3; ++c) {
+        const SflBmpReal* SFL_BMP__RESTRICT top =
+            worker->rows[0] + (SflBmpUSize)c * width;
+        const SflBmpReal* SFL_BMP__RESTRICT bottom =
+            worker->rows[1] + (SflBmpUSize)c * width;
+        const SflBmpReal  scale  = job->scale[c];
+        const SflBmpReal  bias   = job->bias[c];
+        const SflBmpUSize offset =
+            ((SflBmpUSize)c * tensor->height + y) * width;
+
+        SflBmpReal* SFL_BMP__RESTRICT out =
+            (tensor->type == SFL_BMP_TENSOR_FLOAT32)
+                ? (SflBmpReal*)tensor->data + offset
+                : worker->values;
+
+        for (SflBmpU32 x = 0; x < width; ++x) {
+            const SflBmpReal value = top[x] + (bottom[x] - top[x]) * tap.t;
+            out[x]                 = value * scale + bias;
+        }
 
-void sfl_bmp_stdio_init(SflBmpContext* ctx, SflBmpMemoryImplementation* memory)
-{
-    sfl_bmp_init(ctx, &SflBmp_IO_STDLIB, memory);
+        if (tensor->type == SFL_BMP_TENSOR_FLOAT16) {
+            SflBmpU16* halves = (SflBmpU16*)tensor->data + offset;
+            for (SflBmpU32 x = 0; x < width; ++x) {
+                halves[x] = sfl_bmp__half_from_float(out[x]);
+            }
+        }
+    }
 }
 
-void sfl_bmp_stdio_set_file(SflBmpContext* ctx, FILE* file)
+/**
+ * Points job->rows at the rows the taps sample. Without peek, only those are
+ * read (in file order, seeking forwards past the rest) into copy
+ */
+static int sfl_bmp__tensor_source(
+    SflBmpContext*   ctx,
+    SflBmpTensorJob* job,
+    SflBmpU8**       copy,
+    SflBmpUSize*     copy_size)
 {
-    sfl_bmp_set_io_usr(ctx, (void*)file);
-}
+    SflBmpDesc*     in      = job->in;
+    const int       flipped = (in->attributes & SFL_BMP_ATTRIBUTE_FLIPPED);
+    SflBmpUSize     count   = 0;
+    SflBmpU32       next    = (SflBmpU32)-1;
+    SflBmpU32       y;
+    SflBmpU8*       row;
+    const SflBmpU8* source  = sfl_bmp__peek(
+        ctx, &ctx->io, in->offset, (SflBmpU64)in->pitch * in->height);
+
+    if (source) {
+        for (y = 0; y < in->height; ++y) {
+            const SflBmpU32 file_y = flipped ? in->height - 1 - y : y;
+            job->rows[y] = source + (SflBmpUSize)file_y * in->pitch;
+        }
+        return 1;
+    }
 
-SflBmpIOImplementation* sfl_bmp_stdio_get_implementation(void)
-{
-    return &SflBmp_IO_STDLIB;
-}
+    /* Sampled rows are marked first, with any pointer that isn't null */
+    memset(job->rows, 0, sizeof(*job->rows) * in->height);
+    for (y = 0; y < job->tensor->height; ++y) {
+        job->rows[job->y_taps[y].i0] = (const SflBmpU8*)in;
+        job->rows[job->y_taps[y].i1] = (const SflBmpU8*)in;
+    }
+    for (y = 0; y < in->height; ++y) {
+        count += job->rows[y] != 0;
+    }
 
-#endif
+    *copy_size = count * in->pitch;
+    *copy      = (SflBmpU8*)SFL_BMP_ALLOCATE(ctx, *copy_size);
+    if (!*copy) {
+        return 0;
+    }
 
-#if SFL_BMP_MEMORY_IMPLEMENTATION_STDLIB
-#include <stdlib.h>
+    row = *copy;
+    for (SflBmpU32 file_y = 0; file_y < in->height; ++file_y) {
+        y = flipped ? in->height - 1 - file_y : file_y;
+        if (!job->rows[y]) {
+            continue;
+        }
 
-static PROC_SFL_BMP_MEMORY_ALLOCATE(sfl_bmp_stdlib_allocate)
-{
-    return malloc(size);
-}
+        /* Consecutive rows follow one another, the rest need a seek */
+        if (file_y != next &&
+            SFL_BMP_SEEK(
+                ctx,
+                in->offset + (SflBmpU64)file_y * in->pitch,
+                SFL_BMP_IO_SET))
+        {
+            return 0;
+        }
 
-static PROC_SFL_BMP_MEMORY_RELEASE(sfl_bmp_stdlib_release) { free(ptr); }
+        if (!SFL_BMP_READ(ctx, row, in->pitch)) {
+            return 0;
+        }
 
-static SflBmpMemoryImplementation SflBmp_Memory_STDLIB = {
-    sfl_bmp_stdlib_allocate,
-    sfl_bmp_stdlib_release,
-};
+        job->rows[y] = row;
+        row += in->pitch;
+        next = file_y + 1;
+    }
 
-void sfl_bmp_stdlib_init(SflBmpContext* ctx, SflBmpIOImplementation* io)
-{
-    sfl_bmp_init(ctx, io, &SflBmp_Memory_STDLIB);
+    return 1;
 }
 
-SflBmpMemoryImplementation* sfl_bmp_stdlib_get_implementation(void)
+static SFL_BMP__THREAD_PROC(sfl_bmp__tensor_worker)
 {
-    return &SflBmp_Memory_STDLIB;
-}
+    SflBmpTensorWorker* worker = (SflBmpTensorWorker*)param;
+    SflBmpTensorJob*    job    = worker->job;
 
-/* SFL_BMP_MEMORY_IMPLEMENTATION_STDLIB */
-#endif
+    for (;;) {
+        SflBmpU32 band;
 
-#if SFL_BMP_IO_IMPLEMENTATION_STDIO && SFL_BMP_MEMORY_IMPLEMENTATION_STDLIB
-void sfl_bmp_cstd_init(SflBmpContext* ctx)
-{
-    sfl_bmp_init(ctx, &SflBmp_IO_STDLIB, &SflBmp_Memory_STDLIB);
-}
+        sfl_bmp__mutex_lock(&job->mutex);
+        band = job->next_band++;
+        sfl_bmp__mutex_unlock(&job->mutex);
 
-#endif
+        if (band >= job->num_bands) {
+            break;
+        }
 
-#if SFL_BMP_IO_IMPLEMENTATION_WINAPI
+        SflBmpU32 first = band * SFL_BMP__TENSOR_BAND_ROWS;
+        SflBmpU32 last  = first + SFL_BMP__TENSOR_BAND_ROWS;
+        if (last > job->tensor->height) {
+            last = job->tensor->height;
+        }
 
-static PROC_SFL_BMP_IO_READ(sfl_bmp_winapi_read)
-{
-    HANDLE* f = (HANDLE*)usr;
-    DWORD   bytes_read;
-    BOOL    success = ReadFile(*f, ptr, size, &bytes_read, NULL);
-    return success && (bytes_read == size);
+        for (SflBmpU32 y = first; y < last; ++y) {
+            sfl_bmp__tensor_row(worker, y);
+        }
+    }
+
+    return SFL_BMP__THREAD_RETURN;
 }
 
-static PROC_SFL_BMP_IO_SEEK(sfl_bmp_winapi_seek)
+int sfl_bmp_decode_tensor(
+    SflBmpContext*              ctx,
+    const SflBmpTensorSettings* settings,
+    SflBmpTensor*               tensor)
 {
-    DWORD move_method = 3;
+    SflBmpDesc          in;
+    SflBmpDesc          pixel_desc;
+    SflBmpTensorJob     job;
+    SflBmpTensorWorker* workers     = 0;
+    SflBmpThread*       threads;
+    SflBmpU8*           copy        = 0;
+    SflBmpU8*           data        = 0;
+    SflBmpUSize         copy_size   = 0;
+    SflBmpUSize         worker_size = 0;
+    SflBmpUSize         taps_size   = 0;
+    SflBmpU32           crop_width, crop_height;
+    int                 num_threads = 1;
+    int                 num_started = 0;
+    int                 result      = 0;
+    int                 i;
+    SFL_BMP__STAGE_DECLARE(convert_time);
+
+    const SflBmpTensorType type =
+        settings ? settings->type : SFL_BMP_TENSOR_FLOAT32;
+    const SflBmpUSize element_size = (type == SFL_BMP_TENSOR_FLOAT16)
+                                         ? sizeof(SflBmpU16)
+                                         : sizeof(SflBmpReal);
+
+    memset(&job, 0, sizeof(job));
+    if (!sfl_bmp_probe(ctx, &in)) {
+        return 0;
+    }
 
-    switch (whence) {
-        case SFL_BMP_IO_SET:
-            move_method = FILE_BEGIN;
-            break;
-        case SFL_BMP_IO_CUR:
-            move_method = FILE_CURRENT;
-            break;
-        case SFL_BMP_IO_END:
-            move_method = FILE_END;
-            break;
-        default: {
-            return -1;
-        } break;
+    /* Rows are converted to R8G8B8A8, and sampled from that */
+    memset(&pixel_desc, 0, sizeof(pixel_desc));
+    pixel_desc.format = SFL_BMP_PIXEL_FORMAT_R8G8B8A8;
+    pixel_desc.slice  = 4;
+    sfl_bmp__bitmasks_from_pixel_format(pixel_desc.format, pixel_desc.mask);
+    if (!sfl_bmp__decodable(ctx, &in) || in.width == 0 || in.height == 0 ||
+        !sfl_bmp__decode_converter_init(ctx, &job.conv, &in, &pixel_desc))
+    {
+        return 0;
     }
 
-    HANDLE* f      = (HANDLE*)usr;
-    DWORD   result = SetFilePointer(*f, offset, 0, move_method);
-    if (result == INVALID_SET_FILE_POINTER) {
-        /*
-        INVALID_SET_FILE_POINTER is a valid low order dword return value, so we
-        have to check with GetLastError() if this failed
-        */
-        if (GetLastError() == ERROR_SUCCESS) {
-            return 0;
-        } else {
-            return -1;
-        }
-    } else {
+    crop_width  = in.width;
+    crop_height = in.height;
+    if (settings && settings->crop_width && settings->crop_width < in.width) {
+        crop_width = settings->crop_width;
+    }
+    if (settings && settings->crop_height && settings->crop_height < in.height)
+    {
+        crop_height = settings->crop_height;
+    }
+
+    tensor->type   = type;
+    tensor->width  = (settings && settings->width) ? settings->width
+                                                   : crop_width;
+    tensor->height = (settings && settings->height) ? settings->height
+                                                    : crop_height;
+    if (settings && settings->num_threads > 1) {
+        num_threads = settings->num_threads;
+    }
+
+    const SflBmpU64 size =
+        (SflBmpU64)tensor->width * tensor->height * 3 * element_size;
+    if (!sfl_bmp__addressable(size) || (tensor->data && tensor->size < size)) {
         return 0;
     }
-}
 
-static PROC_SFL_BMP_IO_TELL(sfl_bmp_winapi_tell)
-{
-    HANDLE* f      = (HANDLE*)usr;
-    DWORD   result = SetFilePointer(*f, 0, 0, 0);
-    if (result == INVALID_SET_FILE_POINTER) {
-        /*
-        INVALID_SET_FILE_POINTER is a valid low order dword return value, so we
-        have to check with GetLastError() if this failed
-        */
-        if (GetLastError() == ERROR_SUCCESS) {
-            return (long)result;
-        } else {
-            return -1;
+    for (int c = 0; c < 3; ++c) {
+        const SflBmpReal mean = settings ? settings->mean[c] : 0;
+        const SflBmpReal std =
+            (settings && settings->std[c] != 0) ? settings->std[c] : 1;
+        job.scale[c] = 1.0f / (255.0f * std);
+        job.bias[c]  = -mean / std;
+    }
+
+    /* A pointer per image row, and the taps */
+    taps_size   = sizeof(const SflBmpU8*) * in.height +
+                  sizeof(SflBmpTensorTap) * (tensor->width + tensor->height);
+    worker_size = sizeof(SflBmpTensorWorker) + sizeof(SflBmpThread) +
+                  (SflBmpUSize)in.width * 4 +
+                  sizeof(SflBmpReal) * tensor->width * 7;
+    if (!sfl_bmp__within_budget(
+            ctx,
+            (tensor->data ? 0 : (SflBmpUSize)size) + taps_size +
+                worker_size * num_threads))
+    {
+        return 0;
+    }
+
+    if (!tensor->data) {
+        data = (SflBmpU8*)SFL_BMP_ALLOCATE(ctx, (SflBmpUSize)size);
+        if (!data) {
+            goto EXIT_PROC;
         }
-    } else {
-        return (long)result;
+        tensor->data = data;
+        tensor->size = (SflBmpUSize)size;
     }
-}
 
-static SflBmpIOImplementation SflBmp_IO_WINAPI = {
-    sfl_bmp_winapi_read,
-    0,
-    sfl_bmp_winapi_seek,
-    sfl_bmp_winapi_tell,
-};
+    /* Everything is allocated here, so ctx->mem needn't be thread safe */
+    workers = (SflBmpTensorWorker*)SFL_BMP_ALLOCATE(
+        ctx, taps_size + worker_size * num_threads);
+    if (!workers) {
+        goto EXIT_PROC;
+    }
+    threads     = (SflBmpThread*)(workers + num_threads);
+    job.rows    = (const SflBmpU8**)(threads + num_threads);
+    job.x_taps  = (SflBmpTensorTap*)(job.rows + in.height);
+    job.y_taps  = job.x_taps + tensor->width;
+    job.in      = &in;
+    job.tensor  = tensor;
+
+    sfl_bmp__tensor_taps(
+        job.x_taps, tensor->width, (in.width - crop_width) / 2, crop_width);
+    sfl_bmp__tensor_taps(
+        job.y_taps, tensor->height, (in.height - crop_height) / 2, crop_height);
+
+    /* Bands are filled in any order, so the rows they sample are read first */
+    if (!sfl_bmp__tensor_source(ctx, &job, &copy, &copy_size)) {
+        goto EXIT_PROC;
+    }
 
-void sfl_bmp_winapi_io_init(
-    SflBmpContext* ctx, SflBmpMemoryImplementation* memory)
-{
-    sfl_bmp_init(ctx, &SflBmp_IO_WINAPI, memory);
-}
+    for (i = 0; i < num_threads; ++i) {
+        SflBmpReal* memory =
+            (SflBmpReal*)(job.y_taps + tensor->height) +
+            (SflBmpUSize)i * tensor->width * 7;
+        workers[i].job        = &job;
+        workers[i].rows[0]    = memory;
+        workers[i].rows[1]    = memory + (SflBmpUSize)tensor->width * 3;
+        workers[i].values     = memory + (SflBmpUSize)tensor->width * 6;
+        workers[i].row_ids[0] = (SflBmpU32)-1;
+        workers[i].row_ids[1] = (SflBmpU32)-1;
+        workers[i].pixels =
+            (SflBmpU8*)((SflBmpReal*)(job.y_taps + tensor->height) +
+                        (SflBmpUSize)num_threads * tensor->width * 7) +
+            (SflBmpUSize)i * in.width * 4;
+    }
 
-void sfl_bmp_winapi_io_set_file(SflBmpContext* ctx, HANDLE* file)
-{
-    ctx->io.usr = (void*)file;
-}
+    job.num_bands = (tensor->height + SFL_BMP__TENSOR_BAND_ROWS - 1) /
+                    SFL_BMP__TENSOR_BAND_ROWS;
 
-SflBmpIOImplementation* sfl_bmp_winapi_io_get_implementation(void)
-{
-    return &SflBmp_IO_WINAPI;
+    sfl_bmp__mutex_init(&job.mutex);
+    SFL_BMP__STAGE_BEGIN(ctx, SFL_BMP_STAGE_CONVERT, convert_time);
+
+    for (i = 1; i < num_threads; ++i) {
+        if (!sfl_bmp__thread_start(
+                &threads[num_started], sfl_bmp__tensor_worker, &workers[i]))
+        {
+            break;
+        }
+        num_started++;
+    }
+
+    /* The calling thread takes bands too, and all of them if no thread
+     * could be started */
+    sfl_bmp__tensor_worker(&workers[0]);
+
+    for (i = 0; i < num_started; ++i) {
+        sfl_bmp__thread_join(threads[i]);
+    }
+
+    SFL_BMP__STAGE_END(ctx, SFL_BMP_STAGE_CONVERT, convert_time);
+    sfl_bmp__mutex_destroy(&job.mutex);
+    result = 1;
+
+EXIT_PROC:
+    if (workers) {
+        SFL_BMP_RELEASE(ctx, workers, taps_size + worker_size * num_threads);
+    }
+    if (copy) {
+        SFL_BMP_RELEASE(ctx, copy, copy_size);
+    }
+    if (data) {
+        if (result) {
+            sfl_bmp__disown(ctx, (SflBmpUSize)size);
+        } else {
+            SFL_BMP_RELEASE(ctx, data, (SflBmpUSize)size);
+            tensor->data = 0;
+            tensor->size = 0;
+        }
+    }
+    return result;
 }
 
-/* SFL_BMP_IO_IMPLEMENTATION_WINAPI */
+/* SFL_BMP_TENSOR */
 #endif
 
 #undef SFL_BMP_READ_STRUCT
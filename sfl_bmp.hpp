@@ -0,0 +1,462 @@
+/* sfl_bmp.hpp v0.1
+C++ wrapper over sfl_bmp.h: images that own their pixel data, rows as spans,
+and pixels typed by their format at compile time, so that conversions between
+two formats are generated for that pair alone.
+
+MIT License
+
+Copyright (c) 2023 Michael Dodis
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+
+USAGE
+Needs C++11. The options of sfl_bmp.h apply as usual, and the implementation
+still goes in one translation unit (compiled as C++, since sfl_bmp.h declares
+everything with C++ linkage there):
+
+    #define SFL_BMP_IMPLEMENTATION
+    #include "sfl_bmp.hpp"
+
+    SflBmpContext ctx;
+    sfl_bmp_cstd_init(&ctx);
+    sfl_bmp_stdio_set_file(&ctx, file);
+
+    auto image = sfl::bmp::Image<sfl::bmp::Format::R8G8B8A8>::decode(ctx);
+    if (!image) { ... }
+
+    for (auto& pixel : image.row(0)) {
+        pixel.a = 255;
+    }
+
+    auto packed = sfl::bmp::convert<sfl::bmp::Format::B5G6R5>(image);
+
+Nothing here throws: functions that can fail return an empty image (which
+tests false) or 0, like the C functions they call.
+
+Rows are std::span with C++20, and sfl::bmp::Span otherwise, which has the
+same data(), size(), operator[] and iteration. Either way row(0) is the top
+row, even for images stored bottom to top.
+
+Conversions round to nearest, with the same results as sfl_bmp_decode's;
+pass SFL_BMP_ATTRIBUTE_DITHERED to Image::decode to have the library dither
+instead. Palette index formats have no pixel type.
+
+*/
+#ifndef SFL_BMP_HPP
+#define SFL_BMP_HPP
+
+#include "sfl_bmp.h"
+
+#include <string.h>
+
+#if defined(__has_include)
+#if __has_include(<version>)
+#include <version>
+#endif
+#endif
+
+#if defined(__cpp_lib_span)
+#include <span>
+#endif
+
+namespace sfl {
+namespace bmp {
+
+#if defined(__cpp_lib_span)
+template <typename T>
+using Span = std::span<T>;
+#else
+/** Stands in for std::span before C++20 */
+template <typename T>
+class Span {
+public:
+    Span() : ptr_(0), count_(0) {}
+    Span(T* ptr, SflBmpUSize count) : ptr_(ptr), count_(count) {}
+    /** Span<T> to Span<const T> */
+    template <typename U>
+    Span(const Span<U>& other) : ptr_(other.data()), count_(other.size())
+    {
+    }
+
+    T*          data() const { return ptr_; }
+    SflBmpUSize size() const { return count_; }
+    bool        empty() const { return count_ == 0; }
+    T*          begin() const { return ptr_; }
+    T*          end() const { return ptr_ + count_; }
+    T&          operator[](SflBmpUSize i) const { return ptr_[i]; }
+
+private:
+    T*          ptr_;
+    SflBmpUSize count_;
+};
+#endif
+
+enum class Format : int
+{
+    B8G8R8A8 = SFL_BMP_PIXEL_FORMAT_B8G8R8A8,
+    B8G8R8   = SFL_BMP_PIXEL_FORMAT_B8G8R8,
+    B5G6R5   = SFL_BMP_PIXEL_FORMAT_B5G6R5,
+    R8G8B8A8 = SFL_BMP_PIXEL_FORMAT_R8G8B8A8,
+    B8G8R8X8 = SFL_BMP_PIXEL_FORMAT_B8G8R8X8,
+    B5G5R5X1 = SFL_BMP_PIXEL_FORMAT_B5G5R5X1,
+};
+
+/**
+ * A pixel of format F, laid out as in memory. Each one also has the shift &
+ * width of its components within the (little endian) pixel value, the same
+ * as sfl_bmp.h's masks for F. A component that isn't there is 0 bits wide
+ */
+template <Format F>
+struct Pixel;
+
+#define SFL_BMP__PIXEL_LAYOUT(F, SLICE, RS, RB, GS, GB, BS, BB, AS, AB)     \
+    static const Format    format  = Format::F;                             \
+    static const SflBmpU32 slice   = SLICE;                                 \
+    static const SflBmpU32 r_shift = RS, r_bits = RB;                       \
+    static const SflBmpU32 g_shift = GS, g_bits = GB;                       \
+    static const SflBmpU32 b_shift = BS, b_bits = BB;                       \
+    static const SflBmpU32 a_shift = AS, a_bits = AB
+
+template <>
+struct Pixel<Format::B8G8R8A8> {
+    SFL_BMP__PIXEL_LAYOUT(B8G8R8A8, 4, 16, 8, 8, 8, 0, 8, 24, 8);
+    SflBmpU8 b, g, r, a;
+};
+
+template <>
+struct Pixel<Format::B8G8R8> {
+    SFL_BMP__PIXEL_LAYOUT(B8G8R8, 3, 16, 8, 8, 8, 0, 8, 0, 0);
+    SflBmpU8 b, g, r;
+};
+
+template <>
+struct Pixel<Format::B5G6R5> {
+    SFL_BMP__PIXEL_LAYOUT(B5G6R5, 2, 11, 5, 5, 6, 0, 5, 0, 0);
+    SflBmpU16 value;
+};
+
+template <>
+struct Pixel<Format::R8G8B8A8> {
+    SFL_BMP__PIXEL_LAYOUT(R8G8B8A8, 4, 0, 8, 8, 8, 16, 8, 24, 8);
+    SflBmpU8 r, g, b, a;
+};
+
+template <>
+struct Pixel<Format::B8G8R8X8> {
+    SFL_BMP__PIXEL_LAYOUT(B8G8R8X8, 4, 16, 8, 8, 8, 0, 8, 0, 0);
+    SflBmpU8 b, g, r, x;
+};
+
+template <>
+struct Pixel<Format::B5G5R5X1> {
+    SFL_BMP__PIXEL_LAYOUT(B5G5R5X1, 2, 10, 5, 5, 5, 0, 5, 0, 0);
+    SflBmpU16 value;
+};
+
+#undef SFL_BMP__PIXEL_LAYOUT
+
+namespace detail {
+
+template <typename P>
+inline SflBmpU32 load(const P& pixel)
+{
+    SflBmpU32 value = 0;
+    memcpy(&value, &pixel, P::slice);
+    return value;
+}
+
+template <typename P>
+inline void store(P& pixel, SflBmpU32 value)
+{
+    memcpy(&pixel, &value, P::slice);
+}
+
+inline SflBmpU32 mask(SflBmpU32 shift, SflBmpU32 bits)
+{
+    return ((SflBmpU32)((1ull << bits) - 1)) << shift;
+}
+
+/**
+ * Rescales a component from InBits to OutBits, rounding to nearest, as
+ * sfl_bmp__scale_component does. Missing input components are zero, or max
+ * if Fill is set (alpha)
+ */
+template <SflBmpU32 InBits, SflBmpU32 OutBits, bool Fill>
+inline SflBmpU32 scale(SflBmpU32 value)
+{
+    const SflBmpU32 in_max  = (SflBmpU32)((1ull << InBits) - 1);
+    const SflBmpU32 out_max = (SflBmpU32)((1ull << OutBits) - 1);
+    if (OutBits == 0) return 0;
+    if (InBits == 0) return Fill ? out_max : 0;
+    if (InBits == OutBits) return value;
+    return (value * out_max + in_max / 2) / in_max;
+}
+
+template <SflBmpU32 InShift,
+          SflBmpU32 InBits,
+          SflBmpU32 OutShift,
+          SflBmpU32 OutBits,
+          bool      Fill>
+inline SflBmpU32 component(SflBmpU32 pixel)
+{
+    const SflBmpU32 value = (pixel >> InShift) & mask(0, InBits);
+    return scale<InBits, OutBits, Fill>(value) << OutShift;
+}
+
+} // namespace detail
+
+/**
+ * Converts one pixel. Every shift & width is known here, so the compiler is
+ * left with a handful of shifts and multiplications per pair of formats
+ */
+template <Format To, Format From>
+inline Pixel<To> convert_pixel(const Pixel<From>& pixel)
+{
+    typedef Pixel<From> I;
+    typedef Pixel<To>   O;
+    const SflBmpU32 p = detail::load(pixel);
+    const SflBmpU32 r = detail::
+        component<I::r_shift, I::r_bits, O::r_shift, O::r_bits, false>(p);
+    const SflBmpU32 g = detail::
+        component<I::g_shift, I::g_bits, O::g_shift, O::g_bits, false>(p);
+    const SflBmpU32 b = detail::
+        component<I::b_shift, I::b_bits, O::b_shift, O::b_bits, false>(p);
+    const SflBmpU32 a = detail::
+        component<I::a_shift, I::a_bits, O::a_shift, O::a_bits, true>(p);
+
+    O result;
+    detail::store(result, r | g | b | a);
+    return result;
+}
+
+/**
+ * Converts as many pixels as both rows have
+ */
+template <Format To, Format From>
+inline void convert_row(Span<const Pixel<From>> src, Span<Pixel<To>> dst)
+{
+    const SflBmpUSize   count = src.size() < dst.size() ? src.size()
+                                                          : dst.size();
+    const Pixel<From>*  in    = src.data();
+    Pixel<To>*          out   = dst.data();
+    for (SflBmpUSize i = 0; i < count; ++i) {
+        out[i] = convert_pixel<To, From>(in[i]);
+    }
+}
+
+/**
+ * An image of format F. It owns its pixel data, and releases it through the
+ * memory implementation it was allocated with. Moving hands that over, and
+ * copying isn't allowed; convert<F>() makes a copy
+ */
+template <Format F>
+class Image {
+public:
+    typedef Pixel<F> PixelType;
+
+    Image() : mem_(0) { clear(); }
+
+    /**
+     * Allocates a width by height image (from the top row down), or leaves
+     * it empty if that fails. The pixels aren't initialized
+     */
+    Image(SflBmpU32 width, SflBmpU32 height, SflBmpMemoryImplementation* mem)
+        : mem_(0)
+    {
+        clear();
+        const SflBmpU64 pitch = (((SflBmpU64)PixelType::slice * 8 * width +
+                                  31) / 32) * 4;
+        const SflBmpU64 size  = pitch * height;
+        if (!mem || pitch > 0xFFFFFFFFu || size != (SflBmpUSize)size) {
+            return;
+        }
+
+        void* data = mem->allocate(mem->usr, (SflBmpUSize)size);
+        if (!data) {
+            return;
+        }
+
+        mem_          = mem;
+        desc_.data    = data;
+        desc_.width   = width;
+        desc_.height  = height;
+        desc_.pitch   = (SflBmpU32)pitch;
+        desc_.slice   = PixelType::slice;
+        desc_.size    = size;
+        desc_.format  = (SflBmpU32)F;
+        desc_.mask[0] = detail::mask(PixelType::r_shift, PixelType::r_bits);
+        desc_.mask[1] = detail::mask(PixelType::g_shift, PixelType::g_bits);
+        desc_.mask[2] = detail::mask(PixelType::b_shift, PixelType::b_bits);
+        desc_.mask[3] = detail::mask(PixelType::a_shift, PixelType::a_bits);
+        desc_.num_planes      = 1;
+        desc_.plane_pitch[0]  = desc_.pitch;
+#if SFL_BMP_MIPMAPS
+        desc_.num_levels     = 1;
+        desc_.level_pitch[0] = desc_.pitch;
+#endif
+    }
+
+    /**
+     * Decodes the image that ctx reads, with sfl_bmp_decode
+     * @param attributes Output attributes, of which only
+     *                   SFL_BMP_ATTRIBUTE_DITHERED applies
+     * @return The image, or an empty one if decoding failed
+     */
+    static Image decode(SflBmpContext& ctx, int attributes = 0)
+    {
+        Image image;
+        image.desc_.format     = (SflBmpU32)F;
+        image.desc_.attributes = attributes & SFL_BMP_ATTRIBUTE_DITHERED;
+        if (!sfl_bmp_decode(&ctx, &image.desc_)) {
+            image.clear();
+            return image;
+        }
+
+        image.mem_ = ctx.mem;
+        return image;
+    }
+
+    Image(Image&& other) : mem_(other.mem_), desc_(other.desc_)
+    {
+        other.clear();
+    }
+
+    Image& operator=(Image&& other)
+    {
+        if (this != &other) {
+            reset();
+            mem_  = other.mem_;
+            desc_ = other.desc_;
+            other.clear();
+        }
+        return *this;
+    }
+
+    Image(const Image&)            = delete;
+    Image& operator=(const Image&) = delete;
+
+    ~Image() { reset(); }
+
+    explicit operator bool() const { return desc_.data != 0; }
+
+    SflBmpU32 width() const { return desc_.width; }
+    SflBmpU32 height() const { return desc_.height; }
+    /** Bytes from one row to the next, padding included */
+    SflBmpU32 pitch() const { return desc_.pitch; }
+
+    /** Row y, counting from the top */
+    Span<PixelType> row(SflBmpU32 y)
+    {
+        return Span<PixelType>((PixelType*)row_data(y), desc_.width);
+    }
+
+    Span<const PixelType> row(SflBmpU32 y) const
+    {
+        return Span<const PixelType>(
+            (const PixelType*)row_data(y), desc_.width);
+    }
+
+    /** The descriptor, for the C functions */
+    const SflBmpDesc& desc() const { return desc_; }
+
+    SflBmpMemoryImplementation* memory() const { return mem_; }
+
+    /**
+     * Encodes the image with sfl_bmp_encode
+     * @param ctx      The write context
+     * @param out_desc The output format, compression and header ids,
+     *                 @see sfl_bmp_encode
+     */
+    int encode(SflBmpContext& ctx, SflBmpDesc& out_desc) const
+    {
+        SflBmpContext                source;
+        SflBmpIOImplementationMemory source_io;
+        SflBmpDesc                   in_desc = desc_;
+        if (!desc_.data) {
+            return 0;
+        }
+
+        sfl_bmp_memory_io_init(&source, mem_);
+        sfl_bmp_memory_io_set_source(
+            &source, &source_io, desc_.data, (SflBmpUSize)desc_.size);
+        in_desc.offset = 0;
+        return sfl_bmp_encode(&ctx, &in_desc, &source.io, &out_desc);
+    }
+
+    /**
+     * Hands the pixel data over to the caller, who releases it through
+     * memory(), and leaves the image empty
+     */
+    SflBmpDesc release()
+    {
+        const SflBmpDesc desc = desc_;
+        clear();
+        return desc;
+    }
+
+private:
+    void clear()
+    {
+        mem_ = 0;
+        memset(&desc_, 0, sizeof(desc_));
+    }
+
+    void reset()
+    {
+        if (desc_.data && mem_) {
+            mem_->release(mem_->usr, desc_.data);
+        }
+        clear();
+    }
+
+    SflBmpU8* row_data(SflBmpU32 y) const
+    {
+        if (desc_.attributes & SFL_BMP_ATTRIBUTE_FLIPPED) {
+            y = desc_.height - y - 1;
+        }
+        return (SflBmpU8*)desc_.data + (SflBmpUSize)y * desc_.pitch;
+    }
+
+    SflBmpMemoryImplementation* mem_;
+    SflBmpDesc                  desc_;
+};
+
+/**
+ * Converts src to format To, into an image allocated the same way. Rows of
+ * the result go from the top down, whichever way src's did
+ * @return The converted image, or an empty one if allocating it failed
+ */
+template <Format To, Format From>
+inline Image<To> convert(const Image<From>& src)
+{
+    Image<To> dst(src.width(), src.height(), src.memory());
+    if (!src || !dst) {
+        return Image<To>();
+    }
+
+    for (SflBmpU32 y = 0; y < src.height(); ++y) {
+        convert_row<To, From>(src.row(y), dst.row(y));
+    }
+    return dst;
+}
+
+} // namespace bmp
+} // namespace sfl
+
+#endif
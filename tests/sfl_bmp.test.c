@@ -1,7 +1,22 @@
 #define SFL_BMP_ALWAYS_CONVERT 1
+#define SFL_BMP_QUANTIZE 1
+#define SFL_BMP_HASH 1
+#define SFL_BMP_MIPMAPS 1
+#define SFL_BMP_TENSOR 1
+#define SFL_BMP_CUSTOM_PIXEL_FORMATS 1
+#define SFL_BMP_PIXEL_STATS 1
+#define SFL_BMP_STATS 1
+#define SFL_BMP_BATCH 1
+#define SFL_BMP_PARALLEL_ENCODE 1
+#if defined(__linux__)
+#define SFL_BMP_BATCH_IO_URING 1
+#endif
 #define SFL_BMP_IMPLEMENTATION
 #include "sfl_bmp.h"
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
 
 typedef struct {
     const char *filepath;
@@ -15,9 +30,894 @@ static TestCase Test_Cases[] = {
     },
 };
 
+static int Num_Failures = 0;
+
 static int test(SflBmpContext *ctx, TestCase *test_case) {
 }
 
+/** Packs an R8G8B8A8 color into a pixel described by masks */
+static uint32_t test_pack(const uint32_t *masks, uint32_t color) {
+    uint32_t pixel = 0;
+    for (int c = 0; c < 4; ++c) {
+        uint32_t component = (color >> (c * 8)) & 0xff;
+        if (masks[c] == 0) continue;
+        /* Test colors are either 0 or 0xff, which map to 0 or max */
+        if (component) pixel |= masks[c];
+    }
+    return pixel;
+}
+
+/**
+ * Writes a V5 BMP with the given masks & bpp, holding the test pattern:
+ * red, blue / green, white (top to bottom) with an extra black column, so
+ * that rows need padding.
+ */
+static size_t test_build_bmp(
+    uint8_t *buf, int bpp, const uint32_t *masks, int flipped)
+{
+    static const uint32_t pattern[2][3] = {
+        {0xff0000ff, 0xffff0000, 0xff000000},
+        {0xff00ff00, 0xffffffff, 0xff000000},
+    };
+
+    const uint32_t width = 3, height = 2;
+    const uint32_t pitch = ((bpp * width + 31) / 32) * 4;
+    const uint32_t offset =
+        sizeof(SflBmpFileHeader) + sizeof(SflBmpInfoHeader124);
+
+    SflBmpFileHeader hdr = {0};
+    hdr.hdr[0] = 'B';
+    hdr.hdr[1] = 'M';
+    hdr.file_size = offset + pitch * height;
+    hdr.offset = offset;
+
+    SflBmpInfoHeader124 info = {0};
+    info.size = sizeof(info);
+    info.width = width;
+    info.height = flipped ? (int32_t)height : -(int32_t)height;
+    info.planes = 1;
+    info.bpp = bpp;
+    /* Bitfields aren't allowed with 24 bpp */
+    info.compression = (bpp == 24)
+        ? SFL_BMP_COMPRESSION_NONE
+        : SFL_BMP_COMPRESSION_BITFIELDS;
+    info.raw_size = pitch * height;
+    info.red_mask = masks[0];
+    info.green_mask = masks[1];
+    info.blue_mask = masks[2];
+    info.alpha_mask = masks[3];
+
+    memcpy(buf, &hdr, sizeof(hdr));
+    memcpy(buf + sizeof(hdr), &info, sizeof(info));
+    memset(buf + offset, 0, pitch * height);
+
+    for (uint32_t y = 0; y < height; ++y) {
+        uint32_t row = flipped ? height - y - 1 : y;
+        uint8_t *dst = buf + offset + row * pitch;
+        for (uint32_t x = 0; x < width; ++x) {
+            uint32_t pixel = test_pack(masks, pattern[y][x]);
+            memcpy(dst + x * (bpp / 8), &pixel, bpp / 8);
+        }
+    }
+
+    return hdr.file_size;
+}
+
+/** Decodes a generated image into every output format */
+static void test_convert_all(int bpp, const uint32_t *masks, int flipped) {
+    static const int formats[] = {
+        SFL_BMP_PIXEL_FORMAT_B8G8R8A8,
+        SFL_BMP_PIXEL_FORMAT_B8G8R8,
+        SFL_BMP_PIXEL_FORMAT_B5G6R5,
+        SFL_BMP_PIXEL_FORMAT_R8G8B8A8,
+        SFL_BMP_PIXEL_FORMAT_B8G8R8X8,
+        SFL_BMP_PIXEL_FORMAT_B5G5R5X1,
+    };
+    static const uint32_t expected[2][3] = {
+        {0xff0000ff, 0xffff0000, 0xff000000},
+        {0xff00ff00, 0xffffffff, 0xff000000},
+    };
+
+    uint8_t file[256];
+    size_t size = test_build_bmp(file, bpp, masks, flipped);
+
+    SflBmpContext ctx;
+    SflBmpIOImplementationMemory mem;
+    sfl_bmp_memory_io_init(&ctx, sfl_bmp_stdlib_get_implementation());
+    sfl_bmp_memory_io_set_source(&ctx, &mem, file, size);
+
+    for (int f = 0; f < (int)(sizeof(formats) / sizeof(formats[0])); ++f) {
+        SflBmpDesc desc = {0};
+        desc.format = formats[f];
+        mem.curr = 0;
+
+        if (!sfl_bmp_decode(&ctx, &desc)) {
+            printf("%d bpp -> %s: decode failed\n",
+                bpp, sfl_bmp_describe_pixel_format(formats[f]));
+            Num_Failures++;
+            continue;
+        }
+
+        uint32_t out_masks[4];
+        sfl_bmp__bitmasks_from_pixel_format(desc.format, out_masks);
+
+        for (uint32_t y = 0; y < desc.height; ++y) {
+            uint32_t ry = (desc.attributes & SFL_BMP_ATTRIBUTE_FLIPPED)
+                ? desc.height - y - 1 : y;
+            for (uint32_t x = 0; x < desc.width; ++x) {
+                uint32_t pixel = 0;
+                memcpy(&pixel,
+                    (uint8_t*)desc.data + ry * desc.pitch + x * desc.slice,
+                    desc.slice);
+
+                uint32_t color = expected[y][x];
+                /* Alpha is dropped on X formats, and opaque otherwise */
+                uint32_t want = test_pack(out_masks, color);
+                if (pixel != want) {
+                    printf("%d bpp (%08x %08x %08x %08x) -> %s: "
+                        "(%u, %u) %08x != (expected) %08x\n",
+                        bpp, masks[0], masks[1], masks[2], masks[3],
+                        sfl_bmp_describe_pixel_format(desc.format),
+                        x, y, pixel, want);
+                    Num_Failures++;
+                }
+            }
+        }
+
+        free(desc.data);
+    }
+}
+
+static void test_converters(void) {
+    static const struct {
+        int      bpp;
+        uint32_t masks[4];
+    } inputs[] = {
+        {32, {0x00ff0000, 0x0000ff00, 0x000000ff, 0xff000000}},
+        {32, {0x000000ff, 0x0000ff00, 0x00ff0000, 0xff000000}},
+        {32, {0x00ff0000, 0x0000ff00, 0x000000ff, 0x00000000}},
+        {24, {0x00ff0000, 0x0000ff00, 0x000000ff, 0x00000000}},
+        {16, {0xf800, 0x07e0, 0x001f, 0x0000}},
+        {16, {0x7c00, 0x03e0, 0x001f, 0x0000}},
+        /* Not a known format; goes through the generic converter */
+        {32, {0x3ff00000, 0x000ffc00, 0x000003ff, 0xc0000000}},
+        {16, {0x0f00, 0x00f0, 0x000f, 0xf000}},
+    };
+
+    for (int i = 0; i < (int)(sizeof(inputs) / sizeof(inputs[0])); ++i) {
+        test_convert_all(inputs[i].bpp, inputs[i].masks, 1);
+        test_convert_all(inputs[i].bpp, inputs[i].masks, 0);
+    }
+}
+
+/**
+ * Encodes an image a few rows at a time, with a known and an unknown height,
+ * and checks both against sfl_bmp_encode
+ */
+static void test_streaming_encoder(void) {
+    enum { W = 5, H = 7, PITCH = W * 4 };
+    uint8_t pixels[H * PITCH];
+    for (int i = 0; i < H * PITCH; ++i) pixels[i] = (uint8_t)(i * 37 + 11);
+
+    SflBmpDesc in_desc = {0};
+    in_desc.data       = pixels;
+    in_desc.width      = W;
+    in_desc.height     = H;
+    in_desc.pitch      = PITCH;
+    in_desc.slice      = 4;
+    in_desc.format     = SFL_BMP_PIXEL_FORMAT_R8G8B8A8;
+    in_desc.attributes = SFL_BMP_ATTRIBUTE_FLIPPED;
+
+    uint8_t expected[512], actual[512];
+    SflBmpIOImplementationMemory in_mem, out_mem;
+    SflBmpContext in_ctx, out_ctx;
+    sfl_bmp_memory_io_init(&in_ctx, sfl_bmp_stdlib_get_implementation());
+    sfl_bmp_memory_io_set_source(&in_ctx, &in_mem, pixels, sizeof(pixels));
+    sfl_bmp_memory_io_init(&out_ctx, sfl_bmp_stdlib_get_implementation());
+    sfl_bmp_memory_io_set_sink(&out_ctx, &out_mem, expected, sizeof(expected));
+
+    SflBmpDesc out_desc     = {0};
+    out_desc.format         = SFL_BMP_PIXEL_FORMAT_B8G8R8;
+    out_desc.compression    = SFL_BMP_COMPRESSION_BITFIELDS;
+    out_desc.file_header_id = SFL_BMP_HDR_ID_BM;
+    out_desc.info_header_id = SFL_BMP_NFO_ID_V5;
+    if (!sfl_bmp_encode(&out_ctx, &in_desc, &in_ctx.io, &out_desc)) {
+        printf("streaming encoder: reference encode failed\n");
+        Num_Failures++;
+        return;
+    }
+    size_t expected_size = out_mem.len;
+
+    for (int unknown_height = 0; unknown_height < 2; ++unknown_height) {
+        SflBmpDesc stream_desc = in_desc;
+        SflBmpDesc stream_out  = out_desc;
+        stream_desc.height     = unknown_height ? 0 : H;
+
+        memset(actual, 0xcd, sizeof(actual));
+        sfl_bmp_memory_io_set_sink(&out_ctx, &out_mem, actual, sizeof(actual));
+
+        SflBmpEncoder *enc =
+            sfl_bmp_encoder_begin(&out_ctx, &stream_desc, &stream_out);
+        int ok = enc != 0;
+        /* Uneven bands, the last one shorter */
+        for (int y = 0; ok && y < H; y += 3) {
+            int count = (H - y) < 3 ? (H - y) : 3;
+            ok = sfl_bmp_encoder_write_rows(enc, pixels + y * PITCH, count, PITCH);
+        }
+        if (enc && !sfl_bmp_encoder_end(enc)) ok = 0;
+
+        if (!ok || out_mem.len != expected_size ||
+            memcmp(actual, expected, expected_size) != 0)
+        {
+            printf("streaming encoder (unknown height: %d): mismatch\n",
+                unknown_height);
+            Num_Failures++;
+        }
+    }
+
+    /* Too many rows for the declared height */
+    sfl_bmp_memory_io_set_sink(&out_ctx, &out_mem, actual, sizeof(actual));
+    SflBmpEncoder *enc = sfl_bmp_encoder_begin(&out_ctx, &in_desc, &out_desc);
+    if (!enc || sfl_bmp_encoder_write_rows(enc, pixels, H + 1, PITCH)) {
+        printf("streaming encoder: accepted too many rows\n");
+        Num_Failures++;
+    }
+    if (enc && sfl_bmp_encoder_end(enc)) {
+        printf("streaming encoder: ended with missing rows\n");
+        Num_Failures++;
+    }
+}
+/**
+ * Encodes into growable and preallocated sinks, and decodes the result back
+ * from a source
+ */
+static void test_memory_io(void) {
+    enum { W = 13, H = 9, PITCH = W * 4 };
+    uint8_t pixels[H * PITCH];
+    for (int i = 0; i < H * PITCH; ++i) pixels[i] = (uint8_t)(i * 7 + 3);
+
+    SflBmpDesc in_desc = {0};
+    in_desc.width      = W;
+    in_desc.height     = H;
+    in_desc.pitch      = PITCH;
+    in_desc.slice      = 4;
+    in_desc.format     = SFL_BMP_PIXEL_FORMAT_R8G8B8A8;
+
+    SflBmpIOImplementationMemory in_mem, out_mem;
+    SflBmpContext in_ctx, out_ctx;
+    sfl_bmp_memory_io_init(&in_ctx, sfl_bmp_stdlib_get_implementation());
+    sfl_bmp_memory_io_init(&out_ctx, sfl_bmp_stdlib_get_implementation());
+
+    SflBmpDesc out_desc     = {0};
+    out_desc.format         = SFL_BMP_PIXEL_FORMAT_B8G8R8A8;
+    out_desc.compression    = SFL_BMP_COMPRESSION_BITFIELDS;
+    out_desc.file_header_id = SFL_BMP_HDR_ID_BM;
+    out_desc.info_header_id = SFL_BMP_NFO_ID_V5;
+    SflBmpUSize expected_size = sfl_bmp_encoded_size(&in_desc, &out_desc);
+
+    /* Starting from nothing, then from the exact size */
+    SflBmpUSize initial[] = {0, expected_size};
+    for (int i = 0; i < 2; ++i) {
+        /* The sink's buffer is counted like any other allocation */
+        SflBmpStats stats = {0};
+        sfl_bmp_set_stats(&out_ctx, &stats);
+        sfl_bmp_memory_io_set_source(&in_ctx, &in_mem, pixels, sizeof(pixels));
+        sfl_bmp_memory_io_set_sink(&out_ctx, &out_mem, 0, initial[i]);
+        SflBmpUSize capacity = out_mem.capacity;
+
+        SflBmpDesc encoded_desc = out_desc;
+        if (!sfl_bmp_encode(&out_ctx, &in_desc, &in_ctx.io, &encoded_desc)) {
+            printf("memory io: encode failed\n");
+            Num_Failures++;
+            continue;
+        }
+
+        if (initial[i] && out_mem.capacity != capacity) {
+            printf("memory io: preallocated sink grew\n");
+            Num_Failures++;
+        }
+
+        SflBmpUSize size;
+        void *file = sfl_bmp_memory_io_take(&out_mem, &size);
+        if (size != expected_size) {
+            printf("memory io: wrote %zu bytes, expected %zu\n",
+                (size_t)size, (size_t)expected_size);
+            Num_Failures++;
+        }
+        if (stats.num_allocations == 0 || stats.bytes_in_use != 0 ||
+            stats.peak_bytes_in_use < expected_size)
+        {
+            printf("memory io: sink allocations went uncounted\n");
+            Num_Failures++;
+        }
+        sfl_bmp_set_stats(&out_ctx, 0);
+
+        SflBmpDesc decoded = {0};
+        decoded.format     = SFL_BMP_PIXEL_FORMAT_R8G8B8A8;
+        sfl_bmp_memory_io_set_source(&in_ctx, &in_mem, file, size);
+        if (!sfl_bmp_decode(&in_ctx, &decoded)) {
+            printf("memory io: decode failed\n");
+            Num_Failures++;
+        } else {
+            if (memcmp(decoded.data, pixels, sizeof(pixels)) != 0) {
+                printf("memory io: round trip mismatch\n");
+                Num_Failures++;
+            }
+            free(decoded.data);
+        }
+
+        free(file);
+    }
+
+    /* Growing past the limit fails the write, rather than the process */
+    SflBmpLimits limits = {0};
+    limits.max_memory   = expected_size / 2;
+    sfl_bmp_set_limits(&out_ctx, &limits);
+    sfl_bmp_memory_io_set_source(&in_ctx, &in_mem, pixels, sizeof(pixels));
+    sfl_bmp_memory_io_set_sink(&out_ctx, &out_mem, 0, 0);
+    SflBmpDesc limited_desc = out_desc;
+    if (sfl_bmp_encode(&out_ctx, &in_desc, &in_ctx.io, &limited_desc)) {
+        printf("memory io: sink grew past the memory limit\n");
+        Num_Failures++;
+    }
+    free(sfl_bmp_memory_io_take(&out_mem, 0));
+    if (limits.in_use != 0) {
+        printf("memory io: %zu bytes still counted against the limit\n",
+            (size_t)limits.in_use);
+        Num_Failures++;
+    }
+}
+
+/** Counts the rows handed out by the push decoder */
+static PROC_SFL_BMP_DECODER_ROWS(test_decoder_rows) {
+    uint32_t *next_row = (uint32_t*)usr;
+    if (first != *next_row) {
+        printf("push decoder: rows out of order\n");
+        Num_Failures++;
+    }
+    *next_row = first + count;
+}
+
+/** Feeds a generated image in chunks of every size, plus trailing bytes */
+static void test_push_decoder(void) {
+    static const uint32_t masks[4] = {0xff0000, 0xff00, 0xff, 0};
+    uint8_t file[1024];
+    size_t size = test_build_bmp(file, 24, masks, 1);
+    memset(file + size, 0xcd, 16);
+
+    SflBmpContext ctx;
+    SflBmpIOImplementationMemory mem;
+    sfl_bmp_memory_io_init(&ctx, sfl_bmp_stdlib_get_implementation());
+    sfl_bmp_memory_io_set_source(&ctx, &mem, file, size);
+
+    SflBmpDesc expected = {0};
+    expected.format     = SFL_BMP_PIXEL_FORMAT_R8G8B8A8;
+    if (!sfl_bmp_decode(&ctx, &expected)) {
+        printf("push decoder: decode failed\n");
+        Num_Failures++;
+        return;
+    }
+
+    for (size_t chunk = 1; chunk <= size + 16; ++chunk) {
+        SflBmpDesc desc = {0};
+        desc.format     = SFL_BMP_PIXEL_FORMAT_R8G8B8A8;
+        uint32_t next_row = 0;
+        SflBmpDecoder *dec =
+            sfl_bmp_decoder_begin(&ctx, &desc, test_decoder_rows, &next_row);
+
+        for (size_t i = 0; i < size + 16; i += chunk) {
+            size_t n = (size + 16 - i < chunk) ? size + 16 - i : chunk;
+            if (!sfl_bmp_feed(dec, file + i, n)) {
+                printf("push decoder: feed failed (chunk %zu)\n", chunk);
+                Num_Failures++;
+                break;
+            }
+        }
+
+        SflBmpDecoderProgress progress;
+        sfl_bmp_decoder_progress(dec, &progress);
+        if (progress.bytes_expected != size ||
+            progress.rows_decoded != expected.height ||
+            next_row != expected.height)
+        {
+            printf("push decoder: bad progress (chunk %zu)\n", chunk);
+            Num_Failures++;
+        }
+
+        if (!sfl_bmp_decoder_end(dec)) {
+            printf("push decoder: incomplete (chunk %zu)\n", chunk);
+            Num_Failures++;
+            continue;
+        }
+
+        if (desc.size != expected.size ||
+            memcmp(desc.data, expected.data, expected.size) != 0 ||
+            desc.file_hash != expected.file_hash ||
+            desc.data_hash != expected.data_hash)
+        {
+            printf("push decoder: mismatch (chunk %zu)\n", chunk);
+            Num_Failures++;
+        }
+        free(desc.data);
+    }
+
+    /* All in one chunk: only the headers are copied, never the pixels */
+    SflBmpDesc whole = {0};
+    whole.format     = SFL_BMP_PIXEL_FORMAT_R8G8B8A8;
+    SflBmpDecoder *dec = sfl_bmp_decoder_begin(&ctx, &whole, 0, 0);
+    if (!sfl_bmp_feed(dec, file, size) ||
+        dec->header_capacity > dec->in.offset)
+    {
+        printf("push decoder: buffered %zu bytes of a %zu byte file\n",
+            (size_t)dec->header_capacity, size);
+        Num_Failures++;
+    }
+    if (!sfl_bmp_decoder_end(dec) || !whole.data ||
+        memcmp(whole.data, expected.data, expected.size) != 0)
+    {
+        printf("push decoder: mismatch (one chunk)\n");
+        Num_Failures++;
+    }
+    free(whole.data);
+
+    /* Truncated, then not a BMP at all */
+    SflBmpDesc desc = {0};
+    dec = sfl_bmp_decoder_begin(&ctx, &desc, 0, 0);
+    sfl_bmp_feed(dec, file, size - 1);
+    if (sfl_bmp_decoder_end(dec) || desc.data) {
+        printf("push decoder: truncated file accepted\n");
+        Num_Failures++;
+    }
+
+    memset(file, 'x', 64);
+    dec = sfl_bmp_decoder_begin(&ctx, &desc, 0, 0);
+    if (sfl_bmp_feed(dec, file, 64)) {
+        printf("push decoder: garbage accepted\n");
+        Num_Failures++;
+    }
+    sfl_bmp_decoder_end(dec);
+
+    free(expected.data);
+}
+
+/** XXH64 reference vectors, then the hashes filled in by decode */
+static void test_hash(void) {
+    static const struct {
+        const char *input;
+        uint64_t hash;
+    } vectors[] = {
+        {"", 0xEF46DB3751D8E999ull},
+        {"a", 0xD24EC4F1A98C6E5Bull},
+        {"abc", 0x44BC2CF5AD770999ull},
+        {"Nobody inspects the spammish repetition", 0xFBCEA83C8A378BF1ull},
+    };
+
+    for (size_t i = 0; i < sizeof(vectors) / sizeof(vectors[0]); ++i) {
+        if (sfl_bmp_hash(vectors[i].input, strlen(vectors[i].input)) !=
+            vectors[i].hash)
+        {
+            printf("hash: wrong hash for \"%s\"\n", vectors[i].input);
+            Num_Failures++;
+        }
+    }
+
+    static const uint32_t masks[4] = {0xff0000, 0xff00, 0xff, 0};
+    uint8_t file[1024];
+    size_t size = test_build_bmp(file, 24, masks, 0);
+
+    SflBmpContext ctx;
+    SflBmpIOImplementationMemory mem;
+    sfl_bmp_memory_io_init(&ctx, sfl_bmp_stdlib_get_implementation());
+    sfl_bmp_memory_io_set_source(&ctx, &mem, file, size);
+
+    SflBmpDesc in;
+    if (!sfl_bmp_probe(&ctx, &in)) {
+        printf("hash: probe failed\n");
+        Num_Failures++;
+        return;
+    }
+
+    SflBmpDesc desc = {0};
+    desc.format     = SFL_BMP_PIXEL_FORMAT_B8G8R8A8;
+    sfl_bmp_memory_io_set_source(&ctx, &mem, file, size);
+    if (!sfl_bmp_decode(&ctx, &desc)) {
+        printf("hash: decode failed\n");
+        Num_Failures++;
+        return;
+    }
+
+    if (desc.file_hash !=
+            sfl_bmp_hash(file + in.offset, (size_t)in.pitch * in.height) ||
+        desc.data_hash != sfl_bmp_hash(desc.data, desc.size))
+    {
+        printf("hash: decode hashes don't match the data\n");
+        Num_Failures++;
+    }
+
+    /* Same pixels, different output format: same file hash only */
+    SflBmpDesc other = {0};
+    other.format     = SFL_BMP_PIXEL_FORMAT_R8G8B8A8;
+    sfl_bmp_memory_io_set_source(&ctx, &mem, file, size);
+    if (!sfl_bmp_decode(&ctx, &other) ||
+        other.file_hash != desc.file_hash ||
+        other.data_hash == desc.data_hash)
+    {
+        printf("hash: output format should only change the data hash\n");
+        Num_Failures++;
+    }
+
+    free(other.data);
+    free(desc.data);
+}
+
+/** Images over the limits fail before anything is allocated for them */
+static void test_limits(void) {
+    static const uint32_t masks[4] = {0xff0000, 0xff00, 0xff, 0};
+    uint8_t file[1024];
+    size_t size = test_build_bmp(file, 24, masks, 1);
+
+    SflBmpContext ctx;
+    SflBmpIOImplementationMemory mem;
+    sfl_bmp_memory_io_init(&ctx, sfl_bmp_stdlib_get_implementation());
+
+    SflBmpLimits limits = {0};
+    sfl_bmp_set_limits(&ctx, &limits);
+
+    /* 3x2, decoded to 24 bytes, with a 12 byte scan-line */
+    struct { uint32_t max_width, max_height; size_t max_memory; int ok; }
+    cases[] = {
+        {3, 2, 0, 1},
+        {2, 0, 0, 0},
+        {0, 1, 0, 0},
+        {0, 0, 36, 1},
+        {0, 0, 35, 0},
+    };
+
+    for (int i = 0; i < (int)(sizeof(cases) / sizeof(cases[0])); ++i) {
+        limits.max_width = cases[i].max_width;
+        limits.max_height = cases[i].max_height;
+        limits.max_memory = cases[i].max_memory;
+
+        SflBmpDesc desc = {0};
+        desc.format = SFL_BMP_PIXEL_FORMAT_R8G8B8A8;
+        sfl_bmp_memory_io_set_source(&ctx, &mem, file, size);
+        int ok = sfl_bmp_decode(&ctx, &desc);
+        if (ok != cases[i].ok || limits.in_use != 0) {
+            printf("limits: case %d decoded %d, %zu bytes in use\n",
+                i, ok, (size_t)limits.in_use);
+            Num_Failures++;
+        }
+        if (ok) free(desc.data);
+    }
+
+    limits.max_width = 2;
+    limits.max_memory = 0;
+    SflBmpDesc desc = {0};
+    SflBmpDecoder *dec = sfl_bmp_decoder_begin(&ctx, &desc, 0, 0);
+    if (sfl_bmp_feed(dec, file, size)) {
+        printf("limits: push decoder went over the limits\n");
+        Num_Failures++;
+    }
+    sfl_bmp_decoder_end(dec);
+    if (limits.in_use != 0) {
+        printf("limits: push decoder left %zu bytes in use\n",
+            (size_t)limits.in_use);
+        Num_Failures++;
+    }
+}
+
+/** Encodes images of a few colors with a palette, and decodes them back */
+static void test_palette_encode(void) {
+    enum { W = 29, H = 11 };
+    static const struct {
+        int num_colors;
+        uint8_t alpha;
+        SflBmpU32 format;
+    } cases[] = {
+        {2, 0xff, SFL_BMP_PIXEL_FORMAT_I1},
+        {11, 0xff, SFL_BMP_PIXEL_FORMAT_I4},
+        {256, 0xff, SFL_BMP_PIXEL_FORMAT_I8},
+        /* Too many colors, or not opaque: no palette */
+        {257, 0xff, SFL_BMP_PIXEL_FORMAT_B8G8R8A8},
+        {91, 0x80, SFL_BMP_PIXEL_FORMAT_B8G8R8A8},
+    };
+
+    SflBmpContext in_ctx, out_ctx;
+    SflBmpIOImplementationMemory in_mem, out_mem;
+    sfl_bmp_memory_io_init(&in_ctx, sfl_bmp_stdlib_get_implementation());
+    sfl_bmp_memory_io_init(&out_ctx, sfl_bmp_stdlib_get_implementation());
+
+    for (int i = 0; i < (int)(sizeof(cases) / sizeof(cases[0])); ++i) {
+        uint32_t pixels[W * H];
+        for (int p = 0; p < W * H; ++p) {
+            uint32_t c = (uint32_t)(p % cases[i].num_colors) * 0x2f1b07u;
+            pixels[p] = (c & 0xffffff) | ((uint32_t)cases[i].alpha << 24);
+        }
+
+        SflBmpDesc in_desc = {0};
+        in_desc.width      = W;
+        in_desc.height     = H;
+        in_desc.pitch      = W * 4;
+        in_desc.slice      = 4;
+        in_desc.format     = SFL_BMP_PIXEL_FORMAT_R8G8B8A8;
+
+        SflBmpDesc out_desc     = {0};
+        out_desc.format         = SFL_BMP_PIXEL_FORMAT_B8G8R8A8;
+        out_desc.compression    = SFL_BMP_COMPRESSION_BITFIELDS;
+        out_desc.file_header_id = SFL_BMP_HDR_ID_BM;
+        out_desc.info_header_id = SFL_BMP_NFO_ID_V5;
+        out_desc.attributes     = SFL_BMP_ATTRIBUTE_PALETTIZED;
+
+        sfl_bmp_memory_io_set_source(&in_ctx, &in_mem, pixels, sizeof(pixels));
+        sfl_bmp_memory_io_set_sink(&out_ctx, &out_mem, 0, 0);
+        if (!sfl_bmp_encode(&out_ctx, &in_desc, &in_ctx.io, &out_desc)) {
+            printf("palette encode: case %d failed\n", i);
+            Num_Failures++;
+            continue;
+        }
+
+        SflBmpUSize size;
+        void *file = sfl_bmp_memory_io_take(&out_mem, &size);
+        size_t table_size = 0;
+        if (out_desc.attributes & SFL_BMP_ATTRIBUTE_PALETTIZED) {
+            table_size = out_desc.num_table_entries * 4;
+        }
+
+        if (out_desc.format != cases[i].format ||
+            size != sizeof(SflBmpFileHeader) + sizeof(SflBmpInfoHeader124) +
+                        table_size + out_desc.size)
+        {
+            printf("palette encode: case %d wrote %s, %zu bytes\n",
+                i, sfl_bmp_describe_pixel_format(out_desc.format), (size_t)size);
+            Num_Failures++;
+        }
+
+        SflBmpDesc decoded = {0};
+        decoded.format     = SFL_BMP_PIXEL_FORMAT_R8G8B8A8;
+        sfl_bmp_memory_io_set_source(&in_ctx, &in_mem, file, size);
+        if (!sfl_bmp_decode(&in_ctx, &decoded) ||
+            memcmp(decoded.data, pixels, sizeof(pixels)) != 0)
+        {
+            printf("palette encode: case %d round trip mismatch\n", i);
+            Num_Failures++;
+        }
+
+        free(decoded.data);
+        free(file);
+    }
+}
+
+static void test_quantize(void) {
+    enum { W = 61, H = 83 };
+    static const SflBmpDither dithers[] = {
+        SFL_BMP_DITHER_NONE, SFL_BMP_DITHER_ORDERED, SFL_BMP_DITHER_DIFFUSION,
+    };
+
+    SflBmpContext in_ctx, out_ctx;
+    SflBmpIOImplementationMemory in_mem, out_mem;
+    sfl_bmp_memory_io_init(&in_ctx, sfl_bmp_stdlib_get_implementation());
+    sfl_bmp_memory_io_init(&out_ctx, sfl_bmp_stdlib_get_implementation());
+
+    static uint32_t pixels[W * H];
+    for (int y = 0; y < H; ++y) {
+        for (int x = 0; x < W; ++x) {
+            pixels[y * W + x] = (uint32_t)(x * 4) | (uint32_t)(y * 3) << 8 |
+                                (uint32_t)((x + y) * 255 / (W + H)) << 16 |
+                                0xff000000u;
+        }
+    }
+
+    SflBmpDesc in_desc = {0};
+    in_desc.width      = W;
+    in_desc.height     = H;
+    in_desc.pitch      = W * 4;
+    in_desc.slice      = 4;
+    in_desc.format     = SFL_BMP_PIXEL_FORMAT_R8G8B8A8;
+
+    for (int d = 0; d < 3; ++d) {
+        void *files[2];
+        SflBmpUSize sizes[2];
+
+        /* One thread and three must write the same file */
+        for (int t = 0; t < 2; ++t) {
+            SflBmpQuantizeSettings settings = {0};
+            settings.num_colors  = 16;
+            settings.dither      = dithers[d];
+            settings.num_threads = t ? 3 : 1;
+
+            SflBmpDesc out_desc     = {0};
+            out_desc.file_header_id = SFL_BMP_HDR_ID_BM;
+            out_desc.info_header_id = SFL_BMP_NFO_ID_V5;
+
+            sfl_bmp_memory_io_set_source(
+                &in_ctx, &in_mem, pixels, sizeof(pixels));
+            sfl_bmp_memory_io_set_sink(&out_ctx, &out_mem, 0, 0);
+            if (!sfl_bmp_encode_quantized(
+                    &out_ctx, &in_desc, &in_ctx.io, &out_desc, &settings) ||
+                out_desc.format != SFL_BMP_PIXEL_FORMAT_I4 ||
+                out_desc.num_table_entries != 16)
+            {
+                printf("quantize: dither %d failed\n", d);
+                Num_Failures++;
+                return;
+            }
+            files[t] = sfl_bmp_memory_io_take(&out_mem, &sizes[t]);
+        }
+
+        if (sizes[0] != sizes[1] ||
+            memcmp(files[0], files[1], (size_t)sizes[0]) != 0)
+        {
+            printf("quantize: dither %d depends on the threads\n", d);
+            Num_Failures++;
+        }
+
+        /* 16 colors for a gradient: close, but not that close */
+        SflBmpDesc decoded = {0};
+        decoded.format     = SFL_BMP_PIXEL_FORMAT_R8G8B8A8;
+        sfl_bmp_memory_io_set_source(&in_ctx, &in_mem, files[0], sizes[0]);
+        if (!sfl_bmp_decode(&in_ctx, &decoded)) {
+            printf("quantize: dither %d doesn't decode\n", d);
+            Num_Failures++;
+        } else {
+            const uint8_t *a = (const uint8_t*)pixels;
+            const uint8_t *b = (const uint8_t*)decoded.data;
+            long error = 0;
+            for (int i = 0; i < W * H * 4; ++i) {
+                error += abs((int)a[i] - (int)b[i]);
+            }
+            if (error / (W * H * 3) > 24) {
+                printf("quantize: dither %d is off by %ld on average\n",
+                    d, error / (W * H * 3));
+                Num_Failures++;
+            }
+        }
+
+        free(decoded.data);
+        free(files[0]);
+        free(files[1]);
+    }
+
+    /* Fewer colors than asked for come out exact */
+    for (int p = 0; p < W * H; ++p) {
+        pixels[p] = (p % 3 == 0 ? 0x102030u : p % 3 == 1 ? 0xf0a050u : 0x0u) |
+                    0xff000000u;
+    }
+
+    SflBmpDesc out_desc     = {0};
+    out_desc.file_header_id = SFL_BMP_HDR_ID_BM;
+    out_desc.info_header_id = SFL_BMP_NFO_ID_V5;
+    sfl_bmp_memory_io_set_source(&in_ctx, &in_mem, pixels, sizeof(pixels));
+    sfl_bmp_memory_io_set_sink(&out_ctx, &out_mem, 0, 0);
+    if (!sfl_bmp_encode_quantized(&out_ctx, &in_desc, &in_ctx.io, &out_desc, 0) ||
+        out_desc.num_table_entries != 3)
+    {
+        printf("quantize: 3 colors failed\n");
+        Num_Failures++;
+        return;
+    }
+
+    SflBmpUSize size;
+    void *file = sfl_bmp_memory_io_take(&out_mem, &size);
+    SflBmpDesc decoded = {0};
+    decoded.format     = SFL_BMP_PIXEL_FORMAT_R8G8B8A8;
+    sfl_bmp_memory_io_set_source(&in_ctx, &in_mem, file, size);
+    if (!sfl_bmp_decode(&in_ctx, &decoded) ||
+        memcmp(decoded.data, pixels, sizeof(pixels)) != 0)
+    {
+        printf("quantize: 3 colors round trip mismatch\n");
+        Num_Failures++;
+    }
+
+    free(decoded.data);
+    free(file);
+}
+
+static void test_pack16(void) {
+    enum { W = 13, H = 7 };
+    static uint32_t pixels[W * H];
+    for (int p = 0; p < W * H; ++p) {
+        pixels[p] = (p & 1 ? 0x848484u : (uint32_t)p * 0x2f1b07u & 0xffffffu) |
+                    0xff000000u;
+    }
+
+    SflBmpContext in_ctx, out_ctx;
+    SflBmpIOImplementationMemory in_mem, out_mem;
+    sfl_bmp_memory_io_init(&in_ctx, sfl_bmp_stdlib_get_implementation());
+    sfl_bmp_memory_io_init(&out_ctx, sfl_bmp_stdlib_get_implementation());
+
+    SflBmpDesc in_desc = {0};
+    in_desc.width      = W;
+    in_desc.height     = H;
+    in_desc.pitch      = W * 4;
+    in_desc.slice      = 4;
+    in_desc.format     = SFL_BMP_PIXEL_FORMAT_R8G8B8A8;
+
+    /* B8G8R8X8 source file, and the same pixels packed by the encoder */
+    void *files[2];
+    SflBmpUSize sizes[2];
+    for (int i = 0; i < 2; ++i) {
+        SflBmpDesc out_desc     = {0};
+        out_desc.format         = i ? SFL_BMP_PIXEL_FORMAT_B5G6R5
+                                    : SFL_BMP_PIXEL_FORMAT_B8G8R8X8;
+        out_desc.compression    = i ? SFL_BMP_COMPRESSION_BITFIELDS
+                                    : SFL_BMP_COMPRESSION_NONE;
+        out_desc.file_header_id = SFL_BMP_HDR_ID_BM;
+        out_desc.info_header_id = SFL_BMP_NFO_ID_V5;
+        out_desc.attributes     = i ? SFL_BMP_ATTRIBUTE_DITHERED : 0;
+
+        sfl_bmp_memory_io_set_source(&in_ctx, &in_mem, pixels, sizeof(pixels));
+        sfl_bmp_memory_io_set_sink(&out_ctx, &out_mem, 0, 0);
+        if (!sfl_bmp_encode(&out_ctx, &in_desc, &in_ctx.io, &out_desc)) {
+            printf("pack16: encode %d failed\n", i);
+            Num_Failures++;
+            return;
+        }
+        files[i] = sfl_bmp_memory_io_take(&out_mem, &sizes[i]);
+    }
+
+    /* Decoded straight to 16 bpp, rounded and dithered */
+    SflBmpDesc packed[2];
+    for (int i = 0; i < 2; ++i) {
+        memset(&packed[i], 0, sizeof(packed[i]));
+        packed[i].format     = SFL_BMP_PIXEL_FORMAT_B5G6R5;
+        packed[i].attributes = i ? SFL_BMP_ATTRIBUTE_DITHERED : 0;
+        sfl_bmp_memory_io_set_source(&in_ctx, &in_mem, files[0], sizes[0]);
+        if (!sfl_bmp_decode(&in_ctx, &packed[i]) ||
+            packed[i].slice != 2 || packed[i].pitch != (W * 2 + 3) / 4 * 4)
+        {
+            printf("pack16: decode %d failed\n", i);
+            Num_Failures++;
+            return;
+        }
+    }
+
+    int gray[2] = {0, 0};
+    for (int y = 0; y < H; ++y) {
+        const uint16_t *row =
+            (const uint16_t*)((const uint8_t*)packed[0].data + y * packed[0].pitch);
+        const uint16_t *dithered =
+            (const uint16_t*)((const uint8_t*)packed[1].data + y * packed[1].pitch);
+        for (int x = 0; x < W; ++x) {
+            const uint32_t p = pixels[y * W + x];
+            const uint32_t expected =
+                ((p & 0xff) * 31 + 127) / 255 << 11 |
+                ((p >> 8 & 0xff) * 63 + 127) / 255 << 5 |
+                ((p >> 16 & 0xff) * 31 + 127) / 255;
+            if (row[x] != expected) {
+                printf("pack16: (%d, %d) is %04x, not %04x\n",
+                    x, y, row[x], expected);
+                Num_Failures++;
+                return;
+            }
+            if ((y * W + x) & 1) {
+                gray[0] += row[x] >> 11;
+                gray[1] += dithered[x] >> 11;
+            }
+        }
+    }
+
+    /* 0x84 is 16.05 in 5 bits: rounding always gives 16, dithering sometimes
+     * gives 17 */
+    if (gray[0] != 16 * (W * H / 2) || gray[1] <= gray[0]) {
+        printf("pack16: gray sums to %d and %d\n", gray[0], gray[1]);
+        Num_Failures++;
+    }
+
+    /* The encoder dithers the same way, row for row */
+    if (memcmp(
+            (const uint8_t*)files[1] + sizes[1] - packed[1].size,
+            packed[1].data,
+            packed[1].size) != 0)
+    {
+        printf("pack16: encoded and decoded dithering differ\n");
+        Num_Failures++;
+    }
+
+    free(packed[0].data);
+    free(packed[1].data);
+    free(files[0]);
+    free(files[1]);
+}
 
 /**
  * Test a given pixel of an image description
@@ -65,46 +965,2318 @@ static inline void test_pixel(SflBmpDesc *desc, int x, int y, uint32_t color) {
                 x, y,
                 pixel,
                 color);
+            Num_Failures++;
             return;
         }
     }
 }
 
-/**
- * Invocation: <executable>
- */
-int main(int argc, char const *argv[]) {
-    if (argc < 2) {
-        puts("Invalid number of arguments");
-        return -1;
+/** Mip chains from decode and from the push decoder, box and sRGB */
+static void test_mipmaps(void) {
+    enum { W = 13, H = 6 };
+    static uint32_t pixels[W * H];
+    for (int y = 0; y < H; ++y) {
+        for (int x = 0; x < W; ++x) {
+            /* Black and white checkers in green, a gradient elsewhere */
+            pixels[y * W + x] = (uint32_t)(x * 19) |
+                                (((x + y) & 1) ? 0xff00u : 0) |
+                                (uint32_t)(y * 41) << 16 | 0xff000000u;
+        }
     }
 
-    FILE *f = fopen(argv[1], "rb");
-    if (f == 0) {
-        puts("File doesn't exist");
-        return -1;
+    SflBmpContext in_ctx, out_ctx;
+    SflBmpIOImplementationMemory in_mem, out_mem;
+    sfl_bmp_memory_io_init(&in_ctx, sfl_bmp_stdlib_get_implementation());
+    sfl_bmp_memory_io_init(&out_ctx, sfl_bmp_stdlib_get_implementation());
+
+    SflBmpDesc in_desc = {0};
+    in_desc.width      = W;
+    in_desc.height     = H;
+    in_desc.pitch      = W * 4;
+    in_desc.slice      = 4;
+    in_desc.format     = SFL_BMP_PIXEL_FORMAT_R8G8B8A8;
+
+    SflBmpDesc out_desc     = {0};
+    out_desc.format         = SFL_BMP_PIXEL_FORMAT_B8G8R8X8;
+    out_desc.file_header_id = SFL_BMP_HDR_ID_BM;
+    out_desc.info_header_id = SFL_BMP_NFO_ID_V5;
+    sfl_bmp_memory_io_set_source(&in_ctx, &in_mem, pixels, sizeof(pixels));
+    sfl_bmp_memory_io_set_sink(&out_ctx, &out_mem, 0, 0);
+    if (!sfl_bmp_encode(&out_ctx, &in_desc, &in_ctx.io, &out_desc)) {
+        printf("mipmaps: encode failed\n");
+        Num_Failures++;
+        return;
     }
+    SflBmpUSize size;
+    void *file = sfl_bmp_memory_io_take(&out_mem, &size);
 
-    SflBmpContext read_context;
-    sfl_bmp_cstd_init(&read_context);
-    sfl_bmp_stdio_set_file(&read_context, f);
+    static const uint32_t widths[] = {13, 6, 3, 1};
+    static const uint32_t heights[] = {6, 3, 1, 1};
 
-    SflBmpDesc desc;
-    if (sfl_bmp_decode(&read_context, &desc) == 0) {
-        perror("Failed.");
-        return -1;
+    for (int srgb = 0; srgb < 2; ++srgb) {
+        SflBmpDesc desc = {0};
+        desc.format     = SFL_BMP_PIXEL_FORMAT_R8G8B8A8;
+        desc.attributes = SFL_BMP_ATTRIBUTE_MIPMAPPED |
+                          (srgb ? SFL_BMP_ATTRIBUTE_SRGB : 0);
+        sfl_bmp_memory_io_set_source(&in_ctx, &in_mem, file, size);
+        if (!sfl_bmp_decode(&in_ctx, &desc) || desc.num_levels != 4 ||
+            desc.level_offset[1] != desc.pitch * H ||
+            desc.size != desc.level_offset[3] + desc.level_pitch[3])
+        {
+            printf("mipmaps: bad layout (srgb %d)\n", srgb);
+            Num_Failures++;
+            free(desc.data);
+            continue;
+        }
+
+        /* Each level against a 2x2 box of the one above it */
+        for (uint32_t level = 1; level < desc.num_levels; ++level) {
+            const uint8_t *base = (uint8_t*)desc.data;
+            const uint8_t *src = base + desc.level_offset[level - 1];
+            const uint8_t *dst = base + desc.level_offset[level];
+            const uint32_t src_pitch = desc.level_pitch[level - 1];
+
+            for (uint32_t y = 0; y < heights[level]; ++y) {
+                for (uint32_t x = 0; x < widths[level]; ++x) {
+                    uint32_t x1 = (widths[level - 1] > 1) ? x * 2 + 1 : 0;
+                    uint32_t y1 = (heights[level - 1] > 1) ? y * 2 + 1 : 0;
+                    for (int c = 0; c < 4; ++c) {
+                        int sum = src[y * 2 * src_pitch + x * 8 + c] +
+                                  src[y * 2 * src_pitch + x1 * 4 + c] +
+                                  src[y1 * src_pitch + x * 8 + c] +
+                                  src[y1 * src_pitch + x1 * 4 + c];
+                        int got = dst[y * desc.level_pitch[level] + x * 4 + c];
+
+                        /* sRGB color only has to be brighter than a box */
+                        int ok = (srgb && c < 3) ? got >= (sum + 2) / 4
+                                                 : got == (sum + 2) / 4;
+                        if (!ok) {
+                            printf("mipmaps: level %u (%u, %u) is off\n",
+                                level, x, y);
+                            Num_Failures++;
+                            y = heights[level];
+                            level = desc.num_levels;
+                            break;
+                        }
+                    }
+                }
+            }
+        }
+
+        /* Half black, half white: 128 averaged as is, 188 in linear light */
+        const uint8_t *level1 = (uint8_t*)desc.data + desc.level_offset[1];
+        if (level1[1] != (srgb ? 188 : 128) || level1[3] != 0xff) {
+            printf("mipmaps: checkers average to %d (srgb %d)\n",
+                level1[1], srgb);
+            Num_Failures++;
+        }
+
+        /* The push decoder fills the same chain */
+        SflBmpDesc pushed = {0};
+        pushed.format     = desc.format;
+        pushed.attributes = desc.attributes;
+        SflBmpDecoder *dec = sfl_bmp_decoder_begin(&in_ctx, &pushed, 0, 0);
+        for (SflBmpUSize i = 0; i < size; i += 7) {
+            SflBmpUSize n = (size - i < 7) ? size - i : 7;
+            sfl_bmp_feed(dec, (uint8_t*)file + i, n);
+        }
+        if (!sfl_bmp_decoder_end(dec) || pushed.size != desc.size ||
+            memcmp(pushed.data, desc.data, desc.size) != 0)
+        {
+            printf("mipmaps: push decoder differs (srgb %d)\n", srgb);
+            Num_Failures++;
+        }
+        free(pushed.data);
+        free(desc.data);
     }
 
-    printf("Image format: %s\n",
-        sfl_bmp_describe_pixel_format(desc.format));
+    /* Only 8 bit components can be filtered */
+    SflBmpDesc packed = {0};
+    packed.format     = SFL_BMP_PIXEL_FORMAT_B5G6R5;
+    packed.attributes = SFL_BMP_ATTRIBUTE_MIPMAPPED;
+    sfl_bmp_memory_io_set_source(&in_ctx, &in_mem, file, size);
+    if (sfl_bmp_decode(&in_ctx, &packed)) {
+        printf("mipmaps: 16 bpp chain accepted\n");
+        Num_Failures++;
+        free(packed.data);
+    }
 
-    printf("Image is flipped: %d\n", 
-        desc.attributes & SFL_BMP_ATTRIBUTE_FLIPPED);
+    free(file);
+}
 
-    test_pixel(&desc, 0, 0, 0xff0000ff);
-    test_pixel(&desc, 1, 0, 0xffff0000);
-    test_pixel(&desc, 0, 1, 0xff00ff00);
-    test_pixel(&desc, 1, 1, 0xffffffff);
+/** Planar output matches interleaved output, from every kind of input */
+static void test_planar(void) {
+    enum { W = 301, H = 3 };
+    static const struct {
+        int format;
+        int compression;
+        int attributes;
+    } sources[] = {
+        {SFL_BMP_PIXEL_FORMAT_B8G8R8, SFL_BMP_COMPRESSION_NONE, 0},
+        {SFL_BMP_PIXEL_FORMAT_B8G8R8A8, SFL_BMP_COMPRESSION_BITFIELDS, 0},
+        {SFL_BMP_PIXEL_FORMAT_B5G6R5, SFL_BMP_COMPRESSION_BITFIELDS, 0},
+        /* 11 colors, written as 4 bpp indices */
+        {SFL_BMP_PIXEL_FORMAT_B8G8R8A8, SFL_BMP_COMPRESSION_BITFIELDS,
+         SFL_BMP_ATTRIBUTE_PALETTIZED},
+    };
+    static const int outputs[] = {
+        SFL_BMP_PIXEL_FORMAT_R8G8B8A8,
+        SFL_BMP_PIXEL_FORMAT_B8G8R8,
+    };
 
-    return 0;
+    SflBmpContext in_ctx, out_ctx;
+    SflBmpIOImplementationMemory in_mem, out_mem;
+    sfl_bmp_memory_io_init(&in_ctx, sfl_bmp_stdlib_get_implementation());
+    sfl_bmp_memory_io_init(&out_ctx, sfl_bmp_stdlib_get_implementation());
+
+    static uint32_t pixels[W * H];
+    for (int s = 0; s < (int)(sizeof(sources) / sizeof(sources[0])); ++s) {
+        for (int p = 0; p < W * H; ++p) {
+            uint32_t c = (sources[s].attributes ? (uint32_t)(p % 11)
+                                                : (uint32_t)p) *
+                         0x2f1b07u;
+            pixels[p] = (c & 0xffffff) |
+                        (sources[s].attributes ? 0xff000000u : c << 24);
+        }
+
+        SflBmpDesc in_desc = {0};
+        in_desc.width      = W;
+        in_desc.height     = H;
+        in_desc.pitch      = W * 4;
+        in_desc.slice      = 4;
+        in_desc.format     = SFL_BMP_PIXEL_FORMAT_R8G8B8A8;
+
+        SflBmpDesc out_desc     = {0};
+        out_desc.format         = sources[s].format;
+        out_desc.compression    = sources[s].compression;
+        out_desc.file_header_id = SFL_BMP_HDR_ID_BM;
+        out_desc.info_header_id = SFL_BMP_NFO_ID_V5;
+        out_desc.attributes     = sources[s].attributes;
+
+        sfl_bmp_memory_io_set_source(&in_ctx, &in_mem, pixels, sizeof(pixels));
+        sfl_bmp_memory_io_set_sink(&out_ctx, &out_mem, 0, 0);
+        if (!sfl_bmp_encode(&out_ctx, &in_desc, &in_ctx.io, &out_desc)) {
+            printf("planar: encode %d failed\n", s);
+            Num_Failures++;
+            continue;
+        }
+        SflBmpUSize size;
+        void *file = sfl_bmp_memory_io_take(&out_mem, &size);
+
+        for (int o = 0; o < 2; ++o) {
+            SflBmpDesc desc[2];
+            for (int planar = 0; planar < 2; ++planar) {
+                memset(&desc[planar], 0, sizeof(desc[planar]));
+                desc[planar].format     = outputs[o];
+                desc[planar].attributes = planar ? SFL_BMP_ATTRIBUTE_PLANAR : 0;
+                sfl_bmp_memory_io_set_source(&in_ctx, &in_mem, file, size);
+                if (!sfl_bmp_decode(&in_ctx, &desc[planar])) {
+                    desc[planar].data = 0;
+                }
+            }
+
+            const SflBmpDesc *planes = &desc[1];
+            if (!desc[0].data || !planes->data ||
+                planes->num_planes != desc[0].slice ||
+                planes->pitch != (W + 3) / 4 * 4 ||
+                planes->data_hash !=
+                    sfl_bmp_hash(planes->data, planes->size))
+            {
+                printf("planar: source %d, output %d failed\n", s, o);
+                Num_Failures++;
+            } else {
+                int mismatches = 0;
+                for (uint32_t p = 0; p < planes->num_planes; ++p) {
+                    const uint8_t *plane =
+                        (uint8_t*)planes->data + planes->plane_offset[p];
+                    for (int y = 0; y < H; ++y) {
+                        const uint8_t *row = plane + y * planes->plane_pitch[p];
+                        const uint8_t *pixel =
+                            (uint8_t*)desc[0].data + y * desc[0].pitch + p;
+                        for (int x = 0; x < W; ++x) {
+                            mismatches += row[x] != pixel[x * desc[0].slice];
+                        }
+                        mismatches += row[W] != 0;
+                    }
+                }
+
+                if (mismatches) {
+                    printf("planar: source %d, output %d: %d mismatches\n",
+                        s, o, mismatches);
+                    Num_Failures++;
+                }
+            }
+            free(desc[0].data);
+            free(desc[1].data);
+        }
+        free(file);
+    }
+}
+
+/** Widens a half; the test values are all normal or zero */
+static float test_half_to_float(uint16_t half) {
+    int exponent = (half >> 10) & 0x1f;
+    float value = (exponent == 0)
+        ? ldexpf((float)(half & 0x3ff), -24)
+        : ldexpf((float)((half & 0x3ff) | 0x400), exponent - 25);
+    return (half & 0x8000) ? -value : value;
+}
+
+/** Bilinear tap of output sample i, in a crop of extent from first */
+static double test_tap(int i, int count, int first, int extent, int *i0) {
+    double position = (i + 0.5) * extent / count - 0.5;
+    if (position < 0) position = 0;
+    *i0 = (int)position;
+    if (*i0 > extent - 1) *i0 = extent - 1;
+    double t = position - *i0;
+    *i0 += first;
+    return t > 1 ? 1 : t;
+}
+
+/** Tensors against a reference computed from the decoded image */
+static void test_tensor(void) {
+    enum { W = 45, H = 38 };
+    static const struct {
+        uint32_t width, height, crop_width, crop_height;
+        SflBmpTensorType type;
+        int num_threads;
+        int flipped;
+    } cases[] = {
+        {0, 0, 0, 0, SFL_BMP_TENSOR_FLOAT32, 1, 0},
+        {0, 0, 0, 0, SFL_BMP_TENSOR_FLOAT32, 1, 1},
+        {16, 16, 32, 32, SFL_BMP_TENSOR_FLOAT32, 1, 0},
+        {64, 50, 40, 0, SFL_BMP_TENSOR_FLOAT32, 3, 1},
+        {64, 50, 40, 0, SFL_BMP_TENSOR_FLOAT16, 3, 0},
+        {7, 100, 0, 0, SFL_BMP_TENSOR_FLOAT16, 2, 1},
+    };
+    static const float mean[3] = {0.485f, 0.456f, 0.406f};
+    static const float std[3] = {0.229f, 0.224f, 0.225f};
+
+    SflBmpContext in_ctx, out_ctx;
+    SflBmpIOImplementationMemory in_mem, out_mem;
+    sfl_bmp_memory_io_init(&in_ctx, sfl_bmp_stdlib_get_implementation());
+    sfl_bmp_memory_io_init(&out_ctx, sfl_bmp_stdlib_get_implementation());
+
+    static uint32_t pixels[W * H];
+    for (int p = 0; p < W * H; ++p) {
+        pixels[p] = ((uint32_t)p * 0x9e3779b1u) | 0xff000000u;
+    }
+
+    for (int k = 0; k < (int)(sizeof(cases) / sizeof(cases[0])); ++k) {
+        SflBmpDesc in_desc = {0};
+        in_desc.width      = W;
+        in_desc.height     = H;
+        in_desc.pitch      = W * 4;
+        in_desc.slice      = 4;
+        in_desc.format     = SFL_BMP_PIXEL_FORMAT_R8G8B8A8;
+        in_desc.attributes = cases[k].flipped ? SFL_BMP_ATTRIBUTE_FLIPPED : 0;
+
+        SflBmpDesc out_desc     = {0};
+        out_desc.format         = SFL_BMP_PIXEL_FORMAT_B8G8R8;
+        out_desc.file_header_id = SFL_BMP_HDR_ID_BM;
+        out_desc.info_header_id = SFL_BMP_NFO_ID_V5;
+
+        sfl_bmp_memory_io_set_source(&in_ctx, &in_mem, pixels, sizeof(pixels));
+        sfl_bmp_memory_io_set_sink(&out_ctx, &out_mem, 0, 0);
+        if (!sfl_bmp_encode(&out_ctx, &in_desc, &in_ctx.io, &out_desc)) {
+            printf("tensor: encode %d failed\n", k);
+            Num_Failures++;
+            continue;
+        }
+        SflBmpUSize size;
+        void *file = sfl_bmp_memory_io_take(&out_mem, &size);
+
+        SflBmpDesc desc = {0};
+        desc.format = SFL_BMP_PIXEL_FORMAT_R8G8B8A8;
+        sfl_bmp_memory_io_set_source(&in_ctx, &in_mem, file, size);
+        if (!sfl_bmp_decode(&in_ctx, &desc)) {
+            printf("tensor: decode %d failed\n", k);
+            Num_Failures++;
+            free(file);
+            continue;
+        }
+
+        SflBmpTensorSettings settings = {0};
+        settings.type        = cases[k].type;
+        settings.width       = cases[k].width;
+        settings.height      = cases[k].height;
+        settings.crop_width  = cases[k].crop_width;
+        settings.crop_height = cases[k].crop_height;
+        settings.num_threads = cases[k].num_threads;
+        memcpy(settings.mean, mean, sizeof(mean));
+        memcpy(settings.std, std, sizeof(std));
+
+        /* Once allocated, and once more into the same buffer */
+        SflBmpTensor tensor = {0};
+        SflBmpTensor again = {0};
+        sfl_bmp_memory_io_set_source(&in_ctx, &in_mem, file, size);
+        int ok = sfl_bmp_decode_tensor(&in_ctx, &settings, &tensor);
+        if (ok) {
+            again.size = tensor.size;
+            again.data = malloc(again.size);
+            settings.num_threads = 4 - settings.num_threads;
+            sfl_bmp_memory_io_set_source(&in_ctx, &in_mem, file, size);
+            ok = sfl_bmp_decode_tensor(&in_ctx, &settings, &again) &&
+                 memcmp(tensor.data, again.data, tensor.size) == 0;
+        }
+
+        int cw = cases[k].crop_width ? (int)cases[k].crop_width : W;
+        int ch = cases[k].crop_height ? (int)cases[k].crop_height : H;
+        int tw = cases[k].width ? (int)cases[k].width : cw;
+        int th = cases[k].height ? (int)cases[k].height : ch;
+        if (!ok || (int)tensor.width != tw || (int)tensor.height != th) {
+            printf("tensor: case %d failed\n", k);
+            Num_Failures++;
+        } else {
+            const double tolerance =
+                (cases[k].type == SFL_BMP_TENSOR_FLOAT16) ? 4e-3 : 1e-4;
+            int mismatches = 0;
+            for (int y = 0; y < th; ++y) {
+                int y0, x0;
+                double ty = test_tap(y, th, (H - ch) / 2, ch, &y0);
+                int y1 = (y0 + 1 < (H - ch) / 2 + ch) ? y0 + 1 : y0;
+                for (int x = 0; x < tw; ++x) {
+                    double tx = test_tap(x, tw, (W - cw) / 2, cw, &x0);
+                    int x1 = (x0 + 1 < (W - cw) / 2 + cw) ? x0 + 1 : x0;
+                    for (int c = 0; c < 3; ++c) {
+                        double s[2][2];
+                        for (int j = 0; j < 2; ++j) {
+                            int sy = j ? y1 : y0;
+                            if (desc.attributes & SFL_BMP_ATTRIBUTE_FLIPPED) {
+                                sy = H - 1 - sy;
+                            }
+                            const uint8_t *row =
+                                (uint8_t*)desc.data + sy * desc.pitch;
+                            s[j][0] = row[x0 * 4 + c];
+                            s[j][1] = row[x1 * 4 + c];
+                        }
+                        double top = s[0][0] + (s[0][1] - s[0][0]) * tx;
+                        double bottom = s[1][0] + (s[1][1] - s[1][0]) * tx;
+                        double expected =
+                            ((top + (bottom - top) * ty) / 255.0 - mean[c]) /
+                            std[c];
+
+                        size_t index = ((size_t)c * th + y) * tw + x;
+                        double value =
+                            (cases[k].type == SFL_BMP_TENSOR_FLOAT16)
+                                ? test_half_to_float(
+                                      ((uint16_t*)tensor.data)[index])
+                                : ((float*)tensor.data)[index];
+                        mismatches += fabs(value - expected) > tolerance;
+                    }
+                }
+            }
+
+            if (mismatches) {
+                printf("tensor: case %d: %d mismatches\n", k, mismatches);
+                Num_Failures++;
+            }
+        }
+
+        free(tensor.data);
+        free(again.data);
+        free(desc.data);
+        free(file);
+    }
+}
+
+/**
+ * A bottom-up B8G8R8A8 file far over 4GiB that exists only as headers, with
+ * every byte of pixel data made up from its offset
+ */
+typedef struct {
+    uint8_t  header[sizeof(SflBmpFileHeader) + sizeof(SflBmpInfoHeader124)];
+    uint64_t len;
+    uint64_t curr;
+} TestLargeFile;
+
+static uint8_t test_large_byte(uint64_t offset) {
+    return (uint8_t)((offset * 0x9e3779b97f4a7c15ull) >> 56);
+}
+
+static PROC_SFL_BMP_IO_READ(test_large_read) {
+    TestLargeFile *file = (TestLargeFile*)usr;
+    if (file->curr + size > file->len) return 0;
+    for (SflBmpUSize i = 0; i < size; ++i, ++file->curr) {
+        ((uint8_t*)ptr)[i] = (file->curr < sizeof(file->header))
+            ? file->header[file->curr]
+            : test_large_byte(file->curr);
+    }
+    return 1;
+}
+
+static PROC_SFL_BMP_IO_SEEK(test_large_seek) {
+    TestLargeFile *file = (TestLargeFile*)usr;
+    SflBmpI64 base = 0;
+    switch (whence) {
+        case SFL_BMP_IO_SET: base = 0; break;
+        case SFL_BMP_IO_CUR: base = (SflBmpI64)file->curr; break;
+        case SFL_BMP_IO_END: base = (SflBmpI64)file->len; break;
+    }
+    if (base + offset < 0 || (uint64_t)(base + offset) > file->len) return -1;
+    file->curr = (uint64_t)(base + offset);
+    return 0;
+}
+
+static PROC_SFL_BMP_IO_TELL(test_large_tell) {
+    return (SflBmpI64)((TestLargeFile*)usr)->curr;
+}
+
+static SflBmpIOImplementation Test_Large_IO = {
+    test_large_read,
+    0,
+    test_large_seek,
+    test_large_tell,
+    0,
+    0,
+};
+
+/** Sizes and offsets past 4GiB, and reading rows from that far in */
+static void test_large(void) {
+    enum { W = 40000, H = 40000, TW = 6, TH = 5 };
+    const uint64_t offset =
+        sizeof(SflBmpFileHeader) + sizeof(SflBmpInfoHeader124);
+    const uint64_t size = (uint64_t)W * 4 * H;
+
+    TestLargeFile file;
+    memset(&file, 0, sizeof(file));
+    file.len = offset + size;
+
+    SflBmpFileHeader hdr = {0};
+    hdr.hdr[0] = 'B';
+    hdr.hdr[1] = 'M';
+    hdr.offset = (uint32_t)offset;
+
+    SflBmpInfoHeader124 info = {0};
+    info.size = sizeof(info);
+    info.width = W;
+    info.height = H;
+    info.planes = 1;
+    info.bpp = 32;
+    info.compression = SFL_BMP_COMPRESSION_BITFIELDS;
+    info.red_mask = 0xff0000;
+    info.green_mask = 0xff00;
+    info.blue_mask = 0xff;
+    info.alpha_mask = 0xff000000;
+    memcpy(file.header, &hdr, sizeof(hdr));
+    memcpy(file.header + sizeof(hdr), &info, sizeof(info));
+
+    /* Nothing that holds all of it could be allocated */
+    SflBmpContext ctx;
+    sfl_bmp_stdlib_init(&ctx, &Test_Large_IO);
+    sfl_bmp_set_io_usr(&ctx, &file);
+    SflBmpLimits limits = {0};
+    limits.max_memory = 16 << 20;
+    sfl_bmp_set_limits(&ctx, &limits);
+
+    SflBmpDesc in_desc;
+    if (!sfl_bmp_probe(&ctx, &in_desc) || in_desc.size != size ||
+        in_desc.offset != offset)
+    {
+        printf("large: probe failed\n");
+        Num_Failures++;
+        return;
+    }
+
+    SflBmpDesc out_desc     = {0};
+    out_desc.format         = SFL_BMP_PIXEL_FORMAT_B8G8R8;
+    out_desc.file_header_id = SFL_BMP_HDR_ID_BM;
+    out_desc.info_header_id = SFL_BMP_NFO_ID_V5;
+    uint64_t encoded_size = sfl_bmp_encoded_size(&in_desc, &out_desc);
+    if (encoded_size != offset + (uint64_t)W * 3 * H) {
+        printf("large: encoded size %llu\n", (unsigned long long)encoded_size);
+        Num_Failures++;
+    }
+
+    /* Only the rows that are sampled get read, from all over the file */
+    SflBmpTensorSettings settings = {0};
+    settings.width  = TW;
+    settings.height = TH;
+    SflBmpTensor tensor = {0};
+    file.curr = 0;
+    if (!sfl_bmp_decode_tensor(&ctx, &settings, &tensor)) {
+        printf("large: tensor decode failed\n");
+        Num_Failures++;
+        return;
+    }
+
+    int mismatches = 0;
+    for (int y = 0; y < TH; ++y) {
+        int y0, x0;
+        double ty = test_tap(y, TH, 0, H, &y0);
+        for (int x = 0; x < TW; ++x) {
+            double tx = test_tap(x, TW, 0, W, &x0);
+            for (int c = 0; c < 3; ++c) {
+                double s[2][2];
+                for (int j = 0; j < 2; ++j) {
+                    /* Bottom-up, and B, G, R in memory */
+                    uint64_t row =
+                        offset + (uint64_t)(H - 1 - (y0 + j)) * W * 4;
+                    s[j][0] = test_large_byte(row + x0 * 4 + (2 - c));
+                    s[j][1] = test_large_byte(row + (x0 + 1) * 4 + (2 - c));
+                }
+                double top = s[0][0] + (s[0][1] - s[0][0]) * tx;
+                double bottom = s[1][0] + (s[1][1] - s[1][0]) * tx;
+                double expected = (top + (bottom - top) * ty) / 255.0;
+                double value = ((float*)tensor.data)[(c * TH + y) * TW + x];
+                mismatches += fabs(value - expected) > 1e-4;
+            }
+        }
+    }
+
+    if (mismatches) {
+        printf("large: %d tensor mismatches\n", mismatches);
+        Num_Failures++;
+    }
+    free(tensor.data);
+}
+
+/**
+ * Invocation: <executable> [path]
+ * Without a path, only the in-memory tests are run
+ */
+/** Counts calls to the memory implementation, for test_frames */
+typedef struct {
+    int num_allocations;
+    int num_live;
+} TestCountedMemory;
+
+static PROC_SFL_BMP_MEMORY_ALLOCATE(test_counted_allocate) {
+    TestCountedMemory *counts = (TestCountedMemory*)usr;
+    counts->num_allocations++;
+    counts->num_live++;
+    return malloc(size);
+}
+
+static PROC_SFL_BMP_MEMORY_RELEASE(test_counted_release) {
+    ((TestCountedMemory*)usr)->num_live--;
+    free(ptr);
+}
+
+/**
+ * Decodes a sequence of frames of a few sizes & formats over and over with
+ * the frame decoder, which should stop allocating after the first pass
+ */
+static void test_frames(void) {
+    enum { NUM_FILES = 4, NUM_PASSES = 3, MAX_W = 24, MAX_H = 10 };
+    static const struct {
+        uint32_t width, height;
+        int format;
+        int attributes;
+    } files[NUM_FILES] = {
+        {16, 8, SFL_BMP_PIXEL_FORMAT_B8G8R8, 0},
+        {16, 8, SFL_BMP_PIXEL_FORMAT_B8G8R8A8, 0},
+        {24, 10, SFL_BMP_PIXEL_FORMAT_B8G8R8A8, SFL_BMP_ATTRIBUTE_PALETTIZED},
+        {8, 4, SFL_BMP_PIXEL_FORMAT_B5G6R5, 0},
+    };
+
+    void *encoded[NUM_FILES];
+    SflBmpUSize sizes[NUM_FILES];
+    SflBmpDesc expected[NUM_FILES];
+
+    SflBmpContext in_ctx, out_ctx;
+    SflBmpIOImplementationMemory in_mem, out_mem;
+    sfl_bmp_memory_io_init(&in_ctx, sfl_bmp_stdlib_get_implementation());
+    sfl_bmp_memory_io_init(&out_ctx, sfl_bmp_stdlib_get_implementation());
+
+    for (int i = 0; i < NUM_FILES; ++i) {
+        uint32_t pixels[MAX_W * MAX_H];
+        const uint32_t count = files[i].width * files[i].height;
+        for (uint32_t p = 0; p < count; ++p) {
+            pixels[p] = (((p * 7 + i) % 37) * 0x2f1b07u) | 0xff000000u;
+        }
+
+        SflBmpDesc in_desc = {0};
+        in_desc.width      = files[i].width;
+        in_desc.height     = files[i].height;
+        in_desc.pitch      = files[i].width * 4;
+        in_desc.slice      = 4;
+        in_desc.format     = SFL_BMP_PIXEL_FORMAT_R8G8B8A8;
+
+        SflBmpDesc out_desc     = {0};
+        out_desc.format         = files[i].format;
+        out_desc.compression    = files[i].format == SFL_BMP_PIXEL_FORMAT_B8G8R8
+                                      ? SFL_BMP_COMPRESSION_NONE
+                                      : SFL_BMP_COMPRESSION_BITFIELDS;
+        out_desc.file_header_id = SFL_BMP_HDR_ID_BM;
+        out_desc.info_header_id = SFL_BMP_NFO_ID_V5;
+        out_desc.attributes     = files[i].attributes;
+
+        sfl_bmp_memory_io_set_source(
+            &in_ctx, &in_mem, pixels, count * sizeof(uint32_t));
+        sfl_bmp_memory_io_set_sink(&out_ctx, &out_mem, 0, 0);
+        if (!sfl_bmp_encode(&out_ctx, &in_desc, &in_ctx.io, &out_desc)) {
+            printf("frames: encoding file %d failed\n", i);
+            Num_Failures++;
+            return;
+        }
+        encoded[i] = sfl_bmp_memory_io_take(&out_mem, &sizes[i]);
+
+        memset(&expected[i], 0, sizeof(expected[i]));
+        expected[i].format = SFL_BMP_PIXEL_FORMAT_R8G8B8A8;
+        sfl_bmp_memory_io_set_source(&in_ctx, &in_mem, encoded[i], sizes[i]);
+        if (!sfl_bmp_decode(&in_ctx, &expected[i])) {
+            printf("frames: decoding file %d failed\n", i);
+            Num_Failures++;
+            return;
+        }
+    }
+
+    TestCountedMemory counts = {0};
+    SflBmpMemoryImplementation counted = {
+        test_counted_allocate,
+        test_counted_release,
+        &counts,
+    };
+    SflBmpContext ctx;
+    sfl_bmp_memory_io_init(&ctx, &counted);
+    sfl_bmp_set_memory_usr(&ctx, &counts);
+
+    /* Each frame stays out until the next one is in */
+    SflBmpFrameDecoder *dec = sfl_bmp_frame_decoder_begin(&ctx, 2);
+    void *previous = 0;
+    int warm_allocations = 0;
+    for (int pass = 0; pass < NUM_PASSES; ++pass) {
+        if (pass == 1) warm_allocations = counts.num_allocations;
+
+        for (int i = 0; i < NUM_FILES; ++i) {
+            /*
+             * Alternately through memory IO that can be peeked at, and not.
+             * Only the IO of these contexts is used
+             */
+            SflBmpContext frame_ctx;
+            sfl_bmp_memory_io_init(
+                &frame_ctx, sfl_bmp_stdlib_get_implementation());
+            sfl_bmp_memory_io_set_source(
+                &frame_ctx, &in_mem, encoded[i], sizes[i]);
+            if (!(i & 1)) {
+                frame_ctx.io.peek = 0;
+            }
+
+            SflBmpDesc desc = {0};
+            desc.format = SFL_BMP_PIXEL_FORMAT_R8G8B8A8;
+            if (!sfl_bmp_frame_decode(dec, &frame_ctx, &desc) ||
+                desc.size != expected[i].size ||
+                memcmp(desc.data, expected[i].data, desc.size) != 0)
+            {
+                printf("frames: pass %d, file %d mismatch\n", pass, i);
+                Num_Failures++;
+                continue;
+            }
+
+            if (previous && !sfl_bmp_frame_recycle(dec, previous)) {
+                printf("frames: recycling pass %d, file %d failed\n", pass, i);
+                Num_Failures++;
+            }
+            previous = desc.data;
+        }
+    }
+
+    if (counts.num_allocations != warm_allocations) {
+        printf("frames: %d allocations after the first pass\n",
+            counts.num_allocations - warm_allocations);
+        Num_Failures++;
+    }
+
+    /* One buffer is still out, and the pool holds two */
+    SflBmpContext frame_ctx;
+    sfl_bmp_memory_io_init(&frame_ctx, sfl_bmp_stdlib_get_implementation());
+    sfl_bmp_memory_io_set_source(&frame_ctx, &in_mem, encoded[0], sizes[0]);
+    SflBmpDesc a = {0}, b = {0};
+    int ok_a = sfl_bmp_frame_decode(dec, &frame_ctx, &a);
+    sfl_bmp_memory_io_set_source(&frame_ctx, &in_mem, encoded[0], sizes[0]);
+    int ok_b = sfl_bmp_frame_decode(dec, &frame_ctx, &b);
+    if (!ok_a || ok_b || sfl_bmp_frame_recycle(dec, &counts)) {
+        printf("frames: pool decoded %d, %d frames with one free buffer\n",
+            ok_a, ok_b);
+        Num_Failures++;
+    }
+
+    sfl_bmp_frame_decoder_end(dec);
+    if (counts.num_live != 0) {
+        printf("frames: %d allocations weren't released\n", counts.num_live);
+        Num_Failures++;
+    }
+
+    for (int i = 0; i < NUM_FILES; ++i) {
+        free(expected[i].data);
+        free(encoded[i]);
+    }
+}
+
+#define TEST_FORMAT_A2R10G10B10 100
+#define TEST_FORMAT_L8 101
+#define TEST_FORMAT_R16G16B16A16 102
+
+/* Kernels count their calls through usr */
+static PROC_SFL_BMP_PIXEL_ROW(test_l8_from_rgba8) {
+    const uint8_t *s = (const uint8_t *)src;
+    uint8_t *d = (uint8_t *)dst;
+    ++*(int *)usr;
+    for (uint32_t i = 0; i < count; ++i) {
+        d[i] = (uint8_t)((s[i * 4 + 0] * 77 + s[i * 4 + 1] * 150 +
+                          s[i * 4 + 2] * 29 + 128) >> 8);
+    }
+}
+
+static PROC_SFL_BMP_PIXEL_ROW(test_l8_to_rgba8) {
+    const uint8_t *s = (const uint8_t *)src;
+    uint8_t *d = (uint8_t *)dst;
+    ++*(int *)usr;
+    for (uint32_t i = 0; i < count; ++i) {
+        d[i * 4 + 0] = d[i * 4 + 1] = d[i * 4 + 2] = s[i];
+        d[i * 4 + 3] = 0xff;
+    }
+}
+
+static PROC_SFL_BMP_PIXEL_ROW(test_r16_from_rgba8) {
+    const uint8_t *s = (const uint8_t *)src;
+    uint16_t *d = (uint16_t *)dst;
+    (void)usr;
+    for (uint32_t i = 0; i < count * 4; ++i) {
+        d[i] = (uint16_t)(s[i] * 257);
+    }
+}
+
+static PROC_SFL_BMP_PIXEL_ROW(test_r16_to_rgba8) {
+    const uint16_t *s = (const uint16_t *)src;
+    uint8_t *d = (uint8_t *)dst;
+    (void)usr;
+    for (uint32_t i = 0; i < count * 4; ++i) {
+        d[i] = (uint8_t)(s[i] >> 8);
+    }
+}
+
+/** Encodes in_desc's pixels to a file of format, or returns null */
+static void *test_encode_to(
+    const void *pixels, SflBmpDesc *in_desc, int format, int attributes,
+    SflBmpUSize *size)
+{
+    SflBmpContext in_ctx, out_ctx;
+    SflBmpIOImplementationMemory in_mem, out_mem;
+    sfl_bmp_memory_io_init(&in_ctx, sfl_bmp_stdlib_get_implementation());
+    sfl_bmp_memory_io_init(&out_ctx, sfl_bmp_stdlib_get_implementation());
+
+    SflBmpDesc out_desc     = {0};
+    out_desc.format         = format;
+    out_desc.compression    = format == SFL_BMP_PIXEL_FORMAT_B8G8R8
+                                  ? SFL_BMP_COMPRESSION_NONE
+                                  : SFL_BMP_COMPRESSION_BITFIELDS;
+    out_desc.file_header_id = SFL_BMP_HDR_ID_BM;
+    out_desc.info_header_id = SFL_BMP_NFO_ID_V5;
+    out_desc.attributes     = attributes;
+
+    sfl_bmp_memory_io_set_source(
+        &in_ctx, &in_mem, (void *)pixels, in_desc->pitch * in_desc->height);
+    sfl_bmp_memory_io_set_sink(&out_ctx, &out_mem, 0, 0);
+    if (!sfl_bmp_encode(&out_ctx, in_desc, &in_ctx.io, &out_desc)) {
+        free(sfl_bmp_memory_io_take(&out_mem, size));
+        return 0;
+    }
+    return sfl_bmp_memory_io_take(&out_mem, size);
+}
+
+/** Decodes file to format, or returns a desc without data */
+static SflBmpDesc test_decode_to(void *file, SflBmpUSize size, int format) {
+    SflBmpContext ctx;
+    SflBmpIOImplementationMemory mem;
+    sfl_bmp_memory_io_init(&ctx, sfl_bmp_stdlib_get_implementation());
+    sfl_bmp_memory_io_set_source(&ctx, &mem, file, size);
+
+    SflBmpDesc desc = {0};
+    desc.format = format;
+    if (!sfl_bmp_decode(&ctx, &desc)) {
+        desc.data = 0;
+    }
+    return desc;
+}
+
+static void test_custom_formats(void) {
+    enum { W = 300, H = 5 };
+    int l8_calls = 0;
+
+    SflBmpPixelFormatInfo a2r10g10b10 = {0};
+    a2r10g10b10.format = TEST_FORMAT_A2R10G10B10;
+    a2r10g10b10.name = "A2R10G10B10";
+    a2r10g10b10.bpp = 32;
+    a2r10g10b10.mask[0] = 0x3ff00000;
+    a2r10g10b10.mask[1] = 0x000ffc00;
+    a2r10g10b10.mask[2] = 0x000003ff;
+    a2r10g10b10.mask[3] = 0xc0000000;
+
+    SflBmpPixelFormatInfo l8 = {0};
+    l8.format = TEST_FORMAT_L8;
+    l8.name = "L8";
+    l8.bpp = 8;
+    l8.from_rgba8 = test_l8_from_rgba8;
+    l8.to_rgba8 = test_l8_to_rgba8;
+    l8.usr = &l8_calls;
+
+    SflBmpPixelFormatInfo r16g16b16a16 = {0};
+    r16g16b16a16.format = TEST_FORMAT_R16G16B16A16;
+    r16g16b16a16.name = "R16G16B16A16";
+    r16g16b16a16.bpp = 64;
+    r16g16b16a16.from_rgba8 = test_r16_from_rgba8;
+    r16g16b16a16.to_rgba8 = test_r16_to_rgba8;
+
+    if (!sfl_bmp_register_pixel_format(&a2r10g10b10) ||
+        !sfl_bmp_register_pixel_format(&l8) ||
+        !sfl_bmp_register_pixel_format(&r16g16b16a16))
+    {
+        printf("custom formats: registration failed\n");
+        Num_Failures++;
+        return;
+    }
+
+    /* Taken identifiers, nothing to convert with, and odd sizes */
+    SflBmpPixelFormatInfo bad = l8;
+    int rejected = !sfl_bmp_register_pixel_format(&bad);
+    bad.format = SFL_BMP_PIXEL_FORMAT_B8G8R8A8;
+    rejected &= !sfl_bmp_register_pixel_format(&bad);
+    bad.format = 103;
+    bad.from_rgba8 = bad.to_rgba8 = 0;
+    rejected &= !sfl_bmp_register_pixel_format(&bad);
+    bad = a2r10g10b10;
+    bad.format = 103;
+    bad.bpp = 12;
+    rejected &= !sfl_bmp_register_pixel_format(&bad);
+    bad.bpp = 64;
+    rejected &= !sfl_bmp_register_pixel_format(&bad);
+    if (!rejected ||
+        strcmp(sfl_bmp_describe_pixel_format(TEST_FORMAT_L8), "L8") != 0)
+    {
+        printf("custom formats: bad registrations were accepted\n");
+        Num_Failures++;
+    }
+
+    /* Opaque grays, so each format holds them exactly */
+    static uint32_t pixels[W * H];
+    static uint8_t grays[W * H];
+    for (int p = 0; p < W * H; ++p) {
+        grays[p] = (uint8_t)((p % 11) * 23);
+        pixels[p] = grays[p] * 0x010101u | 0xff000000u;
+    }
+
+    SflBmpDesc rgba_desc = {0};
+    rgba_desc.width      = W;
+    rgba_desc.height     = H;
+    rgba_desc.pitch      = W * 4;
+    rgba_desc.slice      = 4;
+    rgba_desc.format     = SFL_BMP_PIXEL_FORMAT_R8G8B8A8;
+
+    /* Masks only: written as bitfields, and probed by them */
+    SflBmpUSize size;
+    void *file = test_encode_to(
+        pixels, &rgba_desc, TEST_FORMAT_A2R10G10B10, 0, &size);
+    SflBmpDesc probed = {0};
+    SflBmpDesc decoded = {0};
+    if (file) {
+        SflBmpContext ctx;
+        SflBmpIOImplementationMemory mem;
+        sfl_bmp_memory_io_init(&ctx, sfl_bmp_stdlib_get_implementation());
+        sfl_bmp_memory_io_set_source(&ctx, &mem, file, size);
+        sfl_bmp_probe(&ctx, &probed);
+        decoded = test_decode_to(file, size, SFL_BMP_PIXEL_FORMAT_R8G8B8A8);
+    }
+    if (probed.format != TEST_FORMAT_A2R10G10B10 || !decoded.data ||
+        memcmp(decoded.data, pixels, sizeof(pixels)) != 0)
+    {
+        printf("custom formats: A2R10G10B10 round trip failed\n");
+        Num_Failures++;
+    }
+    free(decoded.data);
+    free(file);
+
+    /* Kernels, from a direct & a paletted file */
+    for (int palettized = 0; palettized < 2; ++palettized) {
+        file = test_encode_to(pixels, &rgba_desc,
+            palettized ? SFL_BMP_PIXEL_FORMAT_B8G8R8A8
+                       : SFL_BMP_PIXEL_FORMAT_B8G8R8,
+            palettized ? SFL_BMP_ATTRIBUTE_PALETTIZED : 0, &size);
+        decoded = test_decode_to(file, size, TEST_FORMAT_L8);
+        if (!decoded.data || decoded.pitch != W ||
+            memcmp(decoded.data, grays, sizeof(grays)) != 0)
+        {
+            printf("custom formats: decoding to L8 failed (paletted: %d)\n",
+                palettized);
+            Num_Failures++;
+        }
+        free(decoded.data);
+        free(file);
+    }
+
+    /* Kernel-only formats can't be written, but can be read from */
+    SflBmpDesc l8_desc = rgba_desc;
+    l8_desc.pitch      = W;
+    l8_desc.slice      = 1;
+    l8_desc.format     = TEST_FORMAT_L8;
+    file = test_encode_to(grays, &l8_desc, TEST_FORMAT_L8, 0, &size);
+    if (file) {
+        printf("custom formats: encoded to L8\n");
+        Num_Failures++;
+        free(file);
+    }
+
+    file = test_encode_to(
+        grays, &l8_desc, SFL_BMP_PIXEL_FORMAT_B8G8R8, 0, &size);
+    decoded = test_decode_to(file, size, SFL_BMP_PIXEL_FORMAT_R8G8B8A8);
+    if (!decoded.data || memcmp(decoded.data, pixels, sizeof(pixels)) != 0 ||
+        l8_calls == 0)
+    {
+        printf("custom formats: encoding from L8 failed\n");
+        Num_Failures++;
+    }
+    free(decoded.data);
+    free(file);
+
+    /* Wider than any built-in format */
+    static uint16_t wide[W * H * 4];
+    for (int i = 0; i < W * H * 4; ++i) {
+        wide[i] = (uint16_t)(((i * 37) & 0xff) * 257);
+    }
+
+    SflBmpDesc wide_desc = rgba_desc;
+    wide_desc.pitch      = W * 8;
+    wide_desc.slice      = 8;
+    wide_desc.format     = TEST_FORMAT_R16G16B16A16;
+    file = test_encode_to(
+        wide, &wide_desc, SFL_BMP_PIXEL_FORMAT_B8G8R8A8, 0, &size);
+    decoded = test_decode_to(file, size, TEST_FORMAT_R16G16B16A16);
+    if (!decoded.data || decoded.slice != 8 ||
+        memcmp(decoded.data, wide, sizeof(wide)) != 0)
+    {
+        printf("custom formats: R16G16B16A16 round trip failed\n");
+        Num_Failures++;
+    }
+    free(decoded.data);
+    free(file);
+}
+
+/** What the stats of an image of these R8G8B8A8 pixels should be */
+static void test_expected_stats(
+    const uint32_t *pixels, size_t count, SflBmpPixelStats *stats)
+{
+    memset(stats, 0, sizeof(*stats));
+    memset(stats->min, 0xff, sizeof(stats->min));
+    int binary = 1, opaque = 1;
+    for (size_t i = 0; i < count; ++i) {
+        uint32_t v[SFL_BMP_CHANNEL_COUNT];
+        for (int c = 0; c < 4; ++c) {
+            v[c] = (pixels[i] >> (c * 8)) & 0xff;
+        }
+        v[SFL_BMP_CHANNEL_LUMA] =
+            (54 * v[0] + 183 * v[1] + 19 * v[2] + 128) >> 8;
+
+        for (int c = 0; c < SFL_BMP_CHANNEL_COUNT; ++c) {
+            stats->histogram[c][v[c]]++;
+            if (v[c] < stats->min[c]) stats->min[c] = (uint8_t)v[c];
+            if (v[c] > stats->max[c]) stats->max[c] = (uint8_t)v[c];
+        }
+        opaque &= v[3] == 0xff;
+        binary &= v[3] == 0xff || v[3] == 0;
+    }
+
+    stats->num_pixels = count;
+    stats->alpha = opaque   ? SFL_BMP_ALPHA_OPAQUE
+                   : binary ? SFL_BMP_ALPHA_BINARY
+                            : SFL_BMP_ALPHA_TRANSLUCENT;
+}
+
+static int test_same_stats(
+    const SflBmpPixelStats *a, const SflBmpPixelStats *b)
+{
+    return a->num_pixels == b->num_pixels && a->alpha == b->alpha &&
+           memcmp(a->min, b->min, sizeof(a->min)) == 0 &&
+           memcmp(a->max, b->max, sizeof(a->max)) == 0 &&
+           memcmp(a->histogram, b->histogram, sizeof(a->histogram)) == 0;
+}
+
+/** Rounds each component to bits and back to 8, as the converters do */
+static uint32_t test_requantize(uint32_t pixel, const int bits[4]) {
+    uint32_t result = 0;
+    for (int c = 0; c < 4; ++c) {
+        uint32_t v = (pixel >> (c * 8)) & 0xff;
+        if (bits[c] == 0) {
+            v = c == 3 ? 0xff : 0;
+        } else {
+            const uint32_t max = (1u << bits[c]) - 1;
+            v = (v * max + 127) / 255;
+            v = (v * 255 + max / 2) / max;
+        }
+        result |= v << (c * 8);
+    }
+    return result;
+}
+
+/** Decodes images with every kind of alpha to a few formats, with stats */
+static void test_pixel_stats(void) {
+    enum { W = 37, H = 13 };
+    static const struct {
+        int format;
+        int attributes;
+        int bits[4];
+    } outputs[] = {
+        {SFL_BMP_PIXEL_FORMAT_R8G8B8A8, 0, {8, 8, 8, 8}},
+        {SFL_BMP_PIXEL_FORMAT_B8G8R8A8, SFL_BMP_ATTRIBUTE_PLANAR, {8, 8, 8, 8}},
+        {SFL_BMP_PIXEL_FORMAT_B8G8R8, 0, {8, 8, 8, 0}},
+        {SFL_BMP_PIXEL_FORMAT_B5G6R5, 0, {5, 6, 5, 0}},
+    };
+
+    SflBmpDesc rgba_desc = {0};
+    rgba_desc.width      = W;
+    rgba_desc.height     = H;
+    rgba_desc.pitch      = W * 4;
+    rgba_desc.slice      = 4;
+    rgba_desc.format     = SFL_BMP_PIXEL_FORMAT_R8G8B8A8;
+
+    for (int kind = 0; kind < 3; ++kind) {
+        uint32_t pixels[W * H], expected_pixels[W * H];
+        for (int p = 0; p < W * H; ++p) {
+            const uint32_t alpha = kind == 0   ? 0xff
+                                   : kind == 1 ? (p % 3 ? 0xff : 0)
+                                               : (uint32_t)(p * 5) & 0xff;
+            pixels[p] = ((uint32_t)p * 0x9e3779u & 0xffffff) | alpha << 24;
+        }
+
+        SflBmpUSize size;
+        void *file = test_encode_to(
+            pixels, &rgba_desc, SFL_BMP_PIXEL_FORMAT_B8G8R8A8, 0, &size);
+
+        for (int o = 0; o < (int)(sizeof(outputs) / sizeof(outputs[0])); ++o) {
+            static SflBmpPixelStats stats, expected;
+            for (int p = 0; p < W * H; ++p) {
+                expected_pixels[p] =
+                    test_requantize(pixels[p], outputs[o].bits);
+            }
+            test_expected_stats(expected_pixels, W * H, &expected);
+
+            SflBmpContext ctx;
+            SflBmpIOImplementationMemory mem;
+            sfl_bmp_memory_io_init(&ctx, sfl_bmp_stdlib_get_implementation());
+            sfl_bmp_memory_io_set_source(&ctx, &mem, file, size);
+            sfl_bmp_set_pixel_stats(&ctx, &stats);
+
+            SflBmpDesc desc = {0};
+            desc.format     = outputs[o].format;
+            desc.attributes = outputs[o].attributes;
+            if (!sfl_bmp_decode(&ctx, &desc) ||
+                !test_same_stats(&stats, &expected))
+            {
+                printf("pixel stats: alpha kind %d to %s differs\n", kind,
+                    sfl_bmp_describe_pixel_format(outputs[o].format));
+                Num_Failures++;
+            }
+            free(desc.data);
+
+            /* The push decoder gathers them as rows come in */
+            memset(&stats, 0xcd, sizeof(stats));
+            desc.data = 0;
+            SflBmpDecoder *dec = sfl_bmp_decoder_begin(&ctx, &desc, 0, 0);
+            for (SflBmpUSize i = 0; i < size; i += 100) {
+                sfl_bmp_feed(dec, (uint8_t *)file + i,
+                    size - i < 100 ? size - i : 100);
+            }
+            if (!sfl_bmp_decoder_end(dec) ||
+                !test_same_stats(&stats, &expected))
+            {
+                printf("pixel stats: push decoder, alpha kind %d to %s "
+                       "differs\n", kind,
+                    sfl_bmp_describe_pixel_format(outputs[o].format));
+                Num_Failures++;
+            }
+            free(desc.data);
+        }
+        free(file);
+    }
+}
+
+static void test_put(uint8_t *buf, size_t *pos, const void *data, size_t size) {
+    memcpy(buf + *pos, data, size);
+    *pos += size;
+}
+
+static void test_put_file_header(
+    uint8_t *buf, size_t *pos, const char *type, int16_t hot_x,
+    int16_t hot_y, uint32_t offset)
+{
+    SflBmpFileHeader hdr = {0};
+    hdr.hdr[0] = type[0];
+    hdr.hdr[1] = type[1];
+    hdr.file_size = sizeof(hdr);
+    hdr.reserved[0] = (uint16_t)hot_x;
+    hdr.reserved[1] = (uint16_t)hot_y;
+    hdr.offset = offset;
+    test_put(buf, pos, &hdr, sizeof(hdr));
+}
+
+/**
+ * An OS/2 bitmap array of a color icon (core headers), a monochrome pointer
+ * (short OS/2 v2 headers) and a paletted bitmap (full OS/2 v2 header)
+ */
+static void test_os2_array(void) {
+    /* Rows in file order (bottom up), 1 bits of the AND mask leave the
+     * screen be */
+    static const uint8_t ci_and[2] = {0x90, 0x00};
+    static const uint32_t ci_color[2][4] = {
+        {0x112233, 0x445566, 0x778899, 0xaabbcc},
+        {0xddeeff, 0x102030, 0x405060, 0x708090},
+    };
+    static const uint8_t pt_and[4] = {0xf0, 0x00, 0x0f, 0x00};
+    static const uint8_t pt_xor[4] = {0xaa, 0x55, 0xff, 0x00};
+    static const uint32_t bm_palette[3] = {0x800000, 0x008000, 0x000080};
+    static const uint8_t bm_indices[2][2] = {{0x01, 0x20}, {0x21, 0x00}};
+
+    uint8_t file[1024] = {0};
+    size_t pos = 0;
+    size_t arrays[3], images[3], data[4];
+
+    /* Headers first, then the pixel data; offsets are patched after */
+    SflBmpArrayHeader array = {{'B', 'A'}, sizeof(array), 0, 1024, 768};
+    SflBmpCoreHeader core = {sizeof(core), 4, 4, 1, 1};
+    const uint8_t mono_table[2 * 4] = {0, 0, 0, 0, 0xff, 0xff, 0xff, 0};
+    arrays[0] = pos;
+    test_put(file, &pos, &array, sizeof(array));
+    images[0] = pos;
+    test_put_file_header(file, &pos, "CI", 1, 2, 0);
+    test_put(file, &pos, &core, sizeof(core));
+    test_put(file, &pos, mono_table, 2 * 3);
+    test_put_file_header(file, &pos, "CI", 1, 2, 0);
+    core.height = 2;
+    core.bpp = 24;
+    test_put(file, &pos, &core, sizeof(core));
+
+    SflBmpInfoHeader064 os22 = {0};
+    os22.size = 16;
+    os22.width = 8;
+    os22.height = 8;
+    os22.planes = 1;
+    os22.bpp = 1;
+    array.display_width = array.display_height = 0;
+    arrays[1] = pos;
+    test_put(file, &pos, &array, sizeof(array));
+    images[1] = pos;
+    test_put_file_header(file, &pos, "PT", -3, 7, 0);
+    test_put(file, &pos, &os22, 16);
+    test_put(file, &pos, mono_table, sizeof(mono_table));
+
+    os22.size = sizeof(os22);
+    os22.width = 3;
+    os22.height = 2;
+    os22.bpp = 4;
+    os22.num_colors = 3;
+    arrays[2] = pos;
+    test_put(file, &pos, &array, sizeof(array));
+    images[2] = pos;
+    test_put_file_header(file, &pos, "BM", 0, 0, 0);
+    test_put(file, &pos, &os22, sizeof(os22));
+    test_put(file, &pos, bm_palette, sizeof(bm_palette));
+
+    /* CI: the mask bitmap (AND, then an unused XOR), and the colors */
+    data[0] = pos;
+    for (int y = 0; y < 4; ++y, pos += 4) {
+        file[pos] = y < 2 ? ci_and[y] : 0xff;
+    }
+    data[1] = pos;
+    for (int y = 0; y < 2; ++y, pos += 12) {
+        for (int x = 0; x < 4; ++x) {
+            memcpy(file + pos + x * 3, &ci_color[y][x], 3);
+        }
+    }
+    /* PT: AND, then XOR in one bitmap */
+    data[2] = pos;
+    for (int y = 0; y < 8; ++y, pos += 4) {
+        file[pos] = y < 4 ? pt_and[y] : pt_xor[y - 4];
+    }
+    data[3] = pos;
+    for (int y = 0; y < 2; ++y, pos += 4) {
+        memcpy(file + pos, bm_indices[y], 2);
+    }
+
+    for (int i = 0; i < 3; ++i) {
+        const uint32_t next = i < 2 ? (uint32_t)arrays[i + 1] : 0;
+        memcpy(file + arrays[i] + 6, &next, 4);
+    }
+    memcpy(file + images[0] + 10, &(uint32_t){(uint32_t)data[0]}, 4);
+    memcpy(file + images[0] + 14 + 12 + 6 + 10,
+        &(uint32_t){(uint32_t)data[1]}, 4);
+    memcpy(file + images[1] + 10, &(uint32_t){(uint32_t)data[2]}, 4);
+    memcpy(file + images[2] + 10, &(uint32_t){(uint32_t)data[3]}, 4);
+
+    SflBmpContext ctx;
+    SflBmpIOImplementationMemory mem;
+    sfl_bmp_memory_io_init(&ctx, sfl_bmp_stdlib_get_implementation());
+    sfl_bmp_memory_io_set_source(&ctx, &mem, file, pos);
+
+    SflBmpImageInfo info[4];
+    memset(info, 0, sizeof(info));
+    if (sfl_bmp_index(&ctx, info, 1) != 3 || info[1].width != 0 ||
+        sfl_bmp_index(&ctx, info, 4) != 3)
+    {
+        printf("os2 array: didn't find 3 images\n");
+        Num_Failures++;
+        return;
+    }
+
+    static const struct {
+        SflBmpHdrID type;
+        uint32_t width, height, bpp;
+        uint16_t display_width;
+        int16_t hotspot_x, hotspot_y;
+    } expected_info[3] = {
+        {SFL_BMP_HDR_ID_CI, 4, 2, 24, 1024, 1, 2},
+        {SFL_BMP_HDR_ID_PT, 8, 4, 1, 0, -3, 7},
+        {SFL_BMP_HDR_ID_BM, 3, 2, 4, 0, 0, 0},
+    };
+    for (int i = 0; i < 3; ++i) {
+        if (info[i].type != expected_info[i].type ||
+            info[i].width != expected_info[i].width ||
+            info[i].height != expected_info[i].height ||
+            info[i].bpp != expected_info[i].bpp ||
+            info[i].display_width != expected_info[i].display_width ||
+            info[i].hotspot_x != expected_info[i].hotspot_x ||
+            info[i].hotspot_y != expected_info[i].hotspot_y ||
+            info[i].offset != images[i] ||
+            info[i].data_offset != (i == 0 ? data[1] : data[i + 1] +
+                                    (i == 1 ? 4 * 4 : 0)))
+        {
+            printf("os2 array: image %d indexed wrong\n", i);
+            Num_Failures++;
+        }
+    }
+
+    /* Last to first, so each one has to find its own way */
+    uint32_t expected[4][8];
+    for (int i = 2; i >= 0; --i) {
+        SflBmpDesc desc = {0};
+        desc.format = SFL_BMP_PIXEL_FORMAT_R8G8B8A8;
+        if (!sfl_bmp_decode_image(&ctx, &info[i], &desc)) {
+            printf("os2 array: decoding image %d failed\n", i);
+            Num_Failures++;
+            continue;
+        }
+
+        for (uint32_t y = 0; y < info[i].height; ++y) {
+            for (uint32_t x = 0; x < info[i].width; ++x) {
+                uint32_t bgr = 0;
+                int masked = 0;
+                if (i == 0) {
+                    bgr = ci_color[y][x];
+                    masked = (ci_and[y] >> (7 - x)) & 1;
+                } else if (i == 1) {
+                    bgr = ((pt_xor[y] >> (7 - x)) & 1) ? 0xffffff : 0;
+                    masked = (pt_and[y] >> (7 - x)) & 1;
+                } else {
+                    const uint8_t byte = bm_indices[y][x / 2];
+                    bgr = bm_palette[x % 2 ? byte & 0xf : byte >> 4];
+                }
+
+                /* B, G, R in memory to R8G8B8A8 */
+                const uint32_t rgba = ((bgr >> 16) & 0xff) |
+                                      (bgr & 0xff00) |
+                                      ((bgr & 0xff) << 16) | 0xff000000u;
+                expected[y][x] = masked ? 0 : rgba;
+            }
+        }
+
+        int same = desc.width == info[i].width &&
+                   desc.height == info[i].height &&
+                   desc.file_header_id == info[i].type &&
+                   (desc.attributes & SFL_BMP_ATTRIBUTE_FLIPPED);
+        for (uint32_t y = 0; same && y < desc.height; ++y) {
+            same = memcmp((uint8_t *)desc.data + y * desc.pitch, expected[y],
+                          desc.width * 4) == 0;
+        }
+        if (!same) {
+            printf("os2 array: image %d decoded wrong\n", i);
+            Num_Failures++;
+        }
+        free(desc.data);
+    }
+
+    /* A chain that goes back on itself */
+    memcpy(file + arrays[2] + 6, &(uint32_t){(uint32_t)arrays[1]}, 4);
+    if (sfl_bmp_index(&ctx, info, 4) != 0) {
+        printf("os2 array: looping chain accepted\n");
+        Num_Failures++;
+    }
+
+    /* Plain bitmaps are an image of their own */
+    static const uint32_t masks[4] = {0xff0000, 0xff00, 0xff, 0};
+    uint8_t bmp[256];
+    size_t size = test_build_bmp(bmp, 24, masks, 1);
+    sfl_bmp_memory_io_set_source(&ctx, &mem, bmp, size);
+
+    SflBmpDesc decoded = {0}, expected_desc = {0};
+    if (sfl_bmp_index(&ctx, info, 4) != 1 ||
+        info[0].type != SFL_BMP_HDR_ID_BM || info[0].offset != 0 ||
+        !sfl_bmp_decode_image(&ctx, &info[0], &decoded) ||
+        !sfl_bmp_decode(&ctx, &expected_desc) ||
+        memcmp(decoded.data, expected_desc.data, decoded.size) != 0)
+    {
+        printf("os2 array: plain bitmap indexed or decoded wrong\n");
+        Num_Failures++;
+    }
+    free(decoded.data);
+    free(expected_desc.data);
+}
+
+/**
+ * R8G8B8A8 is in memory order, so its masks are the little-endian ones, and
+ * encoding it with bitfields stores the source bytes as they are
+ */
+static void test_rgba_masks(void) {
+    static const uint32_t expected[4] = {
+        0x000000ff, 0x0000ff00, 0x00ff0000, 0xff000000,
+    };
+    static const uint8_t pixels[2 * 4] = {
+        0x11, 0x22, 0x33, 0x44, 0x55, 0x66, 0x77, 0x88,
+    };
+
+    uint32_t masks[4];
+    sfl_bmp__bitmasks_from_pixel_format(SFL_BMP_PIXEL_FORMAT_R8G8B8A8, masks);
+    if (memcmp(masks, expected, sizeof(masks)) != 0) {
+        printf("rgba masks: %08x %08x %08x %08x\n",
+            masks[0], masks[1], masks[2], masks[3]);
+        Num_Failures++;
+    }
+
+    SflBmpDesc in_desc = {0};
+    in_desc.width      = 2;
+    in_desc.height     = 1;
+    in_desc.pitch      = sizeof(pixels);
+    in_desc.slice      = 4;
+    in_desc.format     = SFL_BMP_PIXEL_FORMAT_R8G8B8A8;
+
+    SflBmpUSize size;
+    uint8_t *file = (uint8_t *)test_encode_to(
+        pixels, &in_desc, SFL_BMP_PIXEL_FORMAT_R8G8B8A8, 0, &size);
+    if (!file) {
+        printf("rgba masks: encode failed\n");
+        Num_Failures++;
+        return;
+    }
+
+    SflBmpFileHeader hdr;
+    SflBmpInfoHeader124 info;
+    memcpy(&hdr, file, sizeof(hdr));
+    memcpy(&info, file + sizeof(hdr), sizeof(info));
+    if (info.red_mask != expected[0] || info.green_mask != expected[1] ||
+        info.blue_mask != expected[2] || info.alpha_mask != expected[3] ||
+        memcmp(file + hdr.offset, pixels, sizeof(pixels)) != 0)
+    {
+        printf("rgba masks: encoded in the wrong byte order\n");
+        Num_Failures++;
+    }
+    free(file);
+}
+
+/** Bitfield files probe as the format their masks and bpp describe */
+static void test_format_from_masks(void) {
+    static const struct {
+        int       bpp;
+        uint32_t  masks[4];
+        SflBmpU32 format;
+    } cases[] = {
+        {32, {0x00ff0000, 0x0000ff00, 0x000000ff, 0xff000000},
+            SFL_BMP_PIXEL_FORMAT_B8G8R8A8},
+        {32, {0x000000ff, 0x0000ff00, 0x00ff0000, 0xff000000},
+            SFL_BMP_PIXEL_FORMAT_R8G8B8A8},
+        {32, {0x00ff0000, 0x0000ff00, 0x000000ff, 0x00000000},
+            SFL_BMP_PIXEL_FORMAT_B8G8R8X8},
+        {16, {0xf800, 0x07e0, 0x001f, 0x0000},
+            SFL_BMP_PIXEL_FORMAT_B5G6R5},
+        {16, {0x7c00, 0x03e0, 0x001f, 0x0000},
+            SFL_BMP_PIXEL_FORMAT_B5G5R5X1},
+        {16, {0x0f00, 0x00f0, 0x000f, 0xf000},
+            SFL_BMP_PIXEL_FORMAT_UNRECOGNIZED},
+    };
+
+    for (int i = 0; i < (int)(sizeof(cases) / sizeof(cases[0])); ++i) {
+        uint8_t file[256];
+        size_t size = test_build_bmp(file, cases[i].bpp, cases[i].masks, 1);
+
+        SflBmpContext ctx;
+        SflBmpIOImplementationMemory mem;
+        sfl_bmp_memory_io_init(&ctx, sfl_bmp_stdlib_get_implementation());
+        sfl_bmp_memory_io_set_source(&ctx, &mem, file, size);
+
+        SflBmpDesc desc = {0};
+        if (!sfl_bmp_probe(&ctx, &desc) || desc.format != cases[i].format) {
+            printf("format from masks: %d bpp (%08x %08x %08x %08x) "
+                "probed as %s\n",
+                cases[i].bpp, cases[i].masks[0], cases[i].masks[1],
+                cases[i].masks[2], cases[i].masks[3],
+                sfl_bmp_describe_pixel_format(desc.format));
+            Num_Failures++;
+        }
+    }
+
+    /* B8G8R8 and B8G8R8X8 share their masks, so bpp tells them apart */
+    uint32_t bgr[4] = {0x00ff0000, 0x0000ff00, 0x000000ff, 0};
+    if (sfl_bmp_decide_pixel_format_from_bitmasks(24, bgr) !=
+            SFL_BMP_PIXEL_FORMAT_B8G8R8 ||
+        sfl_bmp_decide_pixel_format_from_bitmasks(32, bgr) !=
+            SFL_BMP_PIXEL_FORMAT_B8G8R8X8)
+    {
+        printf("format from masks: 24 & 32 bpp BGR mixed up\n");
+        Num_Failures++;
+    }
+}
+
+/**
+ * V1 heights are signed like the later headers': negative ones are stored
+ * top to bottom, and the decoded height is always positive
+ */
+static void test_v1_height(void) {
+    /* Two B8G8R8 rows in file order: red, green / blue, white */
+    static const uint8_t rows[2][8] = {
+        {0x00, 0x00, 0xff, 0x00, 0xff, 0x00, 0, 0},
+        {0xff, 0x00, 0x00, 0xff, 0xff, 0xff, 0, 0},
+    };
+    static const uint32_t first_row[2][2] = {
+        {0xff0000ff, 0xff00ff00},
+        {0xffff0000, 0xffffffff},
+    };
+
+    for (int top_down = 0; top_down < 2; ++top_down) {
+        uint8_t file[128];
+        size_t size = 0;
+
+        SflBmpInfoHeader040 info = {0};
+        info.size        = sizeof(info);
+        info.width       = 2;
+        info.height      = top_down ? -2 : 2;
+        info.planes      = 1;
+        info.bpp         = 24;
+        info.compression = SFL_BMP_COMPRESSION_NONE;
+
+        const uint32_t offset = sizeof(SflBmpFileHeader) + sizeof(info);
+        test_put_file_header(file, &size, "BM", 0, 0, offset);
+        test_put(file, &size, &info, sizeof(info));
+        test_put(file, &size, rows, sizeof(rows));
+
+        SflBmpContext ctx;
+        SflBmpIOImplementationMemory mem;
+        sfl_bmp_memory_io_init(&ctx, sfl_bmp_stdlib_get_implementation());
+        sfl_bmp_memory_io_set_source(&ctx, &mem, file, size);
+
+        SflBmpDesc desc = {0};
+        desc.format = SFL_BMP_PIXEL_FORMAT_R8G8B8A8;
+        if (!sfl_bmp_decode(&ctx, &desc)) {
+            printf("v1 height (top down: %d): decode failed\n", top_down);
+            Num_Failures++;
+            continue;
+        }
+
+        const int flipped = (desc.attributes & SFL_BMP_ATTRIBUTE_FLIPPED) != 0;
+        const uint8_t *top = (const uint8_t *)desc.data +
+            (flipped ? desc.pitch * (desc.height - 1) : 0);
+        uint32_t pixels[2];
+        memcpy(pixels, top, sizeof(pixels));
+        if (desc.height != 2 || flipped == top_down ||
+            pixels[0] != first_row[!top_down][0] ||
+            pixels[1] != first_row[!top_down][1])
+        {
+            printf("v1 height (top down: %d): height %u, flipped %d, "
+                "top row %08x %08x\n",
+                top_down, desc.height, flipped, pixels[0], pixels[1]);
+            Num_Failures++;
+        }
+        free(desc.data);
+    }
+}
+
+/**
+ * sfl_bmp_decode writes the format requested in desc->format, or the default
+ * one (R8G8B8A8 with SFL_BMP_ALWAYS_CONVERT) for UNRECOGNIZED
+ */
+static void test_decode_format(void) {
+    static const struct {
+        SflBmpU32 requested;
+        SflBmpU32 format;
+        uint32_t  slice;
+    } cases[] = {
+        {SFL_BMP_PIXEL_FORMAT_B5G6R5, SFL_BMP_PIXEL_FORMAT_B5G6R5, 2},
+        {SFL_BMP_PIXEL_FORMAT_B8G8R8, SFL_BMP_PIXEL_FORMAT_B8G8R8, 3},
+        {SFL_BMP_PIXEL_FORMAT_B8G8R8X8, SFL_BMP_PIXEL_FORMAT_B8G8R8X8, 4},
+        {SFL_BMP_PIXEL_FORMAT_UNRECOGNIZED, SFL_BMP_PIXEL_FORMAT_R8G8B8A8, 4},
+    };
+    static const uint32_t masks[4] = {0xff0000, 0xff00, 0xff, 0};
+
+    uint8_t file[256];
+    size_t size = test_build_bmp(file, 24, masks, 1);
+
+    for (int i = 0; i < (int)(sizeof(cases) / sizeof(cases[0])); ++i) {
+        SflBmpDesc desc = test_decode_to(file, size, cases[i].requested);
+        if (!desc.data || desc.format != cases[i].format ||
+            desc.slice != cases[i].slice ||
+            desc.pitch != (desc.width * cases[i].slice + 3) / 4 * 4)
+        {
+            printf("decode format: asked for %s, got %s (slice %u)\n",
+                sfl_bmp_describe_pixel_format(cases[i].requested),
+                sfl_bmp_describe_pixel_format(desc.format), desc.slice);
+            Num_Failures++;
+        }
+        free(desc.data);
+    }
+}
+
+/**
+ * Rows are encoded in the order they're read: the file is bottom-up only if
+ * the source is, whatever the output descriptor asked for
+ */
+static void test_encode_row_order(void) {
+    enum { W = 2, H = 3, PITCH = W * 4 };
+    uint8_t pixels[H * PITCH];
+    for (int i = 0; i < H * PITCH; ++i) pixels[i] = (uint8_t)(i * 13 + 1);
+
+    for (int flipped = 0; flipped < 2; ++flipped) {
+        SflBmpDesc in_desc = {0};
+        in_desc.width      = W;
+        in_desc.height     = H;
+        in_desc.pitch      = PITCH;
+        in_desc.slice      = 4;
+        in_desc.format     = SFL_BMP_PIXEL_FORMAT_R8G8B8A8;
+        in_desc.attributes = flipped ? SFL_BMP_ATTRIBUTE_FLIPPED : 0;
+
+        SflBmpUSize size;
+        uint8_t *file = (uint8_t *)test_encode_to(
+            pixels, &in_desc, SFL_BMP_PIXEL_FORMAT_R8G8B8A8,
+            flipped ? 0 : SFL_BMP_ATTRIBUTE_FLIPPED, &size);
+        if (!file) {
+            printf("encode row order (flipped: %d): encode failed\n", flipped);
+            Num_Failures++;
+            continue;
+        }
+
+        SflBmpFileHeader hdr;
+        SflBmpInfoHeader124 info;
+        memcpy(&hdr, file, sizeof(hdr));
+        memcpy(&info, file + sizeof(hdr), sizeof(info));
+        if (info.height != (flipped ? H : -H) ||
+            memcmp(file + hdr.offset, pixels, sizeof(pixels)) != 0)
+        {
+            printf("encode row order (flipped: %d): height %d, rows %s\n",
+                flipped, info.height,
+                memcmp(file + hdr.offset, pixels, sizeof(pixels))
+                    ? "reordered" : "kept");
+            Num_Failures++;
+        }
+        free(file);
+    }
+}
+
+/** Stage boundaries, in the order they were reported */
+typedef struct {
+    int events[16];
+    int num_events;
+} TestStages;
+
+static PROC_SFL_BMP_STAGE(test_stage) {
+    TestStages *stages = (TestStages *)usr;
+    (void)elapsed_ns;
+    if (stages->num_events < 16) {
+        stages->events[stages->num_events] = stage * 2 + end;
+    }
+    stages->num_events++;
+}
+
+static void test_expect_stages(
+    const char *what, const SflBmpStats *stats, const TestStages *stages,
+    const int *expected, int num_expected)
+{
+    if (stages->num_events != num_expected ||
+        memcmp(stages->events, expected, num_expected * sizeof(int)) != 0)
+    {
+        printf("stats: %s reported %d stage events\n",
+            what, stages->num_events);
+        Num_Failures++;
+        return;
+    }
+
+    /* Each stage that ended once was timed once */
+    for (int s = 0; s < SFL_BMP_STAGE_COUNT; ++s) {
+        uint64_t ends = 0;
+        for (int i = 0; i < num_expected; ++i) {
+            ends += expected[i] == s * 2 + 1;
+        }
+        if (stats->stage_count[s] != ends) {
+            printf("stats: %s entered stage %d %llu times\n",
+                what, s, (unsigned long long)stats->stage_count[s]);
+            Num_Failures++;
+        }
+    }
+}
+
+/**
+ * Exact IO & allocation counts of an encode (with an input that can be peeked
+ * at) and a decode (through plain reads) of a 3x2 image
+ */
+static void test_stats(void) {
+    enum { W = 3, H = 2, PITCH = W * 4, OUT_PITCH = 12 };
+    enum {
+        HEADERS = sizeof(SflBmpFileHeader) + sizeof(SflBmpInfoHeader124),
+    };
+    uint8_t pixels[H * PITCH];
+    for (int i = 0; i < H * PITCH; ++i) pixels[i] = (uint8_t)(i * 9);
+
+    SflBmpDesc in_desc = {0};
+    in_desc.width      = W;
+    in_desc.height     = H;
+    in_desc.pitch      = PITCH;
+    in_desc.slice      = 4;
+    in_desc.format     = SFL_BMP_PIXEL_FORMAT_R8G8B8A8;
+
+    SflBmpContext in_ctx, ctx;
+    SflBmpIOImplementationMemory in_mem, mem;
+    sfl_bmp_memory_io_init(&in_ctx, sfl_bmp_stdlib_get_implementation());
+    sfl_bmp_memory_io_init(&ctx, sfl_bmp_stdlib_get_implementation());
+
+    uint8_t file[512];
+    sfl_bmp_memory_io_set_source(&in_ctx, &in_mem, pixels, sizeof(pixels));
+    sfl_bmp_memory_io_set_sink(&ctx, &mem, file, sizeof(file));
+
+    SflBmpStats stats = {0};
+    TestStages stages = {{0}, 0};
+    stats.stage_callback = test_stage;
+    stats.stage_usr = &stages;
+    sfl_bmp_set_stats(&ctx, &stats);
+
+    SflBmpDesc out_desc     = {0};
+    out_desc.format         = SFL_BMP_PIXEL_FORMAT_B8G8R8;
+    out_desc.compression    = SFL_BMP_COMPRESSION_NONE;
+    out_desc.file_header_id = SFL_BMP_HDR_ID_BM;
+    out_desc.info_header_id = SFL_BMP_NFO_ID_V5;
+    if (!sfl_bmp_encode(&ctx, &in_desc, &in_ctx.io, &out_desc)) {
+        printf("stats: encode failed\n");
+        Num_Failures++;
+        return;
+    }
+
+    /* The source is peeked at once, and written as 2 headers and 2 rows,
+     * through a single scan-line */
+    static const int encode_stages[] = {
+        SFL_BMP_STAGE_CONVERT * 2, SFL_BMP_STAGE_CONVERT * 2 + 1,
+    };
+    if (stats.num_reads != 1 || stats.bytes_read != sizeof(pixels) ||
+        stats.num_writes != 4 ||
+        stats.bytes_written != HEADERS + H * OUT_PITCH ||
+        stats.num_seeks != 0 || stats.num_allocations != 1 ||
+        stats.bytes_allocated != OUT_PITCH || stats.bytes_in_use != 0 ||
+        stats.peak_bytes_in_use != OUT_PITCH)
+    {
+        printf("stats: encode counted %llu reads (%llu bytes), %llu writes "
+            "(%llu bytes), %llu allocations (%llu bytes, %llu in use)\n",
+            (unsigned long long)stats.num_reads,
+            (unsigned long long)stats.bytes_read,
+            (unsigned long long)stats.num_writes,
+            (unsigned long long)stats.bytes_written,
+            (unsigned long long)stats.num_allocations,
+            (unsigned long long)stats.bytes_allocated,
+            (unsigned long long)stats.bytes_in_use);
+        Num_Failures++;
+    }
+    test_expect_stages("encode", &stats, &stages, encode_stages, 2);
+
+    /* Decoded without peeking, so the pixels are read a row at a time */
+    const size_t size = mem.len;
+    sfl_bmp_memory_io_set_source(&ctx, &mem, file, size);
+    ctx.io.peek = 0;
+    memset(&stats, 0, sizeof(stats));
+    stages.num_events    = 0;
+    stats.stage_callback = test_stage;
+    stats.stage_usr      = &stages;
+
+    SflBmpDesc desc = {0};
+    desc.format     = SFL_BMP_PIXEL_FORMAT_R8G8B8A8;
+    if (!sfl_bmp_decode(&ctx, &desc)) {
+        printf("stats: decode failed\n");
+        Num_Failures++;
+        return;
+    }
+
+    /* File header, info header size, info header, then 2 rows. The output
+     * and the scan-line are allocated, and the output handed over */
+    static const int decode_stages[] = {
+        SFL_BMP_STAGE_PROBE * 2,   SFL_BMP_STAGE_HEADER * 2,
+        SFL_BMP_STAGE_HEADER * 2 + 1, SFL_BMP_STAGE_PROBE * 2 + 1,
+        SFL_BMP_STAGE_CONVERT * 2, SFL_BMP_STAGE_CONVERT * 2 + 1,
+    };
+    if (stats.num_reads != 5 ||
+        stats.bytes_read != HEADERS + 4 + H * OUT_PITCH ||
+        stats.num_writes != 0 || stats.num_seeks != 3 ||
+        stats.num_allocations != 2 ||
+        stats.bytes_allocated != H * PITCH + OUT_PITCH ||
+        stats.bytes_in_use != 0 ||
+        stats.peak_bytes_in_use != H * PITCH + OUT_PITCH)
+    {
+        printf("stats: decode counted %llu reads (%llu bytes), %llu seeks, "
+            "%llu allocations (%llu bytes, %llu in use)\n",
+            (unsigned long long)stats.num_reads,
+            (unsigned long long)stats.bytes_read,
+            (unsigned long long)stats.num_seeks,
+            (unsigned long long)stats.num_allocations,
+            (unsigned long long)stats.bytes_allocated,
+            (unsigned long long)stats.bytes_in_use);
+        Num_Failures++;
+    }
+    test_expect_stages("decode", &stats, &stages, decode_stages, 6);
+    free(desc.data);
+}
+
+/** Where a test can write a file of its own */
+static void test_temp_path(char *path, size_t size, const char *name) {
+    const char *dir = getenv("TMPDIR");
+    if (!dir) dir = getenv("TEMP");
+    snprintf(path, size, "%s/%s", dir ? dir : "/tmp", name);
+}
+
+static int test_write_file(const char *path, const void *data, size_t size) {
+    FILE *f = fopen(path, "wb");
+    if (!f) return 0;
+    int ok = fwrite(data, 1, size, f) == size;
+    return (fclose(f) == 0) && ok;
+}
+
+typedef struct {
+    int        ok;
+    int        num_calls;
+    SflBmpDesc desc;
+} TestBatchResult;
+
+/** Each index is reported once, so results need no lock */
+static PROC_SFL_BMP_BATCH_DONE(test_batch_done) {
+    TestBatchResult *results = (TestBatchResult *)usr;
+    (void)path;
+    results[index].ok = ok;
+    results[index].num_calls++;
+    results[index].desc = *desc;
+}
+
+/**
+ * Batch decoding with SFL_BMP_PIXEL_STATS compiled in: the decoding threads'
+ * contexts have no pixel stats block to fill
+ */
+static void test_batch_pixel_stats(void) {
+    static const uint32_t masks[4] = {0xff0000, 0xff00, 0xff, 0};
+    uint8_t file[256];
+    size_t size = test_build_bmp(file, 24, masks, 1);
+
+    char path[512];
+    test_temp_path(path, sizeof(path), "sfl_bmp_test_batch_stats.bmp");
+    if (!test_write_file(path, file, size)) {
+        printf("batch pixel stats: can't write %s\n", path);
+        Num_Failures++;
+        return;
+    }
+
+    SflBmpDesc expected = test_decode_to(file, size, 0);
+    const char *paths[] = {path, path, path};
+
+    for (int num_threads = 1; num_threads <= 2; ++num_threads) {
+        TestBatchResult results[3];
+        memset(results, 0, sizeof(results));
+
+        SflBmpBatchSettings settings = {0};
+        settings.num_decode_threads  = num_threads;
+        settings.done                = test_batch_done;
+        settings.usr                 = results;
+        if (!sfl_bmp_batch_decode(paths, 3, &settings)) {
+            printf("batch pixel stats (%d threads): failed\n", num_threads);
+            Num_Failures++;
+        }
+
+        for (int i = 0; i < 3; ++i) {
+            if (!results[i].ok || !expected.data ||
+                memcmp(results[i].desc.data, expected.data,
+                    (size_t)expected.size) != 0)
+            {
+                printf("batch pixel stats (%d threads): image %d differs\n",
+                    num_threads, i);
+                Num_Failures++;
+            }
+            free(results[i].desc.data);
+        }
+    }
+
+    free(expected.data);
+    remove(path);
+}
+
+/**
+ * Decodes files of every bitfield layout with several readers and decoders,
+ * plus a missing and a corrupt one, and checks each against sfl_bmp_decode
+ */
+static void test_batch(void) {
+    static const struct {
+        int      bpp;
+        uint32_t masks[4];
+    } inputs[] = {
+        {32, {0x00ff0000, 0x0000ff00, 0x000000ff, 0xff000000}},
+        {24, {0x00ff0000, 0x0000ff00, 0x000000ff, 0x00000000}},
+        {16, {0xf800, 0x07e0, 0x001f, 0x0000}},
+        {16, {0x0f00, 0x00f0, 0x000f, 0xf000}},
+        {32, {0x3ff00000, 0x000ffc00, 0x000003ff, 0xc0000000}},
+    };
+    enum {
+        NUM_INPUTS = sizeof(inputs) / sizeof(inputs[0]),
+        MISSING    = NUM_INPUTS,
+        CORRUPT    = NUM_INPUTS + 1,
+        NUM_PATHS  = NUM_INPUTS + 2,
+    };
+
+    char storage[NUM_PATHS][512];
+    const char *paths[NUM_PATHS];
+    SflBmpDesc expected[NUM_INPUTS];
+    int written = 1;
+
+    for (int i = 0; i < NUM_PATHS; ++i) {
+        char name[64];
+        snprintf(name, sizeof(name), "sfl_bmp_test_batch_%d.bmp", i);
+        test_temp_path(storage[i], sizeof(storage[i]), name);
+        paths[i] = storage[i];
+    }
+
+    for (int i = 0; i < NUM_INPUTS; ++i) {
+        uint8_t file[256];
+        size_t size =
+            test_build_bmp(file, inputs[i].bpp, inputs[i].masks, i % 2);
+        expected[i] = test_decode_to(file, size, 0);
+        written &= test_write_file(paths[i], file, size);
+    }
+
+    /* Cut off in the middle of the info header */
+    uint8_t corrupt[256];
+    test_build_bmp(corrupt, 24, inputs[1].masks, 1);
+    written &= test_write_file(paths[CORRUPT], corrupt, 40);
+    remove(paths[MISSING]);
+
+    if (!written) {
+        printf("batch: can't write the test files\n");
+        Num_Failures++;
+    }
+
+    static const int threads[][3] = {
+        /* readers, decoders, queue depth */
+        {1, 1, 0},
+        {2, 3, 2},
+        {3, 4, 1},
+        /* Too deep for an io_uring, which falls back to the pread readers */
+        {2, 2, 20000},
+    };
+    const int num_runs = (int)(sizeof(threads) / sizeof(threads[0]));
+    for (int t = 0; written && t < num_runs; ++t) {
+        TestBatchResult results[NUM_PATHS];
+        memset(results, 0, sizeof(results));
+
+        SflBmpBatchSettings settings = {0};
+        settings.num_io_threads      = threads[t][0];
+        settings.num_decode_threads  = threads[t][1];
+        settings.queue_depth         = threads[t][2];
+        settings.done                = test_batch_done;
+        settings.usr                 = results;
+
+        /* Not every file decodes, so the batch as a whole fails */
+        if (sfl_bmp_batch_decode(paths, NUM_PATHS, &settings)) {
+            printf("batch (%d readers, %d decoders): reported success\n",
+                threads[t][0], threads[t][1]);
+            Num_Failures++;
+        }
+
+        for (int i = 0; i < NUM_PATHS; ++i) {
+            const TestBatchResult *result = &results[i];
+            int good = result->num_calls == 1;
+            if (i < NUM_INPUTS) {
+                good = good && result->ok && expected[i].data &&
+                       result->desc.format == expected[i].format &&
+                       result->desc.size == expected[i].size &&
+                       memcmp(result->desc.data, expected[i].data,
+                           (size_t)expected[i].size) == 0;
+            } else {
+                good = good && !result->ok && !result->desc.data;
+            }
+
+            if (!good) {
+                printf("batch (%d readers, %d decoders): %s reported wrong "
+                    "(%d calls, ok: %d)\n",
+                    threads[t][0], threads[t][1], paths[i],
+                    result->num_calls, result->ok);
+                Num_Failures++;
+            }
+            free(result->desc.data);
+        }
+    }
+
+    /* Only the files that decode */
+    TestBatchResult results[NUM_INPUTS];
+    memset(results, 0, sizeof(results));
+    SflBmpBatchSettings settings = {0};
+    settings.num_decode_threads  = 2;
+    settings.done                = test_batch_done;
+    settings.usr                 = results;
+    if (written && !sfl_bmp_batch_decode(paths, NUM_INPUTS, &settings)) {
+        printf("batch: failed with only good files\n");
+        Num_Failures++;
+    }
+    for (int i = 0; i < NUM_INPUTS; ++i) free(results[i].desc.data);
+
+    for (int i = 0; i < NUM_INPUTS; ++i) free(expected[i].data);
+    for (int i = 0; i < NUM_PATHS; ++i) remove(paths[i]);
+}
+
+/** Reads a whole file, allocated with malloc */
+static void *test_read_file(const char *path, size_t *size) {
+    FILE *f = fopen(path, "rb");
+    if (!f) return 0;
+
+    void *data = 0;
+    long length = -1;
+    if (fseek(f, 0, SEEK_END) == 0) length = ftell(f);
+    if (length >= 0 && fseek(f, 0, SEEK_SET) == 0) {
+        data = malloc(length ? (size_t)length : 1);
+        if (data && fread(data, 1, (size_t)length, f) != (size_t)length) {
+            free(data);
+            data = 0;
+        }
+    }
+    fclose(f);
+    *size = (size_t)length;
+    return data;
+}
+
+/**
+ * Encodes with 1 and several threads (more than there are rows for some),
+ * and compares the files byte for byte with sfl_bmp_encode's
+ */
+static void test_parallel_encode(void) {
+    enum { W = 37, H = 29, PITCH = W * 4 };
+    static const int formats[] = {
+        SFL_BMP_PIXEL_FORMAT_B8G8R8,
+        SFL_BMP_PIXEL_FORMAT_B5G6R5,
+        SFL_BMP_PIXEL_FORMAT_B8G8R8A8,
+    };
+    static const int threads[] = {1, 3, 8, 64};
+
+    uint8_t *pixels = (uint8_t *)malloc(H * PITCH);
+    for (int i = 0; i < H * PITCH; ++i) pixels[i] = (uint8_t)(i * 31 + 7);
+
+    char path[512];
+    test_temp_path(path, sizeof(path), "sfl_bmp_test_parallel.bmp");
+
+    SflBmpContext ctx;
+    sfl_bmp_memory_io_init(&ctx, sfl_bmp_stdlib_get_implementation());
+
+    for (int f = 0; f < (int)(sizeof(formats) / sizeof(formats[0])); ++f) {
+        for (int flipped = 0; flipped < 2; ++flipped) {
+            SflBmpDesc in_desc = {0};
+            in_desc.data       = pixels;
+            in_desc.width      = W;
+            in_desc.height     = H;
+            in_desc.pitch      = PITCH;
+            in_desc.slice      = 4;
+            in_desc.format     = SFL_BMP_PIXEL_FORMAT_R8G8B8A8;
+            in_desc.attributes = flipped ? SFL_BMP_ATTRIBUTE_FLIPPED : 0;
+
+            SflBmpUSize expected_size;
+            void *expected = test_encode_to(
+                pixels, &in_desc, formats[f], 0, &expected_size);
+
+            for (int t = 0; t < (int)(sizeof(threads) / sizeof(threads[0]));
+                 ++t)
+            {
+                SflBmpDesc out_desc     = {0};
+                out_desc.format         = formats[f];
+                out_desc.compression    =
+                    formats[f] == SFL_BMP_PIXEL_FORMAT_B8G8R8
+                        ? SFL_BMP_COMPRESSION_NONE
+                        : SFL_BMP_COMPRESSION_BITFIELDS;
+                out_desc.file_header_id = SFL_BMP_HDR_ID_BM;
+                out_desc.info_header_id = SFL_BMP_NFO_ID_V5;
+
+                size_t size = 0;
+                void *actual = 0;
+                if (sfl_bmp_encode_parallel(
+                        &ctx, &in_desc, path, &out_desc, threads[t]))
+                {
+                    actual = test_read_file(path, &size);
+                }
+
+                if (!expected || !actual || size != expected_size ||
+                    memcmp(actual, expected, size) != 0)
+                {
+                    printf("parallel encode: %s (flipped: %d, %d threads) "
+                        "differs from sfl_bmp_encode\n",
+                        sfl_bmp_describe_pixel_format(formats[f]), flipped,
+                        threads[t]);
+                    Num_Failures++;
+                }
+                free(actual);
+            }
+            free(expected);
+        }
+    }
+
+    /* Nothing to split into bands */
+    SflBmpDesc empty = {0};
+    empty.data       = pixels;
+    empty.height     = H;
+    empty.pitch      = PITCH;
+    empty.slice      = 4;
+    empty.format     = SFL_BMP_PIXEL_FORMAT_R8G8B8A8;
+
+    SflBmpDesc out_desc     = {0};
+    out_desc.format         = SFL_BMP_PIXEL_FORMAT_B8G8R8A8;
+    out_desc.compression    = SFL_BMP_COMPRESSION_BITFIELDS;
+    out_desc.file_header_id = SFL_BMP_HDR_ID_BM;
+    out_desc.info_header_id = SFL_BMP_NFO_ID_V5;
+    if (sfl_bmp_encode_parallel(&ctx, &empty, path, &out_desc, 2)) {
+        printf("parallel encode: encoded an image 0 pixels wide\n");
+        Num_Failures++;
+    }
+
+    remove(path);
+    free(pixels);
+}
+
+/**
+ * V2, V3 and V4 headers are cut down V5 ones: the same file with a shorter
+ * header decodes to the same pixels. V2 can't hold an alpha mask
+ */
+static void test_info_versions(void) {
+    static const struct {
+        int      bpp;
+        uint32_t masks[4];
+    } inputs[] = {
+        {16, {0xf800, 0x07e0, 0x001f, 0x0000}},
+        {32, {0x00ff0000, 0x0000ff00, 0x000000ff, 0xff000000}},
+    };
+    static const uint32_t sizes[] = {52, 56, 108};
+
+    for (int i = 0; i < (int)(sizeof(inputs) / sizeof(inputs[0])); ++i) {
+        uint8_t v5[256];
+        size_t v5_size = test_build_bmp(v5, inputs[i].bpp, inputs[i].masks, 1);
+        SflBmpDesc expected =
+            test_decode_to(v5, v5_size, SFL_BMP_PIXEL_FORMAT_R8G8B8A8);
+
+        for (int v = 0; v < (int)(sizeof(sizes) / sizeof(sizes[0])); ++v) {
+            if (sizes[v] == 52 && inputs[i].masks[3]) continue;
+
+            /* Drop the tail of the info header, and move everything up */
+            const uint32_t cut = sizeof(SflBmpInfoHeader124) - sizes[v];
+            uint8_t file[256];
+            size_t size = v5_size - cut;
+            memcpy(file, v5, sizeof(SflBmpFileHeader) + sizes[v]);
+            memcpy(file + sizeof(SflBmpFileHeader) + sizes[v],
+                v5 + sizeof(SflBmpFileHeader) + sizeof(SflBmpInfoHeader124),
+                v5_size - sizeof(SflBmpFileHeader) -
+                    sizeof(SflBmpInfoHeader124));
+
+            SflBmpFileHeader hdr;
+            memcpy(&hdr, file, sizeof(hdr));
+            hdr.file_size -= cut;
+            hdr.offset -= cut;
+            memcpy(file, &hdr, sizeof(hdr));
+            memcpy(file + sizeof(hdr), &sizes[v], sizeof(sizes[v]));
+
+            SflBmpDesc actual =
+                test_decode_to(file, size, SFL_BMP_PIXEL_FORMAT_R8G8B8A8);
+            if (!expected.data || !actual.data ||
+                actual.size != expected.size ||
+                memcmp(actual.data, expected.data, expected.size) != 0)
+            {
+                printf("info versions: %d bpp with a %u byte header\n",
+                    inputs[i].bpp, sizes[v]);
+                Num_Failures++;
+            }
+            free(actual.data);
+        }
+        free(expected.data);
+    }
+}
+
+/**
+ * Heights near the limits of their header fields, mipmapped: V1's can't be
+ * INT32_MIN, and OS/2's up to 4G rows still stop at SFL_BMP_MAX_LEVELS
+ */
+static void test_mip_extents(void) {
+    for (int os2 = 0; os2 < 2; ++os2) {
+        uint8_t file[128];
+        size_t size = 0;
+
+        if (os2) {
+            SflBmpInfoHeader064 info = {0};
+            info.size   = 16;
+            info.width  = 1;
+            info.height = 0xFFFFFFFFu;
+            info.planes = 1;
+            info.bpp    = 24;
+            test_put_file_header(
+                file, &size, "BM", 0, 0, sizeof(SflBmpFileHeader) + 16);
+            test_put(file, &size, &info, 16);
+        } else {
+            SflBmpInfoHeader040 info = {0};
+            info.size        = sizeof(info);
+            info.width       = 1;
+            info.height      = -0x7FFFFFFF - 1;
+            info.planes      = 1;
+            info.bpp         = 24;
+            info.compression = SFL_BMP_COMPRESSION_NONE;
+            test_put_file_header(file, &size, "BM", 0, 0,
+                sizeof(SflBmpFileHeader) + sizeof(info));
+            test_put(file, &size, &info, sizeof(info));
+        }
+        memset(file + size, 0, 16);
+        size += 16;
+
+        SflBmpContext ctx;
+        SflBmpIOImplementationMemory mem;
+        SflBmpLimits limits = {0};
+        limits.max_memory   = 1 << 20;
+        sfl_bmp_memory_io_init(&ctx, sfl_bmp_stdlib_get_implementation());
+        sfl_bmp_memory_io_set_source(&ctx, &mem, file, size);
+        sfl_bmp_set_limits(&ctx, &limits);
+
+        SflBmpDesc probed = {0};
+        if (!os2 && sfl_bmp_probe(&ctx, &probed)) {
+            printf("mip extents: probed a V1 height of INT32_MIN\n");
+            Num_Failures++;
+        }
+
+        SflBmpDesc desc = {0};
+        desc.format     = SFL_BMP_PIXEL_FORMAT_B8G8R8A8;
+        desc.attributes = SFL_BMP_ATTRIBUTE_MIPMAPPED;
+        if (sfl_bmp_decode(&ctx, &desc)) {
+            printf("mip extents (os2: %d): decoded %u rows from 16 bytes\n",
+                os2, desc.height);
+            Num_Failures++;
+            free(desc.data);
+        }
+    }
+}
+
+/**
+ * Decoding straight out of a source that can be peeked at gives what going
+ * through a scan-line does, even with the pixels at odd addresses
+ */
+static void test_peek(void) {
+    static const struct {
+        int      bpp;
+        uint32_t masks[4];
+    } inputs[] = {
+        {32, {0x00ff0000, 0x0000ff00, 0x000000ff, 0xff000000}},
+        {32, {0x3ff00000, 0x000ffc00, 0x000003ff, 0xc0000000}},
+        {24, {0x00ff0000, 0x0000ff00, 0x000000ff, 0x00000000}},
+        {16, {0xf800, 0x07e0, 0x001f, 0x0000}},
+        {16, {0x0f00, 0x00f0, 0x000f, 0xf000}},
+    };
+    static const int formats[] = {
+        SFL_BMP_PIXEL_FORMAT_R8G8B8A8,
+        SFL_BMP_PIXEL_FORMAT_B8G8R8A8,
+        SFL_BMP_PIXEL_FORMAT_B8G8R8,
+        SFL_BMP_PIXEL_FORMAT_B5G6R5,
+    };
+
+    uint8_t storage[256 + 1];
+    uint8_t *file = storage + 1;
+    for (int i = 0; i < (int)(sizeof(inputs) / sizeof(inputs[0])); ++i) {
+        size_t size = test_build_bmp(file, inputs[i].bpp, inputs[i].masks, 1);
+
+        for (int f = 0; f < (int)(sizeof(formats) / sizeof(formats[0])); ++f) {
+            SflBmpDesc decoded[2];
+            for (int peek = 0; peek < 2; ++peek) {
+                SflBmpContext ctx;
+                SflBmpIOImplementationMemory mem;
+                sfl_bmp_memory_io_init(
+                    &ctx, sfl_bmp_stdlib_get_implementation());
+                sfl_bmp_memory_io_set_source(&ctx, &mem, file, size);
+                if (!peek) {
+                    ctx.io.peek = 0;
+                }
+
+                memset(&decoded[peek], 0, sizeof(decoded[peek]));
+                decoded[peek].format = formats[f];
+                if (!sfl_bmp_decode(&ctx, &decoded[peek])) {
+                    decoded[peek].data = 0;
+                }
+            }
+
+            if (!decoded[0].data || !decoded[1].data ||
+                decoded[0].size != decoded[1].size ||
+                memcmp(decoded[0].data, decoded[1].data, decoded[0].size))
+            {
+                printf("peek: %d bpp -> %s differs from reading\n",
+                    inputs[i].bpp, sfl_bmp_describe_pixel_format(formats[f]));
+                Num_Failures++;
+            }
+            free(decoded[0].data);
+            free(decoded[1].data);
+        }
+    }
+}
+
+int main(int argc, char const *argv[]) {
+    test_converters();
+    test_streaming_encoder();
+    test_memory_io();
+    test_push_decoder();
+    test_hash();
+    test_limits();
+    test_palette_encode();
+    test_quantize();
+    test_pack16();
+    test_mipmaps();
+    test_planar();
+    test_tensor();
+    test_large();
+    test_frames();
+    test_custom_formats();
+    test_pixel_stats();
+    test_os2_array();
+    test_rgba_masks();
+    test_format_from_masks();
+    test_v1_height();
+    test_decode_format();
+    test_encode_row_order();
+    test_stats();
+    test_batch_pixel_stats();
+    test_batch();
+    test_parallel_encode();
+    test_peek();
+    test_info_versions();
+    test_mip_extents();
+
+    if (argc < 2) {
+        printf("%d failures\n", Num_Failures);
+        return Num_Failures != 0;
+    }
+
+    FILE *f = fopen(argv[1], "rb");
+    if (f == 0) {
+        puts("File doesn't exist");
+        return -1;
+    }
+
+    SflBmpContext read_context;
+    sfl_bmp_cstd_init(&read_context);
+    sfl_bmp_stdio_set_file(&read_context, f);
+
+    SflBmpDesc desc = {0};
+    if (sfl_bmp_decode(&read_context, &desc) == 0) {
+        perror("Failed.");
+        return -1;
+    }
+
+    printf("Image format: %s\n",
+        sfl_bmp_describe_pixel_format(desc.format));
+
+    printf("Image is flipped: %d\n", 
+        desc.attributes & SFL_BMP_ATTRIBUTE_FLIPPED);
+
+    test_pixel(&desc, 0, 0, 0xff0000ff);
+    test_pixel(&desc, 1, 0, 0xffff0000);
+    test_pixel(&desc, 0, 1, 0xff00ff00);
+    test_pixel(&desc, 1, 1, 0xffffffff);
+
+    printf("%d failures\n", Num_Failures);
+    return Num_Failures != 0;
 }
@@ -0,0 +1,196 @@
+#define SFL_BMP_IMPLEMENTATION
+#include "sfl_bmp.hpp"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <utility>
+
+using sfl::bmp::Format;
+using sfl::bmp::Image;
+
+static int Num_Failures = 0;
+
+/**
+ * Fills every byte of the image with a pattern, except the bits that aren't
+ * part of any component (they're never read back)
+ */
+template <Format F>
+static void test_fill(Image<F> &image, uint32_t seed) {
+    typedef typename Image<F>::PixelType P;
+    const uint32_t used = image.desc().mask[0] | image.desc().mask[1] |
+                          image.desc().mask[2] | image.desc().mask[3];
+    for (uint32_t y = 0; y < image.height(); ++y) {
+        for (uint32_t x = 0; x < image.width(); ++x) {
+            const uint32_t i = y * image.width() + x;
+            const uint32_t value = (i * 2654435761u + seed) & used;
+            P &pixel = image.row(y)[x];
+            memcpy(&pixel, &value, P::slice);
+        }
+    }
+}
+
+template <Format F>
+static bool test_same(const Image<F> &a, const Image<F> &b) {
+    if (a.width() != b.width() || a.height() != b.height()) return false;
+    for (uint32_t y = 0; y < a.height(); ++y) {
+        const size_t bytes = a.width() * Image<F>::PixelType::slice;
+        if (memcmp(a.row(y).data(), b.row(y).data(), bytes) != 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * Decodes file (made from an image of format From) to To with the C library,
+ * and compares it to the same image converted by convert<To>
+ */
+template <Format To, Format From>
+static void test_convert_to(
+    const Image<From> &src, void *file, SflBmpUSize size, int flipped)
+{
+    SflBmpContext ctx;
+    SflBmpIOImplementationMemory io;
+    sfl_bmp_memory_io_init(&ctx, sfl_bmp_stdlib_get_implementation());
+    sfl_bmp_memory_io_set_source(&ctx, &io, file, size);
+
+    Image<To> decoded = Image<To>::decode(ctx);
+    Image<To> converted = sfl::bmp::convert<To>(src);
+    if (!decoded || !converted) {
+        printf("c++: %s to %s (flipped: %d) failed\n",
+            sfl_bmp_describe_pixel_format((int)From),
+            sfl_bmp_describe_pixel_format((int)To), flipped);
+        Num_Failures++;
+        return;
+    }
+
+    if (!test_same(decoded, converted)) {
+        printf("c++: %s to %s (flipped: %d) differs from sfl_bmp_decode\n",
+            sfl_bmp_describe_pixel_format((int)From),
+            sfl_bmp_describe_pixel_format((int)To), flipped);
+        Num_Failures++;
+    }
+}
+
+/** Encodes an image of format From, then checks every conversion of it */
+template <Format From>
+static void test_convert_from(int flipped) {
+    enum { W = 37, H = 11 };
+    Image<From> src(W, H, sfl_bmp_stdlib_get_implementation());
+    if (!src) {
+        printf("c++: allocating %s failed\n",
+            sfl_bmp_describe_pixel_format((int)From));
+        Num_Failures++;
+        return;
+    }
+    test_fill(src, (uint32_t)From * 977u);
+
+    SflBmpContext ctx;
+    SflBmpIOImplementationMemory io;
+    sfl_bmp_memory_io_init(&ctx, sfl_bmp_stdlib_get_implementation());
+    sfl_bmp_memory_io_set_sink(&ctx, &io, 0, 0);
+
+    SflBmpDesc out_desc;
+    memset(&out_desc, 0, sizeof(out_desc));
+    out_desc.format = (SflBmpU32)From;
+    out_desc.attributes = flipped ? SFL_BMP_ATTRIBUTE_FLIPPED : 0;
+    out_desc.compression = (From == Format::B8G8R8)
+        ? SFL_BMP_COMPRESSION_NONE
+        : SFL_BMP_COMPRESSION_BITFIELDS;
+    out_desc.file_header_id = SFL_BMP_HDR_ID_BM;
+    out_desc.info_header_id = SFL_BMP_NFO_ID_V5;
+    if (!src.encode(ctx, out_desc)) {
+        printf("c++: encoding %s failed\n",
+            sfl_bmp_describe_pixel_format((int)From));
+        Num_Failures++;
+        return;
+    }
+
+    SflBmpUSize size;
+    void *file = sfl_bmp_memory_io_take(&io, &size);
+
+    test_convert_to<Format::B8G8R8A8>(src, file, size, flipped);
+    test_convert_to<Format::B8G8R8>(src, file, size, flipped);
+    test_convert_to<Format::B5G6R5>(src, file, size, flipped);
+    test_convert_to<Format::R8G8B8A8>(src, file, size, flipped);
+    test_convert_to<Format::B8G8R8X8>(src, file, size, flipped);
+    test_convert_to<Format::B5G5R5X1>(src, file, size, flipped);
+
+    free(file);
+}
+
+static void test_convert(void) {
+    for (int flipped = 0; flipped < 2; ++flipped) {
+        test_convert_from<Format::B8G8R8A8>(flipped);
+        test_convert_from<Format::B8G8R8>(flipped);
+        test_convert_from<Format::B5G6R5>(flipped);
+        test_convert_from<Format::R8G8B8A8>(flipped);
+        test_convert_from<Format::B8G8R8X8>(flipped);
+        test_convert_from<Format::B5G5R5X1>(flipped);
+    }
+}
+
+/** Counts allocations that haven't been released yet */
+static int Num_Live = 0;
+
+static PROC_SFL_BMP_MEMORY_ALLOCATE(test_counted_allocate) {
+    (void)usr;
+    Num_Live++;
+    return malloc(size);
+}
+
+static PROC_SFL_BMP_MEMORY_RELEASE(test_counted_release) {
+    (void)usr;
+    Num_Live--;
+    free(ptr);
+}
+
+static SflBmpMemoryImplementation Test_Counted_Memory = {
+    test_counted_allocate,
+    test_counted_release,
+    0,
+};
+
+static void test_ownership(void) {
+    {
+        Image<Format::R8G8B8A8> a(4, 4, &Test_Counted_Memory);
+        a.row(3)[2].g = 42;
+
+        Image<Format::R8G8B8A8> b(std::move(a));
+        if (a || !b || b.row(3)[2].g != 42) {
+            printf("c++: move construction didn't hand the image over\n");
+            Num_Failures++;
+        }
+
+        Image<Format::R8G8B8A8> c(2, 2, &Test_Counted_Memory);
+        c = std::move(b);
+        if (b || !c || c.width() != 4 || Num_Live != 1) {
+            printf("c++: move assignment didn't release the old image\n");
+            Num_Failures++;
+        }
+
+        SflBmpDesc desc = c.release();
+        if (c || Num_Live != 1) {
+            printf("c++: release() didn't hand the pixel data over\n");
+            Num_Failures++;
+        }
+        Test_Counted_Memory.release(Test_Counted_Memory.usr, desc.data);
+
+        Image<Format::B5G6R5> d(3, 3, &Test_Counted_Memory);
+    }
+
+    if (Num_Live != 0) {
+        printf("c++: %d images weren't released\n", Num_Live);
+        Num_Failures++;
+    }
+}
+
+int main(int argc, char const *argv[]) {
+    (void)argc;
+    (void)argv;
+    test_convert();
+    test_ownership();
+
+    printf("%d failures\n", Num_Failures);
+    return Num_Failures != 0;
+}